@@ -39,6 +39,13 @@ typedef struct mapping_results_s {
 	/* Flag: set if the result has been marked read only */
 	int	mres_readonly;
 
+	/* Flag: set if the result depends on more than the names of
+	 * the directories above it: symlinks were followed, or the rule
+	 * has conditional actions or a custom mapping function (which
+	 * may test if files exist). Such results must not be cached.
+	*/
+	int	mres_fs_dependent;
+
 	/* errno: non-zero if an error was detected during
 	 * mapping. The interface code should then return
 	 * this value to the application (in the "standard"
@@ -53,34 +60,91 @@ typedef struct mapping_results_s {
 extern void clear_mapping_results_struct(mapping_results_t *res);
 extern void free_mapping_results(mapping_results_t *res);
 
-extern void sbox_map_path(const char *func_name, const char *path,
+/* "fn_id" is the function ID assigned by gen-interface.pl (index to
+ * sb2_fn_names[]), or SB2_FN_ID_UNKNOWN if "func_name" is not the name
+ * of a generated wrapper. Rule conditions on "func_name" are
+ * precompiled to sets of IDs; unknown names use pattern matching. */
+#define SB2_FN_ID_UNKNOWN	(-1)
+
+extern void sbox_map_path(const char *func_name, int fn_id, const char *path,
 	int dont_resolve_final_symlink, mapping_results_t *res);
 
-extern void sbox_map_path_at(const char *func_name, int dirfd,
+extern void sbox_map_path_at(const char *func_name, int fn_id, int dirfd,
 	const char *path, int dont_resolve_final_symlink,
 	mapping_results_t *res);
 
+/* readcache.c: the same for functions which only read (see
+ * "class(...)" in gen-interface.pl) */
+extern void sbox_map_path_for_read(const char *func_name, int fn_id,
+	const char *path, int dont_resolve_final_symlink,
+	mapping_results_t *res);
+extern void sbox_map_path_at_for_read(const char *func_name, int fn_id,
+	int dirfd, const char *path, int dont_resolve_final_symlink,
+	mapping_results_t *res);
+extern void sb2_read_cache_invalidate(void);
+
 extern void sbox_map_path_for_sb2show(const char *binary_name,
 	const char *func_name, const char *path, mapping_results_t *res);
 
 extern void sbox_map_path_for_exec(const char *func_name, const char *path,
 	mapping_results_t *res);
 
+/* mapd.c: requests to the mapping daemon (sb2-mapd) */
+extern void sb2_mapd_client_init(void);
+extern int sb2_mapd_map_path(const char *func_name, int fn_id,
+	const char *path, int dont_resolve_final_symlink,
+	mapping_results_t *res);
+extern int sb2_mapd_reverse_path(const char *func_name,
+	const char *abs_host_path, char **resultp);
+extern int sb2_mapd_prepare_exec(const char *exec_fn_name,
+	const char *orig_file, char *const *orig_argv, char *const *orig_envp,
+	int *resultp, char **new_file, char ***new_argv, char ***new_envp);
+
 extern int sb_execve_preprocess(char **file, char ***argv, char ***envp);
 extern char *emumode_map(const char *path);
 extern void sb_push_string_to_lua_stack(char *str);
+
+/* luaif/pathmatch.c */
+extern int sb2_path_prefix_match(const char *str, size_t str_len,
+	const char *prefix, size_t prefix_len);
+extern int sb2_test_path_match(const char *path, size_t path_len,
+	const char *rule_dir, size_t rule_dir_len,
+	const char *rule_prefix, size_t rule_prefix_len,
+	const char *rule_path, size_t rule_path_len);
+/* luaif/pathclass.c */
+extern int sb2_path_class_map(const char *func_name, const char *path,
+	mapping_results_t *res);
+extern void sb2_path_class_install(char **specs, int replace);
+
 extern char *sb_execve_map_script_interpreter(const char *interpreter,
         const char *interp_arg, const char *mapped_script_filename,
 	const char *orig_script_filename, char ***argv, char ***envp);
 extern int sb_execve_postprocess(char *exec_type,
 	char **mapped_file, char **filename, const char *binary_name,
 	char ***argv, char ***envp);
+struct lua_instance;
+extern int sb_execve_postprocess_cputransparency(struct lua_instance *luaif,
+	const char *conf_name, const char *exec_policy_name,
+	char **mapped_file, char **filename, char ***argv, char ***envp);
+extern char **sb2_path_class_specs_from_lua(struct lua_instance *luaif,
+	const char *binary_name);
+extern void sb2_path_class_load_from_lua(struct lua_instance *luaif,
+	const char *binary_name, int replace);
+extern void sb2_dirfd_path_cache_load_from_lua(struct lua_instance *luaif,
+	const char *binary_name);
 extern void sb_get_host_policy_ld_params(char **popen_ld_preload, char **popen_ld_lib_path);
 
 extern char *scratchbox_reverse_path(
 	const char *func_name, const char *full_path);
 
-extern const char *fdpathdb_find_path(int fd);
+/* fdpathdb.c: refcounted pathnames of open file descriptors */
+typedef struct fdpathdb_path_s fdpathdb_path_t;
+extern fdpathdb_path_t *fdpathdb_get_path(int fd);
+extern const char *fdpathdb_path_str(const fdpathdb_path_t *fpp);
+extern void fdpathdb_release_path(fdpathdb_path_t *fpp);
+extern void *fdpathdb_get_cached_data(const fdpathdb_path_t *fpp);
+extern int fdpathdb_set_cached_data(fdpathdb_path_t *fpp, void *data,
+	void (*free_fn)(void *));
 
 /* ---- internal constants: ---- */
 
@@ -0,0 +1,69 @@
+/*
+ * rootindex.h -- on-disk format of the root index files
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * A root index describes every file, directory and symlink under a
+ * root directory (target_root or tools_root). It is created by
+ * "sb2-rootindex" and mmap()ed by libsb2, which uses it to answer
+ * existence and symlink queries about paths that are mapped by
+ * read-only rules (see preload/rootindex.c).
+ *
+ * File layout:
+ *	struct sb2_rootindex_header
+ *	struct sb2_rootindex_entry[rih_num_entries], sorted by path (strcmp)
+ *	string table; offset 0 is always an empty string
+ *
+ * Paths are relative to the root and begin with a slash, e.g. "/usr/bin";
+ * the root itself is "". The index is valid as long as none of the
+ * generation files has changed (the root directory itself, dpkg's status
+ * file and ".sb2-generation" which can be touched to invalidate the index
+ * after other modifications).
+*/
+
+#ifndef ROOTINDEX_H
+#define ROOTINDEX_H
+
+#include <stdint.h>
+
+#define SB2_ROOTINDEX_MAGIC	"SB2RIDX1"
+#define SB2_ROOTINDEX_MAGIC_LEN	8
+
+#define SB2_ROOTINDEX_NUM_GENERATION_FILES	3
+#define SB2_ROOTINDEX_GENERATION_FILES \
+	{ "", "/var/lib/dpkg/status", "/.sb2-generation" }
+
+struct sb2_rootindex_generation {
+	int64_t		rig_mtime_sec;
+	int64_t		rig_mtime_nsec;
+	uint64_t	rig_ino;	/* 0 if the file did not exist */
+	uint32_t	rig_path_offs;
+	uint32_t	rig_reserved;
+};
+
+struct sb2_rootindex_header {
+	char		rih_magic[SB2_ROOTINDEX_MAGIC_LEN];
+	uint32_t	rih_header_size;
+	uint32_t	rih_entry_size;
+	uint32_t	rih_num_entries;
+	uint32_t	rih_root_offs;	/* absolute path of the root */
+	uint64_t	rih_entries_offs;
+	uint64_t	rih_strings_offs;
+	uint64_t	rih_strings_size;
+	struct sb2_rootindex_generation
+			rih_generation[SB2_ROOTINDEX_NUM_GENERATION_FILES];
+};
+
+struct sb2_rootindex_entry {
+	uint32_t	rie_path_offs;
+	uint32_t	rie_link_offs;	/* symlink destination, 0 if none */
+	uint32_t	rie_mode;
+	uint32_t	rie_flags;
+	uint64_t	rie_size;
+};
+
+/* rie_flags: contents of this directory are not in the index (the
+ * directory is a mount point, or could not be read) */
+#define SB2_ROOTINDEX_F_NOT_INDEXED	01
+
+#endif /* ROOTINDEX_H */
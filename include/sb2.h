@@ -26,14 +26,38 @@
 #include <dmalloc.h>
 #endif
 
+/* Memory of a Lua state (see luaif/luaalloc.c) */
+#define SB2_LUA_HEAP_NUM_CLASSES	24
+
+struct sb2_lua_heap {
+	void	*lh_free[SB2_LUA_HEAP_NUM_CLASSES];	/* free lists */
+	char	*lh_chunks;		/* list of mmap'ed chunks */
+	char	*lh_bump_ptr;		/* unused space of the newest chunk */
+	char	*lh_bump_end;
+	size_t	lh_bytes_in_use;	/* as requested by Lua */
+	size_t	lh_peak_bytes_in_use;
+	size_t	lh_bytes_mapped;	/* chunks and large blocks */
+	int	lh_num_chunks;
+};
+
 struct lua_instance {
 	lua_State *lua;
+	struct sb2_lua_heap heap;
 	int mapping_disabled;
 	int lua_instance_in_use; /* used only if debug messages are active */
 
 	/* for path mapping logic: */
 	char *host_cwd;
 	char *virtual_reversed_cwd;
+
+	/* garbage collector (see luaif/luagc.c): */
+	unsigned long gc_calls;
+	unsigned long gc_steps;
+	unsigned long gc_collections;
+	unsigned long long gc_ns;
+	size_t gc_collect_limit;
+	int gc_over_cap_reported;
+	int gc_stack_base;
 };
 
 /* This version string is used to check that the lua scripts offer 
@@ -84,13 +108,55 @@ struct lua_instance {
  *   - added wrapper for utimensat
  * * Differences between "74" and "72"
  *   - added many wrappers (__*_chk(), etc)
+ * * Differences between "75" and "74"
+ *   - sb.path_exists() takes an optional "readonly" flag (root indexes)
+ * * Differences between "76" and "75"
+ *   - sbox_get_mapping_requirements() gets the function ID as the 4th
+ *     parameter; added sb.get_function_names()
+ * * Differences between "77" and "76"
+ *   - added sb.find_path_match(), used by find_rule()
+ * * Differences between "78" and "77"
+ *   - added sb_execve_postprocess_cputransparency_policy(); command
+ *     lines for Qemu and sbrsh are built in C
+ * * Differences between "79" and "78"
+ *   - sb_execve_map_script_interpreter() may return 3 (argv was
+ *     modified, map the interpreter with ordinary path mapping)
+ * * Differences between "80" and "79"
+ *   - added sb_script_interpreter_cache, which is read by the C code
+ * * Differences between "81" and "80"
+ *   - added sb_get_path_class_specs() (see luaif/pathclass.c)
  *
  * NOTE: the corresponding identifier for Lua is in lua_scripts/main.lua
 */
-#define SB2_LUA_C_INTERFACE_VERSION "74"
+#define SB2_LUA_C_INTERFACE_VERSION "81"
 
 extern struct lua_instance *get_lua(void);
 extern void release_lua(struct lua_instance *ptr);
+extern int sb2_lua_instances_allocated;
+extern int sb2_mapping_disabled_in_this_thread(void);
+
+extern void *sb2_lua_heap_alloc(void *ud, void *ptr, size_t osize,
+	size_t nsize);
+extern void sb2_lua_heap_destroy(struct sb2_lua_heap *heap);
+extern void sb2_lua_heap_log_usage(struct sb2_lua_heap *heap,
+	const char *when);
+extern struct lua_instance *sb2_lua_instance_of_this_thread(void);
+
+extern void sb2_lua_gc_init(struct lua_instance *luaif);
+extern void sb2_lua_gc_after_call(struct lua_instance *luaif);
+extern void sb2_lua_gc_image_done(int is_exec);
+
+/* Calls from C to Lua are timed when the session is profiled
+ * (see preload/profiler.c) */
+extern int sb2_profile_enabled;
+extern void sb2_profile_lua_call(lua_State *l, int nargs, int nresults);
+#define SB2_LUA_CALL(l, nargs, nresults) \
+	do { \
+		if (sb2_profile_enabled) \
+			sb2_profile_lua_call((l), (nargs), (nresults)); \
+		else \
+			lua_call((l), (nargs), (nresults)); \
+	} while (0)
 
 #if 0
 extern char *sb_decolonize_path(const char *path);
@@ -159,6 +225,7 @@ extern char *sbox_orig_binary_name;
 extern char *sbox_active_exec_policy_name;
 
 extern int pthread_library_is_available; /* flag */
+extern void sb2_check_pthread_library(void);
 extern pthread_t (*pthread_self_fnptr)(void);
 extern int (*pthread_mutex_lock_fnptr)(pthread_mutex_t *mutex);
 extern int (*pthread_mutex_unlock_fnptr)(pthread_mutex_t *mutex);
@@ -0,0 +1,61 @@
+/*
+ * watchgen.h -- layout of the directory generation segment
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * "sb2-watchd" watches the writable trees of a session with inotify and
+ * keeps a generation counter for every directory: the counter is
+ * incremented whenever an entry is created, removed, renamed or
+ * changes its attributes in that directory. The counters live in a
+ * file in the session directory ($SBOX_SESSION_DIR/watchgen), which
+ * is mmap()ed by every process of the session (see preload/watchgen.c).
+ *
+ * Directories are hashed to a fixed number of buckets; a collision only
+ * makes a cached entry look stale when it isn't. wgh_events is
+ * incremented for every change, and wgh_generation when everything must
+ * be considered changed (the inotify queue overflowed, or the watcher
+ * stops).
+ *
+ * The buckets are followed by the watched directories (real paths, each
+ * terminated by a NUL); other directories don't get any counts.
+*/
+
+#ifndef WATCHGEN_H
+#define WATCHGEN_H
+
+#include <stdint.h>
+
+#define SB2_WATCHGEN_MAGIC	"SB2WGEN2"
+#define SB2_WATCHGEN_MAGIC_LEN	8
+
+#define SB2_WATCHGEN_NUM_BUCKETS	16384	/* must be a power of 2 */
+
+/* wgh_state */
+#define SB2_WATCHGEN_STATE_RUNNING	1
+#define SB2_WATCHGEN_STATE_STOPPED	2
+
+struct sb2_watchgen_header {
+	char			wgh_magic[SB2_WATCHGEN_MAGIC_LEN];
+	uint32_t		wgh_header_size;
+	uint32_t		wgh_num_buckets;
+	volatile uint32_t	wgh_state;
+	uint32_t		wgh_roots_size;	/* bytes after the buckets */
+	volatile uint64_t	wgh_generation;
+	volatile uint64_t	wgh_events;
+	/* followed by uint32_t buckets[wgh_num_buckets] and the roots */
+};
+
+/* Bucket of a directory. "path" is an absolute host path without
+ * a trailing slash ("" is the root directory) */
+static inline uint32_t sb2_watchgen_bucket(const char *path, size_t len)
+{
+	uint32_t	h = 2166136261u;	/* FNV-1a */
+
+	while (len-- > 0) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+	return(h & (SB2_WATCHGEN_NUM_BUCKETS - 1));
+}
+
+#endif /* WATCHGEN_H */
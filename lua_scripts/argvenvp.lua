@@ -352,11 +352,72 @@ end
 --  1: argv / envp were not modified; mapped_interpreter was set
 --  2: argv / envp were not modified; caller should call ordinary path 
 --	mapping to find the interpreter
+--  3: argv / envp were modified; caller should call ordinary path
+--	mapping to find the interpreter
 -- -1: deny exec.
+--
+-- If the exec policy sets "script_use_mapped_script_path", the
+-- interpreter gets the mapped path of the script instead of the
+-- original path, so that the interpreter doesn't need to find the
+-- script again (this replaces the symlink made by sb2-interp-wrapper,
+-- without an extra process). Mapping rules should map that path
+-- to itself.
+-- Results of sb_execve_map_script_interpreter() are cached here,
+-- sb_script_interpreter_cache[policy_key][interpreter.."\n"..has_interp_arg]
+-- (the key format is used also by the C code, see luaif/argvenvp.c),
+-- when the result depends only on the policy and the interpreter.
+-- "policy_key" is the exec_policy given by the caller, or the mapped
+-- path of the script if the policy is looked up from exec_policy_chains.
+-- Only script_path_cache_max scripts are kept in the cache by path;
+-- when that is reached, all entries with path keys are dropped.
+-- Policies that log something about scripts and rules with conditional
+-- actions (which may test the file system) are not cached.
+-- The C code looks up the cache before calling Lua, and applies the
+-- changes to argv itself (see the fields of the entries below).
+sb_script_interpreter_cache = {}
+setmetatable(sb_script_interpreter_cache, { __mode = "k" })
+
+local script_path_cache_max = 256
+local script_path_cache_n = 0
+
+local function cache_script_interpreter_mapping(policy_key, interpreter,
+	interp_arg, entry)
+
+	local pc = sb_script_interpreter_cache[policy_key]
+	if pc == nil then
+		if type(policy_key) == "string" then
+			if script_path_cache_n >= script_path_cache_max then
+				for k in pairs(sb_script_interpreter_cache) do
+					if type(k) == "string" then
+						sb_script_interpreter_cache[k] = nil
+					end
+				end
+				script_path_cache_n = 0
+			end
+			script_path_cache_n = script_path_cache_n + 1
+		end
+		pc = {}
+		sb_script_interpreter_cache[policy_key] = pc
+	end
+	local has_interp_arg = 0
+	if interp_arg ~= nil then
+		has_interp_arg = 1
+	end
+	pc[interpreter .. "\n" .. has_interp_arg] = entry
+end
+
 function sb_execve_map_script_interpreter(rule, exec_policy, interpreter,
 	interp_arg, mapped_script_filename, orig_script_filename, argv, envp)
 
 	local args_ok
+	local policy_key = nil
+	if type(rule) ~= "string" then
+		if type(exec_policy) == "table" then
+			policy_key = exec_policy
+		elseif exec_policy == nil then
+			policy_key = mapped_script_filename
+		end
+	end
 	args_ok, rule, exec_policy = check_rule_and_policy(rule,
 		exec_policy, orig_script_filename, mapped_script_filename) 
 
@@ -367,6 +428,9 @@ function sb_execve_map_script_interpreter(rule, exec_policy, interpreter,
 	end
 
 	-- exec policy is OK.
+	if (exec_policy.script_log_level ~= nil) then
+		policy_key = nil
+	end
 
 	if (exec_policy.script_log_level ~= nil) then
 		sb.log(exec_policy.script_log_level,
@@ -374,6 +438,13 @@ function sb_execve_map_script_interpreter(rule, exec_policy, interpreter,
 	end
 
 	if (exec_policy.script_deny_exec == true) then
+		if policy_key then
+			cache_script_interpreter_mapping(policy_key,
+				interpreter, interp_arg, {
+					result = -1,
+					exec_policy = exec_policy
+				})
+		end
 		return rule, exec_policy, -1, interpreter, #argv, argv, #envp, envp
 	end
 
@@ -385,6 +456,20 @@ function sb_execve_map_script_interpreter(rule, exec_policy, interpreter,
 			exec_policy.name))
 	end
 
+	local argv_modified = false
+	if (exec_policy.script_use_mapped_script_path == true) then
+		-- argv is {interpreter, [interp_arg,] script, args...}
+		local script_idx = 2
+		if (interp_arg ~= nil) then
+			script_idx = 3
+		end
+		sb.log("debug", string.format(
+			"script path for the interpreter: %s => %s",
+			argv[script_idx], mapped_script_filename))
+		argv[script_idx] = mapped_script_filename
+		argv_modified = true
+	end
+
 	if (exec_policy.script_interpreter_rules ~= nil) then
 		local min_path_len = 0
 		local rule = nil
@@ -397,11 +482,31 @@ function sb_execve_map_script_interpreter(rule, exec_policy, interpreter,
 			exec_pol_2, mapped_interpreter, ro_flag = sbox_execute_rule(
 				interpreter, "map_script_interpreter",
 				interpreter, interpreter, rule, rule)
-		
+
+			if policy_key and rule.actions == nil then
+				local set_argv0 = (exec_policy.script_set_argv0_to_mapped_interpreter ~= nil)
+				local result = 1
+				if set_argv0 or argv_modified then
+					result = 0
+				end
+				cache_script_interpreter_mapping(policy_key,
+					interpreter, interp_arg, {
+						result = result,
+						rule = rule,
+						exec_policy = exec_pol_2,
+						mapped_interpreter = mapped_interpreter,
+						set_argv0 = set_argv0,
+						use_mapped_script_path = argv_modified
+					})
+			end
+
 			if exec_policy.script_set_argv0_to_mapped_interpreter then
 				argv[1] = mapped_interpreter
 				return rule, exec_pol_2, 0, 
 					mapped_interpreter, #argv, argv, #envp, envp
+			elseif argv_modified then
+				return rule, exec_pol_2, 0, 
+					mapped_interpreter, #argv, argv, #envp, envp
 			else
 				return rule, exec_pol_2, 1, 
 					mapped_interpreter, #argv, argv, #envp, envp
@@ -416,6 +521,21 @@ function sb_execve_map_script_interpreter(rule, exec_policy, interpreter,
 	-- The default case:
 	-- exec policy says nothing about the script interpreters.
 	-- use ordinary path mapping to find it
+	if policy_key and exec_policy.script_interpreter_rules == nil then
+		local result = 2
+		if argv_modified then
+			result = 3
+		end
+		cache_script_interpreter_mapping(policy_key,
+			interpreter, interp_arg, {
+				result = result,
+				exec_policy = exec_policy,
+				use_mapped_script_path = argv_modified
+			})
+	end
+	if argv_modified then
+		return rule, exec_policy, 3, interpreter, #argv, argv, #envp, envp
+	end
 	return rule, exec_policy, 2, interpreter, #argv, argv, #envp, envp
 end
 
@@ -702,6 +822,12 @@ function sb_execve_postprocess_cpu_transparency_executable(rule, exec_policy,
 
 	sb.log("debug", "postprocessing cpu_transparency for " .. filename)
 
+	if exec_policy.cputransparency_postprocess ~= nil then
+		return exec_policy.cputransparency_postprocess(rule, exec_policy,
+			exec_type, mapped_file, filename, argv, envp,
+			conf_cputransparency)
+	end
+
 	if conf_cputransparency.method_is_qemu then
 		local new_envp = {}
 		local new_argv = {}
@@ -844,9 +970,44 @@ function sb_execve_postprocess_cpu_transparency_executable(rule, exec_policy,
 end
 
 
--- This is called from C:
-function sb_execve_postprocess(rule, exec_policy, exec_type,
-	mapped_file, filename, binaryname, argv, envp)
+-- The part of exec postprocessing which depends on the type of the
+-- executable. Called after the exec policy has been checked.
+function sb_execve_postprocess_by_type(rule, exec_policy, exec_type,
+	mapped_file, filename, argv, envp)
+
+	if (exec_type == "native") then
+		return sb_execve_postprocess_native_executable(rule,
+			exec_policy, exec_type, mapped_file,
+			filename, argv, envp)
+	elseif (exec_type == "cpu_transparency") then
+		return sb_execve_postprocess_cpu_transparency_executable(rule,
+			exec_policy, exec_type, mapped_file,
+			filename, argv, envp, conf_cputransparency_target)
+	elseif (exec_type == "static") then
+		if (conf_cputransparency_native ~= nil and conf_cputransparency_native.cmd ~= "") then
+			return sb_execve_postprocess_cpu_transparency_executable(rule,
+				exec_policy, exec_type, mapped_file,
+				filename, argv, envp, conf_cputransparency_native)
+		end
+		-- [see comment in sb_exec.c]
+		local ldlibpath
+		local ldpreload
+		ldpreload, ldlibpath = sbox_get_host_policy_ld_params()
+		set_ld_preload(envp, ldpreload)
+		set_ld_library_path(envp, ldlibpath)
+		return 0, mapped_file, filename, #argv, argv, #envp, envp
+	end
+	
+	-- all other exec_types: allow exec with orig.args
+	return 1, mapped_file, filename, #argv, argv, #envp, envp
+end
+
+-- Checks the exec policy (the generic part of postprocessing).
+-- returns: result, exec_policy
+--  result is nil if postprocessing should continue, -1 if exec must
+--  be denied and 1 if exec must be allowed without postprocessing.
+local function check_exec_policy_for_postprocess(rule, exec_policy,
+	exec_type, mapped_file, filename)
 
 	local args_ok
 	args_ok, rule, exec_policy = check_rule_and_policy(rule,
@@ -855,7 +1016,7 @@ function sb_execve_postprocess(rule, exec_policy, exec_type,
 	if args_ok == false then
 		-- postprocessing is not needed / can't be done, but
 		-- exec must be allowed.
-		return 1, mapped_file, filename, #argv, argv, #envp, envp
+		return 1, exec_policy
 	end
 
 	-- Exec policy found.
@@ -865,7 +1026,7 @@ function sb_execve_postprocess(rule, exec_policy, exec_type,
 	end
 
 	if (exec_policy.deny_exec == true) then
-		return -1, mapped_file, filename, #argv, argv, #envp, envp
+		return -1, exec_policy
 	end
 
 	if (exec_policy.name == nil) then
@@ -877,6 +1038,19 @@ function sb_execve_postprocess(rule, exec_policy, exec_type,
 
 	sb.log("debug", string.format("sb_execve_postprocess:type=%s",
 		exec_type))
+	return nil, exec_policy
+end
+
+-- This is called from C:
+function sb_execve_postprocess(rule, exec_policy, exec_type,
+	mapped_file, filename, binaryname, argv, envp)
+
+	local res
+	res, exec_policy = check_exec_policy_for_postprocess(rule,
+		exec_policy, exec_type, mapped_file, filename)
+	if res ~= nil then
+		return res, mapped_file, filename, #argv, argv, #envp, envp
+	end
 
 	if (exec_policy.name) then
 		table.insert(envp, "__SB2_EXEC_POLICY_NAME="..exec_policy.name)
@@ -884,32 +1058,57 @@ function sb_execve_postprocess(rule, exec_policy, exec_type,
 
 	-- End of generic part. Rest of postprocessing depends on type of
 	-- the executable.
+	return sb_execve_postprocess_by_type(rule, exec_policy, exec_type,
+		mapped_file, filename, argv, envp)
+end
 
-	if (exec_type == "native") then
-		return sb_execve_postprocess_native_executable(rule,
-			exec_policy, exec_type, mapped_file,
-			filename, argv, envp)
-	elseif (exec_type == "cpu_transparency") then
-		return sb_execve_postprocess_cpu_transparency_executable(rule,
-			exec_policy, exec_type, mapped_file,
-			filename, argv, envp, conf_cputransparency_target)
-	elseif (exec_type == "static") then
-		if (conf_cputransparency_native ~= nil and conf_cputransparency_native.cmd ~= "") then
-			return sb_execve_postprocess_cpu_transparency_executable(rule,
-				exec_policy, exec_type, mapped_file,
-				filename, argv, envp, conf_cputransparency_native)
-		end
-		-- [see comment in sb_exec.c]
-		local ldlibpath
-		local ldpreload
-		ldpreload, ldlibpath = sbox_get_host_policy_ld_params()
-		set_ld_preload(envp, ldpreload)
-		set_ld_library_path(envp, ldlibpath)
-		return 0, mapped_file, filename, #argv, argv, #envp, envp
+-- This is called from C for executables which are started with a CPU
+-- transparency method ("cpu_transparency" and "static" types), before
+-- argv and envp are converted to Lua tables: Usually only the exec
+-- policy needs to be checked here, and the command line for Qemu or
+-- sbrsh is built in C (luaif/cputransparency.c) from the settings
+-- in conf_cputransparency_target/native. An exec policy can
+-- override that by setting "cputransparency_postprocess" to a function,
+-- which is then called like
+-- sb_execve_postprocess_cpu_transparency_executable().
+--
+-- returns: rule, exec_policy, result, conf_name, exec_policy_name
+-- "result" is one of:
+--  0: build argv and envp in C, using conf_cputransparency_<conf_name>
+--  1: exec with unmodified argv and envp
+--  2: call sb_execve_postprocess() (rule & exec_policy are returned
+--     for that)
+-- -1: deny exec.
+function sb_execve_postprocess_cputransparency_policy(rule, exec_policy,
+	exec_type, mapped_file, filename)
+
+	local args_ok, checked_rule, checked_policy = check_rule_and_policy(
+		rule, exec_policy, filename, mapped_file)
+	local conf_name
+
+	if (exec_type == "cpu_transparency") then
+		conf_name = "target"
+	elseif (exec_type == "static" and conf_cputransparency_native ~= nil
+	    and conf_cputransparency_native.cmd ~= "") then
+		conf_name = "native"
 	end
-	
-	-- all other exec_types: allow exec with orig.args
-	return 1, mapped_file, filename, #argv, argv, #envp, envp
+
+	if args_ok == false then
+		-- exec must be allowed without postprocessing
+		return rule, exec_policy, 1, nil, nil
+	end
+	if (conf_name == nil or
+	    checked_policy.cputransparency_postprocess ~= nil) then
+		return rule, exec_policy, 2, nil, nil
+	end
+
+	local res
+	res, checked_policy = check_exec_policy_for_postprocess(checked_rule,
+		checked_policy, exec_type, mapped_file, filename)
+	if res ~= nil then
+		return rule, exec_policy, res, nil, nil
+	end
+	return rule, exec_policy, 0, conf_name, checked_policy.name
 end
 
 -- This is called from C:
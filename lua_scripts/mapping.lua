@@ -137,6 +137,156 @@ function override_export_chains()
 	return new_chain
 end
 
+-- Precompile the "func_name" conditions of rules: The wrappers pass
+-- a numeric function ID with the name, and the set of IDs that a rule
+-- applies to is computed here once, instead of matching the pattern
+-- against the name for every call. Names that don't have an ID
+-- ("do_exec", etc) are still matched with the pattern by find_rule().
+function compile_func_name_conditions(chains)
+	local fn_names = sb.get_function_names()
+	local seen = {}
+
+	local function compile_chain(chain)
+		while (chain and not seen[chain]) do
+			seen[chain] = true
+			if (chain.rules) then
+				for r = 1, table.maxn(chain.rules) do
+					local rule = chain.rules[r]
+					if (rule.chain) then
+						compile_chain(rule.chain)
+					elseif (rule.func_name and
+					    not rule.func_ids) then
+						rule.func_ids = {}
+						for id, name in pairs(fn_names) do
+							if (string.match(name,
+							    rule.func_name)) then
+								rule.func_ids[id] = true
+							end
+						end
+					end
+				end
+			end
+			chain = chain.next_chain
+		end
+	end
+
+	for i = 1, table.maxn(chains) do
+		compile_chain(chains[i])
+	end
+end
+
+-- Paths in the kernel's virtual file systems are usually mapped to
+-- themselves. The C code (luaif/pathclass.c) can handle those without
+-- calling Lua at all, if the rule set guarantees that the result is
+-- always the same: sb_get_path_class_specs() returns the prefixes that
+-- are selected by "pure" identity rules or by the /proc mapper,
+-- for the chain which is used by "binary_name".
+-- Each string is "<d|p><I|P><r|->selector":
+--  - 'd' = dir, 'p' = prefix,
+--  - 'I' = use the path as it is, 'P' = sb2_procfs_mapper,
+--  - 'r' = read only.
+-- Only the kernel's file systems are considered, because other trees
+-- may contain symlinks which point to paths that are mapped differently.
+-- The C code does the same for a few magic links in those file systems.
+local path_class_fs_roots = { "/proc", "/dev", "/sys" }
+
+local function path_class_selector(sel, is_prefix)
+	for i = 1, table.maxn(path_class_fs_roots) do
+		local root = path_class_fs_roots[i]
+		if sel == root then
+			-- prefix "/sys" would also match "/sysroot";
+			-- use only the directory.
+			return "d", sel
+		end
+		if isprefix(root .. "/", sel) then
+			if is_prefix then
+				return "p", sel
+			end
+			return "d", sel
+		end
+	end
+	return nil
+end
+
+function sb_get_path_class_specs(binary_name)
+	local specs = {}
+	local earlier = {}
+	local chain = find_chain(active_mode_mapping_rule_chains, binary_name)
+
+	local function overlaps_earlier(sel)
+		for i = 1, table.maxn(earlier) do
+			if isprefix(earlier[i], sel) or isprefix(sel, earlier[i]) then
+				return true
+			end
+		end
+		return false
+	end
+
+	while chain do
+		for r = 1, table.maxn(chain.rules) do
+			local rule = chain.rules[r]
+			local sel = rule.dir or rule.prefix
+			local class = nil
+
+			if (rule.chain == nil and rule.path == nil and
+			    (rule.dir == nil or rule.prefix == nil) and
+			    rule.func_name == nil and rule.log_level == nil) then
+				if rule.custom_map_funct == sb2_procfs_mapper then
+					class = "P"
+				elseif (rule.custom_map_funct == nil and
+				    rule.use_orig_path) then
+					class = "I"
+				end
+			end
+			if sel and class and not overlaps_earlier(sel) then
+				local seltype, s = path_class_selector(sel,
+					rule.prefix ~= nil)
+				if seltype then
+					local ro = "-"
+					if rule.readonly then
+						ro = "r"
+					end
+					table.insert(specs, seltype .. class .. ro .. s)
+				end
+			end
+			if rule.dir then table.insert(earlier, rule.dir) end
+			if rule.prefix then table.insert(earlier, rule.prefix) end
+			if rule.path then table.insert(earlier, rule.path) end
+		end
+		chain = chain.next_chain
+	end
+	return specs
+end
+
+-- Returns true if the chain which is used by "binary_name" (or a chain
+-- below it) has rules with "func_name" conditions. Then a directory may
+-- be mapped differently for different functions, and the C code keeps
+-- the resolved prefixes of the *at() functions per function
+-- (see luaif/paths.c).
+function sb_chain_has_func_name_rules(binary_name)
+	local seen = {}
+
+	local function check_chain(chain)
+		while (chain and not seen[chain]) do
+			seen[chain] = true
+			for r = 1, table.maxn(chain.rules) do
+				local rule = chain.rules[r]
+				if (rule.func_name) then
+					return true
+				end
+				if (rule.chain and check_chain(rule.chain)) then
+					return true
+				end
+			end
+			chain = chain.next_chain
+		end
+		return false
+	end
+
+	return check_chain(find_chain(active_mode_mapping_rule_chains,
+		binary_name))
+end
+
 -- Load mode-specific rules.
 -- A mode file must define three variables:
 --  1. rule_file_interface_version (string) is checked and must match,
@@ -290,6 +440,7 @@ active_mode_mapping_rule_chains = {}
 active_mode_exec_policy_chains = {}
 
 load_and_check_rules()
+compile_func_name_conditions(active_mode_mapping_rule_chains)
 
 -- load reverse mapping rules, if those have been created
 -- (the file does not exist during the very first round here)
@@ -404,7 +555,7 @@ function sbox_execute_conditional_actions(binary_name,
 				tmp_dest = sbox_execute_replace_rule(path,
 					action_candidate.if_exists_then_replace_by, rule_selector)
 			end
-			if (sb.path_exists(tmp_dest)) then
+			if (sb.path_exists(tmp_dest, action_candidate.readonly)) then
 				if (debug_messages_enabled) then
 					sb.log("debug", string.format(
 						"target exists: => %s", tmp_dest))
@@ -539,7 +690,9 @@ end
 
 -- returns rule and min_path_len, minimum length which is needed for
 -- successfull mapping.
-function find_rule(chain, func, full_path)
+-- "func_id" is the function ID of "func" (see compile_func_name_conditions()),
+-- or nil/-1 if not known.
+function find_rule(chain, func, full_path, func_id)
 	local i = 0
 	local wrk = chain
 	local min_path_len = 0
@@ -548,50 +701,62 @@ function find_rule(chain, func, full_path)
 	end
 	while (wrk) do
 		-- travel the chains and loop the rules in a chain
-		for i = 1, table.maxn(wrk.rules) do
+		i = 1
+		while (true) do
+			-- sb.find_path_match() is implemented in C (better
+			-- performance). It tests rules i, i+1, ... and
+			-- returns index of the first rule where the path
+			-- matches and min.length, or nil.
+			i, min_path_len = sb.find_path_match(full_path,
+				wrk.rules, i)
+			if (i == nil) then
+				break
+			end
 			local rule = wrk.rules[i]
-			-- sb.test_path_match() is implemented in C (better
-			-- performance). It returns <0 if full_path doesn't
-			-- match, min.length otherwise
-			min_path_len = sb.test_path_match(full_path,
-				rule.dir, rule.prefix, rule.path)
-			if min_path_len >= 0 then
-				if (rule.chain) then
-					-- if rule can be found from
-					-- a subtree, return it,
-					-- otherwise continue looping here.
-					local s_rule
-					local s_min_len
-					s_rule, s_min_len = find_rule(
-						rule.chain, func, full_path)
-					if (s_rule ~= nil) then
-						return s_rule, s_min_len
-					end
-					if (debug_messages_enabled) then
-						sb.log("noise",
-						  "rule not found from subtree")
-					end
+			if (rule.chain) then
+				-- if rule can be found from
+				-- a subtree, return it,
+				-- otherwise continue looping here.
+				local s_rule
+				local s_min_len
+				s_rule, s_min_len = find_rule(
+					rule.chain, func, full_path, func_id)
+				if (s_rule ~= nil) then
+					return s_rule, s_min_len
+				end
+				if (debug_messages_enabled) then
+					sb.log("noise",
+					  "rule not found from subtree")
+				end
+			else
+				-- Path matches, test if other conditions are
+				-- also OK:
+				local func_ok
+				if (not rule.func_name) then
+					func_ok = true
+				elseif (func_id and func_id >= 0 and
+					rule.func_ids) then
+					func_ok = rule.func_ids[func_id]
 				else
-					-- Path matches, test if other conditions are
-					-- also OK:
-					if ((not rule.func_name
-						or string.match(func,
-							 rule.func_name))) then
-						if (debug_messages_enabled) then
-							local rulename = rule.name
-							if rulename == nil then
-								rulename = string.format("#%d",i)
-							end
-
-							sb.log("noise", string.format(
-							  "selected rule '%s'",
-							  rulename))
+					func_ok = string.match(func,
+						rule.func_name)
+				end
+				if (func_ok) then
+					if (debug_messages_enabled) then
+						local rulename = rule.name
+						if rulename == nil then
+							rulename = string.format("#%d",i)
 						end
-						return rule, min_path_len
+
+						sb.log("noise", string.format(
+						  "selected rule '%s'",
+						  rulename))
 					end
-					rule = nil
+					return rule, min_path_len
 				end
+				rule = nil
 			end
+			i = i + 1
 		end
 		wrk = wrk.next_chain
 	end
@@ -670,7 +835,8 @@ end
 -- ("flags" may contain "call_translate_for_all", which
 -- is a flag which controls optimizations in
 -- the path resolution code)
-function sbox_get_mapping_requirements(binary_name, func_name, full_path)
+function sbox_get_mapping_requirements(binary_name, func_name, full_path,
+	func_id)
 	-- loop through the chains, first match is used
 	local min_path_len = 0
 	local rule = nil
@@ -684,7 +850,7 @@ function sbox_get_mapping_requirements(binary_name, func_name, full_path)
 		return nil, false, 0, 0
 	end
 
-	rule, min_path_len = find_rule(chain, func_name, full_path)
+	rule, min_path_len = find_rule(chain, func_name, full_path, func_id)
 	if (not rule) then
 		-- error, not even a default rule found
 		sb.log("error", string.format("Unable to find rule for: %s(%s)", func_name, full_path))
@@ -4,7 +4,7 @@
 
 -- Rule file interface version, mandatory.
 --
-rule_file_interface_version = "22"
+rule_file_interface_version = "26"
 ----------------------------------
 
 if (tools_root and tools_root ~= "/") then
@@ -44,6 +44,9 @@ default_chain = {
 		{ prefix = sbox_dir .. "/bin", use_orig_path = true, readonly = true },
 		{ prefix = sbox_target_toolchain_dir, use_orig_path = true, readonly = true },
 
+		-- mapped script paths (see install_script_interp_rules)
+		{ prefix = target_root, use_orig_path = true },
+
 		{ prefix = "/", map_to = target_root },
 	}
 }
@@ -52,9 +55,9 @@ bash_chain = {
 	next_chain = default_chain,
 	binary = "bash",
 	rules = {
-		{ prefix = "/bin",           func_name = "__xstat.*", map_to = tools_target },
-		{ prefix = "/usr/bin",       func_name = "__xstat.*", map_to = tools_target },
-		{ prefix = "/usr/local/bin", func_name = "__xstat.*", map_to = tools_target },
+		{ prefix = "/bin",           func_name = ".*stat.*", map_to = tools_target },
+		{ prefix = "/usr/bin",       func_name = ".*stat.*", map_to = tools_target },
+		{ prefix = "/usr/local/bin", func_name = ".*stat.*", map_to = tools_target },
 	}
 }
 
@@ -62,9 +65,9 @@ sh_chain = {
 	next_chain = default_chain,
 	binary = "sh",
 	rules = {
-		{ prefix = "/bin",           func_name = "__xstat.*", map_to = tools_target },
-		{ prefix = "/usr/bin",       func_name = "__xstat.*", map_to = tools_target },
-		{ prefix = "/usr/local/bin", func_name = "__xstat.*", map_to = tools_target },
+		{ prefix = "/bin",           func_name = ".*stat.*", map_to = tools_target },
+		{ prefix = "/usr/bin",       func_name = ".*stat.*", map_to = tools_target },
+		{ prefix = "/usr/local/bin", func_name = ".*stat.*", map_to = tools_target },
 	}
 }
 
@@ -72,9 +75,9 @@ interp_wrapper_chain = {
 	next_chain = default_chain,
 	binary = "sb2-interp-wrapper",
 	rules = {
-		{ prefix = "/bin",           func_name = "__xstat.*", map_to = tools_target },
-		{ prefix = "/usr/bin",       func_name = "__xstat.*", map_to = tools_target },
-		{ prefix = "/usr/local/bin", func_name = "__xstat.*", map_to = tools_target },
+		{ prefix = "/bin",           func_name = ".*stat.*", map_to = tools_target },
+		{ prefix = "/usr/bin",       func_name = ".*stat.*", map_to = tools_target },
+		{ prefix = "/usr/local/bin", func_name = ".*stat.*", map_to = tools_target },
 	}
 }
 
@@ -87,8 +90,46 @@ export_chains = {
 
 -- Exec policy rules.
 
+-- Script interpreters are started from the tools, and they get the
+-- mapped path of the script. That is what sb2-interp-wrapper does
+-- for /bin/sh and /bin/bash, but without starting the wrapper.
+install_script_interp_rules = {
+	rules = {
+		{ dir = session_dir, use_orig_path = true },
+		{ prefix = tools_source, use_orig_path = true, readonly = true },
+
+		{ prefix = "/bin",           map_to = tools_target },
+		{ prefix = "/usr/bin",       map_to = tools_target },
+		{ prefix = "/usr/local/bin", map_to = tools_target },
+
+		{ prefix = sbox_user_home_dir, use_orig_path = true },
+		{ prefix = sbox_workdir, use_orig_path = true },
+		{ prefix = sbox_dir .. "/bin", use_orig_path = true, readonly = true },
+
+		{ prefix = "/", map_to = target_root },
+	}
+}
+
+-- If the permission token exists and contains "root",
+-- use fakeroot
+local fakeroot_ld_preload = ""
+if sb.get_session_perm() == "root" then
+	fakeroot_ld_preload = ":"..host_ld_preload_fakeroot
+end
+
 default_exec_policy = {
-	name = "Default"
+	name = "Default",
+
+	native_app_ld_preload_prefix = host_ld_preload..fakeroot_ld_preload,
+
+	native_app_ld_library_path_prefix =
+		host_ld_library_path_libfakeroot ..
+		host_ld_library_path_prefix ..
+		host_ld_library_path_libsb2,
+	native_app_ld_library_path_suffix = host_ld_library_path_suffix,
+
+	script_interpreter_rules = install_script_interp_rules,
+	script_use_mapped_script_path = true,
 }
 
 -- Note that the real path (mapped path) is used when looking up rules!
@@ -150,7 +150,7 @@ int sb_execve_preprocess(char **file, char ***argv, char ***envp)
 
 	/* args:    binaryname, argv, envp
 	 * returns: err, file, argc, argv, envc, envp */
-	lua_call(luaif->lua, 3, 6);
+	SB2_LUA_CALL(luaif->lua, 3, 6);
 	
 	res = lua_tointeger(luaif->lua, -6);
 	*file = strdup(lua_tostring(luaif->lua, -5));
@@ -200,6 +200,41 @@ int sb_execve_postprocess(char *exec_type,
 	SB_LOG(SB_LOGLEVEL_NOISE,
 		"sb_execve_postprocess: gettop=%d", lua_gettop(luaif->lua));
 
+	if (strcmp(exec_type, "native")) {
+		/* CPU transparency: Only the exec policy is checked in Lua,
+		 * the command line is built by cputransparency.c unless
+		 * the policy wants to do that in Lua */
+		lua_getfield(luaif->lua, LUA_GLOBALSINDEX,
+			"sb_execve_postprocess_cputransparency_policy");
+		lua_insert(luaif->lua, -3);
+		lua_pushstring(luaif->lua, exec_type);
+		lua_pushstring(luaif->lua, *mapped_file);
+		lua_pushstring(luaif->lua, *filename);
+
+		/* args: rule, exec_policy, exec_type, mapped_file, filename
+		 * returns: rule, exec_policy, res, conf_name,
+		 *	exec_policy_name */
+		SB2_LUA_CALL(luaif->lua, 5, 5);
+
+		res = lua_tointeger(luaif->lua, -3);
+		if (res != 2) {
+			if (res == 0) {
+				res = sb_execve_postprocess_cputransparency(
+					luaif, lua_tostring(luaif->lua, -2),
+					lua_tostring(luaif->lua, -1),
+					mapped_file, filename, argv, envp);
+			}
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"sb_execve_postprocess: cpu transparency, "
+				"result=%d", res);
+			lua_pop(luaif->lua, 5);
+			release_lua(luaif);
+			return res;
+		}
+		/* leave "rule" and "exec_policy" for sb_execve_postprocess */
+		lua_pop(luaif->lua, 3);
+	}
+
 	lua_getfield(luaif->lua, LUA_GLOBALSINDEX, "sb_execve_postprocess");
 
 	/* stack now contains "rule", "exec_policy" and "sb_execve_postprocess".
@@ -216,7 +251,7 @@ int sb_execve_postprocess(char *exec_type,
 	/* args: rule, exec_policy, exec_type, mapped_file, filename,
 	 *	 binaryname, argv, envp
 	 * returns: res, mapped_file, filename, argc, argv, envc, envp */
-	lua_call(luaif->lua, 8, 7);
+	SB2_LUA_CALL(luaif->lua, 8, 7);
 	
 	res = lua_tointeger(luaif->lua, -7);
 	switch (res) {
@@ -273,6 +308,104 @@ int sb_execve_postprocess(char *exec_type,
 	return res;
 }
 
+static char *map_script_interpreter_for_exec(const char *interpreter)
+{
+	char			*mapped_interpreter = NULL;
+	mapping_results_t	mapping_result;
+
+	clear_mapping_results_struct(&mapping_result);
+	sbox_map_path_for_exec("script_interp",
+		interpreter, &mapping_result);
+	if (mapping_result.mres_result_buf) {
+		mapped_interpreter = strdup(mapping_result.mres_result_buf);
+	}
+	free_mapping_results(&mapping_result);
+	return(mapped_interpreter);
+}
+
+/* Results of sb_execve_map_script_interpreter() (Lua) are cached by
+ * the Lua code to "sb_script_interpreter_cache", per exec policy and
+ * interpreter, when the result doesn't depend on anything else.
+ * If an entry is found, argv is updated here, "rule" and "exec_policy"
+ * in the stack are replaced as the Lua function would have done, and
+ * the result code is returned to "*resp". Returns 0 if an entry was
+ * not found (the stack is not modified).
+*/
+static int map_script_interpreter_from_cache(struct lua_instance *luaif,
+	const char *interpreter, const char *interp_arg,
+	const char *mapped_script_filename, char **argv,
+	char **mapped_interpreterp, int *resp)
+{
+	lua_State	*l = luaif->lua;
+	const char	*mi;
+	int		script_idx;
+
+	if (lua_isstring(l, -2)) return(0); /* rule: mapping has failed */
+	lua_getfield(l, LUA_GLOBALSINDEX, "sb_script_interpreter_cache");
+	if (!lua_istable(l, -1)) {
+		lua_pop(l, 1);
+		return(0);
+	}
+	/* the key is exec_policy, or the script's path if there is
+	 * no policy yet (see argvenvp.lua) */
+	if (lua_istable(l, -2)) lua_pushvalue(l, -2);
+	else if (lua_isnil(l, -2)) lua_pushstring(l, mapped_script_filename);
+	else {
+		lua_pop(l, 1);
+		return(0);
+	}
+	lua_rawget(l, -2);
+	if (!lua_istable(l, -1)) {
+		lua_pop(l, 2);
+		return(0);
+	}
+	lua_pushfstring(l, "%s\n%d", interpreter, (interp_arg != NULL));
+	lua_rawget(l, -2);
+	if (!lua_istable(l, -1)) {
+		lua_pop(l, 3);
+		return(0);
+	}
+	/* stack: rule, exec_policy, cache, policy's cache, entry */
+	lua_replace(l, -3);
+	lua_pop(l, 1);
+	lua_getfield(l, -1, "result");
+	*resp = lua_tointeger(l, -1);
+	lua_pop(l, 1);
+	if ((*resp == 0) || (*resp == 1)) {
+		/* the interpreter was mapped by a script_interpreter_rule,
+		 * which determines the new rule and policy */
+		lua_getfield(l, -1, "rule");
+		lua_replace(l, -4);
+		lua_getfield(l, -1, "exec_policy");
+		lua_replace(l, -3);
+	} else {
+		/* the policy which was used, if it was looked up */
+		lua_getfield(l, -1, "exec_policy");
+		if (lua_isnil(l, -1)) lua_pop(l, 1);
+		else lua_replace(l, -3);
+	}
+
+	lua_getfield(l, -1, "mapped_interpreter");
+	mi = lua_tostring(l, -1);
+	*mapped_interpreterp = (mi ? strdup(mi) : NULL);
+	lua_pop(l, 1);
+
+	/* argv is {interpreter, [interp_arg,] script, args...} */
+	lua_getfield(l, -1, "set_argv0");
+	if (lua_toboolean(l, -1) && *mapped_interpreterp) {
+		free(argv[0]);
+		argv[0] = strdup(*mapped_interpreterp);
+	}
+	lua_getfield(l, -2, "use_mapped_script_path");
+	script_idx = (interp_arg ? 2 : 1);
+	if (lua_toboolean(l, -1) && argv[script_idx]) {
+		free(argv[script_idx]);
+		argv[script_idx] = strdup(mapped_script_filename);
+	}
+	lua_pop(l, 3); /* leave rule & policy */
+	return(1);
+}
+
 /* Map script interpreter:
  * Called with "rule" and "exec_policy" already in lua's stack,
  * leaves (possibly modified) "rule" and "exec_policy" to lua's stack.
@@ -308,6 +441,30 @@ char *sb_execve_map_script_interpreter(
 		lua_gettop(luaif->lua), interpreter, interp_arg,
 		mapped_script_filename, orig_script_filename);
 
+	if (map_script_interpreter_from_cache(luaif, interpreter, interp_arg,
+	    mapped_script_filename, *argv, &mapped_interpreter, &res)) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"sb_execve_map_script_interpreter: cached result %d",
+			res);
+		switch (res) {
+		case 0:
+		case 1:
+			break;
+		case 2:
+		case 3:
+			free(mapped_interpreter);
+			mapped_interpreter = map_script_interpreter_for_exec(
+				interpreter);
+			break;
+		default:
+			free(mapped_interpreter);
+			mapped_interpreter = NULL;
+			break;
+		}
+		release_lua(luaif);
+		return mapped_interpreter;
+	}
+
 	lua_getfield(luaif->lua, LUA_GLOBALSINDEX,
 		"sb_execve_map_script_interpreter");
 
@@ -332,6 +489,9 @@ char *sb_execve_map_script_interpreter(
 	 * "result" is one of:
 	 *  0: argv / envp were modified; mapped_interpreter was set
 	 *  1: argv / envp were not modified; mapped_interpreter was set
+	 *  2: argv / envp were not modified; use ordinary path mapping
+	 *     to find the interpreter
+	 *  3: argv / envp were modified; use ordinary path mapping
 	 * -1: deny exec.
 	*/
 	if(SB_LOG_IS_ACTIVE(SB_LOGLEVEL_NOISE3)) {
@@ -340,7 +500,7 @@ char *sb_execve_map_script_interpreter(
 	SB_LOG(SB_LOGLEVEL_NOISE,
 		"sb_execve_map_script_interpreter: call lua, gettop=%d",
 		lua_gettop(luaif->lua));
-	lua_call(luaif->lua, 8, 8);
+	SB2_LUA_CALL(luaif->lua, 8, 8);
 	SB_LOG(SB_LOGLEVEL_NOISE,
 		"sb_execve_map_script_interpreter: return from lua, gettop=%d",
 		lua_gettop(luaif->lua));
@@ -379,25 +539,28 @@ char *sb_execve_map_script_interpreter(
 		lua_pop(luaif->lua, 6);
 		break;
 
+	case 3:
+		/* exec arguments were modified, and the interpreter is
+		 * found with ordinary path mapping */
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"sb_execve_map_script_interpreter: Updated argv&envp");
+
+		strvec_free(*argv);
+		new_argc = lua_tointeger(luaif->lua, -4);
+		lua_string_table_to_strvec(luaif, -3, argv, new_argc);
+
+		new_envc = lua_tointeger(luaif->lua, -2);
+		strvec_free(*envp);
+		lua_string_table_to_strvec(luaif, -1, envp, new_envc);
+		/* FALLTHROUGH */
 	case 2:
 		SB_LOG(SB_LOGLEVEL_DEBUG,
 			"sb_execve_map_script_interpreter: use sbox_map_path_for_exec");
 		/* remove return values from the stack, leave rule & policy.  */
 		lua_pop(luaif->lua, 6);
 		if (mapped_interpreter) free(mapped_interpreter);
-		mapped_interpreter = NULL;
-		{
-			mapping_results_t	mapping_result;
-
-			clear_mapping_results_struct(&mapping_result);
-			sbox_map_path_for_exec("script_interp",
-				interpreter, &mapping_result);
-			if (mapping_result.mres_result_buf) {
-				mapped_interpreter =
-					strdup(mapping_result.mres_result_buf);
-			}
-			free_mapping_results(&mapping_result);
-		}
+		mapped_interpreter = map_script_interpreter_for_exec(
+			interpreter);
 		SB_LOG(SB_LOGLEVEL_DEBUG, "sb_execve_map_script_interpreter: "
 			"interpreter=%s mapped_interpreter=%s",
 			interpreter, mapped_interpreter);
@@ -455,7 +618,7 @@ void sb_get_host_policy_ld_params(char **p_ld_preload, char **p_ld_lib_path)
 
 	/* no args,    
 	 * returns: ld_preload, ld_library_path */
-	lua_call(luaif->lua, 0, 2);
+	SB2_LUA_CALL(luaif->lua, 0, 2);
 	
 	*p_ld_preload = strdup(lua_tostring(luaif->lua, -2));
 	*p_ld_lib_path = strdup(lua_tostring(luaif->lua, -1));
@@ -0,0 +1,629 @@
+/*
+ * cputransparency.c -- command lines for the CPU transparency methods
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * When a target binary is executed, argv and envp are rewritten so that
+ * the binary is started by the CPU transparency method (Qemu or sbrsh).
+ * The settings of the methods come from exec_config.lua
+ * (conf_cputransparency_target and conf_cputransparency_native, see
+ * utils/sb2) and never change during a session: they are read from Lua
+ * once, and the new argv and envp are built here. The strings of the
+ * original vectors are moved to the new vectors, only the added elements
+ * are allocated.
+ *
+ * This does the same as sb_execve_postprocess_cpu_transparency_executable()
+ * and sb_execve_postprocess_sbrsh() in argvenvp.lua; exec policies which
+ * override the default behavior are still handled by the Lua code
+ * (see sb_execve_postprocess_cputransparency_policy()).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <sb2.h>
+#include <mapping.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+
+#include "libsb2.h"
+#include "exported.h"
+
+#define CPUTRANSP_METHOD_NONE	0
+#define CPUTRANSP_METHOD_QEMU	1
+#define CPUTRANSP_METHOD_SBRSH	2
+
+struct cputransparency_conf {
+	int	ctc_method;
+	char	**ctc_qemu_argv; /* the emulator and its options */
+	int	ctc_qemu_argc;
+	char	**ctc_qemu_env;
+	int	ctc_qemu_envc;
+	int	ctc_has_argv0_flag;
+	int	ctc_has_env_control_flags;
+	int	ctc_has_libattr_hack_flag;
+	char	*ctc_ld_library_path;	 /* "LD_LIBRARY_PATH=.." for Qemu */
+	char	*ctc_ld_preload;	 /* "LD_PRELOAD=.." for Qemu */
+	char	*ctc_ld_preload_fakeroot; /* as above + libfakeroot */
+};
+
+struct cputransparency_settings {
+	struct cputransparency_conf	cts_target;
+	struct cputransparency_conf	cts_native;
+
+	/* for sbrsh: */
+	char	**cts_sbrsh_argv; /* tokens of sbox_cputransparency_method */
+	int	cts_sbrsh_argc;
+	char	*cts_target_root; /* with a trailing slash; NULL if not set */
+	char	*cts_user_home_dir;
+	char	*cts_sbrsh_config;
+	char	*cts_libsb2;
+};
+
+static struct cputransparency_settings *cputransparency_settings = NULL;
+
+/* returns an allocated copy of a string from the Lua stack, or NULL */
+static char *dup_lua_string(lua_State *l, int idx)
+{
+	const char *str = lua_tostring(l, idx);
+
+	return(str ? strdup(str) : NULL);
+}
+
+static char *dup_global_string(lua_State *l, const char *name)
+{
+	char *str;
+
+	lua_getfield(l, LUA_GLOBALSINDEX, name);
+	str = dup_lua_string(l, -1);
+	lua_pop(l, 1);
+	return(str);
+}
+
+static char *dup_field_string(lua_State *l, int table_idx, const char *name)
+{
+	char *str;
+
+	lua_getfield(l, table_idx, name);
+	str = dup_lua_string(l, -1);
+	lua_pop(l, 1);
+	return(str);
+}
+
+static int get_field_boolean(lua_State *l, int table_idx, const char *name)
+{
+	int b;
+
+	lua_getfield(l, table_idx, name);
+	b = lua_toboolean(l, -1);
+	lua_pop(l, 1);
+	return(b);
+}
+
+/* read a table of strings; returns the number of elements, or -1 if
+ * the field is not a table */
+static int dup_field_strvec(lua_State *l, int table_idx, const char *name,
+	char ***vecp)
+{
+	int	n = -1;
+	int	i;
+
+	*vecp = NULL;
+	lua_getfield(l, table_idx, name);
+	if (lua_istable(l, -1)) {
+		n = lua_objlen(l, -1);
+		*vecp = calloc(n + 1, sizeof(char *));
+		for (i = 0; i < n; i++) {
+			lua_rawgeti(l, -1, i + 1);
+			(*vecp)[i] = dup_lua_string(l, -1);
+			lua_pop(l, 1);
+		}
+	}
+	lua_pop(l, 1);
+	return(n);
+}
+
+static char *concat3(const char *a, const char *b, const char *c)
+{
+	char *str = NULL;
+
+	if (asprintf(&str, "%s%s%s", a, b ? b : "", c ? c : "") < 0)
+		return(NULL);
+	return(str);
+}
+
+static void load_conf(lua_State *l, const char *conf_var_name,
+	struct cputransparency_conf *ctc, const char *host_ld_library_path,
+	const char *host_ld_preload, const char *host_ld_preload_fakeroot)
+{
+	int	t;
+	char	*str;
+
+	memset(ctc, 0, sizeof(*ctc));
+
+	lua_getfield(l, LUA_GLOBALSINDEX, conf_var_name);
+	t = lua_gettop(l);
+	if (!lua_istable(l, t)) {
+		lua_pop(l, 1);
+		return;
+	}
+
+	/* method_is_* have been set by argvenvp.lua */
+	if (get_field_boolean(l, t, "method_is_qemu"))
+		ctc->ctc_method = CPUTRANSP_METHOD_QEMU;
+	else if (get_field_boolean(l, t, "method_is_sbrsh"))
+		ctc->ctc_method = CPUTRANSP_METHOD_SBRSH;
+
+	ctc->ctc_qemu_argc = dup_field_strvec(l, t, "qemu_argv",
+		&ctc->ctc_qemu_argv);
+	if (ctc->ctc_qemu_argc < 1) {
+		free(ctc->ctc_qemu_argv);
+		ctc->ctc_qemu_argv = calloc(2, sizeof(char *));
+		ctc->ctc_qemu_argv[0] = dup_field_string(l, t, "cmd");
+		ctc->ctc_qemu_argc = 1;
+	}
+	ctc->ctc_qemu_envc = dup_field_strvec(l, t, "qemu_env",
+		&ctc->ctc_qemu_env);
+	if (ctc->ctc_qemu_envc < 0) ctc->ctc_qemu_envc = 0;
+
+	ctc->ctc_has_argv0_flag = get_field_boolean(l, t, "has_argv0_flag");
+	ctc->ctc_has_env_control_flags = get_field_boolean(l, t,
+		"qemu_has_env_control_flags");
+	ctc->ctc_has_libattr_hack_flag = get_field_boolean(l, t,
+		"qemu_has_libattr_hack_flag");
+
+	str = dup_field_string(l, t, "qemu_ld_library_path");
+	if (str && *str) ctc->ctc_ld_library_path = str;
+	else {
+		ctc->ctc_ld_library_path = concat3("LD_LIBRARY_PATH=",
+			host_ld_library_path, NULL);
+		free(str);
+	}
+
+	str = dup_field_string(l, t, "qemu_ld_preload");
+	if (str && *str) ctc->ctc_ld_preload = str;
+	else {
+		ctc->ctc_ld_preload = concat3("LD_PRELOAD=",
+			host_ld_preload, NULL);
+		free(str);
+	}
+	/* NOTE: this assumes that the name of the libfakeroot library
+	 * is the same as what is used on the host, see the comment in
+	 * argvenvp.lua */
+	ctc->ctc_ld_preload_fakeroot = concat3(ctc->ctc_ld_preload, ":",
+		host_ld_preload_fakeroot);
+
+	lua_pop(l, 1);
+}
+
+static struct cputransparency_settings *load_settings(lua_State *l)
+{
+	struct cputransparency_settings *cts;
+	char	*host_ld_library_path;
+	char	*host_ld_preload;
+	char	*host_ld_preload_fakeroot;
+	char	*method;
+	char	*tok, *saveptr;
+	int	n;
+
+	cts = calloc(1, sizeof(*cts));
+	if (!cts) return(NULL);
+
+	host_ld_library_path = dup_global_string(l, "host_ld_library_path");
+	host_ld_preload = dup_global_string(l, "host_ld_preload");
+	host_ld_preload_fakeroot = dup_global_string(l,
+		"host_ld_preload_fakeroot");
+
+	load_conf(l, "conf_cputransparency_target", &cts->cts_target,
+		host_ld_library_path, host_ld_preload,
+		host_ld_preload_fakeroot);
+	load_conf(l, "conf_cputransparency_native", &cts->cts_native,
+		host_ld_library_path, host_ld_preload,
+		host_ld_preload_fakeroot);
+
+	free(host_ld_library_path);
+	free(host_ld_preload);
+	free(host_ld_preload_fakeroot);
+
+	method = dup_global_string(l, "sbox_cputransparency_method");
+	if (method) {
+		cts->cts_sbrsh_argv = calloc(strlen(method) / 2 + 2,
+			sizeof(char *));
+		n = 0;
+		for (tok = strtok_r(method, " \t\n", &saveptr); tok;
+		     tok = strtok_r(NULL, " \t\n", &saveptr))
+			cts->cts_sbrsh_argv[n++] = strdup(tok);
+		cts->cts_sbrsh_argc = n;
+		free(method);
+	}
+
+	cts->cts_target_root = dup_global_string(l, "sbox_target_root");
+	if (cts->cts_target_root && !*cts->cts_target_root) {
+		free(cts->cts_target_root);
+		cts->cts_target_root = NULL;
+	} else if (cts->cts_target_root) {
+		size_t len = strlen(cts->cts_target_root);
+
+		if (cts->cts_target_root[len - 1] != '/') {
+			char *tr = concat3(cts->cts_target_root, "/", NULL);
+
+			free(cts->cts_target_root);
+			cts->cts_target_root = tr;
+		}
+	}
+	cts->cts_user_home_dir = dup_global_string(l, "sbox_user_home_dir");
+	cts->cts_sbrsh_config = dup_global_string(l, "sbox_sbrsh_config");
+	cts->cts_libsb2 = dup_global_string(l, "sbox_libsb2");
+	return(cts);
+}
+
+static int has_prefix(const char *str, const char *prefix)
+{
+	return(str && prefix && !strncmp(str, prefix, strlen(prefix)));
+}
+
+static int count_strvec(char **vec)
+{
+	int n = 0;
+
+	if (vec)
+		while (vec[n]) n++;
+	return(n);
+}
+
+/* Add an element to the new environment of Qemu; variables which
+ * would break the host's libc in Qemu are dropped */
+static void add_qemu_env(char **new_envp, int *new_envc, char *var)
+{
+	if (!var) return;
+	if (has_prefix(var, "GCONV_PATH=") ||
+	    has_prefix(var, "NLSPATH=") ||
+	    has_prefix(var, "LOCPATH=")) {
+		free(var);
+		return;
+	}
+	new_envp[(*new_envc)++] = var;
+}
+
+/* Build the command line for Qemu. "extra_env" (may be NULL) is
+ * handled as the last element of envp. */
+static int postprocess_qemu(struct cputransparency_conf *ctc,
+	char **mapped_file, const char *filename,
+	char ***argvp, char ***envpp, char *extra_env)
+{
+	char	**argv = *argvp, **envp = *envpp;
+	int	argc = count_strvec(argv);
+	int	envc = count_strvec(envp);
+	char	**new_argv, **new_envp;
+	int	new_argc = 0, new_envc = 0;
+	int	needs_libfakeroot = 0;
+	int	i;
+
+	/* one vector for each; they are never longer than this: */
+	new_argv = calloc(ctc->ctc_qemu_argc + 2 + 2 + 1 +
+		2 * (envc + 1) + 1 + argc + 1, sizeof(char *));
+	new_envp = calloc(ctc->ctc_qemu_envc + envc + 1 + 3 + 1,
+		sizeof(char *));
+	if (!new_argv || !new_envp) {
+		free(new_argv);
+		free(new_envp);
+		free(extra_env);
+		return(-1);
+	}
+
+	for (i = 0; i < ctc->ctc_qemu_argc; i++)
+		new_argv[new_argc++] = strdup(ctc->ctc_qemu_argv[i]);
+	for (i = 0; i < ctc->ctc_qemu_envc; i++)
+		add_qemu_env(new_envp, &new_envc, strdup(ctc->ctc_qemu_env[i]));
+
+	/* target runtime linker comes from / */
+	new_argv[new_argc++] = strdup("-L");
+	new_argv[new_argc++] = strdup("/");
+
+	if (ctc->ctc_has_argv0_flag) {
+		/* set target argv[0] */
+		new_argv[new_argc++] = strdup("-0");
+		new_argv[new_argc++] = (argc > 0 ?
+			argv[0] : strdup(filename));
+	} else if (argc > 0) {
+		free(argv[0]);
+	}
+
+	if (ctc->ctc_has_libattr_hack_flag) {
+		/* see the comment in argvenvp.lua */
+		new_argv[new_argc++] = strdup("-libattr-hack");
+	}
+
+	if (sbox_session_perm && !strcmp(sbox_session_perm, "root"))
+		needs_libfakeroot = 1;
+
+	for (i = 0; i <= envc; i++) {
+		char *var = (i < envc ? envp[i] : extra_env);
+
+		if (!var) continue;
+		if (!ctc->ctc_has_env_control_flags) {
+			/* copy environment. Some things will be broken
+			 * with this qemu (e.g. prelinking won't work) */
+			add_qemu_env(new_envp, &new_envc, var);
+		} else if (has_prefix(var, "LD_TRACE_")) {
+			/* move LD_TRACE_* to Qemu's command line */
+			new_argv[new_argc++] = strdup("-E");
+			new_argv[new_argc++] = var;
+		} else if (has_prefix(var, "__SB2_LD_PRELOAD=")) {
+			if (strstr(var, "libfakeroot")) {
+				if (!needs_libfakeroot)
+					add_qemu_env(new_envp, &new_envc,
+						strdup("SBOX_SESSION_PERM=root"));
+				needs_libfakeroot = 1;
+			}
+			/* FIXME: This drops application's LD_PRELOAD,
+			 * see argvenvp.lua */
+			free(var);
+		} else {
+			add_qemu_env(new_envp, &new_envc, var);
+		}
+	}
+
+	/* libsb2 will replace LD_PRELOAD and LD_LIBRARY_PATH for the
+	 * application, but these are needed for Qemu itself */
+	new_envp[new_envc++] = strdup(ctc->ctc_ld_library_path);
+	new_envp[new_envc++] = strdup(needs_libfakeroot ?
+		ctc->ctc_ld_preload_fakeroot : ctc->ctc_ld_preload);
+	new_envp[new_envc] = NULL;
+
+	/* unmapped file is exec'd; argv[0] was handled with -0 */
+	new_argv[new_argc++] = strdup(filename);
+	for (i = 1; i < argc; i++)
+		new_argv[new_argc++] = argv[i];
+	new_argv[new_argc] = NULL;
+
+	free(*mapped_file);
+	*mapped_file = strdup(ctc->ctc_qemu_argv[0]);
+
+	free(argv);
+	free(envp);
+	*argvp = new_argv;
+	*envpp = new_envp;
+	return(0);
+}
+
+/* Remove libsb2 from "LD_PRELOAD=..."; returns NULL if nothing is left */
+static char *ld_preload_without_libsb2(const char *ld_preload,
+	const char *libsb2)
+{
+	const char	*cp = ld_preload + strlen("LD_PRELOAD=");
+	char		*result = malloc(strlen(ld_preload) + 1);
+	char		*rp;
+	int		n = 0;
+
+	if (!result) return(NULL);
+	strcpy(result, "LD_PRELOAD=");
+	rp = result + strlen(result);
+	while (*cp) {
+		size_t	len = strcspn(cp, ":");
+		char	*start = rp;
+
+		if (len > 0) {
+			if (n > 0) *rp++ = ':';
+			memcpy(rp, cp, len);
+			rp[len] = '\0';
+			if (libsb2 && *libsb2 && strstr(rp, libsb2)) {
+				/* throw away libsb2 */
+				rp = start;
+			} else {
+				rp += len;
+				n++;
+			}
+			*rp = '\0';
+		}
+		cp += len;
+		if (*cp == ':') cp++;
+	}
+	if (n == 0) {
+		free(result);
+		return(NULL);
+	}
+	return(result);
+}
+
+static int postprocess_sbrsh(struct cputransparency_settings *cts,
+	char **mapped_file, char ***argvp, char ***envpp, char *extra_env)
+{
+	char	**argv = *argvp, **envp = *envpp;
+	int	argc = count_strvec(argv);
+	int	envc = count_strvec(envp);
+	char	**new_argv, **new_envp;
+	int	new_argc = 0, new_envc = 0;
+	const char *file_in_device;
+	const char *dir_in_device;
+	char	cwd[PATH_MAX + 1];
+	char	*ld_preload = NULL;
+	int	i;
+
+	if (cts->cts_sbrsh_argc < 1) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"Invalid sbox_cputransparency_method set");
+		free(extra_env);
+		return(-1);
+	}
+	if (!cts->cts_target_root) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"sbox_target_root not set, "
+			"unable to execute the target binary");
+		free(extra_env);
+		return(-1);
+	}
+
+	SB_LOG(SB_LOGLEVEL_INFO, "Exec:sbrsh (%s,%s,%s)",
+		cts->cts_sbrsh_argv[0], cts->cts_target_root, *mapped_file);
+
+	/* Check the file to execute; fail if the file can
+	 * not be located on the device */
+	if (has_prefix(*mapped_file, cts->cts_target_root)) {
+		file_in_device = *mapped_file +
+			strlen(cts->cts_target_root) - 1;
+	} else if (has_prefix(*mapped_file, cts->cts_user_home_dir)) {
+		file_in_device = *mapped_file;
+	} else {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"Binary must be under target (%s) or"
+			" home when using sbrsh", cts->cts_target_root);
+		free(extra_env);
+		return(-1);
+	}
+
+	/* Check directory */
+	dir_in_device = getcwd_nomap_nolog(cwd, sizeof(cwd));
+	if (has_prefix(dir_in_device, cts->cts_target_root)) {
+		dir_in_device += strlen(cts->cts_target_root) - 1;
+	} else if (has_prefix(dir_in_device, cts->cts_user_home_dir)) {
+		/* no change */
+	} else {
+		SB_LOG(SB_LOGLEVEL_WARNING,
+			"Executing binary with bogus working"
+			" directory (/tmp) because sbrsh can only"
+			" see %s and %s\n",
+			cts->cts_target_root, cts->cts_user_home_dir);
+		dir_in_device = "/tmp";
+	}
+
+	new_argv = calloc(cts->cts_sbrsh_argc + 2 + 3 + argc + 1,
+		sizeof(char *));
+	new_envp = calloc(envc + 1 + 1 + 1, sizeof(char *));
+	if (!new_argv || !new_envp) {
+		free(new_argv);
+		free(new_envp);
+		free(extra_env);
+		return(-1);
+	}
+
+	for (i = 0; i < cts->cts_sbrsh_argc; i++)
+		new_argv[new_argc++] = strdup(cts->cts_sbrsh_argv[i]);
+	if (cts->cts_sbrsh_config && *cts->cts_sbrsh_config) {
+		new_argv[new_argc++] = strdup("--config");
+		new_argv[new_argc++] = strdup(cts->cts_sbrsh_config);
+	}
+	new_argv[new_argc++] = strdup("--directory");
+	new_argv[new_argc++] = strdup(dir_in_device);
+	new_argv[new_argc++] = strdup(file_in_device);
+
+	/* Append arguments for target process (skip argv[0],
+	 * there isn't currently any way to give that over sbrsh) */
+	if (argc > 0) free(argv[0]);
+	for (i = 1; i < argc; i++)
+		new_argv[new_argc++] = argv[i];
+	new_argv[new_argc] = NULL;
+
+	/* remove libsb2 from LD_PRELOAD; if there are several LD_PRELOADs,
+	 * the last one is used. */
+	for (i = 0; i <= envc; i++) {
+		char *var = (i < envc ? envp[i] : extra_env);
+
+		if (!var) continue;
+		if (has_prefix(var, "LD_PRELOAD=")) {
+			free(ld_preload);
+			ld_preload = var;
+		} else {
+			new_envp[new_envc++] = var;
+		}
+	}
+	if (!ld_preload) {
+		SB_LOG(SB_LOGLEVEL_DEBUG, "LD_PRELOAD not found");
+	} else {
+		char *new_ld_preload;
+
+		SB_LOG(SB_LOGLEVEL_DEBUG, "%s was %s", "LD_PRELOAD",
+			ld_preload);
+		new_ld_preload = ld_preload_without_libsb2(ld_preload,
+			cts->cts_libsb2);
+		if (new_ld_preload) {
+			new_envp[new_envc++] = new_ld_preload;
+			SB_LOG(SB_LOGLEVEL_DEBUG, "set %s", new_ld_preload);
+		} else {
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"nothing left, run without LD_PRELOAD");
+		}
+		free(ld_preload);
+	}
+	new_envp[new_envc] = NULL;
+
+	free(*mapped_file);
+	*mapped_file = strdup(cts->cts_sbrsh_argv[0]);
+
+	free(argv);
+	free(envp);
+	*argvp = new_argv;
+	*envpp = new_envp;
+	return(0);
+}
+
+/* Rewrite argv and envp for the CPU transparency method of
+ * "conf_name" ("target" or "native"). Called with a Lua instance
+ * (needed only when the settings are read for the first time).
+ * Returns 0 if argv, envp and mapped_file were replaced, 1 if the
+ * exec should be done with the original vectors (no method), or
+ * -1 if exec must be denied.
+*/
+int sb_execve_postprocess_cputransparency(struct lua_instance *luaif,
+	const char *conf_name, const char *exec_policy_name,
+	char **mapped_file, char **filename,
+	char ***argv, char ***envp)
+{
+	struct cputransparency_settings *cts = cputransparency_settings;
+	struct cputransparency_conf *ctc;
+	char	*extra_env = NULL;
+
+	if (!cts) {
+		cts = load_settings(luaif->lua);
+		if (!cts) return(-1);
+		/* the settings are the same in all Lua instances; if
+		 * another thread was faster, use its copy. */
+		if (!__sync_bool_compare_and_swap(&cputransparency_settings,
+		    NULL, cts)) {
+			/* leaks a bit, but this is very rare */
+			cts = cputransparency_settings;
+		}
+	}
+
+	ctc = (!strcmp(conf_name, "native") ?
+		&cts->cts_native : &cts->cts_target);
+
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"postprocessing cpu_transparency for %s (%s, method=%d)",
+		*filename, conf_name, ctc->ctc_method);
+
+	if (exec_policy_name && (asprintf(&extra_env,
+	    "__SB2_EXEC_POLICY_NAME=%s", exec_policy_name) < 0))
+		return(-1);
+
+	switch (ctc->ctc_method) {
+	case CPUTRANSP_METHOD_QEMU:
+		return(postprocess_qemu(ctc, mapped_file, *filename,
+			argv, envp, extra_env));
+	case CPUTRANSP_METHOD_SBRSH:
+		return(postprocess_sbrsh(cts, mapped_file,
+			argv, envp, extra_env));
+	}
+
+	/* no method: argv was not modified. The environment is
+	 * always updated. */
+	if (extra_env) {
+		int	envc = count_strvec(*envp);
+		char	**new_envp = realloc(*envp,
+				(envc + 2) * sizeof(char *));
+
+		if (!new_envp) {
+			free(extra_env);
+			return(-1);
+		}
+		new_envp[envc] = extra_env;
+		new_envp[envc + 1] = NULL;
+		*envp = new_envp;
+	}
+	return(1);
+}
@@ -0,0 +1,208 @@
+/*
+ * luaalloc.c -- memory allocator for the Lua states of libsb2
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * libsb2 is preloaded into every process of the session, and Lua
+ * allocates and frees memory all the time while it maps paths. With
+ * the default allocator of luaL_newstate() all of that goes through
+ * the application's malloc(), changing its heap layout and timing (and
+ * some applications bring their own malloc). Each Lua state gets a
+ * private heap instead:
+ *
+ * Small blocks (strings, tables, closures; up to 2048 bytes) are taken
+ * from per-size-class free lists, which are refilled from 64 kB chunks
+ * that are allocated with mmap(). Chunks are released only when the
+ * state is closed. Larger blocks are mmap()ed one by one and resized
+ * with mremap().
+ *
+ * Lua tells the old size of a block to the allocator, so the blocks
+ * don't need headers. There is one heap per Lua state and a Lua state
+ * is used by one thread only, so no locks are needed either.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <sb2.h>
+#include "libsb2.h"
+#include "exported.h"
+
+#define LUA_HEAP_CHUNK_SIZE	(64*1024)
+#define LUA_HEAP_MAX_SMALL	2048
+#define LUA_HEAP_LARGE		(-1)	/* class of large blocks */
+#define LUA_HEAP_PAGE_ROUND(n)	(((n) + 4095) & ~(size_t)4095)
+
+/* Classes 0..7 are 16..128 bytes in 16-byte steps, after that there
+ * are four classes for each power of two (160, 192, 224, 256, 320, ...)
+*/
+static int lua_heap_size_to_class(size_t n)
+{
+	int	g;
+
+	if (n > LUA_HEAP_MAX_SMALL) return(LUA_HEAP_LARGE);
+	if (n <= 128) return((int)((n - 1) >> 4));
+	g = (31 - __builtin_clz((unsigned int)(n - 1))) - 7;
+	return(8 + 4 * g + (int)((n - 1 - (128 << g)) >> (5 + g)));
+}
+
+static size_t lua_heap_class_size(int c)
+{
+	size_t	base;
+
+	if (c < 8) return((c + 1) * 16);
+	base = (size_t)128 << ((c - 8) >> 2);
+	return(base + ((c - 8) & 3) * (base >> 2) + (base >> 2));
+}
+
+static void *lua_heap_mmap(size_t len)
+{
+	void	*p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	return(p == MAP_FAILED ? NULL : p);
+}
+
+static void *lua_heap_alloc_small(struct sb2_lua_heap *heap, int c)
+{
+	void	*p = heap->lh_free[c];
+	size_t	size;
+
+	if (p) {
+		heap->lh_free[c] = *(void **)p;
+		return(p);
+	}
+	size = lua_heap_class_size(c);
+	if ((size_t)(heap->lh_bump_end - heap->lh_bump_ptr) < size) {
+		char	*chunk = lua_heap_mmap(LUA_HEAP_CHUNK_SIZE);
+
+		if (!chunk) return(NULL);
+		/* the first 16 bytes link the chunks together */
+		*(char **)chunk = heap->lh_chunks;
+		heap->lh_chunks = chunk;
+		heap->lh_bump_ptr = chunk + 16;
+		heap->lh_bump_end = chunk + LUA_HEAP_CHUNK_SIZE;
+		heap->lh_bytes_mapped += LUA_HEAP_CHUNK_SIZE;
+		heap->lh_num_chunks++;
+	}
+	p = heap->lh_bump_ptr;
+	heap->lh_bump_ptr += size;
+	return(p);
+}
+
+static void *lua_heap_alloc_block(struct sb2_lua_heap *heap, size_t n)
+{
+	int	c = lua_heap_size_to_class(n);
+	void	*p;
+
+	if (c != LUA_HEAP_LARGE)
+		return(lua_heap_alloc_small(heap, c));
+	p = lua_heap_mmap(LUA_HEAP_PAGE_ROUND(n));
+	if (p) heap->lh_bytes_mapped += LUA_HEAP_PAGE_ROUND(n);
+	return(p);
+}
+
+static void lua_heap_free_block(struct sb2_lua_heap *heap, void *p, size_t n)
+{
+	int	c = lua_heap_size_to_class(n);
+
+	if (c != LUA_HEAP_LARGE) {
+		*(void **)p = heap->lh_free[c];
+		heap->lh_free[c] = p;
+		return;
+	}
+	munmap(p, LUA_HEAP_PAGE_ROUND(n));
+	heap->lh_bytes_mapped -= LUA_HEAP_PAGE_ROUND(n);
+}
+
+static void lua_heap_account(struct sb2_lua_heap *heap, size_t osize,
+	size_t nsize)
+{
+	heap->lh_bytes_in_use += nsize;
+	heap->lh_bytes_in_use -= osize;
+	if (heap->lh_bytes_in_use > heap->lh_peak_bytes_in_use)
+		heap->lh_peak_bytes_in_use = heap->lh_bytes_in_use;
+}
+
+/* The lua_Alloc function; "ud" is the heap */
+void *sb2_lua_heap_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	struct sb2_lua_heap	*heap = ud;
+	void			*p;
+	int			oc, nc;
+
+	if (nsize == 0) {
+		if (ptr) {
+			lua_heap_free_block(heap, ptr, osize);
+			lua_heap_account(heap, osize, 0);
+		}
+		return(NULL);
+	}
+	if (!ptr) {
+		p = lua_heap_alloc_block(heap, nsize);
+		if (p) lua_heap_account(heap, 0, nsize);
+		return(p);
+	}
+
+	oc = lua_heap_size_to_class(osize);
+	nc = lua_heap_size_to_class(nsize);
+	if ((oc == nc) && ((oc != LUA_HEAP_LARGE) ||
+	    (LUA_HEAP_PAGE_ROUND(osize) == LUA_HEAP_PAGE_ROUND(nsize)))) {
+		lua_heap_account(heap, osize, nsize);
+		return(ptr);
+	}
+	if ((oc == LUA_HEAP_LARGE) && (nc == LUA_HEAP_LARGE)) {
+		p = mremap(ptr, LUA_HEAP_PAGE_ROUND(osize),
+			LUA_HEAP_PAGE_ROUND(nsize), MREMAP_MAYMOVE);
+		if (p != MAP_FAILED) {
+			heap->lh_bytes_mapped += LUA_HEAP_PAGE_ROUND(nsize);
+			heap->lh_bytes_mapped -= LUA_HEAP_PAGE_ROUND(osize);
+			lua_heap_account(heap, osize, nsize);
+			return(p);
+		}
+		p = NULL;
+	} else {
+		p = lua_heap_alloc_block(heap, nsize);
+		if (p) {
+			memcpy(p, ptr, (osize < nsize ? osize : nsize));
+			lua_heap_free_block(heap, ptr, osize);
+			lua_heap_account(heap, osize, nsize);
+			return(p);
+		}
+	}
+	/* Lua expects that shrinking never fails. The block is
+	 * big enough, and it is freed to a class where it fits. */
+	if (nsize <= osize) {
+		lua_heap_account(heap, osize, nsize);
+		return(ptr);
+	}
+	return(NULL);
+}
+
+void sb2_lua_heap_log_usage(struct sb2_lua_heap *heap, const char *when)
+{
+	SB_LOG(SB_LOGLEVEL_DEBUG,
+		"Lua heap (%s): %lu bytes in use, peak %lu,"
+		" %lu bytes mapped (%d chunks)", when,
+		(unsigned long)heap->lh_bytes_in_use,
+		(unsigned long)heap->lh_peak_bytes_in_use,
+		(unsigned long)heap->lh_bytes_mapped, heap->lh_num_chunks);
+}
+
+/* Release the chunks. Call this after lua_close(); large blocks
+ * have been unmapped by then. */
+void sb2_lua_heap_destroy(struct sb2_lua_heap *heap)
+{
+	char	*chunk = heap->lh_chunks;
+
+	while (chunk) {
+		char	*next = *(char **)chunk;
+
+		munmap(chunk, LUA_HEAP_CHUNK_SIZE);
+		chunk = next;
+	}
+	memset(heap, 0, sizeof(*heap));
+}
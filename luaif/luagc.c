@@ -0,0 +1,240 @@
+/*
+ * luagc.c -- garbage collector policies for the Lua states of libsb2
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * Every mapping leaves garbage to the Lua state of the thread (strings,
+ * result tables). With Lua's own incremental collector the work is done
+ * inside whatever allocation happens to trigger it, i.e. inside some
+ * unrelated wrapped call of a long-running process (make, shells, build
+ * daemons). SBOX_LUA_GC (option -x of sb2) selects another policy; it
+ * is a comma-separated list of:
+ *
+ *   auto          Lua's own collector (the default)
+ *   pause=N       \ parameters of the automatic collector,
+ *   stepmul=N     / see lua_gc() (LUA_GCSETPAUSE, LUA_GCSETSTEPMUL)
+ *   step=N        stop the automatic collector; do one incremental step
+ *                 after every N mapping calls
+ *   stepsize=K    size of those steps (lua_gc(LUA_GCSTEP, K)), default 0
+ *   exec          stop the automatic collector and don't collect at all:
+ *                 the whole heap of a program image is released at exec
+ *                 and exit anyway
+ *   cap=N[k|M]    do a full collection after a mapping call if more than
+ *                 N bytes are in use (if the live data doesn't fit, the
+ *                 next one is done when the heap has grown by N/4)
+ *
+ * e.g. "exec,cap=4M" or "step=20,stepsize=8". Collections are done only
+ * between mapping calls, never in the middle of one. Lua 5.1 doesn't
+ * have an emergency collector, so the cap can't be enforced by failing
+ * allocations (that would abort the application).
+ *
+ * In Lua 5.1, LUA_GCSTEP and LUA_GCCOLLECT set a new threshold, which
+ * restarts the automatic collector; it is stopped again after every
+ * step or collection.
+ *
+ * The number of steps and collections, the time spent in them and
+ * the size of the heap are written to the debug log at exec and exit.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sb2.h>
+#include "libsb2.h"
+#include "exported.h"
+
+#define LUA_GC_AUTO	0
+#define LUA_GC_STEP	1
+#define LUA_GC_EXEC	2
+
+struct lua_gc_policy {
+	int		lgp_mode;
+	int		lgp_step_calls;
+	int		lgp_step_size;
+	int		lgp_pause;	/* 0 = Lua's default */
+	int		lgp_stepmul;	/* 0 = Lua's default */
+	size_t		lgp_cap;	/* 0 = no cap */
+	const char	*lgp_spec;
+};
+
+static struct lua_gc_policy lua_gc_policy = { LUA_GC_AUTO, 0, 0, 0, 0, 0, "auto" };
+static int lua_gc_policy_initialized = 0;
+
+static const char *lua_gc_mode_names[] = { "auto", "step", "exec" };
+
+static int lua_gc_parse_item(struct lua_gc_policy *p, const char *item)
+{
+	const char	*val = strchr(item, '=');
+	char		*end;
+	unsigned long	n;
+
+	if (!strcmp(item, "auto")) {
+		p->lgp_mode = LUA_GC_AUTO;
+		return(0);
+	}
+	if (!strcmp(item, "exec")) {
+		p->lgp_mode = LUA_GC_EXEC;
+		return(0);
+	}
+	if (!val) return(-1);
+	n = strtoul(val + 1, &end, 10);
+	if (end == val + 1) return(-1);
+
+	if (!strncmp(item, "cap=", 4)) {
+		if (*end == 'k') {
+			n *= 1024;
+			end++;
+		} else if (*end == 'M') {
+			n *= 1024 * 1024;
+			end++;
+		}
+		if (*end) return(-1);
+		p->lgp_cap = n;
+		return(0);
+	}
+	if (*end) return(-1);
+
+	if (!strncmp(item, "step=", 5) && (n > 0)) {
+		p->lgp_mode = LUA_GC_STEP;
+		p->lgp_step_calls = (int)n;
+	} else if (!strncmp(item, "stepsize=", 9)) {
+		p->lgp_step_size = (int)n;
+	} else if (!strncmp(item, "pause=", 6)) {
+		p->lgp_pause = (int)n;
+	} else if (!strncmp(item, "stepmul=", 8)) {
+		p->lgp_stepmul = (int)n;
+	} else {
+		return(-1);
+	}
+	return(0);
+}
+
+static void lua_gc_read_policy(void)
+{
+	struct lua_gc_policy	p = lua_gc_policy;
+	char			*spec, *item, *saveptr = NULL;
+	const char		*env = getenv("SBOX_LUA_GC");
+
+	if (!env || !*env) return;
+	spec = strdup(env);
+	if (!spec) return;
+	for (item = strtok_r(spec, ",", &saveptr); item;
+	     item = strtok_r(NULL, ",", &saveptr)) {
+		if (lua_gc_parse_item(&p, item) < 0) {
+			SB_LOG(SB_LOGLEVEL_WARNING,
+				"SBOX_LUA_GC: ignoring invalid policy '%s'",
+				env);
+			free(spec);
+			return;
+		}
+	}
+	free(spec);
+	p.lgp_spec = strdup(env);
+	lua_gc_policy = p;
+}
+
+/* Called when a Lua state has been initialized */
+void sb2_lua_gc_init(struct lua_instance *luaif)
+{
+	lua_State	*l = luaif->lua;
+
+	if (!lua_gc_policy_initialized) {
+		lua_gc_read_policy();
+		lua_gc_policy_initialized = 1;
+	}
+	/* the "sb" table stays at the bottom of the stack */
+	luaif->gc_stack_base = lua_gettop(l);
+	luaif->gc_collect_limit = lua_gc_policy.lgp_cap;
+	if (lua_gc_policy.lgp_pause)
+		lua_gc(l, LUA_GCSETPAUSE, lua_gc_policy.lgp_pause);
+	if (lua_gc_policy.lgp_stepmul)
+		lua_gc(l, LUA_GCSETSTEPMUL, lua_gc_policy.lgp_stepmul);
+	if (lua_gc_policy.lgp_mode != LUA_GC_AUTO)
+		lua_gc(l, LUA_GCSTOP, 0);
+	SB_LOG(SB_LOGLEVEL_DEBUG, "Lua GC policy '%s' (%s, cap %lu)",
+		lua_gc_policy.lgp_spec,
+		lua_gc_mode_names[lua_gc_policy.lgp_mode],
+		(unsigned long)lua_gc_policy.lgp_cap);
+}
+
+static void lua_gc_run(struct lua_instance *luaif, int what, int data)
+{
+	uint64_t	t0 = sb2_wrapper_stats_timestamp();
+	uint64_t	ns;
+
+	lua_gc(luaif->lua, what, data);
+	if (lua_gc_policy.lgp_mode != LUA_GC_AUTO)
+		lua_gc(luaif->lua, LUA_GCSTOP, 0);
+	ns = sb2_wrapper_stats_timestamp() - t0;
+	luaif->gc_ns += ns;
+	if (what == LUA_GCSTEP) {
+		luaif->gc_steps++;
+		SB_LOG(SB_LOGLEVEL_NOISE, "Lua GC step: %lu ns, heap %lu bytes",
+			(unsigned long)ns,
+			(unsigned long)luaif->heap.lh_bytes_in_use);
+	} else {
+		luaif->gc_collections++;
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"Lua GC full collection: %lu ns, heap %lu bytes",
+			(unsigned long)ns,
+			(unsigned long)luaif->heap.lh_bytes_in_use);
+	}
+}
+
+/* Called by release_lua() */
+void sb2_lua_gc_after_call(struct lua_instance *luaif)
+{
+	/* a nested user still needs the values on the stack */
+	if (!luaif || !luaif->lua || luaif->mapping_disabled ||
+	    (lua_gettop(luaif->lua) > luaif->gc_stack_base))
+		return;
+	luaif->gc_calls++;
+
+	if ((lua_gc_policy.lgp_mode == LUA_GC_STEP) &&
+	    ((luaif->gc_calls % lua_gc_policy.lgp_step_calls) == 0))
+		lua_gc_run(luaif, LUA_GCSTEP, lua_gc_policy.lgp_step_size);
+
+	if (lua_gc_policy.lgp_cap &&
+	    (luaif->heap.lh_bytes_in_use > luaif->gc_collect_limit)) {
+		lua_gc_run(luaif, LUA_GCCOLLECT, 0);
+		luaif->gc_collect_limit = lua_gc_policy.lgp_cap;
+		if (luaif->heap.lh_bytes_in_use > lua_gc_policy.lgp_cap) {
+			/* don't collect after every call if the live
+			 * data doesn't fit */
+			luaif->gc_collect_limit = luaif->heap.lh_bytes_in_use +
+				lua_gc_policy.lgp_cap / 4;
+			if (!luaif->gc_over_cap_reported) SB_LOG(
+				SB_LOGLEVEL_WARNING, "Lua heap is over the cap"
+				" after a full collection (%lu > %lu bytes)",
+				(unsigned long)luaif->heap.lh_bytes_in_use,
+				(unsigned long)lua_gc_policy.lgp_cap);
+			luaif->gc_over_cap_reported = 1;
+		}
+	}
+}
+
+/* Log the statistics of this thread's state. "is_exec" is set if the
+ * image is about to be replaced by exec */
+void sb2_lua_gc_image_done(int is_exec)
+{
+	struct lua_instance	*luaif = sb2_lua_instance_of_this_thread();
+
+	if (!luaif || !luaif->lua) return;
+	SB_LOG(SB_LOGLEVEL_DEBUG, "Lua GC (%s): policy '%s', %lu calls,"
+		" %lu steps, %lu full collections, %llu us in GC;"
+		" heap %lu bytes, peak %lu", (is_exec ? "exec" : "exit"),
+		lua_gc_policy.lgp_spec, luaif->gc_calls, luaif->gc_steps,
+		luaif->gc_collections, luaif->gc_ns / 1000,
+		(unsigned long)luaif->heap.lh_bytes_in_use,
+		(unsigned long)luaif->heap.lh_peak_bytes_in_use);
+}
+
+#ifdef __GNUC__
+void sb2_lua_gc_destructor(void) __attribute((destructor));
+#endif
+void sb2_lua_gc_destructor(void)
+{
+	sb2_lua_gc_image_done(0);
+}
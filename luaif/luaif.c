@@ -34,6 +34,8 @@
 
 #include <mapping.h>
 #include <sb2.h>
+#include "libsb2.h"
+#include "exported.h"
 
 /* ------------ WARNING WARNING WARNING ------------
  * A SERIOUS WARNING ABOUT THE "pthread" LIBRARY:
@@ -66,7 +68,7 @@ int (*pthread_mutex_lock_fnptr)(pthread_mutex_t *mutex) = NULL;
 int (*pthread_mutex_unlock_fnptr)(pthread_mutex_t *mutex) = NULL;
 
 
-static void check_pthread_library()
+void sb2_check_pthread_library(void)
 {
 	if (pthread_detection_done == 0) {
 		/* these are available only in libpthread: */
@@ -153,6 +155,15 @@ static char *read_string_variable_from_lua(
 
 static void free_lua(void *buf)
 {
+	struct lua_instance *luaif = buf;
+
+	/* A thread may exit in the middle of mapping (cancellation);
+	 * then the state can't be closed. */
+	if (luaif && luaif->lua && !luaif->mapping_disabled) {
+		lua_close(luaif->lua);
+		sb2_lua_heap_log_usage(&luaif->heap, "closed");
+		sb2_lua_heap_destroy(&luaif->heap);
+	}
 	free(buf);
 }
 
@@ -165,6 +176,10 @@ static void alloc_lua_key(void)
 /* used only if pthread lib is not available: */
 static	struct lua_instance *my_lua_instance = NULL;
 
+/* number of Lua states created by this process (or by its parent,
+ * before fork()). The mapping daemon is not used after this is set. */
+int sb2_lua_instances_allocated = 0;
+
 static void load_and_execute_lua_file(struct lua_instance *luaif, const char *filename)
 {
 	const char *errmsg;
@@ -185,7 +200,7 @@ static void load_and_execute_lua_file(struct lua_instance *luaif, const char *fi
 	default:
 		;
 	}
-	lua_call(luaif->lua, 0, 0);
+	SB2_LUA_CALL(luaif->lua, 0, 0);
 }
 
 /* Lua calls this at panic: */
@@ -227,6 +242,7 @@ static struct lua_instance *alloc_lua(void)
 		return(NULL);
 	}
 	memset(tmp, 0, sizeof(struct lua_instance));
+	__sync_fetch_and_add(&sb2_lua_instances_allocated, 1);
 
 	if (pthread_setspecific_fnptr) {
 		(*pthread_setspecific_fnptr)(lua_key, tmp);
@@ -250,7 +266,12 @@ static struct lua_instance *alloc_lua(void)
 		
 	SB_LOG(SB_LOGLEVEL_INFO, "Loading '%s'", main_lua_script);
 
-	tmp->lua = luaL_newstate();
+	tmp->lua = lua_newstate(sb2_lua_heap_alloc, &tmp->heap);
+	if (!tmp->lua) {
+		SB_LOG(SB_LOGLEVEL_ERROR,
+			"alloc_lua: Failed to create a Lua state");
+		return(NULL);
+	}
 	lua_atpanic(tmp->lua, sb2_lua_panic);
 
 	disable_mapping(tmp);
@@ -279,7 +300,14 @@ static struct lua_instance *alloc_lua(void)
 	}
 	free(lua_if_version);
 
+	sb2_path_class_load_from_lua(tmp,
+		(sbox_binary_name ? sbox_binary_name : "UNKNOWN"), 0);
+	sb2_dirfd_path_cache_load_from_lua(tmp,
+		(sbox_binary_name ? sbox_binary_name : "UNKNOWN"));
+
 	SB_LOG(SB_LOGLEVEL_INFO, "lua initialized.");
+	sb2_lua_heap_log_usage(&tmp->heap, "initialized");
+	sb2_lua_gc_init(tmp);
 	SB_LOG(SB_LOGLEVEL_NOISE, "gettop=%d", lua_gettop(tmp->lua));
 
 	free(main_lua_script);
@@ -323,6 +351,33 @@ void release_lua(struct lua_instance *luaif)
 
 		(ptr->lua_instance_in_use)--;
 	}
+	sb2_lua_gc_after_call(luaif);
+}
+
+/* Returns nonzero if this thread is inside the mapping code (mapping
+ * has been disabled in its Lua instance). Doesn't create the instance.
+*/
+int sb2_mapping_disabled_in_this_thread(void)
+{
+	struct lua_instance *ptr = sb2_lua_instance_of_this_thread();
+
+	return(ptr && ptr->mapping_disabled);
+}
+
+/* Returns the Lua instance of this thread, or NULL if it hasn't been
+ * created. Doesn't create it. */
+struct lua_instance *sb2_lua_instance_of_this_thread(void)
+{
+	struct lua_instance *ptr = NULL;
+
+	if (!sb2_lua_instances_allocated) return(NULL);
+	if (pthread_library_is_available) {
+		if (pthread_getspecific_fnptr)
+			ptr = (*pthread_getspecific_fnptr)(lua_key);
+	} else {
+		ptr = my_lua_instance;
+	}
+	return(ptr);
 }
 
 /* get access to lua context. Remember to call release_lua() after the
@@ -338,7 +393,7 @@ struct lua_instance *get_lua(void)
 
 	SB_LOG(SB_LOGLEVEL_NOISE, "get_lua()");
 
-	if (pthread_detection_done == 0) check_pthread_library();
+	if (pthread_detection_done == 0) sb2_check_pthread_library();
 
 	if (pthread_library_is_available) {
 		if (pthread_once_fnptr)
@@ -586,20 +641,33 @@ static int lua_sb_setenv(lua_State *luastate)
 
 /* "sb.path_exists", to be called from lua code
  * returns true if file, directory or symlink exists at the specified real path,
- * false if not.
+ * false if not. If the optional second parameter is true, the path
+ * belongs to a read-only tree and the root index may be used.
 */
 static int lua_sb_path_exists(lua_State *l)
 {
 	int n;
 
 	n = lua_gettop(l);
-	if (n != 1) {
+	if ((n != 1) && (n != 2)) {
 		lua_pushboolean(l, 0);
 	} else {
 		char	*path = strdup(lua_tostring(l, 1));
 		int	result = 0;
+		int	readonly = (n == 2) && lua_toboolean(l, 2);
+		struct sb2_rootindex_result	rires;
+
 		SB_LOG(SB_LOGLEVEL_DEBUG, "lua_sb_path_exists testing '%s'",
 			path);
+		if (readonly) {
+			switch (sb2_rootindex_lookup(path, &rires)) {
+			case SB2_ROOTINDEX_FOUND:
+				result = 1;
+				goto done;
+			case SB2_ROOTINDEX_MISSING:
+				goto done;
+			}
+		}
 #ifdef AT_FDCWD
 		/* this is easy, can use faccessat() */
 		if (faccessat_nomap_nolog(AT_FDCWD, path, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
@@ -633,6 +701,7 @@ static int lua_sb_path_exists(lua_State *l)
 			}
 		}
 #endif
+	    done:
 		lua_pushboolean(l, result);
 		SB_LOG(SB_LOGLEVEL_DEBUG, "lua_sb_path_exists got %d",
 			result);
@@ -708,15 +777,15 @@ static int lua_sb_isprefix(lua_State *l)
 	if (n != 2) {
 		lua_pushboolean(l, 0);
 	} else {
-		const char	*str_a = lua_tostring(l, 1);
-		const char	*str_b = lua_tostring(l, 2);
+		size_t		len_a;
+		size_t		len_b;
+		const char	*str_a = lua_tolstring(l, 1, &len_a);
+		const char	*str_b = lua_tolstring(l, 2, &len_b);
 		int	result = 0;
 
-		if (str_a && str_b) {
-			int	prefixlen = strlen(str_a);
-
-			if (!strncmp(str_a, str_b, prefixlen)) result = 1;
-		}
+		if (str_a && str_b)
+			result = sb2_path_prefix_match(str_b, len_b,
+				str_a, len_a);
 
 		SB_LOG(SB_LOGLEVEL_DEBUG, "lua_sb_isprefix '%s','%s' => %d",
 			str_a, str_b, result);
@@ -736,61 +805,92 @@ static int lua_sb_test_path_match(lua_State *l)
 	int	result = -1;
 
 	if (n == 4) {
-		const char	*str_path = lua_tostring(l, 1);
-		const char	*str_rule_dir = lua_tostring(l, 2);
-		const char	*str_rule_prefix = lua_tostring(l, 3);
-		const char	*str_rule_path = lua_tostring(l, 4);
-		const char	*match_type = "no match";
-
-		if (str_path && str_rule_dir && (*str_rule_dir != '\0')) {
-			int	prefixlen = strlen(str_rule_dir);
-
-			/* test a directory prefix: the next char after the
-			 * prefix must be '\0' or '/', unless we are accessing
-			 * the root directory */
-			if (!strncmp(str_path, str_rule_dir, prefixlen)) {
-				if ( ((prefixlen == 1) && (*str_path=='/')) ||
-				     (str_path[prefixlen] == '/') ||
-				     (str_path[prefixlen] == '\0') ) {
-					result = prefixlen;
-					match_type = "dir";
-				}
-			}
-		}
-		if ((result == -1) && str_path
-		    && str_rule_prefix && (*str_rule_prefix != '\0')) {
-			int	prefixlen = strlen(str_rule_prefix);
+		size_t		path_len, dir_len = 0, prefix_len = 0, rpath_len = 0;
+		const char	*str_path = lua_tolstring(l, 1, &path_len);
+		const char	*str_rule_dir = lua_tolstring(l, 2, &dir_len);
+		const char	*str_rule_prefix = lua_tolstring(l, 3, &prefix_len);
+		const char	*str_rule_path = lua_tolstring(l, 4, &rpath_len);
+
+		if (str_path)
+			result = sb2_test_path_match(str_path, path_len,
+				str_rule_dir, dir_len,
+				str_rule_prefix, prefix_len,
+				str_rule_path, rpath_len);
+		SB_LOG(SB_LOGLEVEL_NOISE2,
+			"lua_sb_test_path_match '%s','%s','%s' => %d",
+			str_path, str_rule_prefix, str_rule_path, result);
+	}
+	lua_pushnumber(l, result);
+	return 1;
+}
 
-			if (!strncmp(str_path, str_rule_prefix, prefixlen)) {
-				result = prefixlen;
-				match_type = "prefix";
-			}
+/* get a string field of the table at "index"; the key is at "key_index".
+ * Leaves the value to the stack (the caller pops it) */
+static const char *get_string_field(lua_State *l, int index,
+	int key_index, size_t *lenp)
+{
+	lua_pushvalue(l, key_index);
+	lua_rawget(l, index < 0 ? index - 1 : index);
+	if (!lua_isstring(l, -1)) {
+		*lenp = 0;
+		return(NULL);
+	}
+	return(lua_tolstring(l, -1, lenp));
+}
+
+/* "sb.find_path_match(path, rules, first)":
+ * Same as calling sb.test_path_match() for rules[first], rules[first+1],..
+ * until a rule matches, but tests the whole batch in one call.
+ * Returns index of the rule and min.path length, or nil if none
+ * of the rules matched.
+*/
+static int lua_sb_find_path_match(lua_State *l)
+{
+	size_t		path_len;
+	const char	*str_path;
+	int		num_rules;
+	int		i;
+
+	if ((lua_gettop(l) != 3) || !lua_istable(l, 2) ||
+	    !(str_path = lua_tolstring(l, 1, &path_len))) {
+		lua_pushnil(l);
+		return 1;
+	}
+	num_rules = lua_objlen(l, 2);
+	/* keys of the fields, at stack positions 4..6 */
+	lua_pushliteral(l, "dir");
+	lua_pushliteral(l, "prefix");
+	lua_pushliteral(l, "path");
+	for (i = lua_tointeger(l, 3); i <= num_rules; i++) {
+		size_t		dir_len, prefix_len, rpath_len;
+		const char	*str_rule_dir;
+		const char	*str_rule_prefix;
+		const char	*str_rule_path;
+		int		result;
+
+		if (i < 1) continue;
+		lua_rawgeti(l, 2, i);
+		if (!lua_istable(l, -1)) {
+			lua_pop(l, 1);
+			continue;
 		}
-		if ((result == -1) && str_path && str_rule_path) {
-			int rule_path_len = strlen(str_rule_path);
-			if (!strcmp(str_path, str_rule_path)) {
-				result = rule_path_len;
-				match_type = "path";
-			} else {
-				/* if "path" has a trailing slash, we may
-				 * want to try again, ignoring the trailing
-				 * slash. */
-				int	path_len = strlen(str_path);
-				if ((path_len > 2) &&
-				    (str_path[path_len-1] == '/') &&
-				    (path_len == (rule_path_len+1)) &&
-				    !strncmp(str_path, str_rule_path, rule_path_len)) {
-					result = rule_path_len;
-					match_type = "path/";
-				}
-			}
+		str_rule_dir = get_string_field(l, -1, 4, &dir_len);
+		str_rule_prefix = get_string_field(l, -2, 5, &prefix_len);
+		str_rule_path = get_string_field(l, -3, 6, &rpath_len);
+		result = sb2_test_path_match(str_path, path_len,
+			str_rule_dir, dir_len, str_rule_prefix, prefix_len,
+			str_rule_path, rpath_len);
+		lua_pop(l, 4);
+		if (result >= 0) {
+			SB_LOG(SB_LOGLEVEL_NOISE2,
+				"lua_sb_find_path_match '%s' => #%d, %d",
+				str_path, i, result);
+			lua_pushinteger(l, i);
+			lua_pushinteger(l, result);
+			return 2;
 		}
-		SB_LOG(SB_LOGLEVEL_NOISE2,
-			"lua_sb_test_path_match '%s','%s','%s' => %d (%s)",
-			str_path, str_rule_prefix, str_rule_path,
-			result, match_type);
 	}
-	lua_pushnumber(l, result);
+	lua_pushnil(l);
 	return 1;
 }
 
@@ -887,6 +987,24 @@ static int lua_sb_test_if_listed_in_envvar(lua_State *l)
 	return 1;
 }
 
+/* "sb.get_function_names", to be called from lua code
+ * Returns (in stack):
+ *	1. table: names of the wrapped functions, indexed by the function
+ *		  ID which the wrappers pass to the mapping code
+ *		  (used to precompile "func_name" conditions of rules)
+*/
+static int lua_sb_get_function_names(lua_State *l)
+{
+	int	i;
+
+	lua_createtable(l, 0, sb2_num_fns);
+	for (i = 0; i < sb2_num_fns; i++) {
+		lua_pushstring(l, sb2_fn_names[i]);
+		lua_rawseti(l, -2, i);
+	}
+	return 1;
+}
+
 /* mappings from c to lua */
 static const luaL_reg reg[] =
 {
@@ -908,8 +1026,10 @@ static const luaL_reg reg[] =
 	{"get_session_perm",		lua_sb_get_session_perm},
 	{"isprefix",			lua_sb_isprefix},
 	{"test_path_match",		lua_sb_test_path_match},
+	{"find_path_match",		lua_sb_find_path_match},
 	{"procfs_mapping_request",	lua_sb_procfs_mapping_request},
 	{"test_if_listed_in_envvar",	lua_sb_test_if_listed_in_envvar},
+	{"get_function_names",		lua_sb_get_function_names},
 	{NULL,				NULL}
 };
 
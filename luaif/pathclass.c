@@ -0,0 +1,253 @@
+/*
+ * pathclass.c -- paths that can be mapped without Lua
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * Runtimes (glibc, JVMs, Python, ...) access /proc/self/..., /dev/null,
+ * /sys/devices/system/cpu/... all the time. All mapping modes map those
+ * with identity rules, or with the /proc mapper (preload/procfs.c), but
+ * the generic code still needs Lua, path splitting, find_rule() etc.
+ *
+ * When the rules are loaded, sb_get_path_class_specs() (mapping.lua)
+ * lists the "dir" and "prefix" selectors of the kernel's file systems
+ * that are guaranteed to be mapped by such rules. sbox_map_path() tests
+ * the path against this table first: A clean absolute path which matches
+ * is used as it is, or given directly to procfs_mapping_request().
+ *
+ * Processes which use the mapping daemon (sb2-mapd) get the table from
+ * the daemon when they connect to it.
+ *
+ * The magic links of /proc (and their aliases in /dev) refer to files
+ * elsewhere; paths that go through them are always mapped normally.
+ * So are symlinks in /dev: some of them point outside of the kernel's
+ * file systems (e.g. /dev/log -> /run/systemd/journal/dev-log), and
+ * the rules must be applied to the destination. That costs a readlink
+ * for every /dev path, which is still much less than mapping it.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <sb2.h>
+#include <mapping.h>
+#include <lua.h>
+#include "libsb2.h"
+#include "exported.h"
+
+struct path_class_entry {
+	char	*pce_selector;
+	size_t	pce_len;
+	int	pce_is_dir;
+	char	pce_class;	/* 'I' = identity, 'P' = procfs */
+	int	pce_readonly;
+};
+
+struct path_class_table {
+	/* the characters after the first '/' of all selectors; a quick
+	 * test for most paths, which are not in these file systems */
+	unsigned char	pct_second_chars[256/8];
+	int		pct_count;
+	struct path_class_entry	pct_entries[1];
+};
+
+static struct path_class_table *path_class_table = NULL;
+
+static const char *path_class_magic_components[] = {
+	"fd", "cwd", "root", "map_files",	/* /proc/<pid>/... */
+	"stdin", "stdout", "stderr",		/* /dev/... */
+	NULL
+};
+
+/* Build a table from spec strings (see mapping.lua) */
+static struct path_class_table *create_path_class_table(char **specs)
+{
+	struct path_class_table	*tbl;
+	int	n, i;
+
+	for (n = 0; specs && specs[n]; n++);
+	tbl = calloc(1, sizeof(*tbl) + n * sizeof(struct path_class_entry));
+	if (!tbl) return(NULL);
+
+	for (i = 0; i < n; i++) {
+		const char		*spec = specs[i];
+		struct path_class_entry	*e;
+
+		if ((strlen(spec) < 5) || (spec[3] != '/') ||
+		    ((spec[0] != 'd') && (spec[0] != 'p')) ||
+		    ((spec[1] != 'I') && (spec[1] != 'P'))) {
+			SB_LOG(SB_LOGLEVEL_WARNING,
+				"path class: invalid spec '%s'", spec);
+			continue;
+		}
+		e = &tbl->pct_entries[tbl->pct_count++];
+		e->pce_is_dir = (spec[0] == 'd');
+		e->pce_class = spec[1];
+		e->pce_readonly = (spec[2] == 'r');
+		e->pce_selector = strdup(spec + 3);
+		e->pce_len = strlen(e->pce_selector);
+		tbl->pct_second_chars[(unsigned char)spec[4] / 8] |=
+			1 << ((unsigned char)spec[4] % 8);
+		SB_LOG(SB_LOGLEVEL_DEBUG, "path class: %s %s '%s'%s",
+			(e->pce_is_dir ? "dir" : "prefix"),
+			(e->pce_class == 'P' ? "procfs" : "identity"),
+			e->pce_selector, (e->pce_readonly ? " (readonly)" : ""));
+	}
+	return(tbl);
+}
+
+static void free_path_class_table(struct path_class_table *tbl)
+{
+	int	i;
+
+	for (i = 0; i < tbl->pct_count; i++)
+		free(tbl->pct_entries[i].pce_selector);
+	free(tbl);
+}
+
+/* Install the table. The first one wins, unless "replace" is set (the
+ * mapping daemon does that after it has taken the identity of a client;
+ * it is single-threaded).
+*/
+void sb2_path_class_install(char **specs, int replace)
+{
+	struct path_class_table	*tbl, *old;
+
+	if (!replace && path_class_table) return;
+	tbl = create_path_class_table(specs);
+	if (!tbl) return;
+	if (replace) {
+		old = path_class_table;
+		path_class_table = tbl;
+		if (old) free_path_class_table(old);
+	} else if (!__sync_bool_compare_and_swap(&path_class_table,
+		    NULL, tbl)) {
+		free_path_class_table(tbl);
+	}
+}
+
+/* Get the spec strings for "binary_name" from Lua.
+ * Returns an allocated, NULL-terminated vector.
+*/
+char **sb2_path_class_specs_from_lua(struct lua_instance *luaif,
+	const char *binary_name)
+{
+	lua_State	*l = luaif->lua;
+	char		**specs;
+	int		n, i;
+
+	lua_getfield(l, LUA_GLOBALSINDEX, "sb_get_path_class_specs");
+	if (!lua_isfunction(l, -1)) {
+		lua_pop(l, 1);
+		return(calloc(1, sizeof(char *)));
+	}
+	lua_pushstring(l, binary_name);
+	SB2_LUA_CALL(l, 1, 1);
+	n = (lua_istable(l, -1) ? (int)lua_objlen(l, -1) : 0);
+	specs = calloc(n + 1, sizeof(char *));
+	if (!specs) abort();
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(l, -1, i + 1);
+		specs[i] = strdup(lua_tostring(l, -1) ? lua_tostring(l, -1) : "");
+		lua_pop(l, 1);
+	}
+	lua_pop(l, 1);
+	return(specs);
+}
+
+void sb2_path_class_load_from_lua(struct lua_instance *luaif,
+	const char *binary_name, int replace)
+{
+	char	**specs;
+	int	i;
+
+	specs = sb2_path_class_specs_from_lua(luaif, binary_name);
+	sb2_path_class_install(specs, replace);
+	for (i = 0; specs[i]; i++) free(specs[i]);
+	free(specs);
+}
+
+/* Returns 1 if "path" (starting at a '/' after the selector) is clean
+ * and doesn't contain magic links. */
+static int path_class_rest_is_ok(const char *cp)
+{
+	while (*cp == '/') {
+		const char	*next = strchr(cp + 1, '/');
+		size_t		len = (next ? (size_t)(next - cp - 1) : strlen(cp + 1));
+		const char	**m;
+
+		if (len == 0) {
+			/* "//", or a trailing slash */
+			if (next) return(0);
+			return(1);
+		}
+		if ((cp[1] == '.') &&
+		    ((len == 1) || ((len == 2) && (cp[2] == '.'))))
+			return(0);
+		for (m = path_class_magic_components; *m; m++)
+			if ((strlen(*m) == len) && !strncmp(cp + 1, *m, len))
+				return(0);
+		if (!next) break;
+		cp = next;
+	}
+	return(1);
+}
+
+/* Map "path" without Lua, if it belongs to one of the classes.
+ * Returns 1 if "res" was filled, 0 if the path must be mapped normally.
+*/
+int sb2_path_class_map(const char *func_name, const char *path,
+	mapping_results_t *res)
+{
+	struct path_class_table	*tbl = path_class_table;
+	size_t	path_len;
+	int	i;
+
+	if (!tbl || !path || (path[0] != '/')) return(0);
+	if (!(tbl->pct_second_chars[(unsigned char)path[1] / 8] &
+	      (1 << ((unsigned char)path[1] % 8))))
+		return(0);
+
+	path_len = strlen(path);
+	for (i = 0; i < tbl->pct_count; i++) {
+		struct path_class_entry	*e = &tbl->pct_entries[i];
+		char			*mapped = NULL;
+		const char		*rest;
+
+		if (!sb2_path_prefix_match(path, path_len,
+		    e->pce_selector, e->pce_len))
+			continue;
+		rest = path + e->pce_len;
+		if (e->pce_is_dir && (*rest != '/') && (*rest != '\0'))
+			continue;
+		/* the last component of a prefix selector may be partial */
+		if (!e->pce_is_dir) {
+			rest = strchr(rest, '/');
+			if (!rest) rest = "";
+		}
+		if (!path_class_rest_is_ok(rest)) return(0);
+		if (sb2_mapping_disabled_in_this_thread() ||
+		    getenv("SBOX_DISABLE_MAPPING")) return(0);
+		if ((e->pce_class == 'I') && !strncmp(path, "/dev/", 5)) {
+			char	link_dest[1];
+			int	saved_errno = errno;
+			ssize_t	link_len = readlinkat_nomap_nolog(AT_FDCWD,
+					path, link_dest, sizeof(link_dest));
+
+			errno = saved_errno;
+			if (link_len >= 0) return(0);
+		}
+
+		if (e->pce_class == 'P')
+			mapped = procfs_mapping_request((char *)path);
+		res->mres_result_buf = res->mres_result_path =
+			(mapped ? mapped : strdup(path));
+		res->mres_readonly = e->pce_readonly;
+		SB_LOG(SB_LOGLEVEL_DEBUG, "path class %c: %s(%s) => '%s'",
+			e->pce_class, func_name, path, res->mres_result_buf);
+		return(1);
+	}
+	return(0);
+}
@@ -0,0 +1,191 @@
+/*
+ * pathmatch.c -- path prefix comparisons for rule selection
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * find_rule() (mapping.lua) compares the "dir", "prefix" and "path"
+ * selectors of the rules against the path which is being mapped, via
+ * sb.test_path_match() and sb.find_path_match(). The lengths of both
+ * strings are known (Lua strings carry their length), so a comparison
+ * is a fixed-length equality test: it is done 32 bytes at a time with
+ * AVX2 or 16 bytes at a time with SSE2, and with 8-byte words for short
+ * strings. The variant is selected at runtime on the first call;
+ * "SBOX_PATHMATCH_IMPL" (scalar, sse2 or avx2) can be used to force one
+ * of them, e.g. for benchmarking.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sb2.h>
+#include <mapping.h>
+#include "libsb2.h"
+#include "exported.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SB2_PATHMATCH_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+typedef int (*mem_equal_fn_t)(const char *a, const char *b, size_t len);
+
+/* 0..15 bytes, using two overlapping loads per word size */
+static inline int mem_equal_short(const char *a, const char *b, size_t len)
+{
+	uint64_t	wa1, wb1, wa2, wb2;
+	uint32_t	ha1, hb1, ha2, hb2;
+
+	if (len >= 8) {
+		memcpy(&wa1, a, 8); memcpy(&wb1, b, 8);
+		memcpy(&wa2, a + len - 8, 8); memcpy(&wb2, b + len - 8, 8);
+		return(((wa1 ^ wb1) | (wa2 ^ wb2)) == 0);
+	}
+	if (len >= 4) {
+		memcpy(&ha1, a, 4); memcpy(&hb1, b, 4);
+		memcpy(&ha2, a + len - 4, 4); memcpy(&hb2, b + len - 4, 4);
+		return(((ha1 ^ hb1) | (ha2 ^ hb2)) == 0);
+	}
+	while (len-- > 0)
+		if (*a++ != *b++) return(0);
+	return(1);
+}
+
+static int mem_equal_scalar(const char *a, const char *b, size_t len)
+{
+	uint64_t	wa, wb;
+
+	while (len >= 8) {
+		memcpy(&wa, a, 8); memcpy(&wb, b, 8);
+		if (wa != wb) return(0);
+		a += 8; b += 8; len -= 8;
+	}
+	return(mem_equal_short(a, b, len));
+}
+
+#ifdef SB2_PATHMATCH_X86_SIMD
+static int mem_equal_sse2(const char *a, const char *b, size_t len)
+{
+	size_t	i;
+
+	if (len < 16) return(mem_equal_short(a, b, len));
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i	va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i	vb = _mm_loadu_si128((const __m128i *)(b + i));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF)
+			return(0);
+	}
+	if (i < len) {
+		/* the last 16 bytes; overlaps with the previous block */
+		__m128i	va = _mm_loadu_si128((const __m128i *)(a + len - 16));
+		__m128i	vb = _mm_loadu_si128((const __m128i *)(b + len - 16));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF)
+			return(0);
+	}
+	return(1);
+}
+
+__attribute__((target("avx2")))
+static int mem_equal_avx2(const char *a, const char *b, size_t len)
+{
+	size_t	i;
+
+	if (len < 32) return(mem_equal_sse2(a, b, len));
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i	va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i	vb = _mm256_loadu_si256((const __m256i *)(b + i));
+
+		if ((unsigned)_mm256_movemask_epi8(
+		    _mm256_cmpeq_epi8(va, vb)) != 0xFFFFFFFFu)
+			return(0);
+	}
+	if (i < len) {
+		__m256i	va = _mm256_loadu_si256((const __m256i *)(a + len - 32));
+		__m256i	vb = _mm256_loadu_si256((const __m256i *)(b + len - 32));
+
+		if ((unsigned)_mm256_movemask_epi8(
+		    _mm256_cmpeq_epi8(va, vb)) != 0xFFFFFFFFu)
+			return(0);
+	}
+	return(1);
+}
+#endif
+
+static mem_equal_fn_t	mem_equal_impl = NULL;
+
+static void select_mem_equal_impl(void)
+{
+	const char	*forced = getenv("SBOX_PATHMATCH_IMPL");
+	mem_equal_fn_t	impl = mem_equal_scalar;
+	const char	*name = "scalar";
+
+#ifdef SB2_PATHMATCH_X86_SIMD
+	__builtin_cpu_init();
+	if (!forced || strcmp(forced, "scalar")) {
+		impl = mem_equal_sse2;
+		name = "sse2";
+		if ((!forced || !strcmp(forced, "avx2")) &&
+		    __builtin_cpu_supports("avx2")) {
+			impl = mem_equal_avx2;
+			name = "avx2";
+		}
+	}
+#else
+	(void)forced;
+#endif
+	/* the result is always the same, so a race is harmless */
+	mem_equal_impl = impl;
+	SB_LOG(SB_LOGLEVEL_DEBUG, "path prefix matcher: %s", name);
+}
+
+/* Returns 1 if "prefix" is a prefix of "str" */
+int sb2_path_prefix_match(const char *str, size_t str_len,
+	const char *prefix, size_t prefix_len)
+{
+	if (prefix_len > str_len) return(0);
+	if (!mem_equal_impl) select_mem_equal_impl();
+	return(mem_equal_impl(str, prefix, prefix_len));
+}
+
+/* Test "path" against the selectors of a rule, in the order
+ * which find_rule() has always used: "dir", "prefix", "path".
+ * NULL selectors are not used. Returns min.path length if the
+ * rule matches, -1 otherwise.
+*/
+int sb2_test_path_match(const char *path, size_t path_len,
+	const char *rule_dir, size_t rule_dir_len,
+	const char *rule_prefix, size_t rule_prefix_len,
+	const char *rule_path, size_t rule_path_len)
+{
+	if (rule_dir && (rule_dir_len > 0) &&
+	    sb2_path_prefix_match(path, path_len, rule_dir, rule_dir_len)) {
+		/* test a directory prefix: the next char after the
+		 * prefix must be '\0' or '/', unless we are accessing
+		 * the root directory */
+		if (((rule_dir_len == 1) && (*path == '/')) ||
+		    (path[rule_dir_len] == '/') ||
+		    (path[rule_dir_len] == '\0'))
+			return(rule_dir_len);
+	}
+	if (rule_prefix && (rule_prefix_len > 0) &&
+	    sb2_path_prefix_match(path, path_len, rule_prefix, rule_prefix_len))
+		return(rule_prefix_len);
+	if (rule_path) {
+		if ((path_len == rule_path_len) &&
+		    sb2_path_prefix_match(path, path_len,
+			rule_path, rule_path_len))
+			return(rule_path_len);
+		/* if "path" has a trailing slash, we may want to try
+		 * again, ignoring the trailing slash. */
+		if ((path_len > 2) && (path[path_len-1] == '/') &&
+		    (path_len == (rule_path_len+1)) &&
+		    sb2_path_prefix_match(path, path_len,
+			rule_path, rule_path_len))
+			return(rule_path_len);
+	}
+	return(-1);
+}
@@ -90,6 +90,7 @@
 typedef struct path_mapping_context_s {
 	const char		*pmc_binary_name;
 	const char		*pmc_func_name;
+	int			pmc_fn_id;
 	const char		*pmc_virtual_orig_path;
 	int			pmc_dont_resolve_final_symlink;
 	struct lua_instance	*pmc_luaif;
@@ -799,7 +800,7 @@ static char *call_lua_function_sbox_translate_path(
 	lua_pushstring(luaif->lua, ctx->pmc_func_name);
 	lua_pushstring(luaif->lua, abs_clean_virtual_path);
 	 /* 4 arguments, returns rule,policy,path,flags */
-	lua_call(luaif->lua, 4, 4);
+	SB2_LUA_CALL(luaif->lua, 4, 4);
 
 	host_path = (char *)lua_tostring(luaif->lua, -2);
 	if (host_path && (*host_path != '/')) {
@@ -923,9 +924,10 @@ static int call_lua_function_sbox_get_mapping_requirements(
 	lua_pushstring(luaif->lua, ctx->pmc_binary_name);
 	lua_pushstring(luaif->lua, ctx->pmc_func_name);
 	lua_pushstring(luaif->lua, abs_virtual_source_path_string);
-	/* 3 arguments, returns 4: (rule, rule_found_flag,
+	lua_pushinteger(luaif->lua, ctx->pmc_fn_id);
+	/* 4 arguments, returns 4: (rule, rule_found_flag,
 	 * min_path_len, flags) */
-	lua_call(luaif->lua, 3, 4);
+	SB2_LUA_CALL(luaif->lua, 4, 4);
 
 	rule_found = lua_toboolean(luaif->lua, -3);
 	min_path_len = lua_tointeger(luaif->lua, -2);
@@ -967,7 +969,7 @@ static char *call_lua_function_sbox_reverse_path(
 	lua_pushstring(luaif->lua, ctx->pmc_func_name);
 	lua_pushstring(luaif->lua, abs_host_path);
 	 /* 3 arguments, returns virtual_path and flags */
-	lua_call(luaif->lua, 3, 2);
+	SB2_LUA_CALL(luaif->lua, 3, 2);
 
 	virtual_path = (char *)lua_tostring(luaif->lua, -2);
 	if (virtual_path) {
@@ -1014,6 +1016,59 @@ static void sb_path_resolution_resolve_symlink(
 	mapping_results_t *resolved_virtual_path_res,
 	int nest_count);
 
+/* Directory fds for path resolution:
+ *
+ * Testing every prefix of a path with readlink() makes the kernel walk
+ * O(N*N) components for a path with N components. As long as the
+ * mapping just appends components to the host path (that is the usual
+ * case, see "standard mapping" below), the resolution loop keeps an
+ * fd open to the host directory which contains the current component,
+ * and uses readlinkat() and openat() relative to that. Then each step
+ * costs only one lookup. Whenever the host prefix changes (a rule with
+ * a custom mapping function), or if the directory can't be opened, the
+ * loop falls back to using full host paths.
+*/
+#ifdef O_PATH
+#define PATH_RESOLUTION_DIRFD_FLAGS (O_PATH | O_DIRECTORY)
+#else
+#define PATH_RESOLUTION_DIRFD_FLAGS (O_RDONLY | O_DIRECTORY)
+#endif
+
+/* Returns a new directory fd for "component" which is located in
+ * directory "dirfd", or for "host_path" if dirfd is not valid.
+ * Closes the old fd. Returns -1 if the directory can't be opened.
+*/
+static int path_resolution_descend_dirfd(int dirfd,
+	const char *component, const char *host_path)
+{
+	int	flags = PATH_RESOLUTION_DIRFD_FLAGS;
+	int	new_fd;
+	int	saved_errno = errno;
+
+#ifdef O_CLOEXEC
+	flags |= O_CLOEXEC;
+#endif
+	if (dirfd >= 0) {
+		new_fd = openat_nomap_nolog(dirfd, component, flags);
+		close_nomap_nolog(dirfd);
+	} else {
+		new_fd = open_nomap_nolog(host_path, flags);
+	}
+	errno = saved_errno;
+	return(new_fd);
+}
+
+static void path_resolution_close_dirfd(int *dirfdp)
+{
+	if (*dirfdp >= 0) {
+		int	saved_errno = errno;
+
+		close_nomap_nolog(*dirfdp);
+		errno = saved_errno;
+		*dirfdp = -1;
+	}
+}
+
 /* sb_path_resolution():  This is the place where symlinks are followed.
  *
  * Returns an allocated buffer containing the resolved path (or NULL if error)
@@ -1035,6 +1090,12 @@ static void sb_path_resolution(
 	int	prefix_mapping_result_host_path_flags;
 	int	call_translate_for_all = 0;
 	int	abs_virtual_source_path_has_trailing_slash;
+	/* fd of the host directory which contains the current
+	 * component, or -1 if full host path must be used: */
+	int	host_dirfd = -1;
+	/* set if the previous component was looked up from the root index;
+	 * then the next one is likely to be found there, too */
+	int	rootindex_answered = 0;
 
 	if (!abs_virtual_clean_source_path_list) {
 		SB_LOG(SB_LOGLEVEL_ERROR,
@@ -1078,6 +1139,8 @@ static void sb_path_resolution(
 	if (call_lua_function_sbox_get_mapping_requirements(
 		ctx, abs_virtual_clean_source_path_list,
 		&min_path_len_to_check, &call_translate_for_all)) {
+		if (call_translate_for_all)
+			resolved_virtual_path_res->mres_fs_dependent = 1;
 		/* has requirements:
 		 * skip over path components that we are not supposed to check,
 		 * because otherwise rule recognition & execution could fail.
@@ -1172,8 +1235,30 @@ static void sb_path_resolution(
 			 * used eiher. fortunately readlink() is an ordinary function.
 			*/
 			int	link_len;
-
-			link_len = readlink_nomap(prefix_mapping_result_host_path, link_dest, PATH_MAX);
+			struct sb2_rootindex_result	rires;
+
+			rootindex_answered = 0;
+			if ((prefix_mapping_result_host_path_flags &
+			     SB2_MAPPING_RULE_FLAGS_READONLY) &&
+			    (sb2_rootindex_lookup(prefix_mapping_result_host_path,
+				&rires) != SB2_ROOTINDEX_UNKNOWN)) {
+				/* a read-only tree, and the root index knows
+				 * the answer (a missing path is not a symlink) */
+				rootindex_answered = 1;
+				path_resolution_close_dirfd(&host_dirfd);
+				link_len = 0;
+				if (rires.rir_link_dest) {
+					link_len = snprintf(link_dest, sizeof(link_dest),
+						"%s", rires.rir_link_dest);
+				}
+			} else if (host_dirfd >= 0) {
+				link_len = readlinkat_nomap_nolog(host_dirfd,
+					virtual_path_work_ptr->pe_path_component,
+					link_dest, PATH_MAX);
+			} else {
+				link_len = readlink_nomap(prefix_mapping_result_host_path,
+					link_dest, PATH_MAX);
+			}
 
 			if (link_len > 0) {
 				/* was a symlink */
@@ -1194,6 +1279,8 @@ static void sb_path_resolution(
 				prefix_mapping_result_host_path, link_dest);
 			free(prefix_mapping_result_host_path);
 			prefix_mapping_result_host_path = NULL;
+			path_resolution_close_dirfd(&host_dirfd);
+			resolved_virtual_path_res->mres_fs_dependent = 1;
 
 			sb_path_resolution_resolve_symlink(ctx,
 				virtual_path_work_ptr->pe_link_dest,
@@ -1220,6 +1307,8 @@ static void sb_path_resolution(
 				path_mapping_context_t	ctx_copy = *ctx;
 
 				ctx_copy.pmc_binary_name = "PATH_RESOLUTION/2";
+				/* host prefix may change, can't use the dirfd */
+				path_resolution_close_dirfd(&host_dirfd);
 				if (prefix_mapping_result_host_path) {
 					free(prefix_mapping_result_host_path);
 					prefix_mapping_result_host_path = NULL;
@@ -1244,6 +1333,18 @@ static void sb_path_resolution(
 				*/
 				char	*next_dir = NULL;
 
+				if (((virtual_path_work_ptr->pe_flags &
+				     (PATH_FLAGS_IS_SYMLINK | PATH_FLAGS_NOT_SYMLINK)) == 0) &&
+				    !rootindex_answered) {
+					host_dirfd = path_resolution_descend_dirfd(
+						host_dirfd,
+						virtual_path_work_ptr->pe_prev->pe_path_component,
+						prefix_mapping_result_host_path);
+				} else {
+					/* already known (e.g. a cached dirfd
+					 * prefix), no need to open the dir. */
+					path_resolution_close_dirfd(&host_dirfd);
+				}
 				if (asprintf(&next_dir, "%s/%s",
 					prefix_mapping_result_host_path,
 					virtual_path_work_ptr->pe_path_component) < 0) {
@@ -1262,6 +1363,7 @@ static void sb_path_resolution(
 		}
 		component_index++;
 	}
+	path_resolution_close_dirfd(&host_dirfd);
 	if (prefix_mapping_result_host_path) {
 		free(prefix_mapping_result_host_path);
 		prefix_mapping_result_host_path = NULL;
@@ -1534,6 +1636,215 @@ static int relative_virtual_path_to_abs_path(
 	return(0);
 }
 
+/* Directory prefixes for the *at() functions:
+ * The virtual path of a directory fd is split, cleaned and resolved
+ * when the fd is used as a starting point for the first time, and the
+ * result is attached to the fdpathdb entry. Later calls with the same
+ * directory only need to split the relative part; components which
+ * came from the cache are already known not to be symlinks, so
+ * sb_path_resolution() doesn't need to check them again.
+ * The rule is still selected based on the complete path, because
+ * rules may depend on anything below the directory.
+ * If the session has a watcher (sb2-watchd), the entry is stamped with
+ * the generations of the host directories above it and is not used
+ * after any of them has changed.
+ * If the rule chain has "func_name" conditions, the directory may be
+ * resolved differently for different functions; the entry is used
+ * only by the function that created it, others resolve the directory
+ * without the cache.
+*/
+struct dirfd_path_cache {
+	struct path_entry	*dpc_entries;	/* NULL for the root directory */
+	struct sb2_watchgen_stamp	dpc_stamp;
+	char			*dpc_func_name;	/* NULL = valid for all */
+};
+
+/* Cleared when the rules have been loaded, if the chain doesn't
+ * depend on the function */
+static int dirfd_path_cache_per_function = 1;
+
+void sb2_dirfd_path_cache_load_from_lua(struct lua_instance *luaif,
+	const char *binary_name)
+{
+	lua_State	*l = luaif->lua;
+
+	lua_getfield(l, LUA_GLOBALSINDEX, "sb_chain_has_func_name_rules");
+	if (!lua_isfunction(l, -1)) {
+		lua_pop(l, 1);
+		return;
+	}
+	lua_pushstring(l, binary_name);
+	SB2_LUA_CALL(l, 1, 1);
+	dirfd_path_cache_per_function = lua_toboolean(l, -1);
+	lua_pop(l, 1);
+	SB_LOG(SB_LOGLEVEL_DEBUG, "dirfd path cache: %s",
+		(dirfd_path_cache_per_function ? "per function" : "shared"));
+}
+
+static void free_dirfd_path_cache(void *p)
+{
+	struct dirfd_path_cache *dpc = p;
+
+	free_path_entries(dpc->dpc_entries);
+	sb2_watchgen_stamp_free(&dpc->dpc_stamp);
+	free(dpc->dpc_func_name);
+	free(dpc);
+}
+
+/* Returns NULL if the path can't be resolved. "*cacheablep" is cleared
+ * if the result must not be attached to the fdpathdb entry. */
+static struct dirfd_path_cache *resolve_dirfd_path(
+	const path_mapping_context_t *ctx,
+	const char *dir_path,
+	int *cacheablep)
+{
+	struct path_entry_list	dir_list;
+	mapping_results_t	dir_res;
+	path_mapping_context_t	dir_ctx = *ctx;
+	struct dirfd_path_cache	*dpc = NULL;
+	struct path_entry	*ep;
+	int			flags;
+	uint64_t		watch_events = sb2_watchgen_events();
+	char			*host_path = NULL;
+
+	split_path_to_path_list(dir_path, &dir_list);
+	if (!(dir_list.pl_flags & PATH_FLAGS_ABSOLUTE)) {
+		free_path_list(&dir_list);
+		return(NULL);
+	}
+	switch (is_clean_path(&dir_list)) {
+	case 0: /* clean */
+		break;
+	case 1: /* . */
+		remove_dots_from_path_list(&dir_list);
+		break;
+	case 2: /* .. */
+		remove_dots_from_path_list(&dir_list);
+		clean_dotdots_from_path(ctx, &dir_list);
+		break;
+	}
+
+	/* it is a directory: the last component must always be resolved */
+	dir_ctx.pmc_virtual_orig_path = dir_path;
+	dir_ctx.pmc_dont_resolve_final_symlink = 0;
+	clear_mapping_results_struct(&dir_res);
+
+	disable_mapping(ctx->pmc_luaif);
+	sb_path_resolution(&dir_ctx, &dir_res, 0, &dir_list);
+	if (dir_res.mres_result_path) {
+		drop_rule_from_lua_stack(ctx->pmc_luaif);
+		if (!dir_res.mres_errno) {
+			dpc = malloc(sizeof(*dpc));
+			if (!dpc) abort();
+			dpc->dpc_entries = split_path_to_path_entries(
+				dir_res.mres_result_path, &flags);
+			dpc->dpc_func_name = (dirfd_path_cache_per_function ?
+				strdup(ctx->pmc_func_name) : NULL);
+			if (sb2_watchgen_active()) {
+				host_path = call_lua_function_sbox_translate_path(
+					&dir_ctx, SB_LOGLEVEL_NOISE,
+					dir_res.mres_result_path, &flags);
+				drop_policy_from_lua_stack(ctx->pmc_luaif);
+			}
+			*cacheablep = (sb2_watchgen_stamp_set(&dpc->dpc_stamp,
+				host_path, watch_events) == 0);
+			free(host_path);
+		}
+	}
+	enable_mapping(ctx->pmc_luaif);
+
+	if (dpc) {
+		for (ep = dpc->dpc_entries; ep; ep = ep->pe_next)
+			ep->pe_flags |= PATH_FLAGS_NOT_SYMLINK;
+	}
+
+	SB_LOG(SB_LOGLEVEL_NOISE, "dirfd path '%s' resolved to '%s'",
+		dir_path, (dir_res.mres_result_path ?
+			dir_res.mres_result_path : "<failed>"));
+	free_mapping_results(&dir_res);
+	free_path_list(&dir_list);
+	return(dpc);
+}
+
+/* Build a clean, absolute path list for "relative_path" at the
+ * directory "dirfd_path". Returns -1 if the directory can't be
+ * resolved; the caller must process the full path instead.
+*/
+static int dirfd_relative_path_to_path_list(
+	const path_mapping_context_t *ctx,
+	fdpathdb_path_t *dirfd_path,
+	const char *relative_path,
+	struct path_entry_list *listp)
+{
+	struct dirfd_path_cache	*cached;
+	struct dirfd_path_cache	*uncached = NULL;
+	struct path_entry	*prefix;
+	struct path_entry	*ep;
+	struct path_entry	*rest;
+	int			flags = 0;
+	int			cacheable = 0;
+
+	cached = fdpathdb_get_cached_data(dirfd_path);
+	if (cached && ((cached->dpc_func_name &&
+	     strcmp(cached->dpc_func_name, ctx->pmc_func_name)) ||
+	    !sb2_watchgen_stamp_is_valid(&cached->dpc_stamp))) {
+		/* resolved for another function, or the tree has
+		 * changed. The entry can't be replaced, other threads
+		 * may be using it. */
+		SB_LOG(SB_LOGLEVEL_NOISE, "dirfd path '%s' can't be used",
+			fdpathdb_path_str(dirfd_path));
+		uncached = resolve_dirfd_path(ctx,
+			fdpathdb_path_str(dirfd_path), &cacheable);
+		if (!uncached) return(-1);
+		cached = uncached;
+	} else if (!cached) {
+		cached = resolve_dirfd_path(ctx,
+			fdpathdb_path_str(dirfd_path), &cacheable);
+		if (!cached) return(-1);
+		if (!cacheable) {
+			uncached = cached;
+		} else if (!fdpathdb_set_cached_data(dirfd_path, cached,
+		    free_dirfd_path_cache)) {
+			/* another thread was faster */
+			free_dirfd_path_cache(cached);
+			cached = fdpathdb_get_cached_data(dirfd_path);
+		}
+	}
+
+	/* the cached list is shared, work with a copy */
+	prefix = duplicate_path_entries_until(NULL, cached->dpc_entries);
+	for (ep = prefix; ep; ep = ep->pe_next)
+		ep->pe_flags |= PATH_FLAGS_NOT_SYMLINK;
+	if (uncached) free_dirfd_path_cache(uncached);
+
+	rest = split_path_to_path_entries(relative_path, &flags);
+	prefix = append_path_entries(prefix, rest);
+
+	listp->pl_first = prefix;
+	listp->pl_flags = flags | PATH_FLAGS_ABSOLUTE;
+
+	switch (is_clean_path(listp)) {
+	case 0: /* clean */
+		break;
+	case 1: /* . */
+		remove_dots_from_path_list(listp);
+		break;
+	case 2: /* .. */
+		/* trivial, if ".." only goes up in the cached part */
+		remove_dots_from_path_list(listp);
+		clean_dotdots_from_path(ctx, listp);
+		break;
+	}
+	if (SB_LOG_IS_ACTIVE(SB_LOGLEVEL_NOISE2)) {
+		char *tmp_path_buf = path_list_to_string(listp);
+
+		SB_LOG(SB_LOGLEVEL_NOISE2, "dirfd+relative->'%s'",
+			tmp_path_buf);
+		free(tmp_path_buf);
+	}
+	return(0);
+}
+
 /* make sure to use disable_mapping(m); 
  * to prevent recursive calls to this function.
  * Returns a pointer to an allocated buffer which contains the result.
@@ -1541,9 +1852,12 @@ static int relative_virtual_path_to_abs_path(
 static void sbox_map_path_internal(
 	const char *binary_name,
 	const char *func_name,
+	int fn_id,
 	const char *virtual_orig_path,
 	int dont_resolve_final_symlink,
 	int process_path_for_exec,
+	fdpathdb_path_t *dirfd_path,	/* NULL, or dir. of path_at_dirfd */
+	const char *path_at_dirfd,
 	mapping_results_t *res)
 {
 	char *mapping_result = NULL;
@@ -1555,6 +1869,7 @@ static void sbox_map_path_internal(
 	clear_path_mapping_context(&ctx);
 	ctx.pmc_binary_name = binary_name;
 	ctx.pmc_func_name = func_name;
+	ctx.pmc_fn_id = fn_id;
 	ctx.pmc_virtual_orig_path = virtual_orig_path;
 	ctx.pmc_dont_resolve_final_symlink = dont_resolve_final_symlink;
 
@@ -1603,6 +1918,14 @@ static void sbox_map_path_internal(
 		goto use_orig_path_as_result_and_exit;
 	}
 
+	if (dirfd_path &&
+	    (dirfd_relative_path_to_path_list(&ctx, dirfd_path, path_at_dirfd,
+		&abs_virtual_path_for_rule_selection_list) == 0)) {
+		/* Relative to a directory fd. Already absolute and clean,
+		 * "virtual_orig_path" is the synthetic full path. */
+		goto path_list_ready;
+	}
+
 	split_path_to_path_list(virtual_orig_path,
 		&abs_virtual_path_for_rule_selection_list);
 
@@ -1632,6 +1955,7 @@ static void sbox_map_path_internal(
 		break;
 	}
 
+    path_list_ready:
 	disable_mapping(ctx.pmc_luaif);
 	{
 		/* Mapping disabled inside this block - do not use "return"!! */
@@ -1703,6 +2027,8 @@ static void sbox_map_path_internal(
 				&ctx, SB_LOGLEVEL_INFO,
 				resolved_virtual_path_res.mres_result_path, &flags);
 			res->mres_readonly = (flags & SB2_MAPPING_RULE_FLAGS_READONLY);
+			res->mres_fs_dependent =
+				resolved_virtual_path_res.mres_fs_dependent;
 
 			if (process_path_for_exec == 0) {
 				/* ...and remove rule and policy from stack */
@@ -1778,36 +2104,47 @@ void sbox_map_path_for_sb2show(
 		res->mres_result_buf = res->mres_result_path = NULL;
 		res->mres_readonly = 1;
 	} else {
-		sbox_map_path_internal(binary_name, func_name, virtual_path,
-			0/*dont_resolve_final_symlink*/, 0, res);
+		sbox_map_path_internal(binary_name, func_name,
+			SB2_FN_ID_UNKNOWN, virtual_path,
+			0/*dont_resolve_final_symlink*/, 0, NULL, NULL, res);
 	}
 }
 
 void sbox_map_path(
 	const char *func_name,
+	int fn_id,
 	const char *virtual_path,
 	int dont_resolve_final_symlink,
 	mapping_results_t *res)
 {
+	if (sb2_profile_enabled) sb2_profile_count_mapping();
 	if (!virtual_path) {
 		res->mres_result_buf = res->mres_result_path = NULL;
 		res->mres_readonly = 1;
-	} else {
+	} else if (sb2_path_class_map(func_name, virtual_path, res)) {
+		/* /proc, /dev, ... mapped without Lua */
+	} else if (sb2_mapd_map_path(func_name, fn_id, virtual_path,
+			dont_resolve_final_symlink, res) < 0) {
+		/* not served by the mapping daemon */
 		sbox_map_path_internal(
 			(sbox_binary_name ? sbox_binary_name : "UNKNOWN"),
-			func_name, virtual_path, dont_resolve_final_symlink, 0, res);
+			func_name, fn_id, virtual_path,
+			dont_resolve_final_symlink, 0,
+			NULL, NULL, res);
 	}
 }
 
 void sbox_map_path_at(
 	const char *func_name,
+	int fn_id,
 	int dirfd,
 	const char *virtual_path,
 	int dont_resolve_final_symlink,
 	mapping_results_t *res)
 {
-	const char *dirfd_path;
+	fdpathdb_path_t *dirfd_path;
 
+	if (sb2_profile_enabled) sb2_profile_count_mapping();
 	if (!virtual_path) {
 		res->mres_result_buf = res->mres_result_path = NULL;
 		res->mres_readonly = 1;
@@ -1820,21 +2157,26 @@ void sbox_map_path_at(
 #endif
 	   ) {
 		/* same as sbox_map_path() */
+		if (sb2_path_class_map(func_name, virtual_path, res)) return;
+		if (sb2_mapd_map_path(func_name, fn_id, virtual_path,
+			dont_resolve_final_symlink, res) == 0) return;
 		sbox_map_path_internal(
 			(sbox_binary_name ? sbox_binary_name : "UNKNOWN"),
-			func_name,
-			virtual_path, dont_resolve_final_symlink, 0, res);
+			func_name, fn_id,
+			virtual_path, dont_resolve_final_symlink, 0,
+			NULL, NULL, res);
 		return;
 	}
 
 	/* relative to something else than CWD */
-	dirfd_path = fdpathdb_find_path(dirfd);
+	dirfd_path = fdpathdb_get_path(dirfd);
 
 	if (dirfd_path) {
 		/* pathname found */
 		char *virtual_abs_path_at_fd = NULL;
 
-		if (asprintf(&virtual_abs_path_at_fd, "%s/%s", dirfd_path, virtual_path) < 0) {
+		if (asprintf(&virtual_abs_path_at_fd, "%s/%s",
+		    fdpathdb_path_str(dirfd_path), virtual_path) < 0) {
 			/* asprintf failed */
 			abort();
 		}
@@ -1842,10 +2184,18 @@ void sbox_map_path_at(
 			"Synthetic path for %s(%d,'%s') => '%s'",
 			func_name, dirfd, virtual_path, virtual_abs_path_at_fd);
 
+		if (sb2_mapd_map_path(func_name, fn_id, virtual_abs_path_at_fd,
+		    dont_resolve_final_symlink, res) == 0) {
+			fdpathdb_release_path(dirfd_path);
+			free(virtual_abs_path_at_fd);
+			return;
+		}
 		sbox_map_path_internal(
 			(sbox_binary_name ? sbox_binary_name : "UNKNOWN"),
-			func_name,
-			virtual_abs_path_at_fd, dont_resolve_final_symlink, 0, res);
+			func_name, fn_id,
+			virtual_abs_path_at_fd, dont_resolve_final_symlink, 0,
+			dirfd_path, virtual_path, res);
+		fdpathdb_release_path(dirfd_path);
 		free(virtual_abs_path_at_fd);
 
 		return;
@@ -1868,9 +2218,12 @@ void sbox_map_path_for_exec(
 	const char *virtual_path,
 	mapping_results_t *res)
 {
+	if (sb2_profile_enabled) sb2_profile_count_mapping();
 	sbox_map_path_internal(
 		(sbox_binary_name ? sbox_binary_name : "UNKNOWN"), func_name,
-		virtual_path, 0/*dont_resolve_final_symlink*/, 1/*exec mode*/, res);
+		SB2_FN_ID_UNKNOWN,
+		virtual_path, 0/*dont_resolve_final_symlink*/, 1/*exec mode*/,
+		NULL, NULL, res);
 }
 
 char *scratchbox_reverse_path(
@@ -1880,9 +2233,13 @@ char *scratchbox_reverse_path(
 	char *virtual_path;
 	path_mapping_context_t	ctx;
 
+	if (sb2_mapd_reverse_path(func_name, abs_host_path, &virtual_path) == 0)
+		return(virtual_path);
+
 	clear_path_mapping_context(&ctx);
 	ctx.pmc_binary_name = (sbox_binary_name ? sbox_binary_name : "UNKNOWN");
 	ctx.pmc_func_name = func_name;
+	ctx.pmc_fn_id = SB2_FN_ID_UNKNOWN;
 	ctx.pmc_virtual_orig_path = "";
 	ctx.pmc_dont_resolve_final_symlink = 0;
 	ctx.pmc_luaif = get_lua();
@@ -1896,6 +2253,7 @@ void	clear_mapping_results_struct(mapping_results_t *res)
 {
 	res->mres_result_buf = res->mres_result_path = NULL;
 	res->mres_readonly = 0;
+	res->mres_fs_dependent = 0;
 	res->mres_result_path_was_allocated = 0;
 	res->mres_errno = 0;
 	res->mres_virtual_cwd = NULL;
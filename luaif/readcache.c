@@ -0,0 +1,203 @@
+/*
+ * readcache.c -- cached mapping results for read-only calls
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * Build tools stat(), access() and open() the same absolute paths over
+ * and over again (include directories, libraries, configuration files).
+ * The wrappers of functions tagged with a read class in interface.master
+ * (gen-interface.pl: "class(meta_read)", "class(open_read)",
+ * "class(dir_enum)") map their paths with sbox_map_path_for_read(),
+ * which keeps the results in a small process-wide table.
+ *
+ * The table is used only in sessions which have a watcher (sb2-watchd,
+ * "sb2 -w"). An entry is stamped with the generations of the host
+ * directories above the result and is dropped when any of them changes;
+ * path resolution looked only at those directories when it checked
+ * for symlinks. Results which depend on anything else are not cached:
+ * those that followed a symlink, or were made by a rule with
+ * conditional actions ("if_exists_then_map_to", etc) or a custom
+ * mapping function (mres_fs_dependent), and results outside of the
+ * trees that the watcher watches (the current directory, and
+ * target_root in "root" sessions).
+ *
+ * Changes made by this process are known before the watcher sees them:
+ * wrappers of "class(mutating)" functions (and of "open_read" functions
+ * when opening for writing) call sb2_read_cache_invalidate(), which
+ * drops all entries.
+ *
+ * Entries are keyed by the function ID as well, because rules may have
+ * "func_name" conditions. Only absolute paths are cached.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sb2.h>
+#include <mapping.h>
+#include "libsb2.h"
+#include "exported.h"
+
+#define READ_CACHE_SIZE	256	/* must be a power of 2 */
+
+struct read_cache_entry {
+	uint32_t	rce_hash;
+	int		rce_fn_id;
+	int		rce_nosymlink;
+	uint64_t	rce_generation;
+	char		*rce_path;	/* NULL: unused */
+	char		*rce_result;
+	int		rce_readonly;
+	struct sb2_watchgen_stamp rce_stamp;
+};
+
+static struct read_cache_entry read_cache[READ_CACHE_SIZE];
+static volatile int read_cache_lock = 0;
+static volatile uint64_t read_cache_generation = 1;
+
+static uint32_t read_cache_hash(const char *path, int fn_id,
+	int nosymlink)
+{
+	uint32_t	h = 2166136261u;	/* FNV-1a */
+
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+	return(h ^ ((uint32_t)fn_id * 2654435761u) ^ nosymlink);
+}
+
+static int read_cache_usable(const char *path)
+{
+	return(path && (*path == '/') && sb2_watchgen_active() &&
+		!sb2_mapping_disabled_in_this_thread() &&
+		!getenv("SBOX_DISABLE_MAPPING"));
+}
+
+static void free_read_cache_entry(struct read_cache_entry *e)
+{
+	free(e->rce_path);
+	free(e->rce_result);
+	sb2_watchgen_stamp_free(&e->rce_stamp);
+	e->rce_path = e->rce_result = NULL;
+}
+
+/* Returns 1 if "res" was filled from the cache */
+static int read_cache_lookup(const char *func_name, int fn_id,
+	const char *path, int nosymlink, uint32_t h,
+	mapping_results_t *res)
+{
+	struct read_cache_entry *e = &read_cache[h & (READ_CACHE_SIZE - 1)];
+	int	found = 0;
+
+	if (__sync_lock_test_and_set(&read_cache_lock, 1))
+		return(0);
+	if (e->rce_path && (e->rce_hash == h) && (e->rce_fn_id == fn_id) &&
+	    (e->rce_nosymlink == nosymlink) && !strcmp(e->rce_path, path)) {
+		if ((e->rce_generation == read_cache_generation) &&
+		    sb2_watchgen_stamp_is_valid(&e->rce_stamp)) {
+			res->mres_result_buf = res->mres_result_path =
+				strdup(e->rce_result);
+			res->mres_readonly = e->rce_readonly;
+			found = 1;
+		} else {
+			free_read_cache_entry(e);
+		}
+	}
+	__sync_lock_release(&read_cache_lock);
+	if (found)
+		SB_LOG(SB_LOGLEVEL_DEBUG, "read cache: %s(%s) => '%s'",
+			func_name, path, res->mres_result_buf);
+	return(found);
+}
+
+static void read_cache_insert(int fn_id, const char *path, int nosymlink,
+	uint32_t h, uint64_t generation, uint64_t events_before,
+	const mapping_results_t *res)
+{
+	struct read_cache_entry *e = &read_cache[h & (READ_CACHE_SIZE - 1)];
+	struct sb2_watchgen_stamp stamp;
+
+	if (res->mres_errno || res->mres_fs_dependent ||
+	    !res->mres_result_buf || (res->mres_result_buf[0] != '/') ||
+	    (res->mres_result_path != res->mres_result_buf) ||
+	    !sb2_watchgen_path_is_watched(res->mres_result_buf))
+		return;
+	if (sb2_watchgen_stamp_set(&stamp, res->mres_result_buf,
+	    events_before) < 0) {
+		sb2_watchgen_stamp_free(&stamp);
+		return;
+	}
+	if (__sync_lock_test_and_set(&read_cache_lock, 1)) {
+		sb2_watchgen_stamp_free(&stamp);
+		return;
+	}
+	free_read_cache_entry(e);
+	e->rce_hash = h;
+	e->rce_fn_id = fn_id;
+	e->rce_nosymlink = nosymlink;
+	e->rce_generation = generation;
+	e->rce_path = strdup(path);
+	e->rce_result = strdup(res->mres_result_buf);
+	e->rce_readonly = res->mres_readonly;
+	e->rce_stamp = stamp;
+	__sync_lock_release(&read_cache_lock);
+}
+
+/* Called after this process has modified the file system */
+void sb2_read_cache_invalidate(void)
+{
+	__sync_fetch_and_add(&read_cache_generation, 1);
+}
+
+void sbox_map_path_for_read(
+	const char *func_name,
+	int fn_id,
+	const char *virtual_path,
+	int dont_resolve_final_symlink,
+	mapping_results_t *res)
+{
+	int		nosymlink = (dont_resolve_final_symlink != 0);
+	uint32_t	h;
+	uint64_t	generation, events_before;
+
+	if (!read_cache_usable(virtual_path)) {
+		sbox_map_path(func_name, fn_id, virtual_path,
+			dont_resolve_final_symlink, res);
+		return;
+	}
+	h = read_cache_hash(virtual_path, fn_id, nosymlink);
+	if (sb2_path_class_map(func_name, virtual_path, res) ||
+	    read_cache_lookup(func_name, fn_id, virtual_path, nosymlink,
+		h, res)) {
+		if (sb2_profile_enabled) sb2_profile_count_mapping();
+		return;
+	}
+	generation = read_cache_generation;
+	events_before = sb2_watchgen_events();
+	sbox_map_path(func_name, fn_id, virtual_path,
+		dont_resolve_final_symlink, res);
+	read_cache_insert(fn_id, virtual_path, nosymlink, h,
+		generation, events_before, res);
+}
+
+void sbox_map_path_at_for_read(
+	const char *func_name,
+	int fn_id,
+	int dirfd,
+	const char *virtual_path,
+	int dont_resolve_final_symlink,
+	mapping_results_t *res)
+{
+	/* absolute paths don't depend on "dirfd" */
+	if (virtual_path && (*virtual_path == '/')) {
+		sbox_map_path_for_read(func_name, fn_id, virtual_path,
+			dont_resolve_final_symlink, res);
+		return;
+	}
+	sbox_map_path_at(func_name, fn_id, dirfd, virtual_path,
+		dont_resolve_final_symlink, res);
+}
@@ -29,12 +29,54 @@
 #include "libsb2.h"
 #include "exported.h"
 
-typedef struct fd_path_db_entry_s {
-	char	*fpdb_path;
-} fd_path_db_entry_t;
+/* Pathnames are interned: all fds which refer to the same path (e.g.
+ * after dup()) share one refcounted fdpathdb_path_t object.
+ *
+ * The fd => path table is a segmented array: a fixed top-level table
+ * of pointers to segments, which are allocated when needed but never
+ * moved or freed. Each slot is a pointer, which is replaced atomically.
+ * Lookups don't take any locks; the mutex is used only to protect the
+ * intern table (i.e. when paths are registered or released).
+ *
+ * Because lookups are lock-free, an object may be read while another
+ * thread is releasing it. Objects are therefore not freed immediately
+ * when the last reference is dropped; they are moved to a list of
+ * retired objects, which is freed when no lookups are in progress.
+ * Lookups in progress are counted in a few counters, each in its own
+ * cache line; a thread always uses the same one, so concurrent lookups
+ * of different threads don't have to fight over one counter. Only the
+ * (rare) reclaim has to read all of them.
+ *
+ * The path mapping code may attach data to an object (see
+ * fdpathdb_set_cached_data()); it is released with the object.
+*/
+struct fdpathdb_path_s {
+	struct fdpathdb_path_s	*fpp_next;	/* intern table or retired list */
+	int			fpp_refcount;
+	unsigned int		fpp_hash;
+	void			*fpp_cached_data;
+	void			(*fpp_cached_data_free)(void *);
+	/* fpp_path MUST BE the last member of this struct */
+	char			fpp_path[1];
+};
+
+#define FDPATHDB_SEGMENT_SIZE	1024
+#define FDPATHDB_MAX_SEGMENTS	1024	/* => max. 1M file descriptors */
+#define FDPATHDB_INTERN_BUCKETS	1024
+
+static fdpathdb_path_t **fd_path_db_segments[FDPATHDB_MAX_SEGMENTS];
 
-static fd_path_db_entry_t *fd_path_db = NULL;
-static int fd_path_db_slots = 0;
+static fdpathdb_path_t *fd_path_db_intern_table[FDPATHDB_INTERN_BUCKETS];
+static fdpathdb_path_t *fd_path_db_retired = NULL;
+
+#define FDPATHDB_LOOKUP_SHARDS	16
+
+static struct fdpathdb_lookup_shard {
+	int	fls_active;
+} __attribute__((aligned(64))) fd_path_db_active_lookups[FDPATHDB_LOOKUP_SHARDS];
+
+static unsigned int fd_path_db_next_shard = 0;
+static __thread struct fdpathdb_lookup_shard *fd_path_db_lookup_shard = NULL;
 
 static pthread_mutex_t	fd_path_db_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -59,34 +101,237 @@ static void fdpathdb_mutex_unlock(void)
 	}
 }
 
-const char *fdpathdb_find_path(int fd)
+static unsigned int fdpathdb_hash(const char *path)
+{
+	unsigned int	h = 5381;
+
+	while (*path) h = (h * 33) ^ (unsigned char)*path++;
+	return(h);
+}
+
+/* Returns a pointer to the slot for "fd", or NULL. If "create" is set,
+ * the segment will be allocated if it does not exist yet.
+*/
+static fdpathdb_path_t **fdpathdb_slot(int fd, int create)
+{
+	int	seg_idx;
+	fdpathdb_path_t	**seg;
+
+	if (fd < 0) return(NULL);
+	seg_idx = fd / FDPATHDB_SEGMENT_SIZE;
+	if (seg_idx >= FDPATHDB_MAX_SEGMENTS) return(NULL);
+
+	seg = ((fdpathdb_path_t ** volatile *)fd_path_db_segments)[seg_idx];
+	if (!seg) {
+		if (!create) return(NULL);
+		seg = calloc(FDPATHDB_SEGMENT_SIZE, sizeof(fdpathdb_path_t *));
+		if (!seg) return(NULL);
+		if (!__sync_bool_compare_and_swap(
+		    &fd_path_db_segments[seg_idx], NULL, seg)) {
+			/* another thread was faster */
+			free(seg);
+			seg = fd_path_db_segments[seg_idx];
+		}
+	}
+	return(&seg[fd % FDPATHDB_SEGMENT_SIZE]);
+}
+
+/* Increment the reference count, unless it has already dropped to zero
+ * (=the object is being retired). Returns 0 if failed.
+*/
+static int fdpathdb_path_ref(fdpathdb_path_t *fpp)
+{
+	int	count;
+
+	do {
+		count = *(volatile int *)&fpp->fpp_refcount;
+		if (count <= 0) return(0);
+	} while (!__sync_bool_compare_and_swap(&fpp->fpp_refcount,
+			count, count + 1));
+	return(1);
+}
+
+/* Detach retired objects from the list, if no lookups are in progress.
+ * Called with the mutex locked; the objects must be freed with
+ * fdpathdb_free_paths() after the mutex has been unlocked (the cached
+ * data may have a destructor which uses the logger)
+*/
+static fdpathdb_path_t *fdpathdb_reclaim_retired(void)
+{
+	fdpathdb_path_t	*fpp;
+	int		i;
+
+	/* A lookup which starts after its counter has been read here
+	 * can't find the retired objects anymore */
+	for (i = 0; i < FDPATHDB_LOOKUP_SHARDS; i++) {
+		if (__sync_fetch_and_add(
+		    &fd_path_db_active_lookups[i].fls_active, 0) != 0)
+			return(NULL);
+	}
+
+	fpp = fd_path_db_retired;
+	fd_path_db_retired = NULL;
+	return(fpp);
+}
+
+static void fdpathdb_free_paths(fdpathdb_path_t *fpp)
+{
+	while (fpp) {
+		fdpathdb_path_t *next = fpp->fpp_next;
+
+		if (fpp->fpp_cached_data && fpp->fpp_cached_data_free)
+			(*fpp->fpp_cached_data_free)(fpp->fpp_cached_data);
+		free(fpp);
+		fpp = next;
+	}
+}
+
+void fdpathdb_release_path(fdpathdb_path_t *fpp)
 {
-	const char *ret = NULL;
+	fdpathdb_path_t	*reclaimed;
+
+	if (!fpp) return;
+	if (__sync_sub_and_fetch(&fpp->fpp_refcount, 1) > 0) return;
 
+	/* last reference: remove from the intern table */
 	fdpathdb_mutex_lock();
 	{
 		/* NOTE: This is a critical section:
 		 * - Do not return from this block, mutex is locked !!
 		 * - Do not call the logger from this block !!
 		*/
-		if ((fd >= 0) &&
-		    (fd_path_db_slots > fd) &&
-		    fd_path_db[fd].fpdb_path) {
-			ret = fd_path_db[fd].fpdb_path;
+		fdpathdb_path_t	**pp = &fd_path_db_intern_table[
+			fpp->fpp_hash % FDPATHDB_INTERN_BUCKETS];
+
+		while (*pp && (*pp != fpp)) pp = &(*pp)->fpp_next;
+		if (*pp) *pp = fpp->fpp_next;
+
+		fpp->fpp_next = fd_path_db_retired;
+		fd_path_db_retired = fpp;
+		reclaimed = fdpathdb_reclaim_retired();
+	}
+	fdpathdb_mutex_unlock();
+	fdpathdb_free_paths(reclaimed);
+}
+
+/* Returns a referenced, interned object for "path" */
+static fdpathdb_path_t *fdpathdb_intern_path(const char *path)
+{
+	unsigned int	hash = fdpathdb_hash(path);
+	fdpathdb_path_t	*fpp;
+	size_t		len;
+
+	fdpathdb_mutex_lock();
+	{
+		/* NOTE: This is a critical section:
+		 * - Do not return from this block, mutex is locked !!
+		 * - Do not call the logger from this block !!
+		*/
+		for (fpp = fd_path_db_intern_table[hash % FDPATHDB_INTERN_BUCKETS];
+		     fpp; fpp = fpp->fpp_next) {
+			if ((fpp->fpp_hash == hash) &&
+			    !strcmp(fpp->fpp_path, path) &&
+			    fdpathdb_path_ref(fpp))
+				break;
+		}
+		if (!fpp) {
+			len = strlen(path);
+			fpp = malloc(sizeof(fdpathdb_path_t) + len);
+			if (fpp) {
+				memcpy(fpp->fpp_path, path, len + 1);
+				fpp->fpp_hash = hash;
+				fpp->fpp_refcount = 1;
+				fpp->fpp_cached_data = NULL;
+				fpp->fpp_cached_data_free = NULL;
+				fpp->fpp_next = fd_path_db_intern_table[
+					hash % FDPATHDB_INTERN_BUCKETS];
+				fd_path_db_intern_table[
+					hash % FDPATHDB_INTERN_BUCKETS] = fpp;
+			}
 		}
 	}
 	fdpathdb_mutex_unlock();
+	return(fpp);
+}
+
+const char *fdpathdb_path_str(const fdpathdb_path_t *fpp)
+{
+	return(fpp ? fpp->fpp_path : NULL);
+}
+
+/* Data which has been attached to "fpp" by fdpathdb_set_cached_data(),
+ * or NULL. The data must not be modified, it may be in use by other
+ * threads. */
+void *fdpathdb_get_cached_data(const fdpathdb_path_t *fpp)
+{
+	return(fpp ? *(void * volatile *)&fpp->fpp_cached_data : NULL);
+}
+
+/* Attach "data" to "fpp"; "free_fn" will be called when the object
+ * is freed. Fails and returns 0 if data has already been attached
+ * (another thread may have been faster), the caller still owns
+ * "data" in that case.
+*/
+int fdpathdb_set_cached_data(fdpathdb_path_t *fpp, void *data,
+	void (*free_fn)(void *))
+{
+	if (!fpp || !data) return(0);
+	/* all users set the same destructor, so a plain store is enough */
+	fpp->fpp_cached_data_free = free_fn;
+	return(__sync_bool_compare_and_swap(&fpp->fpp_cached_data, NULL, data));
+}
+
+/* Returns the path which has been registered for "fd" (or NULL),
+ * the caller must release it with fdpathdb_release_path()
+*/
+fdpathdb_path_t *fdpathdb_get_path(int fd)
+{
+	fdpathdb_path_t	**slot;
+	fdpathdb_path_t	*fpp = NULL;
+	struct fdpathdb_lookup_shard	*shard = fd_path_db_lookup_shard;
+
+	if (!shard) {
+		shard = &fd_path_db_active_lookups[
+			__sync_fetch_and_add(&fd_path_db_next_shard, 1) %
+			FDPATHDB_LOOKUP_SHARDS];
+		fd_path_db_lookup_shard = shard;
+	}
+	__sync_fetch_and_add(&shard->fls_active, 1);
+	slot = fdpathdb_slot(fd, 0);
+	if (slot) {
+		fpp = *(fdpathdb_path_t * volatile *)slot;
+		if (fpp && !fdpathdb_path_ref(fpp)) fpp = NULL;
+	}
+	__sync_fetch_and_sub(&shard->fls_active, 1);
 
-	if (ret) {
+	if (fpp) {
 		SB_LOG(SB_LOGLEVEL_NOISE,
-			"fdpathdb_find_path: FD %d => '%s'",
-			fd, fd_path_db[fd].fpdb_path);
+			"fdpathdb_get_path: FD %d => '%s'",
+			fd, fpp->fpp_path);
 	} else {
 		SB_LOG(SB_LOGLEVEL_NOISE,
-			"fdpathdb_find_path: No pathname for FD %d", fd);
+			"fdpathdb_get_path: No pathname for FD %d", fd);
 	}
+	return(fpp);
+}
 
-	return(ret);
+/* Set path of "fd", consumes the reference to "fpp" */
+static void fdpathdb_set_path(int fd, fdpathdb_path_t *fpp)
+{
+	fdpathdb_path_t	**slot;
+	fdpathdb_path_t	*old;
+
+	slot = fdpathdb_slot(fd, (fpp != NULL));
+	if (!slot) {
+		if (fpp) {
+			SB_LOG(SB_LOGLEVEL_WARNING,
+				"fdpathdb: can't register FD %d", fd);
+			fdpathdb_release_path(fpp);
+		}
+		return;
+	}
+	old = __sync_lock_test_and_set(slot, fpp);
+	if (old) fdpathdb_release_path(old);
 }
 
 static void fdpathdb_register_mapped_path(
@@ -120,46 +365,7 @@ static void fdpathdb_register_mapped_path(
 	SB_LOG(SB_LOGLEVEL_NOISE, "%s: Register %d => '%s'",
 		realfnname, fd, path ? path : "(NULL path)");
 
-	fdpathdb_mutex_lock();
-	{
-		/* NOTE: This is a critical section:
-		 * - Do not return from this block, mutex is locked !!
-		 * - Do not call the logger from this block !!
-		*/
-
-		if (fd_path_db_slots <= fd) {
-			if (fd_path_db) {
-				int slots_after_realloc = fd + 1;
-				int new_slots = slots_after_realloc -
-					fd_path_db_slots;
-
-				/* allocate more slots */
-				fd_path_db = realloc(fd_path_db,
-					slots_after_realloc *
-						sizeof(fd_path_db_entry_t));
-				/* realloc() does not initialize memory;
-				 * clear new slots */
-				memset(fd_path_db + fd_path_db_slots, 0,
-					new_slots * sizeof(fd_path_db_entry_t));
-
-				fd_path_db_slots = slots_after_realloc;
-			} else {
-				/* allocate a new table */
-				fd_path_db_slots = fd + 1;
-				fd_path_db = calloc(fd_path_db_slots,
-					sizeof(fd_path_db_entry_t));
-			}
-		}
-
-		if (fd_path_db[fd].fpdb_path) {
-			/* overwriting an old entry */
-			free(fd_path_db[fd].fpdb_path);
-			fd_path_db[fd].fpdb_path = NULL;
-		}
-
-		fd_path_db[fd].fpdb_path = path ? strdup(path) : NULL;
-	}
-	fdpathdb_mutex_unlock();
+	fdpathdb_set_path(fd, path ? fdpathdb_intern_path(path) : NULL);
 }
 
 static void fdpathdb_register_mapping_result(const char *realfnname,
@@ -295,36 +501,35 @@ extern void openat64_postprocess_pathname(
 	fdpathdb_register_mapping_result(realfnname, ret_fd, res, pathname);
 }
 
-void dup_postprocess_(const char *realfnname, int ret, int fd)
+/* duplicated fds share the path object */
+static void fdpathdb_dup_path(const char *realfnname, int fd, int new_fd)
 {
-	const char	*cp = NULL;
+	fdpathdb_path_t	*fpp = fdpathdb_get_path(fd);
 
+	SB_LOG(SB_LOGLEVEL_NOISE, "%s: Register %d => '%s' (dup of %d)",
+		realfnname, new_fd, fpp ? fpp->fpp_path : "(NULL path)", fd);
+	fdpathdb_set_path(new_fd, fpp);
+}
+
+void dup_postprocess_(const char *realfnname, int ret, int fd)
+{
 	if (ret >= 0) {
-		cp = fdpathdb_find_path(fd);
-		if (cp) cp = strdup(cp);
-		fdpathdb_register_mapped_path(realfnname, ret, cp, cp);
+		fdpathdb_dup_path(realfnname, fd, ret);
 	}
 }
 
 void dup2_postprocess_(const char *realfnname, int ret, int fd, int fd2)
 {
-	const char	*cp = NULL;
-
 	if ((ret >= 0) && (fd != fd2)) {
-		cp = fdpathdb_find_path(fd);
-		if (cp) cp = strdup(cp);
-		fdpathdb_register_mapped_path(realfnname, fd2, cp, cp);
+		fdpathdb_dup_path(realfnname, fd, fd2);
 	}
 }
 
 void dup3_postprocess_(const char *realfnname, int ret, int fd, int fd2, int flags)
 {
-	const char	*cp = NULL;
-
+	(void)flags;
 	if ((ret >= 0) && (fd != fd2)) {
-		cp = fdpathdb_find_path(fd);
-		if (cp) cp = strdup(cp);
-		fdpathdb_register_mapped_path(realfnname, fd2, cp, cp);
+		fdpathdb_dup_path(realfnname, fd, fd2);
 	}
 }
 
@@ -337,9 +542,6 @@ void close_postprocess_(const char *realfnname, int ret, int fd)
 void fcntl_postprocess_(const char *realfnname, int ret,
 	int fd, int cmd, void *arg)
 {
-	const char	*cp = NULL;
-
-	(void)cp;
 	(void)arg;
 
 	switch (cmd) {
@@ -71,6 +71,24 @@
 #   - "no_libsb2_init_check" disables the call to sb2_initialize_global_variables()
 #   - "log_params(sb_log_params)" calls SB_LOG(sb_log_params); this can be
 #     used to log parameters of the call.
+#   - "class(name)" tells what the function does to the file system; the
+#     generated code is specialized for the class (may be anywhere in
+#     the modifier list):
+#       "meta_read": reads metadata (the stat family, access, readlink).
+#         Paths are mapped with sbox_map_path_for_read() / _at_for_read(),
+#         which consult the cache of mapping results (readcache.c).
+#         Only conditional readonly checks (check_and_fail_if_readonly)
+#         are allowed.
+#       "dir_enum": enumerates directories (opendir, scandir, ftw...);
+#         like "meta_read", but no readonly checks at all.
+#       "open_read": opens files, usually for reading. Uses the cache;
+#         check_and_fail_if_readonly() is required, and its extra check
+#         tells if the call opens for writing (then the cache is
+#         invalidated after the call).
+#       "mutating": modifies the file system. Invalidates the cache of
+#         mapping results after the call.
+#       "exec": executes programs. The gate does the mapping (and uses
+#         the exec caches), so "map" modifiers are not allowed.
 # For "GATE" only:
 #   - "pass_va_list" is used for generic varargs processing: It passes a
 #     "va_list" to the gate function.
@@ -82,16 +100,33 @@
 #
 # Command "EXPORT_SYMBOL" can be used to export other symbols than functions
 # (e.g. variables)
+#
+# Each generated wrapper and gate gets a numeric function ID, which is
+# passed to the path mapping functions (rules with "func_name" conditions
+# are compiled to sets of function IDs, see mapping.lua). Option "-F"
+# writes names of the functions to "sb2_fn_names[]", indexed by the ID
+# (only one of the generated files may define the table).
+#
+# The real functions are looked up by a constructor of the generated
+# file, all at once (see sbox_find_next_symbols() in libsb2.c); wrappers
+# which are called before that do the lookup themselves.
+#
+# Option "-S" (implies "-F") adds instrumentation to the generated wrappers
+# and gates: if "sb2_wrapper_stats_enabled" is set at runtime, time spent in
+# path mapping and in the real function is recorded by
+# sb2_wrapper_stats_record() (see wrapperstats.c).
 
 use strict;
 
-our($opt_d, $opt_W, $opt_E, $opt_L, $opt_M);
+our($opt_d, $opt_W, $opt_E, $opt_L, $opt_M, $opt_S, $opt_F);
 use Getopt::Std;
 use File::Basename;
 
 # Process options:
-getopts("dW:E:L:M:");
+getopts("dW:E:L:M:SF");
 my $debug = $opt_d;
+my $generate_wrapper_stats = $opt_S;		# -S
+my $generate_function_names = $opt_F || $opt_S;	# -F
 my $wrappers_c_output_file = $opt_W;		# -W generated_c_filename
 my $export_h_output_file = $opt_E;		# -E generated_h_filename
 my $export_list_for_ld_output_file = $opt_L;	# -L generated_list_for_ld
@@ -115,6 +150,28 @@ my $libsb2_initialized_check_for_all_functions =
 	"\tif (!sb2_global_vars_initialized__)\n".
 	"\t\tsb2_initialize_global_variables();\n";
 
+#============================================
+# Names of the wrapped functions; index to this array is the function ID
+# used in the generated code.
+my @function_names;
+
+# Real functions of the wrappers and gates: [name, pointer variable,
+# preprocessor conditionals]
+my @next_symbols;
+
+# Preprocessor conditionals which are active at the current line of
+# input: one list of lines (#if, #elif, #else) per nesting level
+my @cpp_conditionals;
+
+# Classes for "class(name)"; 1 = the class only reads
+my %known_fn_classes = (
+	'meta_read' => 1,
+	'open_read' => 1,
+	'dir_enum' => 1,
+	'mutating' => 0,
+	'exec' => 0,
+);
+
 #============================================
 
 sub write_output_file {
@@ -422,6 +479,19 @@ sub process_readonly_check_modifier {
 		$num_errors++;
 	}
 
+	my $fn_class = $mods->{'fn_class'};
+	if (defined($fn_class) &&
+	    (($fn_class eq 'dir_enum') ||
+	     (($fn_class eq 'meta_read') && !defined($extra_check)))) {
+		# pure reads don't need the readonly flag
+		printf "ERROR: readonly check in class(%s)\n", $fn_class;
+		$num_errors++;
+	}
+	if (defined($extra_check) && defined($fn_class) &&
+	    ($fn_class eq 'open_read')) {
+		$mods->{'write_intent_check'} = $extra_check;
+	}
+
 	if (defined($extra_check)) {
 		$extra_check = " && ($extra_check)";
 	}
@@ -494,6 +564,13 @@ sub process_wrap_or_gate_modifiers {
 		# name of the function pointer variable
 		'real_fn_pointer_name' => "${fn_name}_next__",
 
+		# see "class(name)"
+		'fn_class' => undef,
+		'map_path_fn' => "sbox_map_path",
+		'map_path_at_fn' => "sbox_map_path_at",
+		'write_intent_check' => undef,
+		'after_call_code' => "",
+
 		# Default value to return if error
 		# (e.g. if path mapping returns an error,
 		# errno will be set and this value will be
@@ -517,10 +594,33 @@ sub process_wrap_or_gate_modifiers {
 		}
 	}
 
+	# the class affects other modifiers, find it first.
 	my $i;
+	for($i=0; $i < $num_modifiers; $i++) {
+		if($modifiers[$i] =~ m/^class\((.*)\)$/) {
+			my $fn_class = $1;
+
+			if(!defined($known_fn_classes{$fn_class})) {
+				printf "ERROR: unknown class '%s' at '%s'\n",
+					$fn_class, $fn_name;
+				$num_errors++;
+				return(undef);
+			}
+			$mods->{'fn_class'} = $fn_class;
+		}
+	}
+	my $fn_class = $mods->{'fn_class'};
+	if(defined($fn_class) && $known_fn_classes{$fn_class}) {
+		# reads: use the cache of mapping results
+		$mods->{'map_path_fn'} = "sbox_map_path_for_read";
+		$mods->{'map_path_at_fn'} = "sbox_map_path_at_for_read";
+	}
+
 	for($i=0; $i < $num_modifiers; $i++) {
 		if($debug) { printf "\Modifier:'%s'\n", $modifiers[$i]; }
-		if($modifiers[$i] =~ m/^map\((.*)\)$/) {
+		if($modifiers[$i] =~ m/^class\((.*)\)$/) {
+			# already done.
+		} elsif($modifiers[$i] =~ m/^map\((.*)\)$/) {
 			my $param_to_be_mapped = $1;
 
 			my $new_name = "mapped__".$param_to_be_mapped;
@@ -533,7 +633,7 @@ sub process_wrap_or_gate_modifiers {
 
 			$mods->{'path_mapping_code'} .=
 				"\tclear_mapping_results_struct(&res_$new_name);\n".
-				"\tsbox_map_path(__func__, ".
+				"\t$mods->{'map_path_fn'}(__func__, $fn->{'fn_id'}, ".
 					"$param_to_be_mapped, ".
 					"$no_symlink_resolve, ".
 					"&res_$new_name);\n".
@@ -579,7 +679,7 @@ sub process_wrap_or_gate_modifiers {
 				"\tmapping_results_t res_$new_name;\n";
 			$mods->{'path_mapping_code'} .=
 				"\tclear_mapping_results_struct(&res_$new_name);\n".
-				"\tsbox_map_path_at(__func__, ".
+				"\t$mods->{'map_path_at_fn'}(__func__, $fn->{'fn_id'}, ".
 					"$fd_param, ".
 					"$param_to_be_mapped, ".
 					"$no_symlink_resolve, ".
@@ -687,6 +787,31 @@ sub process_wrap_or_gate_modifiers {
 		$num_errors++;
 		return(undef);
 	}
+
+	if(defined($fn_class)) {
+		if(($fn_class eq 'exec') &&
+		   (keys(%{$mods->{'mapped_params_by_orig_name'}}) > 0)) {
+			printf "ERROR: class(exec) can't map parameters ".
+				"at '%s'\n", $fn_name;
+			$num_errors++;
+			return(undef);
+		}
+		if($fn_class eq 'open_read') {
+			if(!defined($mods->{'write_intent_check'})) {
+				printf "ERROR: class(open_read) requires ".
+					"check_and_fail_if_readonly at '%s'\n",
+					$fn_name;
+				$num_errors++;
+				return(undef);
+			}
+			$mods->{'after_call_code'} =
+				"\tif (".$mods->{'write_intent_check'}.") ".
+				"sb2_read_cache_invalidate();\n";
+		} elsif($fn_class eq 'mutating') {
+			$mods->{'after_call_code'} =
+				"\tsb2_read_cache_invalidate();\n";
+		}
+	}
 	return($mods);
 }
 
@@ -931,6 +1056,9 @@ sub command_wrap_or_gate {
 
 	my $va_list_get_mode_code = "";
 
+	$fn->{'fn_id'} = @function_names;
+	push(@function_names, $fn_name);
+
 	# Time to handle modifiers.
 	my $mods = process_wrap_or_gate_modifiers($command, $fn, $all_modifiers);
 	if(!defined($mods)) { return; } # return if modifiers failed
@@ -976,8 +1104,13 @@ sub command_wrap_or_gate {
 		$nomap_nolog_fn_c_code .= "\t$fn_return_type ret = $default_return_value;\n";
 	}
 	$wrapper_fn_c_code .=	"\tint saved_errno = errno;\n".
-				"\tint result_errno = saved_errno;\n".
-				"\terrno = 0;\n";
+				"\tint result_errno = saved_errno;\n";
+	my $wrapper_stats_id = undef;
+	if($generate_wrapper_stats) {
+		$wrapper_stats_id = $fn->{'fn_id'};
+		$wrapper_fn_c_code .= "\tuint64_t stats_t0 = 0, stats_t1 = 0, stats_t2 = 0;\n";
+	}
+	$wrapper_fn_c_code .=	"\terrno = 0;\n";
 	$nomap_fn_c_code .=	"\tint saved_errno = errno;\n".
 				"\tint result_errno = saved_errno;\n";
 	$nomap_nolog_fn_c_code .= "\tint result_errno = errno;\n";
@@ -988,6 +1121,10 @@ sub command_wrap_or_gate {
 		$nomap_fn_c_code .=		$libsb2_initialized_check_for_all_functions;
 		$nomap_nolog_fn_c_code .=	$libsb2_initialized_check_for_all_functions;
 	}
+	if(defined $wrapper_stats_id) {
+		$wrapper_fn_c_code .=		"\tif (sb2_wrapper_stats_enabled) ".
+			"stats_t0 = sb2_wrapper_stats_timestamp();\n";
+	}
 	if(defined $mods->{'log_params'}) {
 		$wrapper_fn_c_code .=		"\tSB_LOG(".$mods->{'log_params'}.");\n";
 		$nomap_fn_c_code .=		"\tSB_LOG(".$mods->{'log_params'}.");\n";
@@ -1013,9 +1150,15 @@ sub command_wrap_or_gate {
 		$no_real_fn_abort_code = "/* no abort() */";
 	}
 
+	# The pointer is normally set by resolve_next_symbols() when the
+	# library is loaded; then this is a single, predictable branch.
+	push(@next_symbols, [$fn_name, $real_fn_pointer_name,
+		[map { [@$_] } @cpp_conditionals]]);
 	my $check_fn_pointer_log_enabled .=
-		"\tif($real_fn_pointer_name == NULL) {\n".
-		"\t\t$real_fn_pointer_name = sbox_find_next_symbol(1, ".
+		"\tif(__builtin_expect($real_fn_pointer_name == NULL, 0)) {\n".
+		"\t\tresolve_next_symbols();\n".
+		"\t\tif ($real_fn_pointer_name == NULL)\n".
+		"\t\t\t$real_fn_pointer_name = sbox_find_next_symbol(1, ".
 			"\"$fn_name\");\n".
 		"\t\tif ($real_fn_pointer_name == NULL) {\n".
 		"\t\t\tSB_LOG($loglevel_no_real_fn, \"Real '%s'".
@@ -1024,8 +1167,10 @@ sub command_wrap_or_gate {
 		"\t\t}\n".
 		"\t}\n";
 	my $check_fn_pointer_log_disabled .=
-		"\tif($real_fn_pointer_name == NULL) {\n".
-		"\t\t$real_fn_pointer_name = sbox_find_next_symbol(0, ".
+		"\tif(__builtin_expect($real_fn_pointer_name == NULL, 0)) {\n".
+		"\t\tresolve_next_symbols();\n".
+		"\t\tif ($real_fn_pointer_name == NULL)\n".
+		"\t\t\t$real_fn_pointer_name = sbox_find_next_symbol(0, ".
 			"\"$fn_name\");\n".
 		"\t\tif ($real_fn_pointer_name == NULL) {\n".
 		"\t\t\t$no_real_fn_abort_code\n".
@@ -1124,10 +1269,23 @@ sub command_wrap_or_gate {
 
 	# Next, insert the call to the real function
 	# (the call will also copy errno to result_errno)
+	if(defined $wrapper_stats_id) {
+		$wrapper_fn_c_code .=	"\tif (sb2_wrapper_stats_enabled) ".
+			"stats_t1 = sb2_wrapper_stats_timestamp();\n";
+	}
 	$wrapper_fn_c_code .=		$call_line_prefix.$mapped_call;
+	if(defined $wrapper_stats_id) {
+		$wrapper_fn_c_code .=	"\tif (sb2_wrapper_stats_enabled) ".
+			"stats_t2 = sb2_wrapper_stats_timestamp();\n";
+	}
 	$nomap_fn_c_code .=		$call_line_prefix.$unmapped_call;
 	$nomap_nolog_fn_c_code .=	$call_line_prefix.$unmapped_nolog_call;
 
+	# class-specific code (e.g. invalidate cached mapping results).
+	# Not in the "_nomap" versions: libsb2 uses those for its own
+	# files (logs etc), which don't affect path mapping.
+	$wrapper_fn_c_code .=		$mods->{'after_call_code'};
+
 	# calls to postprocessors (if any) before the cleanup 
 	if (defined $postprocesors) {
 		$wrapper_fn_c_code .=	"\t".$postprocesors."\n";
@@ -1136,6 +1294,11 @@ sub command_wrap_or_gate {
 	# cleanup; free allocated variables etc.
 	$wrapper_fn_c_code .=		$mods->{'va_list_end_code'};
 	$wrapper_fn_c_code .=		$mods->{'free_path_mapping_vars_code'};
+	if(defined $wrapper_stats_id) {
+		$wrapper_fn_c_code .=	"\tif (sb2_wrapper_stats_enabled) ".
+			"sb2_wrapper_stats_record($wrapper_stats_id, ".
+			"stats_t0, stats_t1, stats_t2);\n";
+	}
 	$nomap_fn_c_code .=		$mods->{'va_list_end_code'};
 	$nomap_nolog_fn_c_code .=	$mods->{'va_list_end_code'};
 
@@ -1238,6 +1401,15 @@ while ($line = <STDIN>) {
 
 		# Add the line to the output H file
 		$export_h_buffer .= "$src_comment\n";
+
+		if ($line =~ m/^\s*#\s*if/) {
+			push(@cpp_conditionals, [$src_comment]);
+		} elsif (($line =~ m/^\s*#\s*(elif|else)/) &&
+			 @cpp_conditionals) {
+			push(@{$cpp_conditionals[-1]}, $src_comment);
+		} elsif ($line =~ m/^\s*#\s*endif/) {
+			pop(@cpp_conditionals);
+		}
 	}
 
 	# replace multiple whitespaces by single spaces:
@@ -1283,11 +1455,63 @@ if($num_errors) {
 
 # No errors - write output files.
 
+# An entry of the table of real functions, inside the same preprocessor
+# conditionals as the wrapper.
+sub next_symbol_table_entry {
+	my $ns = shift;
+	my ($fn_name, $pointer_name, $conditionals) = @$ns;
+	my $entry = "\t{ \"$fn_name\", (void **)&$pointer_name },\n";
+
+	foreach my $level (reverse(@$conditionals)) {
+		$entry = join("", map { chomp; "$_\n" } @$level).
+			$entry."#endif\n";
+	}
+	return($entry);
+}
+
 my $file_header_comment = "/* Automatically generated file. Do not edit. */\n";
 
 if(defined $wrappers_c_output_file) {
 	my $include_h_file = "";
-	
+	my $function_names_table = "";
+	my $next_symbols_prototype = "";
+	my $next_symbols_table = "";
+
+	if(@next_symbols) {
+		$next_symbols_prototype =
+			"static void resolve_next_symbols(void);\n";
+		$next_symbols_table =
+			"/* Real functions, resolved in one pass when the ".
+			"library is loaded */\n".
+			"static const struct sb2_next_symbol next_symbols[] = {\n".
+			join("", map { next_symbol_table_entry($_) }
+				@next_symbols).
+			"};\n".
+			"static volatile int next_symbols_state = 0;\n\n".
+			"static void resolve_next_symbols(void)\n".
+			"{\n".
+			"\tsbox_find_next_symbols(next_symbols,\n".
+			"\t\tsizeof(next_symbols) / sizeof(next_symbols[0]),\n".
+			"\t\t&next_symbols_state);\n".
+			"}\n\n".
+			"static void resolve_next_symbols_at_load(void) ".
+				"__attribute__((constructor));\n".
+			"static void resolve_next_symbols_at_load(void)\n".
+			"{\n".
+			"\tresolve_next_symbols();\n".
+			"}\n";
+	}
+
+	if($generate_function_names) {
+		$function_names_table =
+			"/* Names of wrapped functions, by ID */\n".
+			"const char *const sb2_fn_names[] = {\n\t\"".
+			join("\",\n\t\"", @function_names).
+			"\"\n};\n".
+			"const int sb2_num_fns = ".
+			scalar(@function_names).";\n";
+	}
+
 	if(defined $export_h_output_file) {
 		my $bn = basename($export_h_output_file);
 		$include_h_file = '#include "'.$bn.'"'."\n";
@@ -1296,7 +1520,10 @@ if(defined $wrappers_c_output_file) {
 		$file_header_comment.
 		'#include "libsb2.h"'."\n".
 		$include_h_file.
-		$wrappers_c_buffer);
+		$next_symbols_prototype.
+		$wrappers_c_buffer.
+		$function_names_table.
+		$next_symbols_table);
 }
 if(defined $export_h_output_file) {
 	write_output_file($export_h_output_file,
@@ -129,6 +129,44 @@ void *sbox_find_next_symbol(int log_enabled, const char *fn_name)
 	return(fn_ptr);
 }
 
+/* Resolve all real functions of a file of generated wrappers. This is
+ * called from a constructor, and by the wrappers if they find their
+ * pointer unset (the constructor may not be the first code that runs).
+ * "*statep" is 0 = not done, 1 = in progress, 2 = done; a wrapper
+ * that comes here while another thread is busy resolves its own
+ * function with sbox_find_next_symbol(). Functions which don't exist
+ * are left to the wrappers, which report them when they are called.
+ *
+ * Doesn't log and doesn't use getenv(), this may be the very first
+ * thing that runs. "SBOX_LAZY_NEXT_SYMBOLS" leaves all lookups to the
+ * wrappers (see "sb2-show startup-bench").
+*/
+void sbox_find_next_symbols(const struct sb2_next_symbol *tbl,
+	int num_symbols, volatile int *statep)
+{
+	static const char lazy_var[] = "SBOX_LAZY_NEXT_SYMBOLS=";
+	char	**ep;
+	int	i;
+
+	if (*statep != 0) return;
+	if (!__sync_bool_compare_and_swap(statep, 0, 1)) return;
+
+	for (ep = environ; ep && *ep; ep++) {
+		if (!strncmp(*ep, lazy_var, sizeof(lazy_var) - 1)) {
+			*statep = 2;
+			return;
+		}
+	}
+	for (i = 0; i < num_symbols; i++) {
+		void	*fn_ptr = dlsym(RTLD_NEXT, tbl[i].ns_name);
+
+		if (fn_ptr) *tbl[i].ns_ptr = fn_ptr;
+	}
+	dlerror();	/* clear errors of missing functions */
+	__sync_synchronize();
+	*statep = 2;
+}
+
 /* ----- EXPORTED from interface.master: ----- */
 char *sb2show__map_path2__(const char *binary_name, const char *mapping_mode, 
         const char *fn_name, const char *pathname, int *readonly)
@@ -317,6 +355,14 @@ void sb2_initialize_global_variables(void)
 			sblog_init();
 			SB_LOG(SB_LOGLEVEL_DEBUG, "global vars initialized from env");
 
+			if (getenv("SBOX_WRAPPER_STATS"))
+				sb2_wrapper_stats_init();
+			cp = getenv("SBOX_PROFILE_FD");
+			if (cp)
+				sb2_profile_init(cp);
+			if (getenv("SBOX_MAPD_SOCKET"))
+				sb2_mapd_client_init();
+
 			/* check if the user wants us to SIGTRAP
 			 * during libsb2 initialization.
 			 *
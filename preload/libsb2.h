@@ -36,6 +36,7 @@
 #include <assert.h>
 
 #include <unistd.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <dlfcn.h>
 #include <stdio.h>
@@ -99,6 +100,15 @@
 
 extern void *sbox_find_next_symbol(int log_enabled, const char *functname);
 
+/* Real functions of the generated wrappers, resolved in one pass by
+ * sbox_find_next_symbols() (the table is generated by gen-interface.pl) */
+struct sb2_next_symbol {
+	const char	*ns_name;
+	void		**ns_ptr;
+};
+extern void sbox_find_next_symbols(const struct sb2_next_symbol *tbl,
+	int num_symbols, volatile int *statep);
+
 extern int fopen_mode_w_perm(const char *mode);
 extern int freopen_errno(FILE *stream);
 
@@ -110,7 +120,58 @@ extern int do_glob64 (const char *pattern, int flags,
 #endif
 
 extern int sb_execvep(const char *file, char *const argv[], char *const envp[]);
+extern int sb_prepare_exec_request(const char *exec_fn_name,
+	const char *orig_file, char *const *orig_argv, char *const *orig_envp,
+	char **new_file, char ***new_argv, char ***new_envp);
 extern char *strvec_to_string(char *const *argv);
 
+/* Names of the wrapped functions, indexed by function ID;
+ * generated by gen-interface.pl -F (for interface.master) */
+extern const char *const sb2_fn_names[];
+extern const int sb2_num_fns;
+
+/* wrapperstats.c; instrumentation is generated by gen-interface.pl -S */
+extern int sb2_wrapper_stats_enabled;
+extern void sb2_wrapper_stats_init(void);
+extern uint64_t sb2_wrapper_stats_timestamp(void);
+extern void sb2_wrapper_stats_record(int fn_id, uint64_t t0, uint64_t t1,
+	uint64_t t2);
+extern void sb2_wrapper_stats_flush(void);
+
+/* profiler.c */
+extern void sb2_profile_init(const char *channel);
+extern void sb2_profile_count_mapping(void);
+extern void sb2_profile_image_done(int is_exec);
+extern void sb2_profile_set_exit_status(int status);
+extern void sb2_profile_child_status(pid_t child, int status);
+
+/* rootindex.c */
+struct sb2_rootindex_result {
+	mode_t		rir_mode;
+	uint64_t	rir_size;
+	const char	*rir_link_dest;	/* NULL if not a symlink */
+};
+#define SB2_ROOTINDEX_UNKNOWN	0
+#define SB2_ROOTINDEX_FOUND	1
+#define SB2_ROOTINDEX_MISSING	2
+extern int sb2_rootindex_lookup(const char *host_path,
+	struct sb2_rootindex_result *res);
+
+/* watchgen.c */
+struct sb2_watchgen_stamp {
+	int		ws_watched;
+	int		ws_num_buckets;
+	uint32_t	*ws_buckets;	/* buckets of the ancestors */
+	uint64_t	ws_generation;
+	uint64_t	ws_sum;
+};
+extern int sb2_watchgen_active(void);
+extern uint64_t sb2_watchgen_events(void);
+extern int sb2_watchgen_path_is_watched(const char *host_path);
+extern int sb2_watchgen_stamp_set(struct sb2_watchgen_stamp *ws,
+	const char *host_path, uint64_t events_before);
+extern int sb2_watchgen_stamp_is_valid(const struct sb2_watchgen_stamp *ws);
+extern void sb2_watchgen_stamp_free(struct sb2_watchgen_stamp *ws);
+
 #endif /* ifndef LIBSB2_H_INCLUDED_ */
 
@@ -0,0 +1,927 @@
+/*
+ * mapd.c -- the mapping daemon ("sb2-mapd") and its client
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * Every process which runs under sb2 creates its own Lua state and loads
+ * the rules before it can map the first path. For shell-script-heavy
+ * builds (e.g. "configure") most processes are short-lived, and this
+ * fixed cost dominates.
+ *
+ * When the session has been started with "sb2 -z", the mapping daemon
+ * keeps a pre-initialized copy of libsb2 and Lua (the rules and the exec
+ * code have been loaded). It listens to a Unix domain socket in the
+ * session directory ($SBOX_MAPD_SOCKET); for every connection it fork()s
+ * a child, which inherits the warm state, takes the identity of the
+ * client (binary name, exec policy, cwd, etc) and serves requests until
+ * the client closes the connection.
+ *
+ * A process which hasn't created a Lua state sends absolute paths,
+ * reverse mapping requests and exec requests to the daemon. As soon as
+ * it needs something that the daemon can't do (e.g. relative paths) it
+ * creates the Lua state as before, and won't use the daemon after that.
+ * Any problem with the daemon also makes the process fall back to local
+ * processing. A process which keeps running long enough to send
+ * SB2_MAPD_REQUEST_BUDGET requests does the same: for it, the cost of
+ * the Lua state is smaller than the cost of the round trips.
+ *
+ * A child created by vfork() (or posix_spawn(), which may use vfork)
+ * runs in the memory of its parent, and no atfork handlers are run.
+ * The connection belongs to the parent, so the child maps everything
+ * locally; it must not modify the parent's connection state.
+ *
+ * Messages are a header followed by a sequence of NUL-terminated strings.
+ * Optional strings are prefixed with '=' (present) or '-' (NULL),
+ * string vectors start with the element count ("-" for a NULL vector).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libsb2.h"
+#include "exported.h"
+
+#define SB2_MAPD_MSG_HELLO	1
+#define SB2_MAPD_MSG_MAP	2
+#define SB2_MAPD_MSG_EXEC	3
+#define SB2_MAPD_MSG_REVERSE	4
+
+#define SB2_MAPD_MAX_MSG_LEN	(16*1024*1024)
+
+/* after this many requests the client creates its own Lua state */
+#define SB2_MAPD_REQUEST_BUDGET	500
+
+typedef struct sb2_mapd_msg_hdr_s {
+	uint32_t	mh_type;
+	uint32_t	mh_len;		/* length of the data after the header */
+	int32_t		mh_status;	/* request flags / return value */
+	int32_t		mh_errno;
+} sb2_mapd_msg_hdr_t;
+
+typedef struct sb2_mapd_buf_s {
+	char	*mb_data;
+	size_t	mb_len;
+	size_t	mb_size;
+	size_t	mb_pos;		/* read position */
+} sb2_mapd_buf_t;
+
+/* ---------- message buffers ---------- */
+
+static void mapd_buf_free(sb2_mapd_buf_t *mb)
+{
+	if (mb->mb_data) free(mb->mb_data);
+	memset(mb, 0, sizeof(*mb));
+}
+
+static void mapd_put_bytes(sb2_mapd_buf_t *mb, const char *data, size_t len)
+{
+	if (mb->mb_len + len > mb->mb_size) {
+		size_t	new_size = (mb->mb_size ? mb->mb_size * 2 : 1024);
+
+		while (new_size < mb->mb_len + len) new_size *= 2;
+		mb->mb_data = realloc(mb->mb_data, new_size);
+		if (!mb->mb_data) abort();
+		mb->mb_size = new_size;
+	}
+	memcpy(mb->mb_data + mb->mb_len, data, len);
+	mb->mb_len += len;
+}
+
+static void mapd_put_str(sb2_mapd_buf_t *mb, const char *str)
+{
+	mapd_put_bytes(mb, str, strlen(str) + 1);
+}
+
+static void mapd_put_optstr(sb2_mapd_buf_t *mb, const char *str)
+{
+	mapd_put_bytes(mb, (str ? "=" : "-"), 1);
+	if (str) mapd_put_str(mb, str);
+	else mapd_put_bytes(mb, "", 1);
+}
+
+static void mapd_put_strvec(sb2_mapd_buf_t *mb, char *const *vec)
+{
+	char	countbuf[32];
+	int	n = 0;
+
+	if (!vec) {
+		mapd_put_str(mb, "-");
+		return;
+	}
+	while (vec[n]) n++;
+	snprintf(countbuf, sizeof(countbuf), "%d", n);
+	mapd_put_str(mb, countbuf);
+	for (n = 0; vec[n]; n++) mapd_put_str(mb, vec[n]);
+}
+
+/* Returns a pointer to the next string in the buffer, or NULL */
+static const char *mapd_get_str(sb2_mapd_buf_t *mb)
+{
+	const char	*str;
+	char		*end;
+
+	if (mb->mb_pos >= mb->mb_len) return(NULL);
+	str = mb->mb_data + mb->mb_pos;
+	end = memchr(str, '\0', mb->mb_len - mb->mb_pos);
+	if (!end) return(NULL);
+	mb->mb_pos += (end - str) + 1;
+	return(str);
+}
+
+/* Returns 0 if ok, -1 if the buffer was malformed */
+static int mapd_get_optstr(sb2_mapd_buf_t *mb, const char **strp)
+{
+	const char	*str = mapd_get_str(mb);
+
+	if (!str) return(-1);
+	*strp = (*str == '=' ? str + 1 : NULL);
+	return(0);
+}
+
+/* Returns an allocated vector (or NULL in *vecp), 0 if ok */
+static int mapd_get_strvec(sb2_mapd_buf_t *mb, char ***vecp)
+{
+	const char	*countstr = mapd_get_str(mb);
+	char		**vec;
+	int		n;
+	int		i;
+
+	*vecp = NULL;
+	if (!countstr) return(-1);
+	if (!strcmp(countstr, "-")) return(0);
+	n = atoi(countstr);
+	if ((n < 0) || ((size_t)n > mb->mb_len)) return(-1);
+
+	vec = calloc(n + 1, sizeof(char *));
+	if (!vec) abort();
+	for (i = 0; i < n; i++) {
+		const char *str = mapd_get_str(mb);
+
+		if (!str) {
+			while (i > 0) free(vec[--i]);
+			free(vec);
+			return(-1);
+		}
+		vec[i] = strdup(str);
+	}
+	*vecp = vec;
+	return(0);
+}
+
+static void mapd_free_strvec(char **vec)
+{
+	char	**p;
+
+	if (!vec) return;
+	for (p = vec; *p; p++) free(*p);
+	free(vec);
+}
+
+/* ---------- socket I/O ---------- */
+
+static int mapd_write_all(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t	n = send(fd, data, len, MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return(-1);
+		}
+		data += n;
+		len -= n;
+	}
+	return(0);
+}
+
+static int mapd_read_all(int fd, char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t	n = recv(fd, data, len, 0);
+
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return(-1);
+		}
+		if (n == 0) return(-1); /* EOF */
+		data += n;
+		len -= n;
+	}
+	return(0);
+}
+
+static int mapd_send_msg(int fd, sb2_mapd_msg_hdr_t *hdr,
+	const sb2_mapd_buf_t *mb)
+{
+	hdr->mh_len = mb->mb_len;
+	if (mapd_write_all(fd, (const char *)hdr, sizeof(*hdr)) < 0)
+		return(-1);
+	if (mb->mb_len && (mapd_write_all(fd, mb->mb_data, mb->mb_len) < 0))
+		return(-1);
+	return(0);
+}
+
+/* Reads a message; the data is placed to "mb" (which must be empty) */
+static int mapd_recv_msg(int fd, sb2_mapd_msg_hdr_t *hdr, sb2_mapd_buf_t *mb)
+{
+	if (mapd_read_all(fd, (char *)hdr, sizeof(*hdr)) < 0) return(-1);
+	if (hdr->mh_len > SB2_MAPD_MAX_MSG_LEN) return(-1);
+	if (hdr->mh_len) {
+		mb->mb_data = malloc(hdr->mh_len);
+		if (!mb->mb_data) abort();
+		mb->mb_size = hdr->mh_len;
+		if (mapd_read_all(fd, mb->mb_data, hdr->mh_len) < 0)
+			return(-1);
+		mb->mb_len = hdr->mh_len;
+	}
+	return(0);
+}
+
+/* ---------- client side ---------- */
+
+/* set in the daemon and in its children; they must never be clients */
+static int mapd_server_mode = 0;
+
+/* the process which owns this memory; a vfork() child has
+ * a different pid */
+static pid_t mapd_client_pid = 0;
+
+static int mapd_fd = -1;
+static pid_t mapd_fd_owner_pid = 0;
+static dev_t mapd_fd_dev;
+static ino_t mapd_fd_ino;
+static int mapd_unavailable = 0;
+static int mapd_requests_done = 0;
+
+static pthread_mutex_t	mapd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void mapd_mutex_lock(void)
+{
+	static int	pthread_checked = 0;
+
+	/* usually nothing has created a Lua state (which does the
+	 * detection) in a client */
+	if (!pthread_checked) {
+		sb2_check_pthread_library();
+		pthread_checked = 1;
+	}
+	if (pthread_library_is_available)
+		(*pthread_mutex_lock_fnptr)(&mapd_mutex);
+}
+
+static void mapd_mutex_unlock(void)
+{
+	if (pthread_library_is_available)
+		(*pthread_mutex_unlock_fnptr)(&mapd_mutex);
+}
+
+/* The daemon is used only by processes which don't have a Lua state */
+static int mapd_should_be_used(void)
+{
+	if (mapd_server_mode || mapd_unavailable) return(0);
+	if (sb2_lua_instances_allocated) return(0);
+	if (getpid() != mapd_client_pid) return(0); /* vfork() child */
+	return(1);
+}
+
+/* check that the application hasn't closed our socket (or replaced
+ * it with something else) */
+static int mapd_fd_is_valid(void)
+{
+	struct stat	st;
+
+	if (mapd_fd < 0) return(0);
+	if (mapd_fd_owner_pid != getpid()) return(0);
+	if (fstat(mapd_fd, &st) < 0) return(0);
+	return(S_ISSOCK(st.st_mode) &&
+		(st.st_dev == mapd_fd_dev) && (st.st_ino == mapd_fd_ino));
+}
+
+/* Also used after fork(): the child closes its copy of the
+ * parent's connection, which does not disturb the parent. */
+static void mapd_disconnect(void)
+{
+	struct stat	st;
+
+	/* don't close it if the application has reused the fd */
+	if ((mapd_fd >= 0) && (fstat(mapd_fd, &st) == 0) &&
+	    (st.st_dev == mapd_fd_dev) && (st.st_ino == mapd_fd_ino))
+		close_nomap_nolog(mapd_fd);
+	mapd_fd = -1;
+}
+
+/* path classes from the HELLO reply */
+static char **mapd_path_class_specs = NULL;
+
+/* fork() child: another thread of the parent may have been inside
+ * mapd_request(). The child has only one thread, so it can just
+ * reinitialize the mutex and drop its copy of the connection. */
+static void mapd_atfork_child(void)
+{
+	static const pthread_mutex_t	unlocked = PTHREAD_MUTEX_INITIALIZER;
+
+	memcpy(&mapd_mutex, &unlocked, sizeof(mapd_mutex));
+	mapd_disconnect();
+	mapd_client_pid = getpid();
+	mapd_requests_done = 0;
+}
+
+/* Called when the global variables are initialized, if
+ * SBOX_MAPD_SOCKET is set. Until this has been called, the
+ * daemon is not used. */
+void sb2_mapd_client_init(void)
+{
+	mapd_client_pid = getpid();
+	pthread_atfork(NULL, NULL, mapd_atfork_child);
+}
+
+/* Connect and send the HELLO message. Called with the mutex locked,
+ * must not log. Returns 0 if ok. */
+static int mapd_connect(void)
+{
+	const char		*socket_path = getenv("SBOX_MAPD_SOCKET");
+	struct sockaddr_un	addr;
+	struct stat		st;
+	sb2_mapd_msg_hdr_t	hdr;
+	sb2_mapd_buf_t		mb;
+	char			cwd[PATH_MAX + 1];
+	int			fd;
+
+	if (!socket_path || !*socket_path ||
+	    (strlen(socket_path) >= sizeof(addr.sun_path)))
+		return(-1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return(-1);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if ((connect_nomap_nolog(fd, (struct sockaddr *)&addr,
+		sizeof(addr)) < 0) ||
+	    (fstat(fd, &st) < 0)) {
+		close_nomap_nolog(fd);
+		return(-1);
+	}
+	mapd_fd = fd;
+	mapd_fd_owner_pid = getpid();
+	mapd_fd_dev = st.st_dev;
+	mapd_fd_ino = st.st_ino;
+
+	/* tell who we are. The daemon refuses if the mapping mode or
+	 * the interface version does not match. */
+	memset(&mb, 0, sizeof(mb));
+	mapd_put_str(&mb, SB2_LUA_C_INTERFACE_VERSION);
+	mapd_put_optstr(&mb, sbox_session_mode);
+	mapd_put_optstr(&mb, sbox_session_perm);
+	mapd_put_optstr(&mb, sbox_binary_name);
+	mapd_put_optstr(&mb, sbox_exec_name);
+	mapd_put_optstr(&mb, sbox_real_binary_name);
+	mapd_put_optstr(&mb, sbox_orig_binary_name);
+	mapd_put_optstr(&mb, sbox_active_exec_policy_name);
+	mapd_put_optstr(&mb, getcwd_nomap_nolog(cwd, sizeof(cwd)));
+	mapd_put_optstr(&mb, getenv("SBOX_REDIRECT_IGNORE"));
+	mapd_put_optstr(&mb, getenv("SBOX_REDIRECT_FORCE"));
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.mh_type = SB2_MAPD_MSG_HELLO;
+	if (mapd_send_msg(fd, &hdr, &mb) < 0) goto failed;
+	mapd_buf_free(&mb);
+	if (mapd_recv_msg(fd, &hdr, &mb) < 0) goto failed;
+	if (hdr.mh_status != 0) goto failed;
+	/* the reply contains the path classes (see luaif/pathclass.c) */
+	{
+		char	**specs = NULL;
+
+		if ((mapd_get_strvec(&mb, &specs) == 0) && specs) {
+			/* installed by mapd_request(), it may log */
+			mapd_free_strvec(mapd_path_class_specs);
+			mapd_path_class_specs = specs;
+		}
+	}
+	mapd_buf_free(&mb);
+	return(0);
+
+    failed:
+	mapd_buf_free(&mb);
+	mapd_disconnect();
+	return(-1);
+}
+
+/* Send a request and receive the reply. Called with the mutex locked,
+ * must not log. "mb" is replaced by the reply. */
+static int mapd_transaction(sb2_mapd_msg_hdr_t *hdr, sb2_mapd_buf_t *mb)
+{
+	if (!mapd_fd_is_valid()) {
+		mapd_disconnect();
+		if (mapd_connect() < 0) return(-1);
+	}
+	if (mapd_send_msg(mapd_fd, hdr, mb) < 0) goto failed;
+	mapd_buf_free(mb);
+	if (mapd_recv_msg(mapd_fd, hdr, mb) < 0) goto failed;
+	return(0);
+
+    failed:
+	mapd_disconnect();
+	return(-1);
+}
+
+static int mapd_request(sb2_mapd_msg_hdr_t *hdr, sb2_mapd_buf_t *mb)
+{
+	int	r;
+	int	budget_used = 0;
+	char	**specs;
+
+	mapd_mutex_lock();
+	r = mapd_transaction(hdr, mb);
+	if (r < 0) {
+		mapd_unavailable = 1;
+	} else if (++mapd_requests_done >= SB2_MAPD_REQUEST_BUDGET) {
+		/* this one was the last; the daemon's child
+		 * exits when the connection is closed */
+		mapd_unavailable = 1;
+		mapd_disconnect();
+		budget_used = 1;
+	}
+	specs = mapd_path_class_specs;
+	mapd_path_class_specs = NULL;
+	mapd_mutex_unlock();
+
+	if (specs) {
+		sb2_path_class_install(specs, 0);
+		mapd_free_strvec(specs);
+	}
+
+	if ((r < 0) && getenv("SBOX_MAPD_SOCKET")) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"mapd: daemon not available, using local Lua");
+	} else if (budget_used) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"mapd: %d requests done, switching to local Lua",
+			SB2_MAPD_REQUEST_BUDGET);
+	}
+	return(r);
+}
+
+/* Paths in /proc depend on the identity of the process (/proc/self,
+ * /proc/<pid>/exe, ...); those must be mapped by the process itself. */
+static int mapd_path_is_usable(const char *path)
+{
+	if (!path || (*path != '/')) return(0);
+	if (!strncmp(path, "/proc", 5) &&
+	    ((path[5] == '/') || (path[5] == '\0'))) return(0);
+	return(1);
+}
+
+/* Map an absolute path using the daemon.
+ * Returns 0 if "res" was filled, -1 if the caller must map it locally.
+*/
+int sb2_mapd_map_path(
+	const char *func_name,
+	int fn_id,
+	const char *virtual_path,
+	int dont_resolve_final_symlink,
+	mapping_results_t *res)
+{
+	sb2_mapd_msg_hdr_t	hdr;
+	sb2_mapd_buf_t		mb;
+	const char		*ro;
+	const char		*result;
+	char			fn_id_buf[32];
+	int			saved_errno = errno;
+
+	if (!mapd_should_be_used() || !mapd_path_is_usable(virtual_path) ||
+	    getenv("SBOX_DISABLE_MAPPING")) return(-1);
+
+	memset(&mb, 0, sizeof(mb));
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.mh_type = SB2_MAPD_MSG_MAP;
+	hdr.mh_status = dont_resolve_final_symlink;
+	mapd_put_str(&mb, func_name);
+	snprintf(fn_id_buf, sizeof(fn_id_buf), "%d", fn_id);
+	mapd_put_str(&mb, fn_id_buf);
+	mapd_put_str(&mb, virtual_path);
+
+	if ((mapd_request(&hdr, &mb) < 0) || (hdr.mh_status != 0) ||
+	    !(ro = mapd_get_str(&mb)) ||
+	    (mapd_get_optstr(&mb, &result) < 0)) {
+		mapd_buf_free(&mb);
+		errno = saved_errno;
+		return(-1);
+	}
+
+	/* flags: readonly, fs_dependent */
+	res->mres_readonly = (ro[0] == '1');
+	res->mres_fs_dependent = (ro[0] && (ro[1] == '1'));
+	res->mres_errno = hdr.mh_errno;
+	res->mres_result_buf = res->mres_result_path =
+		(result ? strdup(result) : NULL);
+	SB_LOG(SB_LOGLEVEL_DEBUG, "mapd: %s(%s) => '%s'",
+		func_name, virtual_path, (result ? result : "<No result>"));
+	mapd_buf_free(&mb);
+	errno = saved_errno;
+	return(0);
+}
+
+/* Reverse mapping of an absolute host path using the daemon.
+ * Returns 0 if *resultp was set (to an allocated string or NULL),
+ * -1 if the caller must do it locally.
+*/
+int sb2_mapd_reverse_path(
+	const char *func_name,
+	const char *abs_host_path,
+	char **resultp)
+{
+	sb2_mapd_msg_hdr_t	hdr;
+	sb2_mapd_buf_t		mb;
+	const char		*result;
+	int			saved_errno = errno;
+
+	if (!mapd_should_be_used() || !mapd_path_is_usable(abs_host_path))
+		return(-1);
+
+	memset(&mb, 0, sizeof(mb));
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.mh_type = SB2_MAPD_MSG_REVERSE;
+	mapd_put_str(&mb, func_name);
+	mapd_put_str(&mb, abs_host_path);
+
+	if ((mapd_request(&hdr, &mb) < 0) || (hdr.mh_status != 0) ||
+	    (mapd_get_optstr(&mb, &result) < 0)) {
+		mapd_buf_free(&mb);
+		errno = saved_errno;
+		return(-1);
+	}
+
+	*resultp = (result ? strdup(result) : NULL);
+	SB_LOG(SB_LOGLEVEL_DEBUG, "mapd: reverse %s(%s) => '%s'",
+		func_name, abs_host_path, (result ? result : "<No result>"));
+	mapd_buf_free(&mb);
+	errno = saved_errno;
+	return(0);
+}
+
+/* Exec preprocessing (see do_exec()) using the daemon.
+ * Returns 0 if the results were filled (*resultp is the return
+ * value of prepare_exec(), errno has been set),
+ * or -1 if the caller must do it locally.
+*/
+int sb2_mapd_prepare_exec(
+	const char *exec_fn_name,
+	const char *orig_file,
+	char *const *orig_argv,
+	char *const *orig_envp,
+	int *resultp,
+	char **new_file,
+	char ***new_argv,
+	char ***new_envp)
+{
+	sb2_mapd_msg_hdr_t	hdr;
+	sb2_mapd_buf_t		mb;
+	const char		*file;
+	char			**argv = NULL;
+	char			**envp = NULL;
+	char			cwd[PATH_MAX + 1];
+
+	if (!mapd_should_be_used() || !mapd_path_is_usable(orig_file))
+		return(-1);
+
+	memset(&mb, 0, sizeof(mb));
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.mh_type = SB2_MAPD_MSG_EXEC;
+	/* the exec code may look at the current directory, and it may
+	 * have been changed after HELLO */
+	mapd_put_optstr(&mb, getcwd_nomap_nolog(cwd, sizeof(cwd)));
+	mapd_put_str(&mb, exec_fn_name);
+	mapd_put_str(&mb, orig_file);
+	mapd_put_strvec(&mb, orig_argv);
+	mapd_put_strvec(&mb, orig_envp);
+
+	if ((mapd_request(&hdr, &mb) < 0) ||
+	    (mapd_get_optstr(&mb, &file) < 0) ||
+	    (mapd_get_strvec(&mb, &argv) < 0) ||
+	    (mapd_get_strvec(&mb, &envp) < 0)) {
+		mapd_free_strvec(argv);
+		mapd_buf_free(&mb);
+		return(-1);
+	}
+
+	*new_file = (file ? strdup(file) : NULL);
+	*new_argv = argv;
+	*new_envp = envp;
+	SB_LOG(SB_LOGLEVEL_DEBUG, "mapd: exec %s => %d, '%s'",
+		orig_file, hdr.mh_status, (file ? file : orig_file));
+	mapd_buf_free(&mb);
+	*resultp = hdr.mh_status;
+	errno = hdr.mh_errno;
+	return(0);
+}
+
+/* ---------- server side ---------- */
+
+static void mapd_set_global(char **varp, const char *value)
+{
+	*varp = (value ? strdup(value) : NULL);
+}
+
+static void mapd_set_env(const char *name, const char *value)
+{
+	if (value) setenv(name, value, 1);
+	else unsetenv(name);
+}
+
+/* Take the identity of the client. Returns 0 if ok; then the reply
+ * contains the path classes for the client's binary. */
+static int mapd_handle_hello(sb2_mapd_buf_t *mb, sb2_mapd_buf_t *reply)
+{
+	struct lua_instance *luaif;
+	char		**specs;
+	const char	*version = mapd_get_str(mb);
+	const char	*mode, *perm, *binary_name, *exec_name;
+	const char	*real_binary_name, *orig_binary_name, *policy;
+	const char	*cwd, *redirect_ignore, *redirect_force;
+
+	if (!version || strcmp(version, SB2_LUA_C_INTERFACE_VERSION) ||
+	    (mapd_get_optstr(mb, &mode) < 0) ||
+	    (mapd_get_optstr(mb, &perm) < 0) ||
+	    (mapd_get_optstr(mb, &binary_name) < 0) ||
+	    (mapd_get_optstr(mb, &exec_name) < 0) ||
+	    (mapd_get_optstr(mb, &real_binary_name) < 0) ||
+	    (mapd_get_optstr(mb, &orig_binary_name) < 0) ||
+	    (mapd_get_optstr(mb, &policy) < 0) ||
+	    (mapd_get_optstr(mb, &cwd) < 0) ||
+	    (mapd_get_optstr(mb, &redirect_ignore) < 0) ||
+	    (mapd_get_optstr(mb, &redirect_force) < 0)) {
+		SB_LOG(SB_LOGLEVEL_WARNING, "mapd: invalid HELLO");
+		return(-1);
+	}
+
+	/* The rules of the mapping mode were loaded when Lua was
+	 * initialized, the mode can't be changed here */
+	if ((mode || sbox_session_mode) &&
+	    (!mode || !sbox_session_mode || strcmp(mode, sbox_session_mode))) {
+		SB_LOG(SB_LOGLEVEL_DEBUG,
+			"mapd: client uses mapping mode %s, refused",
+			(mode ? mode : "<default>"));
+		return(-1);
+	}
+
+	mapd_set_global(&sbox_session_perm, perm);
+	mapd_set_global(&sbox_binary_name, binary_name);
+	mapd_set_global(&sbox_exec_name, exec_name);
+	mapd_set_global(&sbox_real_binary_name, real_binary_name);
+	mapd_set_global(&sbox_orig_binary_name, orig_binary_name);
+	mapd_set_global(&sbox_active_exec_policy_name, policy);
+	mapd_set_env("SBOX_REDIRECT_IGNORE", redirect_ignore);
+	mapd_set_env("SBOX_REDIRECT_FORCE", redirect_force);
+	if (cwd && (chdir_nomap_nolog(cwd) < 0)) {
+		SB_LOG(SB_LOGLEVEL_WARNING, "mapd: chdir(%s) failed", cwd);
+		return(-1);
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG, "mapd: serving %s",
+		(binary_name ? binary_name : "UNKNOWN"));
+
+	/* the rule chain may depend on the binary */
+	luaif = get_lua();
+	if (!luaif) return(-1);
+	specs = sb2_path_class_specs_from_lua(luaif,
+		(binary_name ? binary_name : "UNKNOWN"));
+	release_lua(luaif);
+	sb2_path_class_install(specs, 1);
+	mapd_put_strvec(reply, specs);
+	mapd_free_strvec(specs);
+	return(0);
+}
+
+static int mapd_handle_map(sb2_mapd_msg_hdr_t *hdr, sb2_mapd_buf_t *mb,
+	sb2_mapd_buf_t *reply)
+{
+	const char		*func_name = mapd_get_str(mb);
+	const char		*fn_id_str = mapd_get_str(mb);
+	const char		*path = mapd_get_str(mb);
+	int			dont_resolve_final_symlink = hdr->mh_status;
+	int			fn_id;
+	mapping_results_t	res;
+	char			flags[3];
+
+	if (!func_name || !fn_id_str || !path) return(-1);
+	fn_id = atoi(fn_id_str);
+	if ((fn_id < 0) || (fn_id >= sb2_num_fns))
+		fn_id = SB2_FN_ID_UNKNOWN;
+
+	/* sbox_binary_name was set by HELLO */
+	clear_mapping_results_struct(&res);
+	sbox_map_path(func_name, fn_id, path, dont_resolve_final_symlink, &res);
+	hdr->mh_status = 0;
+	hdr->mh_errno = res.mres_errno;
+	flags[0] = (res.mres_readonly ? '1' : '0');
+	flags[1] = (res.mres_fs_dependent ? '1' : '0');
+	flags[2] = '\0';
+	mapd_put_str(reply, flags);
+	mapd_put_optstr(reply, res.mres_result_buf);
+	free_mapping_results(&res);
+	return(0);
+}
+
+static int mapd_handle_reverse(sb2_mapd_msg_hdr_t *hdr, sb2_mapd_buf_t *mb,
+	sb2_mapd_buf_t *reply)
+{
+	const char	*func_name = mapd_get_str(mb);
+	const char	*path = mapd_get_str(mb);
+	char		*virtual_path;
+
+	if (!func_name || !path) return(-1);
+
+	virtual_path = scratchbox_reverse_path(func_name, path);
+	hdr->mh_status = 0;
+	hdr->mh_errno = 0;
+	mapd_put_optstr(reply, virtual_path);
+	if (virtual_path) free(virtual_path);
+	return(0);
+}
+
+static int mapd_handle_exec(sb2_mapd_msg_hdr_t *hdr, sb2_mapd_buf_t *mb,
+	sb2_mapd_buf_t *reply)
+{
+	const char	*cwd;
+	const char	*exec_fn_name;
+	const char	*orig_file;
+	char		**orig_argv = NULL;
+	char		**orig_envp = NULL;
+	char		*new_file = NULL;
+	char		**new_argv = NULL;
+	char		**new_envp = NULL;
+
+	if (mapd_get_optstr(mb, &cwd) < 0) return(-1);
+	if (cwd && (chdir_nomap_nolog(cwd) < 0)) {
+		SB_LOG(SB_LOGLEVEL_WARNING, "mapd: chdir(%s) failed", cwd);
+		return(-1);
+	}
+	exec_fn_name = mapd_get_str(mb);
+	orig_file = mapd_get_str(mb);
+	if (!exec_fn_name || !orig_file ||
+	    (mapd_get_strvec(mb, &orig_argv) < 0) ||
+	    (mapd_get_strvec(mb, &orig_envp) < 0) ||
+	    !orig_argv || !orig_envp) {
+		mapd_free_strvec(orig_argv);
+		mapd_free_strvec(orig_envp);
+		return(-1);
+	}
+
+	errno = 0;
+	hdr->mh_status = sb_prepare_exec_request(exec_fn_name, orig_file,
+		orig_argv, orig_envp, &new_file, &new_argv, &new_envp);
+	hdr->mh_errno = errno;
+
+	mapd_put_optstr(reply, new_file);
+	mapd_put_strvec(reply, new_argv);
+	mapd_put_strvec(reply, new_envp);
+
+	if (new_file) free(new_file);
+	mapd_free_strvec(new_argv);
+	mapd_free_strvec(new_envp);
+	mapd_free_strvec(orig_argv);
+	mapd_free_strvec(orig_envp);
+	return(0);
+}
+
+/* Serve one client; runs in a child of the daemon */
+static void mapd_serve_client(int fd)
+{
+	for (;;) {
+		sb2_mapd_msg_hdr_t	hdr;
+		sb2_mapd_buf_t		mb;
+		sb2_mapd_buf_t		reply;
+		int			r = -1;
+
+		memset(&mb, 0, sizeof(mb));
+		memset(&reply, 0, sizeof(reply));
+		if (mapd_recv_msg(fd, &hdr, &mb) < 0) {
+			mapd_buf_free(&mb);
+			return;
+		}
+		switch (hdr.mh_type) {
+		case SB2_MAPD_MSG_HELLO:
+			r = mapd_handle_hello(&mb, &reply);
+			hdr.mh_status = r;
+			hdr.mh_errno = 0;
+			break;
+		case SB2_MAPD_MSG_MAP:
+			r = mapd_handle_map(&hdr, &mb, &reply);
+			break;
+		case SB2_MAPD_MSG_EXEC:
+			r = mapd_handle_exec(&hdr, &mb, &reply);
+			break;
+		case SB2_MAPD_MSG_REVERSE:
+			r = mapd_handle_reverse(&hdr, &mb, &reply);
+			break;
+		default:
+			SB_LOG(SB_LOGLEVEL_WARNING,
+				"mapd: unknown request %u", hdr.mh_type);
+			break;
+		}
+		mapd_buf_free(&mb);
+		if (r < 0) {
+			/* client falls back to local processing */
+			reply.mb_len = 0;
+			hdr.mh_status = -1;
+		}
+		r = mapd_send_msg(fd, &hdr, &reply);
+		mapd_buf_free(&reply);
+		if ((r < 0) || (hdr.mh_status < 0 &&
+		    hdr.mh_type == SB2_MAPD_MSG_HELLO))
+			return;
+	}
+}
+
+/* ----- EXPORTED from interface.master: ----- */
+/* The main loop of "sb2-mapd". Returns when process "session_pid"
+ * (the session) has exited. */
+int sb2mapd__serve__(const char *socket_path, int session_pid)
+{
+	struct sockaddr_un	addr;
+	mapping_results_t	res;
+	char			*argvenvp_script = NULL;
+	int			listen_fd;
+
+	if (!sb2_global_vars_initialized__) sb2_initialize_global_variables();
+	mapd_server_mode = 1;
+
+	if (!socket_path || (strlen(socket_path) >= sizeof(addr.sun_path))) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "mapd: invalid socket path");
+		return(-1);
+	}
+
+	/* Warm up: create the Lua state, load the rules (mapping a path
+	 * does that) and the exec code (normally loaded on demand) */
+	clear_mapping_results_struct(&res);
+	sbox_map_path(__func__, SB2_FN_ID_UNKNOWN, "/", 0, &res);
+	free_mapping_results(&res);
+	if (asprintf(&argvenvp_script, "%s/lua_scripts/argvenvp.lua",
+	    sbox_session_dir) > 0) {
+		sb2__load_and_execute_lua_file__(argvenvp_script);
+		free(argvenvp_script);
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "mapd: socket() failed");
+		return(-1);
+	}
+	fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	unlink_nomap_nolog(socket_path);
+	if ((bind_nomap_nolog(listen_fd, (struct sockaddr *)&addr,
+		sizeof(addr)) < 0) ||
+	    (listen(listen_fd, 64) < 0)) {
+		SB_LOG(SB_LOGLEVEL_ERROR, "mapd: can't listen at %s (%d)",
+			socket_path, errno);
+		close_nomap_nolog(listen_fd);
+		return(-1);
+	}
+	signal(SIGCHLD, SIG_IGN); /* children are not waited for */
+	SB_LOG(SB_LOGLEVEL_INFO, "mapd: listening at %s", socket_path);
+
+	while ((kill(session_pid, 0) == 0) || (errno == EPERM)) {
+		struct pollfd	pfd;
+		int		fd;
+
+		pfd.fd = listen_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 1000) <= 0) continue;
+
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) continue;
+
+		switch (fork()) {
+		case 0:
+			close_nomap_nolog(listen_fd);
+			mapd_serve_client(fd);
+			_exit(0);
+		case -1:
+			SB_LOG(SB_LOGLEVEL_ERROR, "mapd: fork failed");
+			break;
+		default:
+			break;
+		}
+		close_nomap_nolog(fd);
+	}
+
+	SB_LOG(SB_LOGLEVEL_INFO, "mapd: session has ended, exiting");
+	close_nomap_nolog(listen_fd);
+	unlink_nomap_nolog(socket_path);
+	return(0);
+}
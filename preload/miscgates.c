@@ -61,7 +61,7 @@ FTS * fts_open_gate(
 
 		clear_mapping_results_struct(&res);
 		path = *p;
-		sbox_map_path(realfnname, path,
+		sbox_map_path(realfnname, SB2_FN_ID_UNKNOWN, path,
 			0/*dont_resolve_final_symlink*/, &res);
 		if (res.mres_result_path) {
 			/* Mapped OK */
@@ -477,6 +477,7 @@ void exit_gate(
 	 *       without making a corresponding change to the script!
 	*/
 	SB_LOG(SB_LOGLEVEL_INFO, "%s: status=%d", realfnname, status);
+	sb2_profile_set_exit_status(status);
 	(real_exit_ptr)(status);
 }
 
@@ -492,6 +493,11 @@ void _exit_gate(
 	 *       without making a corresponding change to the script!
 	*/
 	SB_LOG(SB_LOGLEVEL_INFO, "%s: status=%d", realfnname, status);
+	/* destructors won't be called */
+	sb2_wrapper_stats_flush();
+	sb2_profile_set_exit_status(status);
+	sb2_profile_image_done(0);
+	sb2_lua_gc_image_done(0);
 	(real__exit_ptr)(status);
 }
 
@@ -508,6 +514,10 @@ void _Exit_gate(
 	 *       without making a corresponding change to the script!
 	*/
 	SB_LOG(SB_LOGLEVEL_INFO, "%s: status=%d", realfnname, status);
+	sb2_wrapper_stats_flush();
+	sb2_profile_set_exit_status(status);
+	sb2_profile_image_done(0);
+	sb2_lua_gc_image_done(0);
 	(real__Exit_ptr)(status);
 }
 //void _Exit_gate() __attribute__ ((noreturn));
@@ -518,6 +528,7 @@ static void log_wait_result(const char *realfnname, pid_t pid, int status)
 	 *       postprocessor script "sb2logz". Do not change
 	 *       without making a corresponding changes to the script!
 	*/
+	sb2_profile_child_status(pid, status);
 	if (WIFEXITED(status)) {
 		SB_LOG(SB_LOGLEVEL_INFO, "%s: child %d exit status=%d",
 			realfnname, (int)pid, WEXITSTATUS(status));
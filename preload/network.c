@@ -59,7 +59,8 @@ static void map_sockaddr_un(
 
 	clear_mapping_results_struct(&res);
 	/* FIXME: implement if(pathname_is_readonly!=0)... */
-	sbox_map_path(realfnname, orig_serv_addr_un->sun_path,
+	sbox_map_path(realfnname, SB2_FN_ID_UNKNOWN,
+		orig_serv_addr_un->sun_path,
 		0/*dont_resolve_final_symlink*/, &res);
 	if (res.mres_result_path == NULL) {
 		SB_LOG(SB_LOGLEVEL_ERROR,
@@ -400,7 +401,9 @@ int accept_gate(
 	socklen_t *addrlen)
 {
 	ssize_t	res;
-	socklen_t orig_from_size = *addrlen;
+	socklen_t orig_from_size = 0;
+
+	if (addrlen) orig_from_size = *addrlen;
 
 	errno = *result_errno_ptr; /* restore to orig.value */
 	res = (*real_accept_ptr)(sockfd, addr, addrlen);
@@ -16,6 +16,12 @@
  *       to the binary itself.
  *
  * (all other files under /proc are used directly)
+ *
+ * Tools like ps and pidof (and many language runtimes) read these links
+ * over and over again, so the results are cached: The process' own "exe"
+ * doesn't change while the process exists, and the results for other
+ * processes are cached per pid, and validated with the identity of the
+ * process image from /proc/<pid>/stat (see struct procfs_exe_identity).
 */
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -237,6 +243,116 @@ static char *select_exe_path_for_sb2(
 	return(NULL);
 }
 
+/* Identity of the program which a process is running. The pid and the
+ * start time identify the process; "exec" doesn't change them, but it
+ * sets up a new stack, and (with address space randomization) the
+ * locations of argv and environment strings change. Those are not
+ * available if we aren't allowed to ptrace the process; then "exe"
+ * (the real link) must tell if the process has exec'd something else.
+*/
+struct procfs_exe_identity {
+	pid_t			pei_pid;
+	unsigned long long	pei_starttime;
+	unsigned long		pei_arg_start;
+	unsigned long		pei_env_start;
+};
+
+/* Returns 0 if the identity of process "pid" could be read */
+static int read_procfs_exe_identity(const char *pid_path, pid_t pid,
+	struct procfs_exe_identity *id)
+{
+	char	pathbuf[PATH_MAX];
+	char	buf[1024];
+	char	*cp;
+	int	fd, field;
+	ssize_t	len;
+
+	if (snprintf(pathbuf, sizeof(pathbuf), "%s/stat", pid_path) >=
+	    (int)sizeof(pathbuf))
+		return(-1);
+	fd = open_nomap_nolog(pathbuf, O_RDONLY, 0);
+	if (fd < 0) return(-1);
+	len = read(fd, buf, sizeof(buf)-1);
+	close_nomap_nolog(fd);
+	if (len <= 0) return(-1);
+	buf[len] = '\0';
+
+	memset(id, 0, sizeof(*id));
+	id->pei_pid = pid;
+
+	/* "comm" (field 2) may contain spaces and parentheses; the fields
+	 * after it are separated by single spaces. */
+	cp = strrchr(buf, ')');
+	if (!cp) return(-1);
+	for (field = 2; cp && *cp; field++) {
+		cp = strchr(cp, ' ');
+		if (!cp) break;
+		cp++;
+		switch (field + 1) {
+		case 22: id->pei_starttime = strtoull(cp, NULL, 10); break;
+		case 48: id->pei_arg_start = strtoul(cp, NULL, 10); break;
+		case 50: id->pei_env_start = strtoul(cp, NULL, 10); break;
+		}
+	}
+	return(id->pei_starttime ? 0 : -1);
+}
+
+#define PROCFS_EXE_CACHE_SIZE	64
+
+struct procfs_exe_cache_entry {
+	struct procfs_exe_identity pec_id;
+	char	*pec_real_link;		/* NULL: unused entry */
+	char	*pec_replacement;	/* NULL: use the real link */
+};
+
+static struct procfs_exe_cache_entry procfs_exe_cache[PROCFS_EXE_CACHE_SIZE];
+static volatile int procfs_exe_cache_lock = 0;
+
+/* Returns 1 if a result was found; then "*resultp" is set to a copy of the
+ * cached replacement path (or NULL, if the real link can be used).
+ * The cache is not used if another thread is using it at the same time.
+*/
+static int procfs_exe_cache_lookup(const struct procfs_exe_identity *id,
+	const char *real_link, char **resultp)
+{
+	struct procfs_exe_cache_entry *e =
+		&procfs_exe_cache[(unsigned)id->pei_pid % PROCFS_EXE_CACHE_SIZE];
+	int	found = 0;
+
+	if (__sync_lock_test_and_set(&procfs_exe_cache_lock, 1))
+		return(0);
+	if (e->pec_real_link &&
+	    !memcmp(&e->pec_id, id, sizeof(*id)) &&
+	    !strcmp(e->pec_real_link, real_link)) {
+		*resultp = (e->pec_replacement ?
+			strdup(e->pec_replacement) : NULL);
+		found = 1;
+	}
+	__sync_lock_release(&procfs_exe_cache_lock);
+	return(found);
+}
+
+static void procfs_exe_cache_insert(const struct procfs_exe_identity *id,
+	const char *real_link, const char *replacement)
+{
+	struct procfs_exe_cache_entry *e =
+		&procfs_exe_cache[(unsigned)id->pei_pid % PROCFS_EXE_CACHE_SIZE];
+
+	if (__sync_lock_test_and_set(&procfs_exe_cache_lock, 1))
+		return;
+	free(e->pec_real_link);
+	free(e->pec_replacement);
+	e->pec_id = *id;
+	e->pec_real_link = strdup(real_link);
+	e->pec_replacement = (replacement ? strdup(replacement) : NULL);
+	__sync_lock_release(&procfs_exe_cache_lock);
+}
+
+/* Result for our own "exe"; it is inherited by forked children,
+ * which run the same program. */
+static volatile int my_exe_result_cached = 0;
+static char *my_exe_replacement = NULL;
+
 static char *procfs_mapping_request_for_my_files(
 	char *full_path, char *base_path)
 {
@@ -248,6 +364,16 @@ static char *procfs_mapping_request_for_my_files(
 		char	pathbuf[PATH_MAX];
 		char    link_dest[PATH_MAX+1];
 		int	link_len;
+		char	*result = NULL;
+
+		if (my_exe_result_cached) {
+			SB_LOG(SB_LOGLEVEL_NOISE,
+				"procfs_mapping_request_for_my_files:"
+				" cached (%s)", my_exe_replacement ?
+				my_exe_replacement : "real link is ok");
+			return(my_exe_replacement ?
+				strdup(my_exe_replacement) : NULL);
+		}
 
                 exe_path_inside_sb2 = select_exe_path_for_sb2(
 			sbox_orig_binary_name, sbox_real_binary_name);
@@ -256,6 +382,7 @@ static char *procfs_mapping_request_for_my_files(
 
 		/* check if the real link is OK: */
 		link_len = readlink_nomap(full_path, link_dest, PATH_MAX);
+		if (link_len > 0) link_dest[link_len] = '\0';
 		if ((link_len > 0) &&
 		    !strcmp(exe_path_inside_sb2, link_dest)) {
 			SB_LOG(SB_LOGLEVEL_DEBUG,
@@ -263,13 +390,24 @@ static char *procfs_mapping_request_for_my_files(
 				" real link is ok (%s,%s)",
 				full_path, link_dest);
 			free(exe_path_inside_sb2);
+			my_exe_result_cached = 1;
 			return(NULL);
 		}
 		/* must create a replacement: */
 		if (symlink_for_exe_path(
 		    pathbuf, sizeof(pathbuf), exe_path_inside_sb2, getpid())) {
 			free(exe_path_inside_sb2);
-			return(strdup(pathbuf));
+			result = strdup(pathbuf);
+			if (result) {
+				char *cached = strdup(result);
+
+				if (__sync_bool_compare_and_swap(
+				    &my_exe_replacement, NULL, cached))
+					my_exe_result_cached = 1;
+				else
+					free(cached);
+			}
+			return(result);
 		}
 		/* oops, failed to create the replacement.
 		 * must use the real link, it points to wrong place.. */
@@ -294,6 +432,22 @@ static char *procfs_mapping_request_for_other_files(
                 size_t  len;
                 const char *orig_binary_name;
                 const char *real_binary_name;
+		struct procfs_exe_identity id;
+		int	use_cache;
+		char	*result = NULL;
+
+		link_len = readlink_nomap(full_path, link_dest, PATH_MAX);
+		if (link_len > 0) link_dest[link_len] = '\0';
+
+		use_cache = (link_len > 0) &&
+			(read_procfs_exe_identity(pid_path, pid, &id) == 0);
+		if (use_cache &&
+		    procfs_exe_cache_lookup(&id, link_dest, &result)) {
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+			       "procfs_mapping_request_for_other_files:"
+			       " cached (%s)", result ? result : link_dest);
+			return(result);
+		}
 
                 /* Check the process environment to find out is this 
 		 * runned under sb2 
@@ -302,6 +456,8 @@ static char *procfs_mapping_request_for_other_files(
 			       pid_path);
                 len = read_procfs_file_to_buffer(pathbuf, &buffer);
                 if (len == 0) {
+			if (use_cache)
+				procfs_exe_cache_insert(&id, link_dest, NULL);
                         return(NULL);
                 }
 
@@ -321,11 +477,12 @@ static char *procfs_mapping_request_for_other_files(
 		
                 /* this is not under runned binary */
                 if (!exe_path_inside_sb2) {
+			if (use_cache)
+				procfs_exe_cache_insert(&id, link_dest, NULL);
                         return(NULL);
                 }
 
                 /* check if the real link is OK: */
-                link_len = readlink_nomap(full_path, link_dest, PATH_MAX);
                 if ((link_len > 0) &&
                     !strcmp(exe_path_inside_sb2, link_dest)) {
                         SB_LOG(SB_LOGLEVEL_DEBUG,
@@ -333,12 +490,16 @@ static char *procfs_mapping_request_for_other_files(
 			       " real link is ok (%s,%s)",
 			       full_path, link_dest);
 			free(exe_path_inside_sb2);
+			if (use_cache)
+				procfs_exe_cache_insert(&id, link_dest, NULL);
 			return(NULL);
 		}
 		/* must create a replacement: */
 		if (symlink_for_exe_path(
 		    pathbuf, sizeof(pathbuf), exe_path_inside_sb2, pid)) {
 			free(exe_path_inside_sb2);
+			if (use_cache)
+				procfs_exe_cache_insert(&id, link_dest, pathbuf);
 			return(strdup(pathbuf));
 		}
 		/* oops, failed to create the replacement.
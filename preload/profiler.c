@@ -0,0 +1,220 @@
+/*
+ * profiler.c -- per-process records for the session-wide profiler
+ *		 (see option -p of sb2-monitor)
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * When a session is profiled, sb2-monitor creates a datagram socket
+ * pair and passes one end to the command as an inherited file
+ * descriptor, which is registered in SBOX_PROFILE_FD as "fd,inode".
+ * Every process that runs with libsb2 sends one record when a program
+ * image ends (at exit, or just before exec), and a parent sends a record
+ * when it collects the exit status of a child. Every record is a
+ * single datagram (a line of text), so that records from concurrent
+ * processes are never interleaved, and sending never raises SIGPIPE
+ * even if sb2-monitor has already gone. The inode is checked before
+ * every send: if the program has closed the descriptor and the number
+ * has been reused for something else, nothing is written.
+ *
+ * Image record:
+ *   I pid ppid how status start_ns end_ns utime_us stime_us maxrss_kb
+ *     inblock oublock map_calls lua_calls lua_ns binary_name
+ * "how" is "x" (exit) or "e" (exec) and "status" is -1 if not known
+ * (the parent's wait record has it). Times are CLOCK_REALTIME
+ * nanoseconds; rusage values are cumulative for the pid, i.e.
+ * they include earlier program images of the same process.
+ *
+ * Wait record:
+ *   W pid child_pid exit|signal value
+ *
+ * fork() can not be wrapped (see interface.master). A child that was
+ * created by fork() but has not executed anything reports its rusage,
+ * but not mapping counters or start time (those belong to the process
+ * which initialized libsb2): a pthread_atfork() handler clears
+ * "profile_is_owner" in the child, so that the counters can be updated
+ * without a getpid() call. A child created by vfork() shares the memory
+ * of its parent (and no handlers are run); the few mappings it does
+ * before exec are counted to the parent.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL 0
+#endif
+
+#include "libsb2.h"
+#include "exported.h"
+
+int sb2_profile_enabled = 0;
+
+static int	profile_fd = -1;
+static ino_t	profile_ino = 0;
+static pid_t	profile_owner_pid = 0;
+static int	profile_is_owner = 0;
+static uint64_t	profile_start_ns = 0;
+static int	profile_exit_status = -1;
+static pid_t	profile_exit_status_pid = 0;
+static pid_t	profile_image_written_pid = 0;
+
+static uint64_t	profile_map_calls = 0;
+static uint64_t	profile_lua_calls = 0;
+static uint64_t	profile_lua_ns = 0;
+
+static uint64_t profile_realtime_ns(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_REALTIME, &ts) < 0) return(0);
+	return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void profile_atfork_child(void)
+{
+	profile_is_owner = 0;
+}
+
+/* Called when the global variables are initialized; "channel" is the
+ * value of SBOX_PROFILE_FD */
+void sb2_profile_init(const char *channel)
+{
+	int		fd;
+	unsigned long	ino;
+
+	if (sscanf(channel, "%d,%lu", &fd, &ino) != 2 || fd < 0) {
+		SB_LOG(SB_LOGLEVEL_WARNING,
+			"Invalid SBOX_PROFILE_FD '%s'", channel);
+		return;
+	}
+	profile_fd = fd;
+	profile_ino = (ino_t)ino;
+	profile_owner_pid = getpid();
+	profile_is_owner = 1;
+	pthread_atfork(NULL, NULL, profile_atfork_child);
+	profile_start_ns = profile_realtime_ns();
+	sb2_profile_enabled = 1;
+}
+
+void sb2_profile_count_mapping(void)
+{
+	if (profile_is_owner)
+		__sync_fetch_and_add(&profile_map_calls, 1);
+}
+
+/* Used by SB2_LUA_CALL() */
+void sb2_profile_lua_call(lua_State *l, int nargs, int nresults)
+{
+	uint64_t	t0 = sb2_wrapper_stats_timestamp();
+
+	lua_call(l, nargs, nresults);
+	if (profile_is_owner) {
+		__sync_fetch_and_add(&profile_lua_ns,
+			sb2_wrapper_stats_timestamp() - t0);
+		__sync_fetch_and_add(&profile_lua_calls, 1);
+	}
+}
+
+static void profile_write_record(const char *record, size_t len)
+{
+	struct stat	st;
+	int		saved_errno = errno;
+
+	if ((fstat(profile_fd, &st) == 0) && S_ISSOCK(st.st_mode) &&
+	    (st.st_ino == profile_ino)) {
+		if (send(profile_fd, record, len, MSG_NOSIGNAL) < 0) {
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"Failed to write a profiler record");
+		}
+	}
+	errno = saved_errno;
+}
+
+/* Write the record of the current program image. "is_exec" is set
+ * if the image is about to be replaced by exec */
+void sb2_profile_image_done(int is_exec)
+{
+	struct rusage	ru;
+	char		record[1024];
+	int		len;
+	pid_t		pid;
+	int		is_owner;
+
+	if (!sb2_profile_enabled) return;
+	pid = getpid();
+	if (!is_exec && (profile_image_written_pid == pid)) return;
+	is_owner = (pid == profile_owner_pid);
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0) memset(&ru, 0, sizeof(ru));
+	len = snprintf(record, sizeof(record),
+		"I %d %d %c %d %llu %llu %llu %llu %ld %ld %ld %llu %llu %llu %s\n",
+		(int)pid, (int)getppid(), (is_exec ? 'e' : 'x'),
+		((!is_exec && (profile_exit_status_pid == pid)) ?
+			profile_exit_status : -1),
+		(unsigned long long)(is_owner ? profile_start_ns : 0),
+		(unsigned long long)profile_realtime_ns(),
+		(unsigned long long)ru.ru_utime.tv_sec * 1000000ULL +
+			ru.ru_utime.tv_usec,
+		(unsigned long long)ru.ru_stime.tv_sec * 1000000ULL +
+			ru.ru_stime.tv_usec,
+		ru.ru_maxrss, ru.ru_inblock, ru.ru_oublock,
+		(unsigned long long)(is_owner ? profile_map_calls : 0),
+		(unsigned long long)(is_owner ? profile_lua_calls : 0),
+		(unsigned long long)(is_owner ? profile_lua_ns : 0),
+		(sbox_binary_name ? sbox_binary_name : "UNKNOWN"));
+	if (len >= (int)sizeof(record)) {
+		/* too long binary name; keep the record on one line */
+		len = sizeof(record) - 1;
+		record[len - 1] = '\n';
+	}
+	profile_write_record(record, len);
+	/* if exec fails, the image continues and will be written again */
+	if (!is_exec) profile_image_written_pid = pid;
+}
+
+/* exit(), _exit() and _Exit() tell the status before the image ends */
+void sb2_profile_set_exit_status(int status)
+{
+	if (!sb2_profile_enabled) return;
+	profile_exit_status = status;
+	profile_exit_status_pid = getpid();
+}
+
+/* A child has been waited for */
+void sb2_profile_child_status(pid_t child, int status)
+{
+	char	record[100];
+	int	len;
+
+	if (!sb2_profile_enabled) return;
+	if (WIFEXITED(status)) {
+		len = snprintf(record, sizeof(record), "W %d %d exit %d\n",
+			(int)getpid(), (int)child, WEXITSTATUS(status));
+	} else if (WIFSIGNALED(status)) {
+		len = snprintf(record, sizeof(record), "W %d %d signal %d\n",
+			(int)getpid(), (int)child, WTERMSIG(status));
+	} else {
+		return;
+	}
+	profile_write_record(record, len);
+}
+
+#ifdef __GNUC__
+void sb2_profile_destructor(void) __attribute((destructor));
+#endif
+void sb2_profile_destructor(void)
+{
+	sb2_profile_image_done(0);
+}
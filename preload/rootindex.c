@@ -0,0 +1,257 @@
+/*
+ * rootindex.c -- answer existence and symlink queries from the root
+ *		  indexes (see include/rootindex.h)
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * When a session has been created with "sb2 -I", the session directory
+ * contains indexes of target_root and tools_root ($SBOX_SESSION_DIR/
+ * rootindex/target_root.idx and tools_root.idx). They are mapped on the
+ * first query; an index whose generation files have changed since it was
+ * created is ignored for the rest of the process.
+ *
+ * The callers use the indexes only for paths that have been mapped by
+ * read-only rules, i.e. when the tree is not supposed to change during
+ * the session. target_root can be modified in "root" sessions (sb2 -R),
+ * so its index is not used there, and sb2-exitreport touches
+ * target_root/.sb2-generation when such a session ends.
+ *
+ * Lookups return SB2_ROOTINDEX_UNKNOWN for everything that the index
+ * can't answer (the path is not under an indexed root, it goes thru
+ * a symlink or a directory which was not indexed, etc) and then the
+ * callers fall back to the usual system calls.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "libsb2.h"
+#include "exported.h"
+#include "rootindex.h"
+
+#define SB2_ROOTINDEX_MAX_INDEXES	2
+
+struct rootindex {
+	const char				*ri_root;
+	size_t					ri_root_len;
+	const struct sb2_rootindex_entry	*ri_entries;
+	uint32_t				ri_num_entries;
+	const char				*ri_strings;
+	uint64_t				ri_strings_size;
+};
+
+static struct rootindex	rootindexes[SB2_ROOTINDEX_MAX_INDEXES];
+static int		num_rootindexes = 0;
+
+/* 0 = not loaded, 1 = loading (another thread), 2 = ready */
+static volatile int	rootindex_state = 0;
+
+/* Returns 0 if the generation file still has the stamp which
+ * was recorded when the index was created */
+static int check_generation(const char *root,
+	const char *strings, const struct sb2_rootindex_generation *gen)
+{
+	char		*path = NULL;
+	struct stat	st;
+	int		fd;
+	int		r = -1;
+
+	if (asprintf(&path, "%s%s", root, strings + gen->rig_path_offs) < 0)
+		return(-1);
+	fd = open_nomap_nolog(path, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		if ((errno == ENOENT) && (gen->rig_ino == 0)) r = 0;
+	} else {
+		if ((fstat(fd, &st) == 0) &&
+		    (st.st_mtim.tv_sec == gen->rig_mtime_sec) &&
+		    (st.st_mtim.tv_nsec == gen->rig_mtime_nsec) &&
+		    ((uint64_t)st.st_ino == gen->rig_ino))
+			r = 0;
+		close_nomap_nolog(fd);
+	}
+	free(path);
+	return(r);
+}
+
+static void load_rootindex(const char *index_file)
+{
+	const struct sb2_rootindex_header	*hdr;
+	struct rootindex	*ri;
+	struct stat	st;
+	void		*region;
+	int		fd;
+	int		i;
+
+	fd = open_nomap_nolog(index_file, O_RDONLY);
+	if (fd < 0) return;
+	if ((fstat(fd, &st) < 0) ||
+	    ((size_t)st.st_size < sizeof(struct sb2_rootindex_header))) {
+		close_nomap_nolog(fd);
+		return;
+	}
+	region = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close_nomap_nolog(fd);
+	if (region == MAP_FAILED) return;
+
+	hdr = region;
+	if (memcmp(hdr->rih_magic, SB2_ROOTINDEX_MAGIC,
+		SB2_ROOTINDEX_MAGIC_LEN) ||
+	    (hdr->rih_header_size != sizeof(*hdr)) ||
+	    (hdr->rih_entry_size != sizeof(struct sb2_rootindex_entry)) ||
+	    (hdr->rih_entries_offs + (uint64_t)hdr->rih_num_entries *
+		sizeof(struct sb2_rootindex_entry) > hdr->rih_strings_offs) ||
+	    (hdr->rih_strings_offs + hdr->rih_strings_size >
+		(uint64_t)st.st_size) ||
+	    (hdr->rih_strings_size == 0) ||
+	    (((const char *)region)[hdr->rih_strings_offs +
+		hdr->rih_strings_size - 1] != '\0')) {
+		SB_LOG(SB_LOGLEVEL_WARNING,
+			"Invalid root index file '%s'", index_file);
+		munmap(region, st.st_size);
+		return;
+	}
+
+	ri = &rootindexes[num_rootindexes];
+	ri->ri_strings = (const char *)region + hdr->rih_strings_offs;
+	ri->ri_strings_size = hdr->rih_strings_size;
+	ri->ri_entries = (const struct sb2_rootindex_entry *)
+		((const char *)region + hdr->rih_entries_offs);
+	ri->ri_num_entries = hdr->rih_num_entries;
+	ri->ri_root = ri->ri_strings + hdr->rih_root_offs;
+	ri->ri_root_len = strlen(ri->ri_root);
+	/* "/" is stored as the empty prefix */
+	if (!strcmp(ri->ri_root, "/")) ri->ri_root_len = 0;
+
+	for (i = 0; i < SB2_ROOTINDEX_NUM_GENERATION_FILES; i++) {
+		if (check_generation(ri->ri_root, ri->ri_strings,
+		    &hdr->rih_generation[i])) {
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"Root index '%s' is out of date (%s%s)",
+				index_file, ri->ri_root,
+				ri->ri_strings +
+				hdr->rih_generation[i].rig_path_offs);
+			munmap(region, st.st_size);
+			return;
+		}
+	}
+	SB_LOG(SB_LOGLEVEL_DEBUG, "Using root index '%s' (%s, %u entries)",
+		index_file, ri->ri_root, ri->ri_num_entries);
+	num_rootindexes++;
+}
+
+static int rootindexes_ready(void)
+{
+	if (rootindex_state == 2) return(1);
+	if (!sbox_session_dir) return(0);
+	if (__sync_bool_compare_and_swap(&rootindex_state, 0, 1)) {
+		char	*index_file = NULL;
+
+		/* target_root is written in "root" sessions (sb2 -R) */
+		if (sbox_session_perm && !strcmp(sbox_session_perm, "root")) {
+			SB_LOG(SB_LOGLEVEL_DEBUG,
+				"Root session, target_root index not used");
+		} else if (asprintf(&index_file, "%s/rootindex/target_root.idx",
+		    sbox_session_dir) > 0) {
+			load_rootindex(index_file);
+			free(index_file);
+		}
+		if (asprintf(&index_file, "%s/rootindex/tools_root.idx",
+		    sbox_session_dir) > 0) {
+			load_rootindex(index_file);
+			free(index_file);
+		}
+		__sync_synchronize();
+		rootindex_state = 2;
+		return(1);
+	}
+	/* another thread is loading the indexes */
+	return(0);
+}
+
+static const struct sb2_rootindex_entry *find_entry(
+	const struct rootindex *ri, const char *rel_path, size_t len)
+{
+	uint32_t	lo = 0;
+	uint32_t	hi = ri->ri_num_entries;
+
+	while (lo < hi) {
+		uint32_t	mid = lo + (hi - lo) / 2;
+		const char	*p = ri->ri_strings + ri->ri_entries[mid].rie_path_offs;
+		int		c = strncmp(rel_path, p, len);
+
+		if ((c == 0) && (p[len] != '\0')) c = -1;
+		if (c == 0) return(&ri->ri_entries[mid]);
+		if (c < 0) hi = mid;
+		else lo = mid + 1;
+	}
+	return(NULL);
+}
+
+/* Look up "host_path" (an absolute, clean host path) from the indexes.
+ * Returns SB2_ROOTINDEX_FOUND and fills "res", SB2_ROOTINDEX_MISSING if
+ * the path does not exist, or SB2_ROOTINDEX_UNKNOWN.
+*/
+int sb2_rootindex_lookup(const char *host_path,
+	struct sb2_rootindex_result *res)
+{
+	int	i;
+
+	if (!host_path || (*host_path != '/') || !rootindexes_ready())
+		return(SB2_ROOTINDEX_UNKNOWN);
+
+	for (i = 0; i < num_rootindexes; i++) {
+		const struct rootindex		*ri = &rootindexes[i];
+		const struct sb2_rootindex_entry *e;
+		const char	*rel_path;
+		size_t		len;
+
+		if (strncmp(host_path, ri->ri_root, ri->ri_root_len) ||
+		    ((host_path[ri->ri_root_len] != '/') &&
+		     (host_path[ri->ri_root_len] != '\0')))
+			continue;
+
+		rel_path = host_path + ri->ri_root_len;
+		len = strlen(rel_path);
+		if (len == 1) {
+			/* the root itself */
+			len = 0;
+		} else if ((len > 0) && (rel_path[len - 1] == '/')) {
+			/* must be a directory; let the caller check it */
+			return(SB2_ROOTINDEX_UNKNOWN);
+		}
+		e = find_entry(ri, rel_path, len);
+		if (e) {
+			res->rir_mode = e->rie_mode;
+			res->rir_size = e->rie_size;
+			res->rir_link_dest = e->rie_link_offs ?
+				ri->ri_strings + e->rie_link_offs : NULL;
+			return(SB2_ROOTINDEX_FOUND);
+		}
+
+		/* Not in the index. It does not exist if the nearest
+		 * ancestor that exists is an indexed directory. */
+		while (len > 0) {
+			while ((len > 0) && (rel_path[len - 1] != '/')) len--;
+			if (len > 0) len--;	/* the slash */
+			e = find_entry(ri, rel_path, len);
+			if (e) {
+				if (S_ISDIR(e->rie_mode) &&
+				    !(e->rie_flags & SB2_ROOTINDEX_F_NOT_INDEXED))
+					return(SB2_ROOTINDEX_MISSING);
+				if (S_ISREG(e->rie_mode))
+					return(SB2_ROOTINDEX_MISSING);
+				break;
+			}
+		}
+		return(SB2_ROOTINDEX_UNKNOWN);
+	}
+	return(SB2_ROOTINDEX_UNKNOWN);
+}
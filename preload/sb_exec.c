@@ -333,7 +333,151 @@ static enum binary_type inspect_elf_binary(const char *region)
 	return (BIN_UNKNOWN);
 }
 
-static enum binary_type inspect_binary(const char *filename, int check_x_permission)
+/* The "#!" line of a script: the interpreter and the optional argument */
+struct hashbang_info {
+	char	*hbi_interpreter;
+	char	*hbi_interp_arg;	/* NULL if there is no argument */
+};
+
+static void free_hashbang_info(struct hashbang_info *hbi)
+{
+	free(hbi->hbi_interpreter);
+	free(hbi->hbi_interp_arg);
+	hbi->hbi_interpreter = NULL;
+	hbi->hbi_interp_arg = NULL;
+}
+
+/* Parse the "#!" line from the beginning of a script.
+ * Returns 0 if an interpreter was found. */
+static int parse_hashbang(const char *region, size_t size,
+	struct hashbang_info *hbi)
+{
+	char	hashbang[SBOX_MAXPATH]; /* only 60 needed on linux */
+	int	c, i, j, n;
+	char	ch;
+
+	c = (size < sizeof(hashbang) - 1 ? (int)size : (int)sizeof(hashbang) - 1);
+	memcpy(hashbang, region, c);
+	hashbang[c] = '\0';
+
+	/* skip any initial whitespace following "#!" */
+	for (i = 2; (hashbang[i] == ' ' 
+			|| hashbang[i] == '\t') && i < c; i++)
+		;
+
+	for (n = 0, j = i; i < c; i++) {
+		ch = hashbang[i];
+		if (hashbang[i] == 0
+			|| hashbang[i] == ' '
+			|| hashbang[i] == '\t'
+			|| hashbang[i] == '\n') {
+			hashbang[i] = 0;
+			if (i > j) {
+				if (n++ == 0) {
+					hbi->hbi_interpreter =
+						strdup(&hashbang[j]);
+				} else {
+					/* this was the one and only
+					 * allowed argument for the
+					 * interpreter
+					 */
+					hbi->hbi_interp_arg =
+						strdup(&hashbang[j]);
+					break;
+				}
+			}
+			j = i + 1;
+		}
+		if (ch == '\n' || ch == 0) break;
+	}
+	return(hbi->hbi_interpreter ? 0 : -1);
+}
+
+/* Cache of parsed "#!" lines. Build systems execute the same scripts
+ * (libtool, config.status, ...) over and over again; the key is the
+ * identity and modification time of the script, so the script doesn't
+ * need to be read again. The cache is per process: sb2-mapd serves
+ * every client in a forked child, so entries added while serving one
+ * client are not seen by the others. The cache is not used if another
+ * thread is using it at the same time.
+*/
+#define HASHBANG_CACHE_SIZE	64
+
+struct hashbang_cache_entry {
+	dev_t	hbc_dev;
+	ino_t	hbc_ino;
+	off_t	hbc_size;
+	time_t	hbc_mtime_sec;
+	long	hbc_mtime_nsec;
+	struct hashbang_info hbc_info;	/* hbi_interpreter=NULL: unused */
+};
+
+static struct hashbang_cache_entry hashbang_cache[HASHBANG_CACHE_SIZE];
+static volatile int hashbang_cache_lock = 0;
+
+static struct hashbang_cache_entry *hashbang_cache_slot(
+	const struct stat *st)
+{
+	unsigned int h = (unsigned int)st->st_ino * 2654435761u ^
+		(unsigned int)st->st_dev;
+
+	return(&hashbang_cache[h % HASHBANG_CACHE_SIZE]);
+}
+
+static int hashbang_cache_entry_matches(const struct hashbang_cache_entry *e,
+	const struct stat *st)
+{
+	return(e->hbc_info.hbi_interpreter &&
+		(e->hbc_dev == st->st_dev) && (e->hbc_ino == st->st_ino) &&
+		(e->hbc_size == st->st_size) &&
+		(e->hbc_mtime_sec == st->st_mtim.tv_sec) &&
+		(e->hbc_mtime_nsec == st->st_mtim.tv_nsec));
+}
+
+/* returns 1 and a copy of the cached "#!" line to "hbi" if found */
+static int hashbang_cache_lookup(const struct stat *st,
+	struct hashbang_info *hbi)
+{
+	struct hashbang_cache_entry *e = hashbang_cache_slot(st);
+	int	found = 0;
+
+	if (__sync_lock_test_and_set(&hashbang_cache_lock, 1))
+		return(0);
+	if (hashbang_cache_entry_matches(e, st)) {
+		hbi->hbi_interpreter = strdup(e->hbc_info.hbi_interpreter);
+		hbi->hbi_interp_arg = (e->hbc_info.hbi_interp_arg ?
+			strdup(e->hbc_info.hbi_interp_arg) : NULL);
+		found = 1;
+	}
+	__sync_lock_release(&hashbang_cache_lock);
+	return(found);
+}
+
+static void hashbang_cache_insert(const struct stat *st,
+	const struct hashbang_info *hbi)
+{
+	struct hashbang_cache_entry *e = hashbang_cache_slot(st);
+
+	if (__sync_lock_test_and_set(&hashbang_cache_lock, 1))
+		return;
+	free_hashbang_info(&e->hbc_info);
+	e->hbc_dev = st->st_dev;
+	e->hbc_ino = st->st_ino;
+	e->hbc_size = st->st_size;
+	e->hbc_mtime_sec = st->st_mtim.tv_sec;
+	e->hbc_mtime_nsec = st->st_mtim.tv_nsec;
+	e->hbc_info.hbi_interp_arg = (hbi->hbi_interp_arg ?
+		strdup(hbi->hbi_interp_arg) : NULL);
+	e->hbc_info.hbi_interpreter = strdup(hbi->hbi_interpreter);
+	__sync_lock_release(&hashbang_cache_lock);
+}
+
+/* "use_rootindex" is set if "filename" was mapped by a read-only rule;
+ * then the root index can tell if it exists, and if anyone can execute it.
+ * If "hbi" is not NULL, the "#!" line of a script is returned there.
+*/
+static enum binary_type inspect_binary(const char *filename,
+	int check_x_permission, int use_rootindex, struct hashbang_info *hbi)
 {
 	static char *target_cpu = NULL;
 	enum binary_type retval;
@@ -342,9 +486,26 @@ static enum binary_type inspect_binary(const char *filename, int check_x_permiss
 	char *region;
 	unsigned int ei_data;
 	uint16_t e_machine;
+	int known_to_exist = 0;
 
 	retval = BIN_NONE; /* assume it doesn't exist, until proven otherwise */
-	if (check_x_permission && access_nomap_nolog(filename, X_OK) < 0) {
+	if (use_rootindex) {
+		struct sb2_rootindex_result	rires;
+
+		switch (sb2_rootindex_lookup(filename, &rires)) {
+		case SB2_ROOTINDEX_MISSING:
+			errno = ENOENT;
+			goto _out;
+		case SB2_ROOTINDEX_FOUND:
+			if (S_ISREG(rires.rir_mode) &&
+			    ((rires.rir_mode & 0111) == 0111))
+				known_to_exist = 1;
+			break;
+		}
+	}
+	if (known_to_exist) {
+		/* a regular file with all x bits, access() is not needed */
+	} else if (check_x_permission && access_nomap_nolog(filename, X_OK) < 0) {
 		int saved_errno = errno;
 		char *sb1_bug_emulation_mode =
 			sb2__read_string_variable_from_lua__(
@@ -438,6 +599,12 @@ static enum binary_type inspect_binary(const char *filename, int check_x_permiss
 		goto _out_close;
 	}
 
+	if (hbi && hashbang_cache_lookup(&status, hbi)) {
+		SB_LOG(SB_LOGLEVEL_DEBUG, "Cached #! line for '%s'", filename);
+		retval = BIN_HASHBANG;
+		goto _out_close;
+	}
+
 	region = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 	if (!region) {
 		goto _out_close;
@@ -446,6 +613,10 @@ static enum binary_type inspect_binary(const char *filename, int check_x_permiss
 	retval = inspect_elf_binary(region);
 	switch (retval) {
 	case BIN_HASHBANG:
+		if (hbi && (parse_hashbang(region, status.st_size, hbi) == 0))
+			hashbang_cache_insert(&status, hbi);
+		goto _out_munmap;
+
 	case BIN_HOST_STATIC:
 	case BIN_HOST_DYNAMIC:
 		/* host binary, lets go out of here */
@@ -507,27 +678,21 @@ _out:
 static int prepare_hashbang(
 	char **mapped_file,	/* In: script, out: mapped script interpreter */
 	char *orig_file,
+	const struct hashbang_info *hbi, /* from inspect_binary() */
 	char ***argvp,
 	char ***envpp)
 {
-	int argc, fd, c, i, j, n;
-	char ch;
-	char *ptr, *mapped_interpreter;
+	int argc, i, n;
+	char *mapped_interpreter;
 	char **new_argv;
-	char hashbang[SBOX_MAXPATH]; /* only 60 needed on linux, just be safe */
-	char interpreter[SBOX_MAXPATH];
+	const char *interpreter = hbi->hbi_interpreter;
 	char *interp_arg = NULL;
 	char *tmp, *mapped_binaryname;
 	int result = 0;
 
-	if ((fd = open_nomap(*mapped_file, O_RDONLY)) < 0) {
-		/* unexpected error, just run it */
-		return 0;
-	}
-
-	if ((c = read(fd, &hashbang[0], SBOX_MAXPATH - 1)) < 2) {
-		/* again unexpected error, close fd and run it */
-		close_nomap_nolog(fd);
+	if (!interpreter) {
+		/* unexpected error (the script could not be read),
+		 * just run it */
 		return 0;
 	}
 
@@ -536,36 +701,11 @@ static int prepare_hashbang(
 	/* extra element for hashbang argument */
 	new_argv = calloc(argc + 3, sizeof(char *));
 
-	/* skip any initial whitespace following "#!" */
-	for (i = 2; (hashbang[i] == ' ' 
-			|| hashbang[i] == '\t') && i < c; i++)
-		;
-
-	for (n = 0, j = i; i < c; i++) {
-		ch = hashbang[i];
-		if (hashbang[i] == 0
-			|| hashbang[i] == ' '
-			|| hashbang[i] == '\t'
-			|| hashbang[i] == '\n') {
-			hashbang[i] = 0;
-			if (i > j) {
-				if (n == 0) {
-					ptr = &hashbang[j];
-					strcpy(interpreter, ptr);
-					new_argv[n++] = strdup(interpreter);
-				} else {
-					/* this was the one and only
-					 * allowed argument for the
-					 * interpreter
-					 */
-					interp_arg = strdup(&hashbang[j]);
-					new_argv[n++] = interp_arg;
-					break;
-				}
-			}
-			j = i + 1;
-		}
-		if (ch == '\n' || ch == 0) break;
+	n = 0;
+	new_argv[n++] = strdup(interpreter);
+	if (hbi->hbi_interp_arg) {
+		interp_arg = strdup(hbi->hbi_interp_arg);
+		new_argv[n++] = interp_arg;
 	}
 
 	new_argv[n++] = strdup(orig_file); /* the unmapped script path */
@@ -1030,6 +1170,8 @@ static int prepare_exec(const char *exec_fn_name,
 	enum binary_type type;
 	int postprocess_result = 0;
 	int ret = 0; /* 0: ok to exec, ret<0: exec fails */
+	int mapped_file_readonly = 0;
+	struct hashbang_info hashbang = { NULL, NULL };
 
 	(void)exec_fn_name; /* not yet used */
 	(void)orig_envp; /* not used */
@@ -1082,6 +1224,7 @@ static int prepare_exec(const char *exec_fn_name,
 		sbox_map_path_for_exec("do_exec", my_file, &mapping_result);
 		mapped_file = (mapping_result.mres_result_buf ?
 			strdup(mapping_result.mres_result_buf) : NULL);
+		mapped_file_readonly = mapping_result.mres_readonly;
 			
 		free_mapping_results(&mapping_result);
 
@@ -1100,7 +1243,8 @@ static int prepare_exec(const char *exec_fn_name,
 		"__SB2_REAL_BINARYNAME=", mapped_file);
 
 	/* inspect the completely mangled filename */
-	type = inspect_binary(mapped_file, 1/*check_x_permission*/);
+	type = inspect_binary(mapped_file, 1/*check_x_permission*/,
+		mapped_file_readonly, &hashbang);
 	if (typep) *typep = type;
 
 	switch (type) {
@@ -1109,7 +1253,7 @@ static int prepare_exec(const char *exec_fn_name,
 			/* prepare_hashbang() will call prepare_exec()
 			 * recursively */
 			ret = prepare_hashbang(&mapped_file, my_file,
-					&my_argv, &my_envp);
+					&hashbang, &my_argv, &my_envp);
 			break;
 
 		case BIN_HOST_DYNAMIC:
@@ -1204,6 +1348,7 @@ static int prepare_exec(const char *exec_fn_name,
 			break;
 	}
 
+	free_hashbang_info(&hashbang);
 	*new_file = mapped_file;
 	*new_argv = my_argv;
 	*new_envp = my_envp;
@@ -1244,10 +1389,16 @@ int do_exec(int *result_errno_ptr,
 				binaryname, orig_envp);
 		}
 		
-		new_envp = prepare_envp_for_do_exec(orig_file, binaryname, orig_envp);
+		if (sb2_mapd_prepare_exec(exec_fn_name, orig_file, orig_argv,
+		    orig_envp, &r, &new_file, &new_argv, &new_envp) < 0) {
+			/* not served by the mapping daemon */
+			new_envp = prepare_envp_for_do_exec(orig_file,
+				binaryname, orig_envp);
 
-		r = prepare_exec(exec_fn_name, orig_file, 0, orig_argv, orig_envp,
-			&type, &new_file, &new_argv, &new_envp);
+			r = prepare_exec(exec_fn_name, orig_file, 0,
+				orig_argv, orig_envp,
+				&type, &new_file, &new_argv, &new_envp);
+		}
 
 		if (SB_LOG_IS_ACTIVE(SB_LOGLEVEL_DEBUG)) {
 			/* find out and log if sb_execve_preprocess() did something */
@@ -1274,6 +1425,11 @@ int do_exec(int *result_errno_ptr,
 		}
 	}
 
+	/* statistics would be lost if exec succeeds */
+	sb2_wrapper_stats_flush();
+	sb2_profile_image_done(1);
+	sb2_lua_gc_image_done(1);
+
 	errno = *result_errno_ptr; /* restore to orig.value */
 	result = sb_next_execve(
 		(new_file ? new_file : orig_file),
@@ -1285,6 +1441,29 @@ int do_exec(int *result_errno_ptr,
 	return(result);
 }
 
+/* The part of do_exec() which needs Lua. Used by the mapping
+ * daemon (mapd.c) to serve exec requests from other processes.
+*/
+int sb_prepare_exec_request(const char *exec_fn_name,
+	const char *orig_file,
+	char *const *orig_argv, char *const *orig_envp,
+	char **new_file, char ***new_argv, char ***new_envp)
+{
+	char	*tmp, *binaryname;
+	enum binary_type type;
+	int	r;
+
+	tmp = strdup(orig_file);
+	binaryname = strdup(basename(tmp)); /* basename may modify *tmp */
+	free(tmp);
+
+	*new_envp = prepare_envp_for_do_exec(orig_file, binaryname, orig_envp);
+	r = prepare_exec(exec_fn_name, orig_file, 0, orig_argv, orig_envp,
+		&type, new_file, new_argv, new_envp);
+	free(binaryname);
+	return(r);
+}
+
 /* ----- EXPORTED from interface.master: ----- */
 int sb2show__execve_mods__(
 	char *file,
@@ -1323,7 +1502,8 @@ int sb2show__execve_mods__(
 */
 char *sb2show__binary_type__(const char *filename)
 {
-	enum binary_type type = inspect_binary(filename, 0/*check_x_permission*/);
+	enum binary_type type = inspect_binary(filename,
+		0/*check_x_permission*/, 0/*use_rootindex*/, NULL);
 	char *result = NULL;
 
 	switch (type) {
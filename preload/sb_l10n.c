@@ -37,7 +37,7 @@ char *bindtextdomain_gate(int *result_errno_ptr,
 	clear_mapping_results_struct(&res);
 
 	if (dirname != NULL) { 
-		sbox_map_path(realfn_name, dirname, 0, &res);
+		sbox_map_path(realfn_name, SB2_FN_ID_UNKNOWN, dirname, 0, &res);
 		assert(res.mres_result_path != NULL);
 
 		mapped_dirname = res.mres_result_path;
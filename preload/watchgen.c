@@ -0,0 +1,200 @@
+/*
+ * watchgen.c -- validate cached path information with the directory
+ *		 generation counters of sb2-watchd (see include/watchgen.h)
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * When a session has been created with "sb2 -w", sb2-watchd keeps a
+ * change counter for every directory of the writable trees in
+ * $SBOX_SESSION_DIR/watchgen. A cache entry which depends on a host
+ * directory records a stamp: the counters of all ancestors of that
+ * directory (an entry of a directory can only change if its parent
+ * changes). Validating a stamp costs one load per ancestor.
+ *
+ * Without the watcher, stamps are always valid (cached data is used as
+ * before); if the watcher has stopped, no stamp is valid anymore.
+ * Note that inotify events are asynchronous: a change becomes visible
+ * to other processes when sb2-watchd has processed the event.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "libsb2.h"
+#include "exported.h"
+#include "watchgen.h"
+
+static const struct sb2_watchgen_header	*watchgen_hdr = NULL;
+static const volatile uint32_t		*watchgen_buckets = NULL;
+static const char			*watchgen_roots = NULL;
+static const char			*watchgen_roots_end = NULL;
+
+/* 0 = not loaded, 1 = loading (another thread), 2 = ready */
+static volatile int	watchgen_load_state = 0;
+
+static void load_watchgen(void)
+{
+	char		*path = NULL;
+	struct stat	st;
+	void		*region;
+	int		fd;
+	const struct sb2_watchgen_header *hdr;
+
+	if (asprintf(&path, "%s/watchgen", sbox_session_dir) < 0) return;
+	fd = open_nomap_nolog(path, O_RDONLY);
+	free(path);
+	if (fd < 0) return;
+	if ((fstat(fd, &st) < 0) ||
+	    ((size_t)st.st_size < sizeof(struct sb2_watchgen_header))) {
+		close_nomap_nolog(fd);
+		return;
+	}
+	region = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close_nomap_nolog(fd);
+	if (region == MAP_FAILED) return;
+
+	hdr = region;
+	if (memcmp(hdr->wgh_magic, SB2_WATCHGEN_MAGIC,
+		SB2_WATCHGEN_MAGIC_LEN) ||
+	    (hdr->wgh_header_size != sizeof(*hdr)) ||
+	    (hdr->wgh_num_buckets != SB2_WATCHGEN_NUM_BUCKETS) ||
+	    ((size_t)st.st_size < sizeof(*hdr) +
+		SB2_WATCHGEN_NUM_BUCKETS * sizeof(uint32_t) +
+		hdr->wgh_roots_size)) {
+		SB_LOG(SB_LOGLEVEL_WARNING,
+			"Invalid directory generation segment");
+		munmap(region, st.st_size);
+		return;
+	}
+	watchgen_buckets = (const volatile uint32_t *)(hdr + 1);
+	watchgen_roots = (const char *)(watchgen_buckets +
+		SB2_WATCHGEN_NUM_BUCKETS);
+	watchgen_roots_end = watchgen_roots + hdr->wgh_roots_size;
+	watchgen_hdr = hdr;
+	SB_LOG(SB_LOGLEVEL_DEBUG, "Using directory generation segment");
+}
+
+/* Returns 1 if sb2-watchd has been started for this session, 0 if not,
+ * -1 if another thread is just loading the segment */
+static int watchgen_ready(void)
+{
+	if (watchgen_load_state != 2) {
+		if (!sbox_session_dir) return(0);
+		if (!__sync_bool_compare_and_swap(&watchgen_load_state, 0, 1))
+			return(-1);
+		load_watchgen();
+		__sync_synchronize();
+		watchgen_load_state = 2;
+	}
+	return(watchgen_hdr != NULL);
+}
+
+int sb2_watchgen_active(void)
+{
+	return(watchgen_ready() > 0);
+}
+
+/* Returns 1 if "host_path" (absolute, clean) is in one of the
+ * trees that sb2-watchd watches */
+int sb2_watchgen_path_is_watched(const char *host_path)
+{
+	const char	*root;
+	size_t		len;
+
+	if (!sb2_watchgen_active() || !host_path) return(0);
+	for (root = watchgen_roots; root < watchgen_roots_end;
+	     root += len + 1) {
+		len = strnlen(root, watchgen_roots_end - root);
+		if (len == 1) return(1);	/* "/" */
+		if (!strncmp(host_path, root, len) &&
+		    ((host_path[len] == '/') || (host_path[len] == '\0')))
+			return(1);
+	}
+	return(0);
+}
+
+/* Number of changes seen so far; take this before reading the
+ * information which is going to be cached */
+uint64_t sb2_watchgen_events(void)
+{
+	if (!sb2_watchgen_active()) return(0);
+	return(watchgen_hdr->wgh_events);
+}
+
+static uint64_t watchgen_sum(const uint32_t *buckets, int num_buckets)
+{
+	uint64_t	sum = 0;
+	int		i;
+
+	for (i = 0; i < num_buckets; i++)
+		sum += watchgen_buckets[buckets[i]];
+	return(sum);
+}
+
+/* Set a stamp for information which depends on the host directory
+ * "host_path" (absolute; NULL if it is not known). "events_before" is
+ * the value from sb2_watchgen_events(). Returns -1 if the information
+ * must not be cached (something has changed meanwhile, or the directory
+ * is not known), 0 if the stamp was set.
+*/
+int sb2_watchgen_stamp_set(struct sb2_watchgen_stamp *ws,
+	const char *host_path, uint64_t events_before)
+{
+	size_t	len;
+	int	n;
+	int	ready;
+
+	ws->ws_watched = 0;
+	ws->ws_num_buckets = 0;
+	ws->ws_buckets = NULL;
+	ready = watchgen_ready();
+	if (ready <= 0) return(ready);
+
+	if (!host_path ||
+	    (watchgen_hdr->wgh_state != SB2_WATCHGEN_STATE_RUNNING))
+		return(-1);
+
+	/* proper ancestors: "" (the root directory), "/a", "/a/b" */
+	len = strlen(host_path);
+	while ((len > 1) && (host_path[len - 1] == '/')) len--;
+	for (n = 0; n < (int)len; n++)
+		if (host_path[n] == '/') ws->ws_num_buckets++;
+	ws->ws_buckets = malloc(ws->ws_num_buckets * sizeof(uint32_t) + 1);
+	if (!ws->ws_buckets) return(-1);
+	for (n = 0, ws->ws_num_buckets = 0; n < (int)len; n++) {
+		if (host_path[n] == '/')
+			ws->ws_buckets[ws->ws_num_buckets++] =
+				sb2_watchgen_bucket(host_path, n);
+	}
+	ws->ws_generation = watchgen_hdr->wgh_generation;
+	ws->ws_sum = watchgen_sum(ws->ws_buckets, ws->ws_num_buckets);
+	ws->ws_watched = 1;
+	if (watchgen_hdr->wgh_events != events_before) return(-1);
+	return(0);
+}
+
+/* Returns 1 if nothing that the stamped information depends
+ * on has changed */
+int sb2_watchgen_stamp_is_valid(const struct sb2_watchgen_stamp *ws)
+{
+	if (!ws->ws_watched) return(1);
+	return((watchgen_hdr->wgh_state == SB2_WATCHGEN_STATE_RUNNING) &&
+		(watchgen_hdr->wgh_generation == ws->ws_generation) &&
+		(watchgen_sum(ws->ws_buckets, ws->ws_num_buckets) ==
+			ws->ws_sum));
+}
+
+void sb2_watchgen_stamp_free(struct sb2_watchgen_stamp *ws)
+{
+	free(ws->ws_buckets);
+	ws->ws_buckets = NULL;
+	ws->ws_num_buckets = 0;
+}
@@ -0,0 +1,260 @@
+/*
+ * wrapperstats.c -- call counters and latency histograms for the
+ *		     generated interface functions (see gen-interface.pl)
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+ *
+ * ----------------
+ *
+ * When SBOX_WRAPPER_STATS is set, every generated wrapper and gate
+ * measures how long it spent in path mapping (including the
+ * readonly checks and postprocessors) and how long the real function
+ * (or gate) took. Time is collected to log2 histograms (bucket N
+ * counts calls that took [2^N, 2^(N+1)) nanoseconds) and to totals.
+ *
+ * Each thread updates a private block of counters, so recording needs
+ * neither locks nor atomic operations. The blocks are linked to a global
+ * list (with a compare-and-swap, the only synchronization here) and are
+ * never released, so counts of threads that have already exited are
+ * still available when the results are written.
+ *
+ * Results are written to $SBOX_SESSION_DIR/wrapper_stats/PID.BINARYNAME
+ * at exit and before exec; a later write from the same program image
+ * replaces the earlier one, so the file always contains cumulative
+ * values. exec keeps the pid (and often the binary name), so the first
+ * write of an image doesn't replace an existing file; a sequence number
+ * is added to the name instead (PID.BINARYNAME.N).
+ * A child process which was created by fork() starts with empty
+ * counters: a pthread_atfork() handler drops the copies inherited from
+ * the parent. The child has only one thread at that point, so the list
+ * can be reset without racing with anything. (pthread_atfork() comes
+ * from libc_nonshared.a, it doesn't pull in libpthread.so)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "libsb2.h"
+#include "exported.h"
+
+#define WRAPPER_STATS_HIST_BUCKETS 32
+
+typedef struct wrapper_stats_fn_s {
+	uint64_t	wsf_calls;
+	uint64_t	wsf_map_ns;
+	uint64_t	wsf_real_ns;
+	uint32_t	wsf_map_hist[WRAPPER_STATS_HIST_BUCKETS];
+	uint32_t	wsf_real_hist[WRAPPER_STATS_HIST_BUCKETS];
+} wrapper_stats_fn_t;
+
+typedef struct wrapper_stats_block_s {
+	struct wrapper_stats_block_s	*wsb_next;
+	wrapper_stats_fn_t		wsb_fn[1]; /* sb2_num_fns */
+} wrapper_stats_block_t;
+
+int sb2_wrapper_stats_enabled = 0;
+
+static wrapper_stats_block_t *wrapper_stats_all_blocks = NULL;
+static pid_t wrapper_stats_owner_pid = 0;
+static char wrapper_stats_file[PATH_MAX] = ""; /* set by the first flush */
+static __thread wrapper_stats_block_t *wrapper_stats_this_thread = NULL;
+
+uint64_t sb2_wrapper_stats_timestamp(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) return(0);
+	return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static int wrapper_stats_bucket(uint64_t ns)
+{
+	int	b = 0;
+
+	while ((ns >>= 1) && (b < WRAPPER_STATS_HIST_BUCKETS - 1)) b++;
+	return(b);
+}
+
+/* fork() child: start from zero */
+static void wrapper_stats_atfork_child(void)
+{
+	wrapper_stats_all_blocks = NULL;
+	wrapper_stats_this_thread = NULL;
+	wrapper_stats_owner_pid = getpid();
+	wrapper_stats_file[0] = '\0';
+}
+
+/* Called when the global variables are initialized, if
+ * SBOX_WRAPPER_STATS is set */
+void sb2_wrapper_stats_init(void)
+{
+	wrapper_stats_owner_pid = getpid();
+	pthread_atfork(NULL, NULL, wrapper_stats_atfork_child);
+	sb2_wrapper_stats_enabled = 1;
+}
+
+/* Allocate counters for the current thread. mmap() is used instead of
+ * malloc(), because this may be called from inside malloc-related
+ * wrappers (and the block is never freed anyway)
+*/
+static wrapper_stats_block_t *wrapper_stats_alloc_block(void)
+{
+	wrapper_stats_block_t	*blk;
+	size_t	size = sizeof(wrapper_stats_block_t) +
+		sizeof(wrapper_stats_fn_t) * sb2_num_fns;
+
+	blk = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (blk == MAP_FAILED) return(NULL);
+
+	do {
+		blk->wsb_next = wrapper_stats_all_blocks;
+	} while (!__sync_bool_compare_and_swap(&wrapper_stats_all_blocks,
+			blk->wsb_next, blk));
+	return(blk);
+}
+
+/* Called by the generated code, after the real function has returned
+ * and all cleanup has been done:
+ *   t0 = entry to the wrapper, t1 = real function called,
+ *   t2 = real function returned, now = about to return.
+*/
+void sb2_wrapper_stats_record(int fn_id, uint64_t t0, uint64_t t1,
+	uint64_t t2)
+{
+	wrapper_stats_block_t	*blk = wrapper_stats_this_thread;
+	wrapper_stats_fn_t	*wsf;
+	uint64_t		map_ns;
+	uint64_t		real_ns;
+
+	if ((fn_id < 0) || (fn_id >= sb2_num_fns)) return;
+	if (!blk) {
+		blk = wrapper_stats_this_thread = wrapper_stats_alloc_block();
+		if (!blk) return;
+	}
+	map_ns = (t1 - t0) + (sb2_wrapper_stats_timestamp() - t2);
+	real_ns = t2 - t1;
+
+	wsf = &blk->wsb_fn[fn_id];
+	wsf->wsf_calls++;
+	wsf->wsf_map_ns += map_ns;
+	wsf->wsf_real_ns += real_ns;
+	wsf->wsf_map_hist[wrapper_stats_bucket(map_ns)]++;
+	wsf->wsf_real_hist[wrapper_stats_bucket(real_ns)]++;
+}
+
+static void wrapper_stats_append_hist(char *buf, size_t bufsize,
+	const uint32_t *hist)
+{
+	size_t	len = strlen(buf);
+	int	last = WRAPPER_STATS_HIST_BUCKETS - 1;
+	int	i;
+
+	/* trailing empty buckets are not printed */
+	while ((last > 0) && (hist[last] == 0)) last--;
+	for (i = 0; (i <= last) && (len < bufsize); i++) {
+		len += snprintf(buf + len, bufsize - len, "%s%u",
+			(i ? "," : " "), hist[i]);
+	}
+}
+
+/* Sum up counters from all threads and write the results to
+ * the session directory.
+*/
+void sb2_wrapper_stats_flush(void)
+{
+	wrapper_stats_block_t	*blk;
+	char	path[PATH_MAX];
+	char	line[1024];
+	int	fd;
+	int	i;
+	int	saved_errno = errno;
+
+	if (!sb2_wrapper_stats_enabled || !sbox_session_dir) return;
+	/* nothing was recorded, or this is a child created by vfork()
+	 * (it shares the counters of the parent): */
+	if (!wrapper_stats_all_blocks) return;
+	if (getpid() != wrapper_stats_owner_pid) return;
+
+	if (wrapper_stats_file[0]) {
+		snprintf(path, sizeof(path), "%s", wrapper_stats_file);
+		fd = open_nomap_nolog(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	} else {
+		/* first write of this image: an earlier image of
+		 * this process may have written its results already */
+		snprintf(path, sizeof(path), "%s/wrapper_stats",
+			sbox_session_dir);
+		mkdir_nomap_nolog(path, 0755);
+		snprintf(path, sizeof(path), "%s/wrapper_stats/%u.%s",
+			sbox_session_dir, (unsigned)getpid(),
+			(sbox_binary_name ? sbox_binary_name : "UNKNOWN"));
+		fd = open_nomap_nolog(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		for (i = 2; (fd < 0) && (errno == EEXIST) && (i < 1000); i++) {
+			snprintf(path, sizeof(path),
+				"%s/wrapper_stats/%u.%s.%d",
+				sbox_session_dir, (unsigned)getpid(),
+				(sbox_binary_name ? sbox_binary_name :
+				 "UNKNOWN"), i);
+			fd = open_nomap_nolog(path,
+				O_WRONLY | O_CREAT | O_EXCL, 0644);
+		}
+		if (fd >= 0)
+			snprintf(wrapper_stats_file,
+				sizeof(wrapper_stats_file), "%s", path);
+	}
+	if (fd < 0) {
+		SB_LOG(SB_LOGLEVEL_WARNING,
+			"Failed to write wrapper statistics to %s", path);
+		errno = saved_errno;
+		return;
+	}
+	snprintf(line, sizeof(line),
+		"# function calls map_ns real_ns map_log2_hist real_log2_hist\n");
+	if (write(fd, line, strlen(line)) < 0) goto out;
+
+	for (i = 0; i < sb2_num_fns; i++) {
+		wrapper_stats_fn_t	sum;
+		int	b;
+
+		memset(&sum, 0, sizeof(sum));
+		for (blk = wrapper_stats_all_blocks; blk; blk = blk->wsb_next) {
+			wrapper_stats_fn_t *wsf = &blk->wsb_fn[i];
+
+			sum.wsf_calls += wsf->wsf_calls;
+			sum.wsf_map_ns += wsf->wsf_map_ns;
+			sum.wsf_real_ns += wsf->wsf_real_ns;
+			for (b = 0; b < WRAPPER_STATS_HIST_BUCKETS; b++) {
+				sum.wsf_map_hist[b] += wsf->wsf_map_hist[b];
+				sum.wsf_real_hist[b] += wsf->wsf_real_hist[b];
+			}
+		}
+		if (sum.wsf_calls == 0) continue;
+
+		snprintf(line, sizeof(line), "%s %llu %llu %llu",
+			sb2_fn_names[i],
+			(unsigned long long)sum.wsf_calls,
+			(unsigned long long)sum.wsf_map_ns,
+			(unsigned long long)sum.wsf_real_ns);
+		wrapper_stats_append_hist(line, sizeof(line)-1, sum.wsf_map_hist);
+		wrapper_stats_append_hist(line, sizeof(line)-1, sum.wsf_real_hist);
+		strcat(line, "\n");
+		if (write(fd, line, strlen(line)) < 0) break;
+	}
+    out:
+	close_nomap_nolog(fd);
+	SB_LOG(SB_LOGLEVEL_DEBUG, "Wrapper statistics written to %s", path);
+	errno = saved_errno;
+}
+
+#ifdef __GNUC__
+void sb2_wrapper_stats_destructor(void) __attribute((destructor));
+#endif
+void sb2_wrapper_stats_destructor(void)
+{
+	sb2_wrapper_stats_flush();
+}
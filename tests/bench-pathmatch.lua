@@ -0,0 +1,114 @@
+-- Microbenchmark for rule selection (path prefix matching).
+--
+-- Run inside a session:
+--	sb2 sb2-show execluafile tests/bench-pathmatch.lua
+-- and compare the variants of the C matcher with
+--	SBOX_PATHMATCH_IMPL=scalar (or sse2, avx2) sb2 sb2-show execluafile ...
+--
+-- Prints the cost per tested rule of
+--   1. calling sb.test_path_match() for each rule from Lua (the way
+--      find_rule() used to loop the rules),
+--   2. testing the rules in batches with sb.find_path_match(),
+--   3. find_rule() with the rules of the current mapping mode.
+
+local iterations = tonumber(os.getenv("SBOX_BENCH_ITERATIONS")) or 20000
+
+-- A chain which resembles the rules of the "emulate"/"devel" modes:
+-- most rules don't match, and the rule that matches is near the end.
+local bench_rules = {}
+local selectors = {
+	{dir = "/scratchbox"}, {prefix = "/tmp/sb2-session-"},
+	{dir = "/proc"}, {dir = "/sys"}, {prefix = "/dev/pts"},
+	{path = "/etc/resolv.conf"}, {path = "/etc/hosts"},
+	{dir = "/usr/share/scratchbox2/host_usr"},
+	{prefix = "/usr/lib/gcc/x86_64-linux-gnu/12/include"},
+	{dir = "/usr/share/locale"}, {dir = "/usr/share/zoneinfo"},
+	{prefix = "/home/user/.scratchbox2/testtarget/"},
+	{dir = "/var/lib/dpkg"}, {dir = "/var/cache/apt"},
+	{path = "/usr/bin/sb2-show"}, {dir = "/opt/toolchains"},
+}
+for n = 1, 4 do
+	for k = 1, table.maxn(selectors) do
+		local r = {}
+		for key, val in pairs(selectors[k]) do
+			r[key] = val .. (n > 1 and tostring(n) or "")
+		end
+		table.insert(bench_rules, r)
+	end
+end
+table.insert(bench_rules, {dir = "/usr/include"})
+table.insert(bench_rules, {prefix = "/"})
+
+local bench_paths = {
+	"/usr/include/x86_64-linux-gnu/bits/types/struct_timespec.h",
+	"/usr/lib/gcc/x86_64-linux-gnu/12/include-fixed/limits.h",
+	"/home/user/src/project/build/CMakeFiles/CMakeOutput.log",
+	"/etc/hosts",
+}
+
+-- the old inner loop of find_rule()
+local function select_per_rule(rules, path)
+	for i = 1, table.maxn(rules) do
+		local rule = rules[i]
+		local min_path_len = sb.test_path_match(path,
+			rule.dir, rule.prefix, rule.path)
+		if min_path_len >= 0 then
+			return i, min_path_len
+		end
+	end
+	return nil
+end
+
+-- returns the number of rules that were tested
+local function count_tested(rules, path)
+	local i = sb.find_path_match(path, rules, 1)
+	return i or table.maxn(rules)
+end
+
+local function report(name, seconds, tests)
+	print(string.format("%-28s %8.1f ns/rule  (%d rules tested)",
+		name, seconds * 1e9 / tests, tests))
+end
+
+local tests = 0
+for k = 1, table.maxn(bench_paths) do
+	tests = tests + count_tested(bench_rules, bench_paths[k])
+end
+tests = tests * iterations
+
+print(string.format("%d rules, %d paths, %d iterations, matcher=%s",
+	table.maxn(bench_rules), table.maxn(bench_paths), iterations,
+	os.getenv("SBOX_PATHMATCH_IMPL") or "auto"))
+
+local t0 = os.clock()
+for n = 1, iterations do
+	for k = 1, table.maxn(bench_paths) do
+		select_per_rule(bench_rules, bench_paths[k])
+	end
+end
+report("sb.test_path_match per rule", os.clock() - t0, tests)
+
+t0 = os.clock()
+for n = 1, iterations do
+	for k = 1, table.maxn(bench_paths) do
+		sb.find_path_match(bench_paths[k], bench_rules, 1)
+	end
+end
+report("sb.find_path_match batch", os.clock() - t0, tests)
+
+if (active_mode_mapping_rule_chains and
+    active_mode_mapping_rule_chains[1]) then
+	local chain = find_chain(active_mode_mapping_rule_chains,
+		sb.get_binary_name())
+	if (chain) then
+		t0 = os.clock()
+		for n = 1, iterations do
+			for k = 1, table.maxn(bench_paths) do
+				find_rule(chain, "open", bench_paths[k])
+			end
+		end
+		local secs = os.clock() - t0
+		print(string.format("%-28s %8.1f us/path", "find_rule (current mode)",
+			secs * 1e6 / (iterations * table.maxn(bench_paths))))
+	end
+end
@@ -6,6 +6,11 @@
  * that the open(script) done by the interpreter won't appear at a standard
  * binary directory for the redirector.  By passing a symlink located in /tmp
  * to the interpreter, the 'install' mapping rules do the right thing.
+ *
+ * Scripts which are started via exec are handled without this wrapper if
+ * the exec policy sets "script_use_mapped_script_path" (see
+ * sb_execve_map_script_interpreter() in argvenvp.lua); this is still
+ * used when a shell is executed directly with a script as its argument.
  */
 
 #ifndef _GNU_SOURCE
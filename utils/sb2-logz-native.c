@@ -0,0 +1,1985 @@
+/* sb2-logz-native:
+ * SB2 Log Analyzer, native version of the "sb2-logz" script.
+ *
+ * Reads a logfile from stdin, collects data and then writes a summary to
+ * stdout. The reports are the same as produced by sb2-logz (which
+ * executes this program automatically, unless the script's own debug
+ * mode is requested).
+ *
+ * Logs from long builds may be several gigabytes; this program never
+ * keeps the whole log in memory. The input is read in blocks, a batch
+ * of blocks is parsed in parallel (one thread per block, each collecting
+ * its own tables) and the results are merged to the global tables in
+ * input order before the next batch is read. Memory usage depends on the
+ * number of unique pathnames and processes, not on the size of the log.
+ * Error, warning and notice lines are spooled to temporary files.
+ *
+ * Log lines that affect the process tree are order-dependent; those are
+ * recorded as events by the parser threads and replayed sequentially
+ * when the batch is merged.
+ *
+ * Copyright (c) 2007 Nokia Corporation. All rights reserved.
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <regex.h>
+#include <pthread.h>
+
+#include <config.h>
+
+static const char *progname;
+
+/* Size of one input block (a block is extended if a single line is
+ * longer than this) */
+#define LOGZ_BLOCK_SIZE	(16*1024*1024)
+
+/* ========== Options ========== */
+
+static int	verbose = 0;
+static int	print_mapped_paths = 0;
+static int	print_revmap_paths = 0;
+static int	print_passed_paths = 0;
+static int	print_disabled_passed_paths = 0;
+static int	print_full_details = 0;
+static int	print_process_statistics = 0;
+static int	print_notices = 0;
+static const char *process_diagram_file = NULL;
+static const char *exec_diagram_file = NULL;
+static const char *acct_file = NULL;
+static int	num_threads = 1;
+
+static void usage(void)
+{
+	printf("Usage:\n"
+		"\tsb2-logz [options]\n"
+		"\t(stdin should be a logfile produced by the sb2 command,\n"
+		"\tsee options '-d' and '-L level' of sb2)\n"
+		"Options:\n"
+		"\t-b\tno blacklist: do not ignore log lines from __xstat etc\n"
+		"\t-B fn1,fn2,..\tblacklist funcions fn1,..: ignore log specific lines\n"
+		"\t-h\tdisplay this help text\n"
+		"\t-i\tprint details about 'disabled' pathnames\n"
+		"\t\t(unmodifed paths, because mapping was disabled)\n"
+		"\t-j N\tuse N threads for parsing the log\n"
+		"\t-l\tprint long details (affect output of -i,-m,-r,-p etc)\n"
+		"\t-m\tprint details about mapped pathnames (src->dest)\n"
+		"\t-N\tprint all 'notice' messages\n"
+		"\t-p\tprint details about passed pathnames\n"
+		"\t\t('passed' path = not mapped)\n"
+		"\t-r\tprint reversed mappings (dest->src)\n"
+		"\t-s\tprint process statistics\n"
+		"\t-v\tverbose mode, prints dots while reading input etc.\n"
+		"\t-P file.dot\twrite process diagram to file.dot (postprocess\n"
+		"\t\t\t it with 'dot', e.g. 'dot -Tpdf file.dot >file.pdf'\n"
+		"\t-E file.dot\twrite execution diagram to file.dot (postprocess\n"
+		"\t\t\t it with 'dot', e.g. 'dot -Tpdf file.dot >file.pdf'\n"
+		"\t-A acct-file\tRead process accounting information from acct-file\n"
+		"\t\t\t (enhances output of -P and -E)'\n");
+}
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (!p) {
+		fprintf(stderr, "%s: Out of memory\n", progname);
+		exit(1);
+	}
+	return(p);
+}
+
+static void *xcalloc(size_t n, size_t size)
+{
+	void *p = calloc(n, size);
+
+	if (!p) {
+		fprintf(stderr, "%s: Out of memory\n", progname);
+		exit(1);
+	}
+	return(p);
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	void *p = realloc(ptr, size);
+
+	if (!p) {
+		fprintf(stderr, "%s: Out of memory\n", progname);
+		exit(1);
+	}
+	return(p);
+}
+
+static char *xstrndup(const char *s, size_t len)
+{
+	char *p = xmalloc(len + 1);
+
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return(p);
+}
+
+/* ========== String hash tables ========== */
+
+typedef struct ht_entry_s {
+	struct ht_entry_s	*he_next;
+	uint32_t		he_hash;
+	void			*he_value;
+	size_t			he_keylen;
+	char			he_key[1];	/* allocated with the entry */
+} ht_entry_t;
+
+typedef struct hashtable_s {
+	ht_entry_t	**ht_buckets;
+	size_t		ht_size;	/* number of buckets, power of 2 */
+	size_t		ht_count;
+} hashtable_t;
+
+static uint32_t ht_hash(const char *key, size_t len)
+{
+	uint32_t	h = 2166136261u;	/* FNV-1a */
+
+	while (len-- > 0) {
+		h ^= (unsigned char)*key++;
+		h *= 16777619u;
+	}
+	return(h);
+}
+
+static void ht_grow(hashtable_t *ht)
+{
+	size_t		new_size = (ht->ht_size ? ht->ht_size * 2 : 8);
+	ht_entry_t	**new_buckets = xcalloc(new_size, sizeof(ht_entry_t *));
+	size_t		i;
+
+	for (i = 0; i < ht->ht_size; i++) {
+		ht_entry_t *e = ht->ht_buckets[i];
+
+		while (e) {
+			ht_entry_t *next = e->he_next;
+			size_t b = e->he_hash & (new_size - 1);
+
+			e->he_next = new_buckets[b];
+			new_buckets[b] = e;
+			e = next;
+		}
+	}
+	free(ht->ht_buckets);
+	ht->ht_buckets = new_buckets;
+	ht->ht_size = new_size;
+}
+
+/* Find an entry; if "create" is set and the key does not exist, a new
+ * entry (with NULL value) is added. "*createdp" tells which happened. */
+static ht_entry_t *ht_lookup(hashtable_t *ht, const char *key, size_t len,
+	int create, int *createdp)
+{
+	uint32_t	h = ht_hash(key, len);
+	ht_entry_t	*e;
+
+	if (createdp) *createdp = 0;
+	if (ht->ht_size) {
+		for (e = ht->ht_buckets[h & (ht->ht_size - 1)]; e; e = e->he_next) {
+			if ((e->he_hash == h) && (e->he_keylen == len) &&
+			    !memcmp(e->he_key, key, len))
+				return(e);
+		}
+	}
+	if (!create) return(NULL);
+
+	if (ht->ht_count >= ht->ht_size) ht_grow(ht);
+	e = xmalloc(sizeof(ht_entry_t) + len);
+	e->he_hash = h;
+	e->he_value = NULL;
+	e->he_keylen = len;
+	memcpy(e->he_key, key, len);
+	e->he_key[len] = '\0';
+	e->he_next = ht->ht_buckets[h & (ht->ht_size - 1)];
+	ht->ht_buckets[h & (ht->ht_size - 1)] = e;
+	ht->ht_count++;
+	if (createdp) *createdp = 1;
+	return(e);
+}
+
+static ht_entry_t *ht_find(hashtable_t *ht, const char *key)
+{
+	return(ht_lookup(ht, key, strlen(key), 0, NULL));
+}
+
+static ht_entry_t *ht_add(hashtable_t *ht, const char *key)
+{
+	return(ht_lookup(ht, key, strlen(key), 1, NULL));
+}
+
+static void ht_free(hashtable_t *ht, void (*free_value)(void *))
+{
+	size_t	i;
+
+	for (i = 0; i < ht->ht_size; i++) {
+		ht_entry_t *e = ht->ht_buckets[i];
+
+		while (e) {
+			ht_entry_t *next = e->he_next;
+
+			if (free_value && e->he_value) free_value(e->he_value);
+			free(e);
+			e = next;
+		}
+	}
+	free(ht->ht_buckets);
+	memset(ht, 0, sizeof(*ht));
+}
+
+/* Returns an array of all entries (in table order) */
+static ht_entry_t **ht_entries(hashtable_t *ht)
+{
+	ht_entry_t	**entries = xmalloc((ht->ht_count + 1) *
+				sizeof(ht_entry_t *));
+	size_t		i, n = 0;
+
+	for (i = 0; i < ht->ht_size; i++) {
+		ht_entry_t *e;
+
+		for (e = ht->ht_buckets[i]; e; e = e->he_next)
+			entries[n++] = e;
+	}
+	entries[n] = NULL;
+	return(entries);
+}
+
+static int compare_ht_entries(const void *a, const void *b)
+{
+	const ht_entry_t *ea = *(ht_entry_t *const *)a;
+	const ht_entry_t *eb = *(ht_entry_t *const *)b;
+
+	return(strcmp(ea->he_key, eb->he_key));
+}
+
+/* Returns entries sorted by key (bytewise, like Perl's sort) */
+static ht_entry_t **ht_sorted_entries(hashtable_t *ht)
+{
+	ht_entry_t **entries = ht_entries(ht);
+
+	qsort(entries, ht->ht_count, sizeof(ht_entry_t *), compare_ht_entries);
+	return(entries);
+}
+
+/* ========== Path data ========== */
+
+/* The four path tables */
+#define PT_MAPPED_SRC	0
+#define PT_MAPPED_DEST	1
+#define PT_PASSED	2
+#define PT_DISABLED	3
+#define PT_NUM_TABLES	4
+
+typedef struct path_data_s {
+	long		pd_count;
+	hashtable_t	pd_procs;
+	hashtable_t	pd_fn_names;
+	hashtable_t	pd_refs;
+} path_data_t;
+
+static void free_path_data(void *ptr)
+{
+	path_data_t *pd = (path_data_t *)ptr;
+
+	ht_free(&pd->pd_procs, NULL);
+	ht_free(&pd->pd_fn_names, NULL);
+	ht_free(&pd->pd_refs, NULL);
+	free(pd);
+}
+
+static path_data_t *get_path_data(hashtable_t *pathtable,
+	const char *pathname, size_t len)
+{
+	ht_entry_t	*e = ht_lookup(pathtable, pathname, len, 1, NULL);
+
+	if (!e->he_value) e->he_value = xcalloc(1, sizeof(path_data_t));
+	return((path_data_t *)e->he_value);
+}
+
+static void set_union(hashtable_t *dst, hashtable_t *src)
+{
+	size_t	i;
+
+	for (i = 0; i < src->ht_size; i++) {
+		ht_entry_t *e;
+
+		for (e = src->ht_buckets[i]; e; e = e->he_next)
+			ht_lookup(dst, e->he_key, e->he_keylen, 1, NULL);
+	}
+}
+
+/* ========== Global state (owned by the main thread) ========== */
+
+static hashtable_t blacklisted_functions;
+
+static hashtable_t path_tables[PT_NUM_TABLES];
+
+static char	*sbox_target_root = NULL;
+static char	*sbox_tools_root = NULL;
+static char	*sbox_mapmode = NULL;
+
+static FILE	*errors_file = NULL;
+static FILE	*warnings_file = NULL;
+static FILE	*notices_file = NULL;
+static long	num_errors = 0;
+static long	num_warnings = 0;
+static long	num_notices = 0;
+
+static char	*first_timestamp = NULL;
+static char	*last_timestamp = NULL;
+static long	linenum = 0;
+
+/* ----- processes ----- */
+
+typedef struct program_s {
+	char		*pg_label;
+	char		*pg_exec_policy;
+	char		*pg_exec_binary;
+	hashtable_t	pg_executed;	/* program ids */
+	long		pg_instances;
+	double		pg_time_elapsed;
+	double		pg_time_user;
+	double		pg_time_sys;
+	const char	*pg_cell_color;
+} program_t;
+
+typedef struct ptr_array_s {
+	void	**pa_items;
+	size_t	pa_count;
+	size_t	pa_size;
+} ptr_array_t;
+
+static void pa_push(ptr_array_t *pa, void *item)
+{
+	if (pa->pa_count >= pa->pa_size) {
+		pa->pa_size = (pa->pa_size ? pa->pa_size * 2 : 4);
+		pa->pa_items = xrealloc(pa->pa_items,
+			pa->pa_size * sizeof(void *));
+	}
+	pa->pa_items[pa->pa_count++] = item;
+}
+
+typedef struct process_s {
+	char		*pr_label;
+	char		*pr_program_id;
+	program_t	*pr_program;
+	char		*pr_pid;
+	char		*pr_ppid;
+	char		*pr_name;
+	char		*pr_exec_policy;
+	struct process_s *pr_parent;
+	ptr_array_t	pr_children;
+	ptr_array_t	pr_adopted_children;
+	ptr_array_t	pr_prev_names;
+	ptr_array_t	pr_prev_exec_policies;
+	char		*pr_exit_status;	/* NULL = unknown */
+	int		pr_has_times;
+	double		pr_time_elapsed;
+	double		pr_time_user;
+	double		pr_time_sys;
+	const char	*pr_cell_color;
+	int		pr_show_this;
+} process_t;
+
+static hashtable_t all_processes;	/* processname[pid] => number */
+static ptr_array_t all_processes_array;
+static hashtable_t all_processes_by_pid;
+static hashtable_t active_processes;	/* pid => process */
+static hashtable_t argv0_counters;	/* processname => number */
+static hashtable_t i_pid;		/* pid => pid */
+static hashtable_t programs;		/* program id => program */
+static ptr_array_t programs_array;	/* in creation order */
+static process_t *first_process = NULL;
+static int	program_num = 0;
+
+static double	max_elapsed = 0;
+static double	total_user = 0;
+static double	total_sys = 0;
+
+/* ========== Parsing ========== */
+
+/* Order-dependent log lines are recorded as events */
+#define EV_STARTED	1
+#define EV_EXITED	2
+#define EV_I_PID	3
+
+typedef struct log_event_s {
+	int	ev_type;
+	char	*ev_process_name_and_pid;	/* EV_STARTED */
+	char	*ev_timestamp;			/* EV_STARTED */
+	char	*ev_ppid;			/* EV_STARTED */
+	char	*ev_exec_binary_name;		/* EV_STARTED */
+	char	*ev_exec_policy_name;		/* EV_STARTED */
+	char	*ev_pid;	/* EV_EXITED, EV_I_PID; NULL = unknown */
+	char	*ev_value;	/* exit status / i_pid */
+} log_event_t;
+
+typedef struct string_ref_s {
+	const char	*sr_str;
+	size_t		sr_len;
+} string_ref_t;
+
+typedef struct string_ref_array_s {
+	string_ref_t	*sra_items;
+	size_t		sra_count;
+	size_t		sra_size;
+} string_ref_array_t;
+
+static void sra_push(string_ref_array_t *sra, const char *str, size_t len)
+{
+	if (sra->sra_count >= sra->sra_size) {
+		sra->sra_size = (sra->sra_size ? sra->sra_size * 2 : 16);
+		sra->sra_items = xrealloc(sra->sra_items,
+			sra->sra_size * sizeof(string_ref_t));
+	}
+	sra->sra_items[sra->sra_count].sr_str = str;
+	sra->sra_items[sra->sra_count].sr_len = len;
+	sra->sra_count++;
+}
+
+/* regular expressions, same as in the sb2-logz script. The "mapped",
+ * "pass" and "disabled" lines (most of the log) are matched by
+ * parse_path_message() instead; regexec() is too slow for them. */
+#define RE_STARTING	0
+#define RE_WAIT		1
+#define RE_WAIT_EXIT	2
+#define RE_WAIT_SIGNAL	3
+#define RE_EXIT		4
+#define RE_I_PID	5
+#define RE_NUM		6
+
+static const char *regex_sources[RE_NUM] = {
+	"^---------- Starting \\((.*)\\) \\[(.*)\\] ppid=([0-9]*) <(.*)> \\((.*)\\) -",
+	"^wait[pid]*: child ([0-9]+) (.*)$",
+	"^exit status=([0-9]+)",
+	"^terminated by signal ([0-9]+)(.*)$",
+	"[Ee]xit: status=([0-9]*)",
+	"EXEC: i_pid=([0-9]*) ",
+};
+
+/* Parser state for one block of input. Everything that the parser
+ * collects is local to the block; the main thread merges the results. */
+typedef struct log_block_s {
+	char		*lb_data;	/* complete lines */
+	size_t		lb_len;
+	size_t		lb_size;
+
+	/* state at the beginning of the block; updated by the parser */
+	const char	*lb_target_root;
+	const char	*lb_tools_root;
+	ptr_array_t	lb_allocated_roots;
+
+	/* results */
+	hashtable_t	lb_paths[PT_NUM_TABLES];
+	ptr_array_t	lb_events;
+	string_ref_array_t lb_errors;
+	string_ref_array_t lb_warnings;
+	string_ref_array_t lb_notices;
+	string_ref_t	lb_first_timestamp;
+	string_ref_t	lb_last_timestamp;
+	int		lb_has_timestamps;
+	long		lb_lines;
+	string_ref_t	lb_mapmode;
+	int		lb_has_mapmode;
+
+	/* parser's private data */
+	regex_t		lb_regex[RE_NUM];
+	char		*lb_scratch;
+	size_t		lb_scratch_size;
+	char		*lb_pathbuf;
+	size_t		lb_pathbuf_size;
+} log_block_t;
+
+static void compile_regexes(regex_t *regex)
+{
+	int	i;
+
+	for (i = 0; i < RE_NUM; i++) {
+		if (regcomp(regex + i, regex_sources[i], REG_EXTENDED)) {
+			fprintf(stderr, "%s: Internal error: regcomp(%s)\n",
+				progname, regex_sources[i]);
+			exit(1);
+		}
+	}
+}
+
+static char *ensure_buf(char **bufp, size_t *sizep, size_t needed)
+{
+	if (*sizep < needed) {
+		*sizep = needed + 256;
+		*bufp = xrealloc(*bufp, *sizep);
+	}
+	return(*bufp);
+}
+
+/* split "name[pid]" or "name[pid/tid]" (pid is NULL if neither) */
+static void split_name_and_pid(const char *str, size_t len,
+	string_ref_t *name, string_ref_t *pid)
+{
+	const char	*open_bracket;
+	const char	*cp;
+	int		num_digits = 0;
+	int		slash_seen = 0;
+	int		digits_after_slash = 0;
+
+	name->sr_str = str;
+	name->sr_len = len;
+	pid->sr_str = NULL;
+	pid->sr_len = 0;
+
+	if ((len < 3) || (str[len-1] != ']')) return;
+	for (open_bracket = str + len - 2; open_bracket >= str; open_bracket--)
+		if (*open_bracket == '[') break;
+	if (open_bracket < str) return;
+
+	for (cp = open_bracket + 1; cp < str + len - 1; cp++) {
+		if (isdigit((unsigned char)*cp)) {
+			if (slash_seen) digits_after_slash++;
+			else num_digits++;
+		} else if ((*cp == '/') && !slash_seen) {
+			slash_seen = 1;
+		} else {
+			return;
+		}
+	}
+	if (!num_digits || (slash_seen && !digits_after_slash)) return;
+
+	name->sr_len = open_bracket - str;
+	pid->sr_str = open_bracket + 1;
+	pid->sr_len = num_digits;
+}
+
+/* path_accessed() registers path objects to the path tables */
+static void path_accessed(log_block_t *lb, int table,
+	const char *fn_name, size_t fn_name_len,
+	const string_ref_t *procname,
+	const char *pathname, size_t pathname_len,
+	const char *reference, size_t reference_len)
+{
+	path_data_t	*pd;
+	char		*buf;
+	size_t		len;
+
+	/* tentatively substitute target & tools root paths */
+	buf = ensure_buf(&lb->lb_pathbuf, &lb->lb_pathbuf_size,
+		pathname_len + 16);
+	memcpy(buf, pathname, pathname_len);
+	len = pathname_len;
+	if (lb->lb_target_root) {
+		size_t rl = strlen(lb->lb_target_root);
+
+		if ((len >= rl) && !memcmp(buf, lb->lb_target_root, rl)) {
+			memmove(buf + 13, buf + rl, len - rl);
+			memcpy(buf, "<TARGET_ROOT>", 13);
+			len = len - rl + 13;
+		}
+	}
+	if (lb->lb_tools_root) {
+		size_t rl = strlen(lb->lb_tools_root);
+
+		if ((len >= rl) && !memcmp(buf, lb->lb_tools_root, rl)) {
+			memmove(buf + 12, buf + rl, len - rl);
+			memcpy(buf, "<TOOLS_ROOT>", 12);
+			len = len - rl + 12;
+		}
+	}
+
+	pd = get_path_data(&lb->lb_paths[table], buf, len);
+	pd->pd_count++;
+	ht_lookup(&pd->pd_procs, procname->sr_str, procname->sr_len, 1, NULL);
+	ht_lookup(&pd->pd_fn_names, fn_name, fn_name_len, 1, NULL);
+	if (reference)
+		ht_lookup(&pd->pd_refs, reference, reference_len, 1, NULL);
+}
+
+#define RM_LEN(m)	((size_t)((m).rm_eo - (m).rm_so))
+
+static char *match_dup(const char *str, const regmatch_t *m)
+{
+	return(xstrndup(str + m->rm_so, RM_LEN(*m)));
+}
+
+static int is_blacklisted(const char *fn_name, size_t len)
+{
+	return(ht_lookup(&blacklisted_functions, fn_name, len, 0, NULL) != NULL);
+}
+
+/* Match the messages of mapped, passed and disabled paths like the
+ * regular expressions of the sb2-logz script do:
+ *   ^mapped: ([a-zA-Z0-9_]+) '(.*)' -> '(.*)'
+ *   ^pass: ([a-zA-Z0-9_]+) '(.*)'$
+ *   ^disabled\([0-9]*\): ([a-zA-Z0-9_]+) '(.*)'$
+ * "prefix_len" is the length of the part before the function name.
+ * The results are placed to m[1..3] as regexec() would do.
+ * Returns 0 if the message matches.
+*/
+static int parse_path_message(const char *msg, size_t prefix_len,
+	int is_mapped, regmatch_t *m)
+{
+	const char	*fn = msg + prefix_len;
+	const char	*cp = fn;
+	const char	*last_quote;
+	const char	*arrow;
+
+	while (isalnum((unsigned char)*cp) || (*cp == '_')) cp++;
+	if ((cp == fn) || (cp[0] != ' ') || (cp[1] != '\'')) return(-1);
+	m[1].rm_so = fn - msg;
+	m[1].rm_eo = cp - msg;
+	m[2].rm_so = cp + 2 - msg;
+
+	last_quote = strrchr(cp + 2, '\'');
+	if (!is_mapped) {
+		/* the path extends to the quote at the end */
+		if (!last_quote || last_quote[1]) return(-1);
+		m[2].rm_eo = last_quote - msg;
+		return(0);
+	}
+	/* greedy: the last " -> " which is followed by a quote */
+	if (!last_quote || (last_quote - (cp + 2) < 6)) return(-1);
+	for (arrow = last_quote - 6; arrow >= cp + 2; arrow--) {
+		if (!strncmp(arrow, "' -> '", 6)) {
+			m[2].rm_eo = arrow - msg;
+			m[3].rm_so = arrow + 6 - msg;
+			m[3].rm_eo = last_quote - msg;
+			return(0);
+		}
+	}
+	return(-1);
+}
+
+/* Length of "disabled(N): ", or 0 */
+static size_t disabled_prefix_len(const char *msg)
+{
+	const char	*cp = msg + 9;	/* "disabled(" */
+
+	while (isdigit((unsigned char)*cp)) cp++;
+	if ((cp[0] != ')') || (cp[1] != ':') || (cp[2] != ' ')) return(0);
+	return(cp + 3 - msg);
+}
+
+/* "#SBOX_..." lines. Returns the new value, or NULL */
+static const char *root_from_comment_line(const char *line, size_t len,
+	const char *prefix)
+{
+	size_t	plen = strlen(prefix);
+
+	/* (\/.+) */
+	if ((len >= plen + 2) && !strncmp(line, prefix, plen) &&
+	    (line[plen] == '/'))
+		return(line + plen);
+	return(NULL);
+}
+
+static void parse_line(log_block_t *lb, const char *line, size_t len)
+{
+	const char	*field[4];
+	size_t		field_len[4];
+	int		num_fields = 0;
+	int		last_nonempty = -1;
+	const char	*cp, *start;
+	const char	*ts;
+	size_t		ts_len;
+	const char	*loglevel = NULL;
+	size_t		loglevel_len = 0;
+	char		*msg;
+	regmatch_t	m[6];
+	size_t		prefix_len;
+	string_ref_t	procname, pid;
+	int		i;
+
+	lb->lb_lines++;
+
+	if (len && (line[0] == '#')) {
+		const char *v;
+
+		/* A comment, or line containing environment variable */
+		if ((v = root_from_comment_line(line, len,
+		    "#SBOX_TARGET_ROOT="))) {
+			lb->lb_target_root = xstrndup(v, len - (v - line));
+			pa_push(&lb->lb_allocated_roots,
+				(void *)lb->lb_target_root);
+		} else if ((v = root_from_comment_line(line, len,
+		    "#SBOX_TOOLS_ROOT="))) {
+			lb->lb_tools_root = xstrndup(v, len - (v - line));
+			pa_push(&lb->lb_allocated_roots,
+				(void *)lb->lb_tools_root);
+		} else if (!strncmp(line, "#SBOX_MAPMODE=", 14)) {
+			lb->lb_mapmode.sr_str = line + 14;
+			lb->lb_mapmode.sr_len = len - 14;
+			lb->lb_has_mapmode = 1;
+		}
+		return;
+	}
+
+	/* The logger routine in sb2 uses tabs as separators and makes
+	 * sure that the log messages do not contain extra tabs.
+	 * Like Perl's split(), ignore trailing empty fields. */
+	for (start = cp = line; ; cp++) {
+		if ((cp == line + len) || (*cp == '\t')) {
+			if (cp > start) last_nonempty = num_fields;
+			if (num_fields < 4) {
+				field[num_fields] = start;
+				field_len[num_fields] = cp - start;
+			}
+			num_fields++;
+			if (cp == line + len) break;
+			start = cp + 1;
+		}
+	}
+	if (last_nonempty < 2) {
+		/* not enough fields, malformed line? */
+		return;
+	}
+
+	/* timestamp and level: "^(.*)\s\((.*)\)$" */
+	ts = field[0];
+	ts_len = field_len[0];
+	if ((field_len[0] >= 3) && (field[0][field_len[0]-1] == ')')) {
+		for (i = (int)field_len[0] - 3; i >= 0; i--) {
+			if (isspace((unsigned char)field[0][i]) &&
+			    (field[0][i+1] == '(')) {
+				ts_len = i;
+				loglevel = field[0] + i + 2;
+				loglevel_len = field_len[0] - i - 3;
+				break;
+			}
+		}
+	}
+	if (loglevel) {
+		if ((loglevel_len == 5) && !strncmp(loglevel, "ERROR", 5))
+			sra_push(&lb->lb_errors, line, len);
+		else if ((loglevel_len == 7) && !strncmp(loglevel, "WARNING", 7))
+			sra_push(&lb->lb_warnings, line, len);
+		else if ((loglevel_len == 6) && !strncmp(loglevel, "NOTICE", 6))
+			sra_push(&lb->lb_notices, line, len);
+	}
+	lb->lb_last_timestamp.sr_str = ts;
+	lb->lb_last_timestamp.sr_len = ts_len;
+	if (!lb->lb_has_timestamps) {
+		lb->lb_first_timestamp = lb->lb_last_timestamp;
+		lb->lb_has_timestamps = 1;
+	}
+
+	msg = ensure_buf(&lb->lb_scratch, &lb->lb_scratch_size,
+		field_len[2] + 1);
+	memcpy(msg, field[2], field_len[2]);
+	msg[field_len[2]] = '\0';
+
+	if (!strncmp(msg, "mapped: ", 8) &&
+	    !parse_path_message(msg, 8, 1, m)) {
+		if (!is_blacklisted(msg + m[1].rm_so, RM_LEN(m[1]))) {
+			split_name_and_pid(field[1], field_len[1],
+				&procname, &pid);
+			path_accessed(lb, PT_MAPPED_SRC,
+				msg + m[1].rm_so, RM_LEN(m[1]), &procname,
+				msg + m[2].rm_so, RM_LEN(m[2]),
+				msg + m[3].rm_so, RM_LEN(m[3]));
+			path_accessed(lb, PT_MAPPED_DEST,
+				msg + m[1].rm_so, RM_LEN(m[1]), &procname,
+				msg + m[3].rm_so, RM_LEN(m[3]),
+				msg + m[2].rm_so, RM_LEN(m[2]));
+		}
+	} else if (!strncmp(msg, "pass: ", 6) &&
+	    !parse_path_message(msg, 6, 0, m)) {
+		if (!is_blacklisted(msg + m[1].rm_so, RM_LEN(m[1]))) {
+			split_name_and_pid(field[1], field_len[1],
+				&procname, &pid);
+			path_accessed(lb, PT_PASSED,
+				msg + m[1].rm_so, RM_LEN(m[1]), &procname,
+				msg + m[2].rm_so, RM_LEN(m[2]), NULL, 0);
+		}
+	} else if (!strncmp(msg, "disabled(", 9) &&
+	    (prefix_len = disabled_prefix_len(msg)) &&
+	    !parse_path_message(msg, prefix_len, 0, m)) {
+		if (!is_blacklisted(msg + m[1].rm_so, RM_LEN(m[1]))) {
+			split_name_and_pid(field[1], field_len[1],
+				&procname, &pid);
+			path_accessed(lb, PT_DISABLED,
+				msg + m[1].rm_so, RM_LEN(m[1]), &procname,
+				msg + m[2].rm_so, RM_LEN(m[2]), NULL, 0);
+		}
+	} else if (!strncmp(msg, "---------- Starting (", 21) &&
+	    !regexec(&lb->lb_regex[RE_STARTING], msg, 6, m, 0)) {
+		log_event_t *ev = xcalloc(1, sizeof(log_event_t));
+
+		ev->ev_type = EV_STARTED;
+		ev->ev_process_name_and_pid = xstrndup(field[1], field_len[1]);
+		ev->ev_timestamp = xstrndup(ts, ts_len);
+		ev->ev_ppid = match_dup(msg, &m[3]);
+		ev->ev_exec_binary_name = match_dup(msg, &m[4]);
+		ev->ev_exec_policy_name = match_dup(msg, &m[5]);
+		pa_push(&lb->lb_events, ev);
+	} else if (!strncmp(msg, "wait", 4) &&
+	    !regexec(&lb->lb_regex[RE_WAIT], msg, 3, m, 0)) {
+		const char	*reason = msg + m[2].rm_so;
+		regmatch_t	m2[2];
+		log_event_t	*ev = NULL;
+
+		if (!regexec(&lb->lb_regex[RE_WAIT_EXIT], reason, 2, m2, 0)) {
+			ev = xcalloc(1, sizeof(log_event_t));
+			ev->ev_value = match_dup(reason, &m2[1]);
+		} else if (!regexec(&lb->lb_regex[RE_WAIT_SIGNAL],
+		    reason, 2, m2, 0)) {
+			ev = xcalloc(1, sizeof(log_event_t));
+			ev->ev_value = match_dup(msg, &m[2]);
+		}
+		if (ev) {
+			ev->ev_type = EV_EXITED;
+			ev->ev_pid = match_dup(msg, &m[1]);
+			pa_push(&lb->lb_events, ev);
+		}
+	} else if (strstr(msg, "xit: status=") &&
+	    !regexec(&lb->lb_regex[RE_EXIT], msg, 2, m, 0)) {
+		log_event_t *ev = xcalloc(1, sizeof(log_event_t));
+
+		split_name_and_pid(field[1], field_len[1], &procname, &pid);
+		ev->ev_type = EV_EXITED;
+		ev->ev_pid = (pid.sr_str ? xstrndup(pid.sr_str, pid.sr_len) :
+			NULL);
+		ev->ev_value = match_dup(msg, &m[1]);
+		pa_push(&lb->lb_events, ev);
+	} else if (strstr(msg, "EXEC: i_pid=") &&
+	    !regexec(&lb->lb_regex[RE_I_PID], msg, 2, m, 0)) {
+		log_event_t *ev = xcalloc(1, sizeof(log_event_t));
+
+		/* The "i_pid" hack is used to track lost parents,
+		 * see process_started() */
+		split_name_and_pid(field[1], field_len[1], &procname, &pid);
+		ev->ev_type = EV_I_PID;
+		ev->ev_pid = (pid.sr_str ? xstrndup(pid.sr_str, pid.sr_len) :
+			NULL);
+		ev->ev_value = match_dup(msg, &m[1]);
+		pa_push(&lb->lb_events, ev);
+	}
+}
+
+static void *parse_block(void *arg)
+{
+	log_block_t	*lb = (log_block_t *)arg;
+	char		*line = lb->lb_data;
+	char		*end = lb->lb_data + lb->lb_len;
+
+	compile_regexes(lb->lb_regex);
+	while (line < end) {
+		char *nl = memchr(line, '\n', end - line);
+		size_t len = (nl ? (size_t)(nl - line) : (size_t)(end - line));
+
+		parse_line(lb, line, len);
+		line += len + 1;
+	}
+	return(NULL);
+}
+
+/* ========== Merging ========== */
+
+static void free_event(log_event_t *ev)
+{
+	free(ev->ev_process_name_and_pid);
+	free(ev->ev_timestamp);
+	free(ev->ev_ppid);
+	free(ev->ev_exec_binary_name);
+	free(ev->ev_exec_policy_name);
+	free(ev->ev_pid);
+	free(ev->ev_value);
+	free(ev);
+}
+
+static void process_started(log_event_t *ev)
+{
+	string_ref_t	name_ref, pid_ref;
+	char		*procname;
+	char		*pid = NULL;
+	char		*program_id;
+	program_t	*prog = NULL;
+	ht_entry_t	*e;
+	int		created;
+
+	split_name_and_pid(ev->ev_process_name_and_pid,
+		strlen(ev->ev_process_name_and_pid), &name_ref, &pid_ref);
+	procname = xstrndup(name_ref.sr_str, name_ref.sr_len);
+	if (pid_ref.sr_str) pid = xstrndup(pid_ref.sr_str, pid_ref.sr_len);
+
+	if (!first_process) {
+		/* the very first real process is still unknown..
+		 * "^sb2:[A-Z][a-zA-Z0-9]*$" are sb2's internal,
+		 * initialization-phase processes. Forget them. */
+		if (!strncmp(procname, "sb2:", 4) && isupper(procname[4])) {
+			const char *cp = procname + 5;
+
+			while (*cp && isalnum((unsigned char)*cp)) cp++;
+			if (!*cp) {
+				free(procname);
+				free(pid);
+				return;
+			}
+		}
+	}
+
+	program_id = xmalloc(strlen(ev->ev_exec_policy_name) +
+		strlen(ev->ev_exec_binary_name) + 2);
+	sprintf(program_id, "%s\t%s", ev->ev_exec_policy_name,
+		ev->ev_exec_binary_name);
+	if (strcmp(program_id, "\t")) {
+		e = ht_lookup(&programs, program_id, strlen(program_id),
+			1, &created);
+		if (created) {
+			prog = xcalloc(1, sizeof(program_t));
+			if (asprintf(&prog->pg_label, "P%d", program_num) < 0)
+				exit(1);
+			prog->pg_exec_policy = strdup(ev->ev_exec_policy_name);
+			prog->pg_exec_binary = strdup(ev->ev_exec_binary_name);
+			prog->pg_instances = 1;
+			program_num++;
+			e->he_value = prog;
+			pa_push(&programs_array, prog);
+		} else {
+			prog = (program_t *)e->he_value;
+			prog->pg_instances++;
+		}
+	}
+
+	if (pid) {
+		process_t	*proc;
+		process_t	*parent = NULL;
+
+		e = ht_add(&active_processes, pid);
+		proc = (process_t *)e->he_value;
+		if (!proc) {
+			ht_entry_t *pe;
+
+			/* found a new active process. */
+			proc = xcalloc(1, sizeof(process_t));
+			e->he_value = proc;
+			if (asprintf(&proc->pr_label, "L%s", pid) < 0) exit(1);
+			proc->pr_program_id = strdup(program_id);
+			proc->pr_program = prog;
+			proc->pr_pid = strdup(pid);
+			proc->pr_ppid = strdup(ev->ev_ppid);
+			proc->pr_name = strdup(procname);
+			proc->pr_exec_policy = strdup(ev->ev_exec_policy_name);
+
+			pe = ht_find(&all_processes_by_pid, ev->ev_ppid);
+			if (pe) {
+				parent = (process_t *)pe->he_value;
+				proc->pr_parent = parent;
+				pa_push(&parent->pr_children, proc);
+			} else {
+				/* Oops. Unknown parent. Try if the i_pid
+				 * translation helps: */
+				ht_entry_t *ie = ht_find(&i_pid, pid);
+
+				pe = ht_find(&all_processes_by_pid,
+					(ie ? (char *)ie->he_value : ""));
+				if (pe) {
+					/* found a grandparent. */
+					parent = (process_t *)pe->he_value;
+					proc->pr_parent = parent;
+					pa_push(&parent->pr_adopted_children,
+						proc);
+				}
+			}
+			pa_push(&all_processes_array, proc);
+			/* if pid is reused, the old entry will be
+			 * overwritten. */
+			ht_add(&all_processes_by_pid, pid)->he_value = proc;
+
+			if (!first_process) first_process = proc;
+		} else {
+			/* An old pid; probably the process exec'd
+			 * another executable. */
+			pa_push(&proc->pr_prev_names, proc->pr_name);
+			pa_push(&proc->pr_prev_exec_policies,
+				proc->pr_exec_policy);
+			proc->pr_name = strdup(procname);
+			proc->pr_exec_policy = strdup(ev->ev_exec_policy_name);
+			parent = proc->pr_parent;
+
+			if (!strcmp(proc->pr_program_id, "\t")) {
+				/* the very first shell process, we'll have
+				 * to fix this.. */
+				proc->pr_program = prog;
+				free(proc->pr_program_id);
+				proc->pr_program_id = strdup(program_id);
+			}
+		}
+		if (parent && parent->pr_program) {
+			ht_add(&parent->pr_program->pg_executed, program_id);
+		}
+	}
+
+	e = ht_add(&all_processes, ev->ev_process_name_and_pid);
+	if (!e->he_value) {
+		/* found a new process! count that there was yet another
+		 * instance of procname: */
+		ht_entry_t *ce = ht_add(&argv0_counters, procname);
+
+		ce->he_value = (void *)((intptr_t)ce->he_value + 1);
+	}
+	e->he_value = (void *)((intptr_t)e->he_value + 1);
+
+	free(program_id);
+	free(procname);
+	free(pid);
+}
+
+static void process_exited(log_event_t *ev)
+{
+	ht_entry_t	*e;
+
+	if (!ev->ev_pid) return;
+	e = ht_find(&active_processes, ev->ev_pid);
+	if (e && e->he_value) {
+		process_t *proc = (process_t *)e->he_value;
+
+		free(proc->pr_exit_status);
+		proc->pr_exit_status = strdup(ev->ev_value);
+		/* remove from active processes */
+		e->he_value = NULL;
+	}
+}
+
+static void replay_event(log_event_t *ev)
+{
+	switch (ev->ev_type) {
+	case EV_STARTED:
+		process_started(ev);
+		break;
+	case EV_EXITED:
+		process_exited(ev);
+		break;
+	case EV_I_PID:
+		{
+			ht_entry_t *e = ht_add(&i_pid,
+				(ev->ev_pid ? ev->ev_pid : "0"));
+
+			free(e->he_value);
+			e->he_value = strdup(ev->ev_value);
+		}
+		break;
+	}
+}
+
+static void spool_lines(FILE **filep, long *counter, string_ref_array_t *sra)
+{
+	size_t	i;
+
+	if (!sra->sra_count) return;
+	if (!*filep) {
+		*filep = tmpfile();
+		if (!*filep) {
+			fprintf(stderr, "%s: Failed to create a temporary "
+				"file (%s)\n", progname, strerror(errno));
+			exit(1);
+		}
+	}
+	for (i = 0; i < sra->sra_count; i++) {
+		if (*counter) putc('\n', *filep);
+		fwrite(sra->sra_items[i].sr_str, 1, sra->sra_items[i].sr_len,
+			*filep);
+		(*counter)++;
+	}
+	free(sra->sra_items);
+	memset(sra, 0, sizeof(*sra));
+}
+
+static void merge_block(log_block_t *lb)
+{
+	int	t;
+	size_t	i;
+	long	dots_before = linenum / 1000;
+
+	for (t = 0; t < PT_NUM_TABLES; t++) {
+		hashtable_t *src = &lb->lb_paths[t];
+
+		for (i = 0; i < src->ht_size; i++) {
+			ht_entry_t *e;
+
+			for (e = src->ht_buckets[i]; e; e = e->he_next) {
+				path_data_t *spd = (path_data_t *)e->he_value;
+				path_data_t *dpd = get_path_data(
+					&path_tables[t], e->he_key,
+					e->he_keylen);
+
+				dpd->pd_count += spd->pd_count;
+				set_union(&dpd->pd_procs, &spd->pd_procs);
+				set_union(&dpd->pd_fn_names, &spd->pd_fn_names);
+				set_union(&dpd->pd_refs, &spd->pd_refs);
+			}
+		}
+		ht_free(src, free_path_data);
+	}
+
+	for (i = 0; i < lb->lb_events.pa_count; i++) {
+		log_event_t *ev = (log_event_t *)lb->lb_events.pa_items[i];
+
+		replay_event(ev);
+		free_event(ev);
+	}
+	free(lb->lb_events.pa_items);
+	memset(&lb->lb_events, 0, sizeof(lb->lb_events));
+
+	spool_lines(&errors_file, &num_errors, &lb->lb_errors);
+	spool_lines(&warnings_file, &num_warnings, &lb->lb_warnings);
+	spool_lines(&notices_file, &num_notices, &lb->lb_notices);
+
+	if (lb->lb_has_timestamps) {
+		free(last_timestamp);
+		last_timestamp = xstrndup(lb->lb_last_timestamp.sr_str,
+			lb->lb_last_timestamp.sr_len);
+		if (!first_timestamp)
+			first_timestamp = xstrndup(
+				lb->lb_first_timestamp.sr_str,
+				lb->lb_first_timestamp.sr_len);
+	}
+	if (lb->lb_has_mapmode) {
+		free(sbox_mapmode);
+		sbox_mapmode = xstrndup(lb->lb_mapmode.sr_str,
+			lb->lb_mapmode.sr_len);
+	}
+	/* the roots at the end of this block */
+	if (lb->lb_target_root && (!sbox_target_root ||
+	    strcmp(lb->lb_target_root, sbox_target_root))) {
+		free(sbox_target_root);
+		sbox_target_root = strdup(lb->lb_target_root);
+	}
+	if (lb->lb_tools_root && (!sbox_tools_root ||
+	    strcmp(lb->lb_tools_root, sbox_tools_root))) {
+		free(sbox_tools_root);
+		sbox_tools_root = strdup(lb->lb_tools_root);
+	}
+	for (i = 0; i < lb->lb_allocated_roots.pa_count; i++)
+		free(lb->lb_allocated_roots.pa_items[i]);
+	free(lb->lb_allocated_roots.pa_items);
+
+	linenum += lb->lb_lines;
+	if (verbose) {
+		long dots;
+
+		for (dots = linenum / 1000 - dots_before; dots > 0; dots--)
+			putchar('.');
+		fflush(stdout);
+	}
+	for (t = 0; t < RE_NUM; t++) regfree(&lb->lb_regex[t]);
+}
+
+/* ========== Reading the log ========== */
+
+/* Scan the "#SBOX_..._ROOT=" lines of a block (in the main thread);
+ * the roots are needed when the next block is parsed. New values are
+ * added to "*allocatedp", to be freed after the batch has been merged. */
+static void scan_roots(const char *data, size_t len,
+	const char **target_rootp, const char **tools_rootp,
+	char ***allocatedp, size_t *num_allocatedp)
+{
+	const char *cp = data;
+	const char *end = data + len;
+
+	while (cp < end) {
+		const char *nl = memchr(cp, '\n', end - cp);
+		size_t	linelen = (nl ? (size_t)(nl - cp) : (size_t)(end - cp));
+		const char *v;
+
+		if (*cp == '#') {
+			char **dst = NULL;
+
+			if ((v = root_from_comment_line(cp, linelen,
+			    "#SBOX_TARGET_ROOT=")))
+				dst = (char **)target_rootp;
+			else if ((v = root_from_comment_line(cp, linelen,
+			    "#SBOX_TOOLS_ROOT=")))
+				dst = (char **)tools_rootp;
+			if (dst) {
+				*dst = xstrndup(v, linelen - (v - cp));
+				*allocatedp = xrealloc(*allocatedp,
+					(*num_allocatedp + 1) * sizeof(char *));
+				(*allocatedp)[(*num_allocatedp)++] = *dst;
+			}
+		}
+		cp += linelen + 1;
+	}
+}
+
+static void read_log(FILE *input)
+{
+	log_block_t	*blocks = xcalloc(num_threads, sizeof(log_block_t));
+	pthread_t	*threads = xcalloc(num_threads, sizeof(pthread_t));
+	char		*carry = NULL;	/* incomplete line */
+	size_t		carry_len = 0;
+	int		eof = 0;
+
+	while (!eof) {
+		int	n, i;
+		const char *target_root = sbox_target_root;
+		const char *tools_root = sbox_tools_root;
+		char	**allocated_roots = NULL;
+		size_t	num_allocated_roots = 0;
+
+		/* fill a batch of blocks */
+		for (n = 0; (n < num_threads) && !eof; n++) {
+			log_block_t	*lb = &blocks[n];
+			char		*last_nl;
+			size_t		r;
+
+			memset(lb, 0, sizeof(*lb));
+			lb->lb_size = LOGZ_BLOCK_SIZE + carry_len;
+			lb->lb_data = xmalloc(lb->lb_size);
+			if (carry_len) memcpy(lb->lb_data, carry, carry_len);
+			lb->lb_len = carry_len;
+			free(carry);
+			carry = NULL;
+			carry_len = 0;
+
+			for (;;) {
+				r = fread(lb->lb_data + lb->lb_len, 1,
+					lb->lb_size - lb->lb_len, input);
+				lb->lb_len += r;
+				if (lb->lb_len < lb->lb_size) {
+					eof = 1;
+					break;
+				}
+				last_nl = memrchr(lb->lb_data, '\n',
+					lb->lb_len);
+				if (last_nl) {
+					carry_len = lb->lb_len -
+						(last_nl + 1 - lb->lb_data);
+					if (carry_len)
+						carry = xstrndup(last_nl + 1,
+							carry_len);
+					lb->lb_len -= carry_len;
+					break;
+				}
+				/* a very long line, extend the block */
+				lb->lb_size *= 2;
+				lb->lb_data = xrealloc(lb->lb_data,
+					lb->lb_size);
+			}
+			if (!lb->lb_len) {
+				/* nothing more */
+				free(lb->lb_data);
+				lb->lb_data = NULL;
+				break;
+			}
+			/* the final newline does not start a new line */
+			if (lb->lb_data[lb->lb_len-1] == '\n')
+				lb->lb_len--;
+
+			lb->lb_target_root = target_root;
+			lb->lb_tools_root = tools_root;
+			scan_roots(lb->lb_data, lb->lb_len,
+				&target_root, &tools_root,
+				&allocated_roots, &num_allocated_roots);
+		}
+
+		/* parse the batch */
+		for (i = 0; i < n; i++) {
+			if ((n == 1) || pthread_create(&threads[i], NULL,
+			    parse_block, &blocks[i])) {
+				parse_block(&blocks[i]);
+				threads[i] = 0;
+			}
+		}
+		for (i = 0; i < n; i++)
+			if (threads[i]) pthread_join(threads[i], NULL);
+
+		/* and merge the results, in input order */
+		for (i = 0; i < n; i++) {
+			merge_block(&blocks[i]);
+			free(blocks[i].lb_data);
+			free(blocks[i].lb_scratch);
+			free(blocks[i].lb_pathbuf);
+		}
+
+		while (num_allocated_roots > 0)
+			free(allocated_roots[--num_allocated_roots]);
+		free(allocated_roots);
+	}
+	free(carry);
+	free(blocks);
+	free(threads);
+}
+
+/* ========== Reports ========== */
+
+/* print references and refering function names */
+static void print_details(path_data_t *pd, const char *arrow)
+{
+	ht_entry_t	**entries;
+	int		i;
+
+	entries = ht_sorted_entries(&pd->pd_refs);
+	for (i = 0; entries[i]; i++)
+		printf("    %2s\t%s\n", arrow, entries[i]->he_key);
+	free(entries);
+
+	entries = ht_sorted_entries(&pd->pd_fn_names);
+	printf("\t[");
+	for (i = 0; entries[i]; i++)
+		printf("%s%s", (i ? "," : ""), entries[i]->he_key);
+	printf("]\n");
+	free(entries);
+
+	entries = ht_sorted_entries(&pd->pd_procs);
+	printf("\t[");
+	for (i = 0; entries[i]; i++)
+		printf("%s%s", (i ? "," : ""), entries[i]->he_key);
+	printf("]\n");
+	free(entries);
+}
+
+static void check_multiple_refs(ht_entry_t **paths, const char *name_txt,
+	const char *ref_txt, const char *arrow)
+{
+	int	i;
+	int	found = 0;
+
+	for (i = 0; paths[i]; i++) {
+		path_data_t *pd = (path_data_t *)paths[i]->he_value;
+
+		if (pd->pd_refs.ht_count > 1) {
+			if (!found) {
+				printf("\nNOTICE: Following %s have been "
+					"mapped %s:\n", name_txt, ref_txt);
+				found = 1;
+			}
+			printf("\t%s\n", paths[i]->he_key);
+			if (print_full_details) {
+				print_details(pd, arrow);
+				printf("\n");
+			}
+		}
+	}
+}
+
+static void print_all_paths(ht_entry_t **paths, const char *name_txt,
+	const char *arrow)
+{
+	int	i;
+
+	printf("\n%s (#used, pathname):\n", name_txt);
+	for (i = 0; paths[i]; i++) {
+		path_data_t *pd = (path_data_t *)paths[i]->he_value;
+
+		printf("%ld\t%s\n", pd->pd_count, paths[i]->he_key);
+		if (print_full_details) {
+			print_details(pd, arrow);
+			printf("\n");
+		}
+	}
+}
+
+static void copy_spooled_lines(FILE *f)
+{
+	char	buf[8192];
+	size_t	n;
+
+	if (!f) return;
+	rewind(f);
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		fwrite(buf, 1, n, stdout);
+	printf("\n");
+}
+
+/* process accounting records (struct acct_v3) */
+typedef struct acct_v3_record_s {
+	uint8_t		ac_flag;
+	uint8_t		ac_version;
+	uint16_t	ac_tty;
+	uint32_t	ac_exitcode;
+	uint32_t	ac_uid;
+	uint32_t	ac_gid;
+	uint32_t	ac_pid;
+	uint32_t	ac_ppid;
+	uint32_t	ac_btime;
+	float		ac_etime;
+	uint16_t	ac_utime;
+	uint16_t	ac_stime;
+	uint16_t	ac_mem;
+	uint16_t	ac_io;
+	uint16_t	ac_rw;
+	uint16_t	ac_minflt;
+	uint16_t	ac_majflt;
+	uint16_t	ac_swaps;
+	char		ac_comm[16];
+} acct_v3_record_t;
+
+static void read_acct_file(void)
+{
+	FILE			*f;
+	acct_v3_record_t	a;
+	long			ticks;
+	char			pidbuf[32];
+
+	if (!acct_file) return;
+
+	if (!(f = fopen(acct_file, "r"))) {
+		fprintf(stderr, "Failed to open %s\n", acct_file);
+		exit(1);
+	}
+	ticks = sysconf(_SC_CLK_TCK);
+	if (ticks < 1) ticks = 1;
+
+	while (fread(&a, 64, 1, f) == 1) {
+		ht_entry_t	*e;
+		process_t	*proc;
+
+		if (a.ac_version != 3) {
+			fprintf(stderr, "acct record version != 3\n");
+			exit(1);
+		}
+		snprintf(pidbuf, sizeof(pidbuf), "%u", a.ac_pid);
+		e = ht_find(&all_processes_by_pid, pidbuf);
+		proc = (e ? (process_t *)e->he_value : NULL);
+		if (proc && ((uint32_t)atol(proc->pr_ppid) == a.ac_ppid)) {
+			printf("Found process %u: etime=%f utime=%d stime=%d\n",
+				a.ac_pid, a.ac_etime, a.ac_utime, a.ac_stime);
+			proc->pr_has_times = 1;
+			proc->pr_time_elapsed = a.ac_etime / ticks;
+			proc->pr_time_user = (double)a.ac_utime / ticks;
+			proc->pr_time_sys = (double)a.ac_stime / ticks;
+
+			if (proc->pr_program) {
+				program_t *prog = proc->pr_program;
+
+				prog->pg_time_elapsed += proc->pr_time_elapsed;
+				prog->pg_time_user += proc->pr_time_user;
+				prog->pg_time_sys += proc->pr_time_sys;
+			}
+			if (max_elapsed < proc->pr_time_elapsed)
+				max_elapsed = proc->pr_time_elapsed;
+			total_user += proc->pr_time_user;
+			total_sys += proc->pr_time_sys;
+		}
+	}
+	fclose(f);
+}
+
+/* summary in the dot-files: */
+static const char summary_table_begin[] = " [shape=octagon,margin=0,"
+	"label=<<table border=\"0\" cellborder=\"0\""
+	" cellspacing=\"0\">\n";
+static const char summary_table_end[] = "</table>>];\n";
+
+/* process/program element in the dot-files: */
+static const char pr_element_table_begin[] = " [shape=none,margin=0,"
+	"label=<<table border=\"0\" cellborder=\"1\""
+	" cellspacing=\"0\">\n";
+static const char pr_element_table_end[] = "</table>>];\n";
+
+static const char toploadcolor[] = "red";
+static const char highloadcolor[] = "sandybrown";
+static const char mediumloadcolor[] = "wheat";
+
+static void select_exec_policy_colors(const char *exec_policy,
+	const char **beginp, const char **endp)
+{
+	*beginp = *endp = "";
+	if (!strncmp(exec_policy, "Target", 6)) {
+		*beginp = "<font color=\"darkgreen\">";
+		*endp = "</font>";
+	} else if (!strncmp(exec_policy, "Tools", 5)) {
+		*beginp = "<font color=\"blue\">";
+		*endp = "</font>";
+	}
+}
+
+static void write_process_data(FILE *pdiag, process_t *rp)
+{
+	const char	*ep_color_begin, *ep_color_end;
+	const char	*exit_color_begin = "";
+	const char	*exit_color_end = "";
+	char		*exit_text = NULL;
+	int		has_prev_names = 0;
+	size_t		i;
+
+	select_exec_policy_colors(rp->pr_exec_policy,
+		&ep_color_begin, &ep_color_end);
+
+	if (rp->pr_exit_status) {
+		const char *cp = rp->pr_exit_status;
+
+		while (isdigit((unsigned char)*cp)) cp++;
+		if (!strcmp(rp->pr_exit_status, "0")) {
+			/* normal exit. */
+		} else if (*rp->pr_exit_status && !*cp) {
+			/* numeric */
+			if (asprintf(&exit_text, " exit(%s)",
+			    rp->pr_exit_status) < 0) exit(1);
+		} else {
+			if (asprintf(&exit_text, " %s",
+			    rp->pr_exit_status) < 0) exit(1);
+		}
+	} else {
+		exit_text = strdup(" NO EXIT STATUS");
+	}
+	if (exit_text) {
+		exit_color_begin = "<font color=\"red\">";
+		exit_color_end = "</font>";
+	}
+
+	fprintf(pdiag, "\t%s %s<tr><td colspan=\"2\"", rp->pr_label,
+		pr_element_table_begin);
+	if (rp->pr_cell_color)
+		fprintf(pdiag, " bgcolor=\"%s\"", rp->pr_cell_color);
+	fprintf(pdiag, ">");
+	for (i = 0; i < rp->pr_prev_names.pa_count; i++)
+		if (*(char *)rp->pr_prev_names.pa_items[i]) has_prev_names = 1;
+	if (has_prev_names)
+		for (i = 0; i < rp->pr_prev_names.pa_count; i++)
+			fprintf(pdiag, "%s%s", (i ? "<br/>" : ""),
+				(char *)rp->pr_prev_names.pa_items[i]);
+	fprintf(pdiag, "%s%s</td>\n</tr>\n<tr><td>pid=%s</td>\n<td>",
+		(has_prev_names ? "<br/>" : ""), rp->pr_name, rp->pr_pid);
+	if (has_prev_names) {
+		/* (previous exec policies are not colored, only
+		 * the final policy gets it) */
+		for (i = 0; i < rp->pr_prev_exec_policies.pa_count; i++)
+			fprintf(pdiag, "%s<br/>", (char *)
+				rp->pr_prev_exec_policies.pa_items[i]);
+	}
+	fprintf(pdiag, "%s%s%s</td>\n</tr>\n",
+		ep_color_begin, rp->pr_exec_policy, ep_color_end);
+	if (exit_text) {
+		fprintf(pdiag, "<tr><td colspan=\"2\">%s%s%s</td>\n</tr>\n",
+			exit_color_begin, exit_text, exit_color_end);
+		free(exit_text);
+	}
+	if (rp->pr_has_times) {
+		fprintf(pdiag, "<tr><td colspan=\"2\">real = %5.2f"
+			"<br/>user %5.2f + sys %5.2f = %5.2f</td>\n"
+			"</tr>\n",
+			rp->pr_time_elapsed, rp->pr_time_user,
+			rp->pr_time_sys,
+			rp->pr_time_user + rp->pr_time_sys);
+	}
+	fputs(pr_element_table_end, pdiag);
+}
+
+/* sort by user+sys time, biggest first; stable */
+static int compare_process_times(const void *a, const void *b)
+{
+	process_t *pa = *(process_t *const *)a;
+	process_t *pb = *(process_t *const *)b;
+	double	ta = pa->pr_time_user + pa->pr_time_sys;
+	double	tb = pb->pr_time_user + pb->pr_time_sys;
+
+	if (ta < tb) return(1);
+	if (ta > tb) return(-1);
+	return((pa < pb) ? -1 : (pa > pb));
+}
+
+static void write_process_diagram(void)
+{
+	FILE	*pdiag;
+	size_t	i, j;
+
+	if (acct_file) {
+		/* Add color to the most time consuming processes:
+		 * first sort them. Process structures are allocated in
+		 * order, which makes the sort stable */
+		size_t	num_processes = all_processes_array.pa_count;
+		process_t **sorted = xmalloc((num_processes + 1) *
+			sizeof(process_t *));
+		size_t	top_load_limit = 3;
+		size_t	high_load_limit = 15;
+		size_t	medium_load_limit = 30;
+		size_t	print_limit = (num_processes < medium_load_limit ?
+			num_processes : medium_load_limit);
+
+		memcpy(sorted, all_processes_array.pa_items,
+			num_processes * sizeof(process_t *));
+		qsort(sorted, num_processes, sizeof(process_t *),
+			compare_process_times);
+
+		/* add color attributes: */
+		for (i = 0; i < print_limit; i++) {
+			process_t *rp = sorted[i];
+			process_t *parent;
+
+			printf("PID=%d u=%5.2f s=%5.2f\n", atoi(rp->pr_pid),
+				rp->pr_time_user, rp->pr_time_sys);
+			if (i <= top_load_limit)
+				rp->pr_cell_color = toploadcolor;
+			else if (i <= high_load_limit)
+				rp->pr_cell_color = highloadcolor;
+			else if (i <= medium_load_limit)
+				rp->pr_cell_color = mediumloadcolor;
+			rp->pr_show_this = 1;
+
+			/* make sure that parent and grandparents will be
+			 * visible */
+			for (parent = rp->pr_parent; parent;
+			     parent = parent->pr_parent)
+				parent->pr_show_this = 1;
+		}
+		free(sorted);
+	}
+
+	if (!(pdiag = fopen(process_diagram_file, "w"))) return;
+	fprintf(pdiag, "digraph processes {\n\trankdir=LR;\n");
+	for (i = 0; i < all_processes_array.pa_count; i++) {
+		process_t *rp = all_processes_array.pa_items[i];
+		int	invisible_children = 0;
+
+		if (acct_file && !rp->pr_show_this) continue;
+
+		write_process_data(pdiag, rp);
+		for (j = 0; j < rp->pr_children.pa_count; j++) {
+			process_t *cp = rp->pr_children.pa_items[j];
+
+			if (!acct_file || cp->pr_show_this)
+				fprintf(pdiag, "\t%s -> %s;\n",
+					rp->pr_label, cp->pr_label);
+			else
+				invisible_children++;
+		}
+		for (j = 0; j < rp->pr_adopted_children.pa_count; j++) {
+			process_t *cp = rp->pr_adopted_children.pa_items[j];
+
+			if (!acct_file || cp->pr_show_this)
+				fprintf(pdiag, "\t%s -> %s [style=dashed];\n",
+					rp->pr_label, cp->pr_label);
+			else
+				invisible_children++;
+		}
+		if (invisible_children > 0) {
+			fprintf(pdiag, "\t%s -> %sic;\n",
+				rp->pr_label, rp->pr_label);
+			if (invisible_children == 1)
+				fprintf(pdiag, "\t%sic [shape=ellipse,"
+					"label=\"one child process\"];\n",
+					rp->pr_label);
+			else
+				fprintf(pdiag, "\t%sic [shape=ellipse,"
+					"label=\"%d child processes\"];\n",
+					rp->pr_label, invisible_children);
+		}
+	}
+	fprintf(pdiag, "}\n");
+	fclose(pdiag);
+}
+
+typedef struct program_key_s {
+	const char	*pk_id;
+	program_t	*pk_program;
+} program_key_t;
+
+static int compare_program_times(const void *a, const void *b)
+{
+	const program_key_t *pa = (const program_key_t *)a;
+	const program_key_t *pb = (const program_key_t *)b;
+	double	ta = pa->pk_program->pg_time_user + pa->pk_program->pg_time_sys;
+	double	tb = pb->pk_program->pg_time_user + pb->pk_program->pg_time_sys;
+
+	if (ta < tb) return(1);
+	if (ta > tb) return(-1);
+	return(0);
+}
+
+static void write_exec_diagram(void)
+{
+	FILE		*ediag;
+	ht_entry_t	**all_program_keys;
+	size_t		num_programs = programs.ht_count;
+	size_t		i;
+
+	if (!(ediag = fopen(exec_diagram_file, "w"))) return;
+	fprintf(ediag, "digraph programs {\n"
+		"\trankdir=LR;\n"
+		"summary %s"
+		"<tr><td>Totals:"
+		"<br/>real = %5.2f"
+		"<br/>user = %5.2f<br/>sys = %5.2f\n"
+		"<br/>user + sys = %5.2f</td>\n"
+		"</tr>\n",
+		summary_table_begin,
+		max_elapsed, total_user, total_sys, total_user + total_sys);
+	if (acct_file) {
+		fprintf(ediag,
+			"<tr>\n"
+			"<td bgcolor=\"%s\">Load = top 3%%</td>\n"
+			"</tr>\n"
+			"<tr>\n"
+			"<td bgcolor=\"%s\">Load = high (10%%)</td>\n"
+			"</tr>\n"
+			"<tr>\n"
+			"<td bgcolor=\"%s\">Load = medium (20%%)</td>\n"
+			"</tr>\n",
+			toploadcolor, highloadcolor, mediumloadcolor);
+	}
+	fputs(summary_table_end, ediag);
+
+	all_program_keys = ht_entries(&programs);
+	if (acct_file) {
+		/* Add color to the most time consuming programs:
+		 * first sort them: */
+		program_key_t	*sorted = xmalloc((num_programs + 1) *
+			sizeof(program_key_t));
+		double	top_load_limit = num_programs * .03; /* 3% */
+		double	high_load_limit = num_programs * .10; /* 10% */
+		double	medium_load_limit = num_programs * .20; /* 20% */
+
+		for (i = 0; i < num_programs; i++) {
+			sorted[i].pk_id = all_program_keys[i]->he_key;
+			sorted[i].pk_program = all_program_keys[i]->he_value;
+		}
+		qsort(sorted, num_programs, sizeof(program_key_t),
+			compare_program_times);
+
+		/* add color attributes: */
+		for (i = 0; i < num_programs; i++) {
+			program_t *rp = sorted[i].pk_program;
+
+			printf("u=%5.2f s=%5.2f %s\n", rp->pg_time_user,
+				rp->pg_time_sys, sorted[i].pk_id);
+			if (i <= top_load_limit)
+				rp->pg_cell_color = toploadcolor;
+			else if (i <= high_load_limit)
+				rp->pg_cell_color = highloadcolor;
+			else if (i <= medium_load_limit)
+				rp->pg_cell_color = mediumloadcolor;
+		}
+		free(sorted);
+	}
+
+	for (i = 0; i < num_programs; i++) {
+		program_t	*rp = all_program_keys[i]->he_value;
+		const char	*ep_color_begin, *ep_color_end;
+		ht_entry_t	**executed;
+		size_t		j;
+
+		select_exec_policy_colors(rp->pg_exec_policy,
+			&ep_color_begin, &ep_color_end);
+
+		fprintf(ediag, "\t%s %s<tr>\n<td ", rp->pg_label,
+			pr_element_table_begin);
+		if (rp->pg_cell_color)
+			fprintf(ediag, "bgcolor=\"%s\" ", rp->pg_cell_color);
+		fprintf(ediag, "colspan=\"2\">%s</td>\n"
+			"</tr>\n"
+			"<tr><td>n=%ld</td>\n"
+			"<td>%s%s%s</td>\n"
+			"</tr>\n",
+			rp->pg_exec_binary, rp->pg_instances,
+			ep_color_begin, rp->pg_exec_policy, ep_color_end);
+
+		if (acct_file) {
+			double tu = rp->pg_time_user;
+			double ts = rp->pg_time_sys;
+
+			fprintf(ediag, "<tr><td colspan=\"2\">real = %5.2f"
+				"<br/>user %5.2f + sys %5.2f<br/>\n"
+				" = %5.2f (%2.2f%%)</td>\n"
+				"</tr>\n",
+				rp->pg_time_elapsed, tu, ts, tu + ts,
+				((tu + ts) * 100) / (total_user + total_sys));
+		}
+		fputs(pr_element_table_end, ediag);
+
+		executed = ht_entries(&rp->pg_executed);
+		for (j = 0; executed[j]; j++) {
+			ht_entry_t *x = ht_find(&programs, executed[j]->he_key);
+
+			fprintf(ediag, "\t%s -> %s;\n", rp->pg_label,
+				(x ? ((program_t *)x->he_value)->pg_label : ""));
+		}
+		free(executed);
+	}
+	free(all_program_keys);
+	fprintf(ediag, "}\n");
+	fclose(ediag);
+}
+
+static void write_reports(void)
+{
+	ht_entry_t	**sorted_paths[PT_NUM_TABLES];
+	ht_entry_t	**entries;
+	int		t, i;
+
+	if (num_errors > 0) {
+		printf("\nErrors:\n");
+		copy_spooled_lines(errors_file);
+	}
+	if (num_warnings > 0) {
+		printf("\nWarnings:\n");
+		copy_spooled_lines(warnings_file);
+	}
+	if (num_notices > 0) {
+		if (print_notices) {
+			printf("\nNotices:\n");
+			copy_spooled_lines(notices_file);
+		} else {
+			printf("\n(Use option -N to print all "
+				"'notice'-messages)\n");
+		}
+	}
+
+	for (t = 0; t < PT_NUM_TABLES; t++)
+		sorted_paths[t] = ht_sorted_entries(&path_tables[t]);
+
+	printf("\nMapping mode = %s,\n"
+		"\tTimeframe: %s ... %s,\n"
+		"\t%ld errors, %ld warnings, %ld notices.\n",
+		(sbox_mapmode ? sbox_mapmode : "UNKNOWN"),
+		(first_timestamp ? first_timestamp : ""),
+		(last_timestamp ? last_timestamp : ""),
+		num_errors, num_warnings, num_notices);
+	if (sbox_target_root)
+		printf("\tTARGET_ROOT = %s\n", sbox_target_root);
+	if (sbox_tools_root)
+		printf("\tTOOLS_ROOT = %s\n", sbox_tools_root);
+
+	printf("Number of processes: %zu\n", all_processes.ht_count);
+
+	if (print_process_statistics) {
+		size_t	num_unknown_exit_status = 0;
+
+		printf("\tNumber of instances, process name:\n");
+		entries = ht_sorted_entries(&argv0_counters);
+		for (i = 0; entries[i]; i++)
+			printf("\t\t%ld\t%s\n",
+				(long)(intptr_t)entries[i]->he_value,
+				entries[i]->he_key);
+		free(entries);
+
+		entries = ht_entries(&active_processes);
+		for (i = 0; entries[i]; i++)
+			if (entries[i]->he_value) num_unknown_exit_status++;
+		if (num_unknown_exit_status > 0) {
+			printf("\t%zu processes with unknown exit status "
+				"(or still active):\n",
+				num_unknown_exit_status);
+			for (i = 0; entries[i]; i++) {
+				process_t *rp = entries[i]->he_value;
+
+				if (rp) printf("\t\t%s\t%s\n",
+					entries[i]->he_key, rp->pr_name);
+			}
+		}
+		free(entries);
+	}
+
+	printf("Number of pathnames:\n"
+		"\tMapped %zu to %zu destinations\n"
+		"\tPassed %zu pathnames without modifications\n"
+		"\tPassed %zu because mapping was disabled\n",
+		path_tables[PT_MAPPED_SRC].ht_count,
+		path_tables[PT_MAPPED_DEST].ht_count,
+		path_tables[PT_PASSED].ht_count,
+		path_tables[PT_DISABLED].ht_count);
+
+	if (blacklisted_functions.ht_count > 0) {
+		entries = ht_sorted_entries(&blacklisted_functions);
+		printf("Lines from following functions were ignored:\n\t");
+		for (i = 0; entries[i]; i++)
+			printf("%s%s", (i ? "," : ""), entries[i]->he_key);
+		printf("\n");
+		free(entries);
+	}
+
+	/* First, check if there are potentially problematic paths: */
+	check_multiple_refs(sorted_paths[PT_MAPPED_SRC],
+		"source paths", "to multiple destinations", "->");
+	check_multiple_refs(sorted_paths[PT_MAPPED_DEST],
+		"destination paths", "from multiple sources", "<-");
+
+	if (print_mapped_paths)
+		print_all_paths(sorted_paths[PT_MAPPED_SRC],
+			"Mapped pathnames, by source path", "->");
+	if (print_revmap_paths)
+		print_all_paths(sorted_paths[PT_MAPPED_DEST],
+			"Mapped pathnames, by destination path", "<-");
+	if (print_passed_paths)
+		print_all_paths(sorted_paths[PT_PASSED],
+			"Passed pathnames", "");
+	if (print_disabled_passed_paths)
+		print_all_paths(sorted_paths[PT_DISABLED],
+			"Mapping disabled => passed pathnames", "");
+
+	for (t = 0; t < PT_NUM_TABLES; t++)
+		free(sorted_paths[t]);
+
+	if (acct_file) read_acct_file();
+
+	if (process_diagram_file) write_process_diagram();
+	if (exec_diagram_file) write_exec_diagram();
+
+	if (!print_mapped_paths && !print_revmap_paths &&
+	    !print_passed_paths && !print_disabled_passed_paths &&
+	    !process_diagram_file && !exec_diagram_file) {
+		printf("\n(use options -m, -r, -p and/or -i to print more "
+			"information about\n"
+			"processed paths, and -l to get full details)\n");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int	opt;
+	int	no_blacklist = 0;
+	char	*user_blacklist = NULL;
+	long	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	progname = argv[0];
+	num_threads = (ncpus > 0 ? (int)ncpus : 1);
+
+	while ((opt = getopt(argc, argv, "A:bB:hilmNprsvP:E:j:")) != -1) {
+		switch (opt) {
+		case 'A': acct_file = optarg; break;
+		case 'b': no_blacklist = 1; break;
+		case 'B': user_blacklist = optarg; break;
+		case 'h': usage(); exit(0);
+		case 'i': print_disabled_passed_paths = 1; break;
+		case 'l': print_full_details = 1; break;
+		case 'm': print_mapped_paths = 1; break;
+		case 'N': print_notices = 1; break;
+		case 'p': print_passed_paths = 1; break;
+		case 'r': print_revmap_paths = 1; break;
+		case 's': print_process_statistics = 1; break;
+		case 'v': verbose = 1; break;
+		case 'P': process_diagram_file = optarg; break;
+		case 'E': exec_diagram_file = optarg; break;
+		case 'j':
+			num_threads = atoi(optarg);
+			if (num_threads < 1) num_threads = 1;
+			break;
+		default: usage(); exit(1);
+		}
+	}
+
+	/* list of functions that should be ignored unless -b is
+	 * specified: */
+	if (!no_blacklist) {
+		ht_add(&blacklisted_functions, "__xstat");
+		ht_add(&blacklisted_functions, "__xstat64");
+		ht_add(&blacklisted_functions, "__lxstat");
+		ht_add(&blacklisted_functions, "__lxstat64");
+	}
+	if (user_blacklist) {
+		char *fn;
+
+		for (fn = strtok(user_blacklist, ","); fn;
+		     fn = strtok(NULL, ","))
+			ht_add(&blacklisted_functions, fn);
+	}
+
+	if (verbose) printf("Reading log:\n");
+	read_log(stdin);
+	if (verbose) printf("\nRead %ld lines.\n", linenum);
+
+	write_reports();
+	return(0);
+}
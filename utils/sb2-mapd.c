@@ -0,0 +1,62 @@
+/* sb2-mapd:
+ * The mapping daemon. Keeps a pre-initialized copy of libsb2 and its
+ * Lua state, and serves path mapping and exec requests of other
+ * processes in the session (see preload/mapd.c)
+ *
+ * Started by "sb2 -z"; must be executed under libsb2 (LD_PRELOAD).
+ * Exits when the session process exits (by default, the parent).
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <config.h>
+
+#include "sb2.h"
+
+static void *libsb2_handle = NULL;
+
+static void usage_exit(const char *progname, const char *errmsg, int exitstatus)
+{
+	if (errmsg)
+		fprintf(stderr, "%s: Error: %s\n", progname, errmsg);
+
+	fprintf(stderr, "\nUsage:\n"
+		"\t%s socket_path [session_pid]\n"
+		"The mapping daemon of scratchbox2, started by \"sb2 -z\".\n",
+		progname);
+	exit(exitstatus);
+}
+
+int main(int argc, char *argv[])
+{
+	char	*progname = argv[0];
+	int	(*serve_fnptr)(const char *, int) = NULL;
+	int	session_pid = getppid();
+
+	if ((argc != 2) && (argc != 3))
+		usage_exit(progname, "Wrong number of parameters", 1);
+	if (argc == 3) {
+		session_pid = atoi(argv[2]);
+		if (session_pid <= 0)
+			usage_exit(progname, "Invalid session_pid", 1);
+	}
+
+	/* disable mapping; dlopen must run without mapping. */
+	setenv("SBOX_DISABLE_MAPPING", "1", 1/*overwrite*/);
+	libsb2_handle = dlopen(LIBSB2, RTLD_NOW);
+	unsetenv("SBOX_DISABLE_MAPPING");
+
+	if (libsb2_handle)
+		serve_fnptr = (int(*)(const char *, int))dlsym(libsb2_handle,
+			"sb2mapd__serve__");
+	if (!serve_fnptr)
+		usage_exit(progname, "This command can only be used "
+			"inside a session", 1);
+
+	return((*serve_fnptr)(argv[1], session_pid) < 0 ? 1 : 0);
+}
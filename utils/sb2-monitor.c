@@ -15,6 +15,11 @@
  * "built in" to the signal system. All of this can be described as 
  * yet another best-effort game..
  *
+ * Optionally (-p), this also collects profiling records from all
+ * processes of the session: a datagram socket is inherited by the
+ * command (see preload/profiler.c) and everything that arrives to it
+ * is appended to a file while waiting for the command to finish.
+ *
  *
  * Copyright (c) 2008 Nokia Corporation. All rights reserved.
  * Author: Lauri T. Aarnio
@@ -31,6 +36,8 @@
 #include <unistd.h>
 #include <string.h>
 #include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
 
 #include <config.h>
 
@@ -45,6 +52,11 @@ static int	debug = 0;
 
 static const char *progname;
 
+/* The command's end of the profiling channel is moved to this
+ * descriptor (or the first free one above it), out of the way of
+ * descriptors that programs use for their own purposes */
+#define PROFILE_CHANNEL_MIN_FD	500
+
 #define DEBUG_MSG(...) \
 	do { \
 		if (debug) { \
@@ -68,6 +80,7 @@ static void usage_exit(const char *errmsg, int exitstatus)
 		"\t-e envdir\tRead additional environment variables from 'envdir'\n"
 		"\t-g\tcreate a session and new process group by calling setsid()\n"
 		"\t-G pgrpfile\tappend process group ID to 'pgrpfile'\n"
+		"\t-p file\tcollect profiling records of all processes to 'file'\n"
 		"\nExample:\n"
 		"\t%s -x /bin/echo -- signaltester -n 5\n",
 		progname, progname, progname, progname);
@@ -247,6 +260,48 @@ static void catch_all_signals(void)
 #endif
 }
 
+/* Create the profiling channel. Returns the monitor's end, and the
+ * value for SBOX_PROFILE_FD in "channel" */
+static int create_profile_channel(char *channel, size_t channel_size)
+{
+	int		fds[2];
+	int		cmd_fd;
+	int		bufsize = 1024 * 1024;
+	struct stat	st;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0)
+		usage_exit("socketpair() failed", 1);
+	/* a large receive buffer reduces the risk that processes
+	 * have to wait for this process when many exit at once */
+	setsockopt(fds[0], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+	cmd_fd = fcntl(fds[1], F_DUPFD, PROFILE_CHANNEL_MIN_FD);
+	if (cmd_fd < 0) cmd_fd = fds[1];
+	else close(fds[1]);
+	if (fstat(cmd_fd, &st) < 0) usage_exit("fstat() failed", 1);
+	snprintf(channel, channel_size, "%d,%lu", cmd_fd,
+		(unsigned long)st.st_ino);
+
+	/* the monitor's end must not be inherited by the command */
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	DEBUG_MSG("profiling channel: %s\n", channel);
+	return(fds[0]);
+}
+
+/* copy everything that has arrived to the profiling channel */
+static void copy_profile_records(int channel_fd, int out_fd)
+{
+	char	buf[2048];
+	ssize_t	len;
+
+	while ((len = recv(channel_fd, buf, sizeof(buf), 0)) > 0) {
+		if (write(out_fd, buf, len) < len) {
+			DEBUG_MSG("failed to write profiling records\n");
+		}
+	}
+}
+
 static void read_env_vars_from_dir(const char *envdir)
 {
 	DIR	*ed;
@@ -316,10 +371,14 @@ int main(int argc, char *argv[])
 	char	*envdir = NULL;
 	int	new_session = 0;
 	char	*pgrpfile = NULL;
+	char	*profile_file = NULL;
+	int	profile_channel_fd = -1;
+	int	profile_out_fd = -1;
+	char	profile_channel[100];
 
 	progname = argv[0];
 	
-	while ((opt = getopt(argc, argv, "L:x:dhe:gG:")) != -1) {
+	while ((opt = getopt(argc, argv, "L:x:dhe:gG:p:")) != -1) {
 		switch (opt) {
 		case 'L': sbox_libsb2 = optarg; break;
 		case 'h': usage_exit(NULL, 0); break;
@@ -328,6 +387,7 @@ int main(int argc, char *argv[])
 		case 'e': envdir = optarg; break;
 		case 'g': new_session = 1; break;
 		case 'G': pgrpfile = optarg; break;
+		case 'p': profile_file = optarg; break;
 		default: usage_exit("Illegal option", 1); break;
 		}
 	}
@@ -357,6 +417,16 @@ int main(int argc, char *argv[])
 
 	DEBUG_MSG("PGID=%d\n", (int)getpgrp());
 
+	if (profile_file) {
+		profile_out_fd = open(profile_file,
+			O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (profile_out_fd < 0)
+			usage_exit("failed to open the profile file", 1);
+		fcntl(profile_out_fd, F_SETFD, FD_CLOEXEC);
+		profile_channel_fd = create_profile_channel(profile_channel,
+			sizeof(profile_channel));
+	}
+
 	/* create a child process which will execute the command. */
 	child_pid = fork();
 
@@ -415,6 +485,9 @@ int main(int argc, char *argv[])
 			read_env_vars_from_dir(envdir);
 		}
 
+		if (profile_channel_fd >= 0)
+			setenv("SBOX_PROFILE_FD", profile_channel, 1);
+
 		while (argv[optind] && strchr(argv[optind], '=')) {
 			DEBUG_MSG("child: putenv(%s)\n", argv[optind]);
 			putenv(strdup(argv[optind]));
@@ -490,6 +563,9 @@ int main(int argc, char *argv[])
 #endif
 		close(child2_to_master_pipe_fds[0]); /* close R-end */
 		close(master_to_child2_pipe_fds[1]); /* close W-end */
+		/* the profiling channel must be closed when the monitor
+		 * stops reading it, otherwise late senders would block */
+		if (profile_channel_fd >= 0) close(profile_channel_fd);
 
 		/* process group has been created and changed, 
 		 * let the parent continue by writing a byte. */
@@ -532,10 +608,32 @@ int main(int argc, char *argv[])
 	errno = 0;
 
 	/* wait until the worker child has finished. */
-	while ((waitpid(child_pid, &status, 0) == -1) &&
-	       (errno == EINTR)) {
-		DEBUG_MSG("parent: EINTR\n");
-		errno = 0;
+	if (profile_channel_fd >= 0) {
+		/* ..and collect profiling records while waiting */
+		struct pollfd	pfd;
+		pid_t		r;
+
+		pfd.fd = profile_channel_fd;
+		pfd.events = POLLIN;
+		while (1) {
+			if (poll(&pfd, 1, 500) > 0)
+				copy_profile_records(profile_channel_fd,
+					profile_out_fd);
+			errno = 0;
+			r = waitpid(child_pid, &status, WNOHANG);
+			if (r == child_pid) break;
+			if ((r < 0) && (errno != EINTR)) break;
+		}
+		/* records of the last processes */
+		copy_profile_records(profile_channel_fd, profile_out_fd);
+		close(profile_channel_fd);
+		close(profile_out_fd);
+	} else {
+		while ((waitpid(child_pid, &status, 0) == -1) &&
+		       (errno == EINTR)) {
+			DEBUG_MSG("parent: EINTR\n");
+			errno = 0;
+		}
 	}
 
 	DEBUG_MSG("parent: child returned\n");
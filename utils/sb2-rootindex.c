@@ -0,0 +1,455 @@
+/* sb2-rootindex:
+ * Create and check root index files (see include/rootindex.h).
+ *
+ * "sb2 -I" calls this at session creation to create or update the
+ * indexes of target_root and tools_root; it can also be used directly.
+ * Must be executed outside of sb2 sessions, the root directory is
+ * read without path mapping.
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <config.h>
+
+#include "rootindex.h"
+
+struct index_item {
+	char		*ii_path;
+	char		*ii_link;
+	uint32_t	ii_mode;
+	uint32_t	ii_flags;
+	uint64_t	ii_size;
+};
+
+static struct index_item	*items = NULL;
+static size_t			num_items = 0;
+static size_t			max_items = 0;
+static dev_t			root_dev;
+
+static const char *progname;
+
+static void usage_exit(const char *errmsg, int exitstatus)
+{
+	if (errmsg)
+		fprintf(stderr, "%s: Error: %s\n", progname, errmsg);
+
+	fprintf(stderr, "\nUsage:\n"
+		"\t%s [-f] update ROOT INDEXFILE\n"
+		"\t%s check ROOT INDEXFILE\n"
+		"\t%s lookup INDEXFILE PATH\n"
+		"\nCreates or checks an index of the files under ROOT. \"update\"\n"
+		"recreates the index if it is out of date (or always, with -f).\n"
+		"\"check\" returns 0 if the index is up to date. \"lookup\"\n"
+		"shows the entry of PATH (a path under ROOT).\n",
+		progname, progname, progname);
+	exit(exitstatus);
+}
+
+static void *xmalloc(size_t size)
+{
+	void	*p = malloc(size);
+
+	if (!p) {
+		fprintf(stderr, "%s: Out of memory\n", progname);
+		exit(1);
+	}
+	return(p);
+}
+
+static char *xstrdup(const char *s)
+{
+	char	*p = xmalloc(strlen(s) + 1);
+
+	strcpy(p, s);
+	return(p);
+}
+
+static struct index_item *add_item(const char *path, const struct stat *st)
+{
+	struct index_item	*ii;
+
+	if (num_items == max_items) {
+		struct index_item	*new_items;
+
+		max_items = max_items ? max_items * 2 : 4096;
+		new_items = realloc(items, max_items * sizeof(*items));
+		if (!new_items) {
+			fprintf(stderr, "%s: Out of memory\n", progname);
+			exit(1);
+		}
+		items = new_items;
+	}
+	ii = &items[num_items++];
+	ii->ii_path = xstrdup(path);
+	ii->ii_link = NULL;
+	ii->ii_mode = st->st_mode;
+	ii->ii_flags = 0;
+	ii->ii_size = st->st_size;
+	return(ii);
+}
+
+/* Add contents of directory "dirfd" (which is "path" relative to the
+ * root) to the index, recursively. Closes dirfd. */
+static void index_directory(int dirfd, const char *path, size_t dir_item)
+{
+	DIR		*dir;
+	struct dirent	*de;
+	char		*child_path = NULL;
+	size_t		child_path_size = 0;
+
+	dir = fdopendir(dirfd);
+	if (!dir) {
+		close(dirfd);
+		items[dir_item].ii_flags |= SB2_ROOTINDEX_F_NOT_INDEXED;
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		struct stat		st;
+		struct index_item	*ii;
+		size_t			len;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			/* disappeared, or can't be accessed. Can't
+			 * tell anything about this directory. */
+			items[dir_item].ii_flags |= SB2_ROOTINDEX_F_NOT_INDEXED;
+			continue;
+		}
+		len = strlen(path) + strlen(de->d_name) + 2;
+		if (len > child_path_size) {
+			free(child_path);
+			child_path_size = len + 64;
+			child_path = xmalloc(child_path_size);
+		}
+		sprintf(child_path, "%s/%s", path, de->d_name);
+		ii = add_item(child_path, &st);
+
+		if (S_ISLNK(st.st_mode)) {
+			char	link_dest[PATH_MAX + 1];
+			int	link_len;
+
+			link_len = readlinkat(dirfd, de->d_name,
+				link_dest, PATH_MAX);
+			if (link_len > 0) {
+				link_dest[link_len] = '\0';
+				ii->ii_link = xstrdup(link_dest);
+			} else {
+				/* type is known, but the destination isn't */
+				items[dir_item].ii_flags |=
+					SB2_ROOTINDEX_F_NOT_INDEXED;
+				num_items--;
+				free(ii->ii_path);
+			}
+		} else if (S_ISDIR(st.st_mode)) {
+			size_t	this_item = num_items - 1;
+			int	fd;
+
+			if (st.st_dev != root_dev) {
+				/* a mount point. don't cross it. */
+				ii->ii_flags |= SB2_ROOTINDEX_F_NOT_INDEXED;
+				continue;
+			}
+			fd = openat(dirfd, de->d_name,
+				O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (fd < 0) {
+				ii->ii_flags |= SB2_ROOTINDEX_F_NOT_INDEXED;
+				continue;
+			}
+			index_directory(fd, child_path, this_item);
+		}
+	}
+	closedir(dir);
+	free(child_path);
+}
+
+static int compare_items(const void *a, const void *b)
+{
+	return(strcmp(((const struct index_item *)a)->ii_path,
+		((const struct index_item *)b)->ii_path));
+}
+
+static void get_generation(const char *root, const char *file,
+	struct sb2_rootindex_generation *gen)
+{
+	char		path[PATH_MAX + 1];
+	struct stat	st;
+
+	memset(gen, 0, sizeof(*gen));
+	snprintf(path, sizeof(path), "%s%s", root, file);
+	if (stat(path, &st) == 0) {
+		gen->rig_mtime_sec = st.st_mtim.tv_sec;
+		gen->rig_mtime_nsec = st.st_mtim.tv_nsec;
+		gen->rig_ino = st.st_ino;
+	}
+}
+
+/* Returns 0 if "index_file" exists and describes "root" as it is now */
+static int check_index(const char *root, const char *index_file)
+{
+	static const char *generation_files[] = SB2_ROOTINDEX_GENERATION_FILES;
+	struct sb2_rootindex_header	hdr;
+	FILE	*f;
+	char	*indexed_root;
+	int	i;
+
+	f = fopen(index_file, "r");
+	if (!f) return(-1);
+	if ((fread(&hdr, sizeof(hdr), 1, f) != 1) ||
+	    memcmp(hdr.rih_magic, SB2_ROOTINDEX_MAGIC,
+		SB2_ROOTINDEX_MAGIC_LEN) ||
+	    (hdr.rih_header_size != sizeof(hdr)) ||
+	    (hdr.rih_entry_size != sizeof(struct sb2_rootindex_entry)) ||
+	    (hdr.rih_root_offs >= hdr.rih_strings_size)) {
+		fclose(f);
+		return(-1);
+	}
+	indexed_root = xmalloc(hdr.rih_strings_size - hdr.rih_root_offs);
+	if (fseek(f, hdr.rih_strings_offs + hdr.rih_root_offs, SEEK_SET) ||
+	    (fread(indexed_root, hdr.rih_strings_size - hdr.rih_root_offs,
+		1, f) != 1) ||
+	    strcmp(indexed_root, root)) {
+		free(indexed_root);
+		fclose(f);
+		return(-1);
+	}
+	free(indexed_root);
+	fclose(f);
+
+	for (i = 0; i < SB2_ROOTINDEX_NUM_GENERATION_FILES; i++) {
+		struct sb2_rootindex_generation	gen;
+
+		get_generation(root, generation_files[i], &gen);
+		if ((gen.rig_mtime_sec != hdr.rih_generation[i].rig_mtime_sec) ||
+		    (gen.rig_mtime_nsec != hdr.rih_generation[i].rig_mtime_nsec) ||
+		    (gen.rig_ino != hdr.rih_generation[i].rig_ino))
+			return(-1);
+	}
+	return(0);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char	*p = buf;
+
+	while (len > 0) {
+		ssize_t	n = write(fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return(-1);
+		}
+		p += n;
+		len -= n;
+	}
+	return(0);
+}
+
+static int build_index(const char *root, const char *index_file)
+{
+	static const char *generation_files[] = SB2_ROOTINDEX_GENERATION_FILES;
+	struct sb2_rootindex_header	hdr;
+	struct sb2_rootindex_entry	*entries;
+	struct stat	st;
+	char		*strings;
+	char		*tmp_name;
+	uint64_t	strings_size;
+	uint64_t	offs;
+	size_t		i;
+	int		fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	/* generations are taken before the tree is read, so that
+	 * modifications made during the walk invalidate the result */
+	for (i = 0; i < SB2_ROOTINDEX_NUM_GENERATION_FILES; i++)
+		get_generation(root, generation_files[i],
+			&hdr.rih_generation[i]);
+
+	fd = open(root, O_RDONLY | O_DIRECTORY);
+	if ((fd < 0) || (fstat(fd, &st) < 0)) {
+		fprintf(stderr, "%s: Can't open %s\n", progname, root);
+		return(-1);
+	}
+	root_dev = st.st_dev;
+	add_item("", &st);
+	index_directory(fd, "", 0);
+	qsort(items, num_items, sizeof(*items), compare_items);
+
+	/* string table */
+	strings_size = 1 + strlen(root) + 1;
+	for (i = 0; i < SB2_ROOTINDEX_NUM_GENERATION_FILES; i++)
+		strings_size += strlen(generation_files[i]) + 1;
+	for (i = 0; i < num_items; i++) {
+		strings_size += strlen(items[i].ii_path) + 1;
+		if (items[i].ii_link)
+			strings_size += strlen(items[i].ii_link) + 1;
+	}
+	if (strings_size > UINT32_MAX) {
+		fprintf(stderr, "%s: %s: too many files\n", progname, root);
+		return(-1);
+	}
+	strings = xmalloc(strings_size);
+	entries = xmalloc(num_items * sizeof(*entries) + 1);
+	strings[0] = '\0';
+	offs = 1;
+#define ADD_STRING(s, offsvar) do { \
+		size_t len = strlen(s) + 1; \
+		memcpy(strings + offs, (s), len); \
+		(offsvar) = offs; \
+		offs += len; \
+	} while (0)
+	ADD_STRING(root, hdr.rih_root_offs);
+	for (i = 0; i < SB2_ROOTINDEX_NUM_GENERATION_FILES; i++)
+		ADD_STRING(generation_files[i],
+			hdr.rih_generation[i].rig_path_offs);
+	for (i = 0; i < num_items; i++) {
+		ADD_STRING(items[i].ii_path, entries[i].rie_path_offs);
+		if (items[i].ii_link)
+			ADD_STRING(items[i].ii_link, entries[i].rie_link_offs);
+		else
+			entries[i].rie_link_offs = 0;
+		entries[i].rie_mode = items[i].ii_mode;
+		entries[i].rie_flags = items[i].ii_flags;
+		entries[i].rie_size = items[i].ii_size;
+	}
+#undef ADD_STRING
+
+	memcpy(hdr.rih_magic, SB2_ROOTINDEX_MAGIC, SB2_ROOTINDEX_MAGIC_LEN);
+	hdr.rih_header_size = sizeof(hdr);
+	hdr.rih_entry_size = sizeof(struct sb2_rootindex_entry);
+	hdr.rih_num_entries = num_items;
+	hdr.rih_entries_offs = sizeof(hdr);
+	hdr.rih_strings_offs = sizeof(hdr) + num_items * sizeof(*entries);
+	hdr.rih_strings_size = strings_size;
+
+	/* write to a temporary file and rename, processes which
+	 * have mapped the old index keep using it */
+	tmp_name = xmalloc(strlen(index_file) + 20);
+	sprintf(tmp_name, "%s.%d", index_file, (int)getpid());
+	fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ((fd < 0) ||
+	    write_all(fd, &hdr, sizeof(hdr)) ||
+	    write_all(fd, entries, num_items * sizeof(*entries)) ||
+	    write_all(fd, strings, strings_size) ||
+	    close(fd) ||
+	    rename(tmp_name, index_file)) {
+		fprintf(stderr, "%s: Failed to write %s: %s\n",
+			progname, index_file, strerror(errno));
+		unlink(tmp_name);
+		return(-1);
+	}
+	free(tmp_name);
+	free(strings);
+	free(entries);
+	return(0);
+}
+
+static int lookup(const char *index_file, const char *path)
+{
+	struct sb2_rootindex_header	hdr;
+	struct sb2_rootindex_entry	*entries;
+	char	*strings;
+	FILE	*f;
+	size_t	lo, hi;
+	size_t	root_len;
+	const char	*rel_path;
+
+	f = fopen(index_file, "r");
+	if (!f || (fread(&hdr, sizeof(hdr), 1, f) != 1) ||
+	    memcmp(hdr.rih_magic, SB2_ROOTINDEX_MAGIC,
+		SB2_ROOTINDEX_MAGIC_LEN)) {
+		fprintf(stderr, "%s: %s is not a valid index\n",
+			progname, index_file);
+		return(2);
+	}
+	entries = xmalloc(hdr.rih_num_entries * sizeof(*entries) + 1);
+	strings = xmalloc(hdr.rih_strings_size);
+	if ((fread(entries, sizeof(*entries), hdr.rih_num_entries, f) !=
+	     hdr.rih_num_entries) ||
+	    (fread(strings, hdr.rih_strings_size, 1, f) != 1)) {
+		fprintf(stderr, "%s: %s is truncated\n", progname, index_file);
+		return(2);
+	}
+	fclose(f);
+	printf("root %s, %u entries\n", strings + hdr.rih_root_offs,
+		hdr.rih_num_entries);
+
+	/* entries are relative to the root; the root itself is "" */
+	root_len = strlen(strings + hdr.rih_root_offs);
+	if (!strcmp(strings + hdr.rih_root_offs, "/")) root_len = 0;
+	if (strncmp(path, strings + hdr.rih_root_offs, root_len) ||
+	    ((path[root_len] != '/') && (path[root_len] != '\0'))) {
+		printf("%s: not under the root\n", path);
+		return(1);
+	}
+	rel_path = path + root_len;
+	if (!strcmp(rel_path, "/")) rel_path = "";
+
+	lo = 0;
+	hi = hdr.rih_num_entries;
+	while (lo < hi) {
+		size_t	mid = (lo + hi) / 2;
+		int	c = strcmp(rel_path, strings + entries[mid].rie_path_offs);
+
+		if (c == 0) {
+			printf("%s: mode %o size %llu%s%s%s\n", path,
+				entries[mid].rie_mode,
+				(unsigned long long)entries[mid].rie_size,
+				(entries[mid].rie_link_offs ? " -> " : ""),
+				strings + entries[mid].rie_link_offs,
+				(entries[mid].rie_flags &
+				 SB2_ROOTINDEX_F_NOT_INDEXED ?
+				 " (contents not indexed)" : ""));
+			return(0);
+		}
+		if (c < 0) hi = mid;
+		else lo = mid + 1;
+	}
+	printf("%s: not found\n", path);
+	return(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int	force = 0;
+	int	opt;
+	char	*root;
+
+	progname = argv[0];
+	while ((opt = getopt(argc, argv, "fh")) != -1) {
+		switch (opt) {
+		case 'f': force = 1; break;
+		case 'h': usage_exit(NULL, 0); break;
+		default: usage_exit("Illegal option", 1); break;
+		}
+	}
+	if (argc - optind != 3) usage_exit("Wrong number of parameters", 1);
+
+	if (!strcmp(argv[optind], "lookup"))
+		return(lookup(argv[optind + 1], argv[optind + 2]));
+
+	root = realpath(argv[optind + 1], NULL);
+	if (!root) {
+		fprintf(stderr, "%s: %s: %s\n", progname,
+			argv[optind + 1], strerror(errno));
+		return(1);
+	}
+	if (!strcmp(argv[optind], "check"))
+		return(check_index(root, argv[optind + 2]) ? 1 : 0);
+	if (strcmp(argv[optind], "update"))
+		usage_exit("Unknown command", 1);
+
+	if (!force && (check_index(root, argv[optind + 2]) == 0))
+		return(0);
+	return(build_index(root, argv[optind + 2]) ? 1 : 0);
+}
@@ -8,11 +8,13 @@
 
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include <config.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <sys/vfs.h>
 #include <sys/statvfs.h>
 
@@ -153,6 +155,14 @@ static void usage_exit(const char *progname, const char *errmsg, int exitstatus)
 	    "\t               the active exec policy\n"
 	    "\t-f function    show using 'function' as callers name\n"
 	    "\t-D             ignore directories while verifying path lists\n"
+	    "\t-i listfile    read the path list from 'listfile' instead of\n"
+	    "\t               stdin (verify-pathlist-mappings; may be\n"
+	    "\t               repeated)\n"
+	    "\t-j N           verify path lists using N threads\n"
+	    "\t-o format      output format for verify-pathlist-mappings:\n"
+	    "\t               'text' (default), 'tsv' or 'json' (one\n"
+	    "\t               record per path, in input order; exit\n"
+	    "\t               status is 0, or 4 if a list can't be read)\n"
 	    "\t-v             be more verbose\n"
 	    "\t-t             report elapsed time (real time elapsed while\n"
 	    "\t               executing 'command')\n"
@@ -184,15 +194,22 @@ static void usage_exit(const char *progname, const char *errmsg, int exitstatus)
 	    "\tbinarytype realpath    detect & show type of program at\n"
 	    "\t                       'realpath' (already mapped path)\n"
 	    "\tverify-pathlist-mappings required-prefix [ignorelist]\n"
-	    "\t                       read list of paths from stdin and\n"
-	    "\t                       check that all paths will be mapped to\n"
+	    "\t                       read list of paths from stdin (or\n"
+	    "\t                       from files, see -i) and check that\n"
+	    "\t                       all paths will be mapped to\n"
 	    "\t                       required prefix\n"
 	    "\tvar variablename       show value of a string variable\n"
 	    "\texecluafile filename   load and execute Lua code from file\n"
 	    "\t                       (useful for debugging and/or\n"
 	    "\t                       benchmarking sb2 itself)\n"
 	    "\tlibraryinterface       show preload library interface version\n"
-	    "\t                       (the Lua <-> C code interface)\n");
+	    "\t                       (the Lua <-> C code interface)\n"
+	    "\tstartup-bench N program [argv1]..\n"
+	    "\t                       run 'program' N times with the real\n"
+	    "\t                       functions of libsb2's wrappers looked\n"
+	    "\t                       up one by one (as before the lookup\n"
+	    "\t                       table) and N times with the table,\n"
+	    "\t                       and show the average startup time\n");
 
 	fprintf(stderr, "\n"
 	    "'%s' must be executed inside sb2 sandbox (see the 'sb2'"
@@ -201,6 +218,71 @@ static void usage_exit(const char *progname, const char *errmsg, int exitstatus)
 	exit(exitstatus);
 }
 
+/* Run a program once; returns elapsed wall-clock time in
+ * microseconds, or -1 if it could not be executed. */
+static double run_program_for_startup_bench(char **cmd_argv,
+	int lazy_next_symbols)
+{
+	struct timeval	t0, t1;
+	pid_t		pid;
+	int		status;
+
+	if (gettimeofday(&t0, (struct timezone *)NULL) < 0) return(-1);
+	pid = fork();
+	if (pid == 0) {
+		if (lazy_next_symbols)
+			setenv("SBOX_LAZY_NEXT_SYMBOLS", "1", 1);
+		else
+			unsetenv("SBOX_LAZY_NEXT_SYMBOLS");
+		if (!freopen("/dev/null", "w", stdout)) _exit(127);
+		execvp(cmd_argv[0], cmd_argv);
+		_exit(127);
+	}
+	if (pid < 0) return(-1);
+	if ((waitpid(pid, &status, 0) < 0) ||
+	    (WIFEXITED(status) && (WEXITSTATUS(status) == 127)))
+		return(-1);
+	if (gettimeofday(&t1, (struct timezone *)NULL) < 0) return(-1);
+	return((t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_usec - t0.tv_usec));
+}
+
+/* Per-process startup time with both ways of resolving the real
+ * functions (see sbox_find_next_symbols() in libsb2.c). The variants
+ * are run alternately, so that a change in system load affects both.
+*/
+static int command_startup_bench(const char *progname, char **argv)
+{
+	static const char *const variant_names[2] = {
+		"lookups in wrappers", "next-symbol table" };
+	double	sum[2] = { 0, 0 };
+	double	min[2] = { -1, -1 };
+	int	runs, i, v;
+
+	if (!argv[0] || !argv[1] || ((runs = atoi(argv[0])) <= 0))
+		usage_exit(progname, "startup-bench: number of runs and "
+			"a program are required", 1);
+
+	for (i = 0; i < runs; i++) {
+		for (v = 0; v < 2; v++) {
+			double	usecs = run_program_for_startup_bench(
+				argv + 1, (v == 0));
+
+			if (usecs < 0) {
+				fprintf(stderr, "%s: Failed to execute '%s'\n",
+					progname, argv[1]);
+				return(1);
+			}
+			sum[v] += usecs;
+			if ((min[v] < 0) || (usecs < min[v])) min[v] = usecs;
+		}
+	}
+	printf("startup of '%s', %d runs per variant:\n", argv[1], runs);
+	for (v = 0; v < 2; v++)
+		printf("  %-22s %9.1f us/process  (min %.1f)\n",
+			variant_names[v], sum[v] / runs, min[v]);
+	return(0);
+}
+
 static int command_show_variable(
 	int verbose,
 	const char *progname, 
@@ -599,9 +681,254 @@ static void command_show_pwd(const char *progname)
 	}
 }
 
-/* read paths from stdin, report paths that are not mapped to specified
- * directory.
- * returns 0 if all OK, 1 if one or more paths were not mapped.
+/* ---------- verify-pathlist-mappings ---------- */
+
+typedef enum {
+	PLI_OK = 0,
+	PLI_NOT_OK,
+	PLI_IGNORED,
+	PLI_DIRECTORY,
+	PLI_MAPPING_FAILED
+} pathlist_item_status_t;
+
+static const char *pathlist_item_status_names[] = {
+	"ok", "not-ok", "ignored", "directory", "mapping-failed"
+};
+
+typedef struct pathlist_item_s {
+	const char	*pli_source;	/* name of the list, "-" = stdin */
+	char		*pli_path;
+	char		*pli_mapped_path;
+	int		pli_readonly;
+	int		pli_require_both;
+	pathlist_item_status_t	pli_status;
+} pathlist_item_t;
+
+typedef enum {
+	PATHLIST_OUTPUT_TEXT = 0,
+	PATHLIST_OUTPUT_TSV,
+	PATHLIST_OUTPUT_JSON
+} pathlist_output_format_t;
+
+/* Paths are read and verified in blocks of this many items per thread;
+ * results are written in input order after each block. */
+#define PATHLIST_ITEMS_PER_THREAD	1024
+
+typedef struct pathlist_verifier_s {
+	const char	*pv_binary_name;
+	const char	*pv_fn_name;
+	int		pv_ignore_directories;
+	const char	*pv_required_destination_prefix;
+	int		pv_destination_prefix_len;
+	char		**pv_ignorelist;
+
+	pathlist_item_t	*pv_items;
+	int		pv_num_items;
+	int		pv_next_item;	/* updated atomically by the workers */
+} pathlist_verifier_t;
+
+static void verify_pathlist_item(pathlist_verifier_t *pv,
+	pathlist_item_t *item)
+{
+	char	**ignore_path;
+	/* 1 == ignore, 2 == require_both */
+	int	compare_mode = 1;
+
+	for (ignore_path = pv->pv_ignorelist; *ignore_path; ignore_path++) {
+		if (**ignore_path == '@') {
+			if (!strcmp(*ignore_path, "@ignore:")) {
+				compare_mode = 1;
+				continue;
+			}
+			if (!strcmp(*ignore_path, "@require-both:")) {
+				compare_mode = 2;
+				continue;
+			}
+		}
+
+		if (!strncmp(item->pli_path, *ignore_path,
+		    strlen(*ignore_path))) {
+			if (compare_mode == 1) {
+				item->pli_status = PLI_IGNORED;
+				return;
+			}
+			/* FIXME: check it is 2 */
+			item->pli_require_both = 1;
+			break;
+		}
+	}
+
+	item->pli_mapped_path = call_sb2show__map_path2__(pv->pv_binary_name,
+		"", pv->pv_fn_name, item->pli_path, &item->pli_readonly);
+	if (!item->pli_mapped_path) {
+		item->pli_status = PLI_MAPPING_FAILED;
+		return;
+	}
+
+	if (pv->pv_ignore_directories) {
+		struct stat statbuf;
+
+		if ((stat(item->pli_mapped_path, &statbuf) == 0) &&
+		   S_ISDIR(statbuf.st_mode)) {
+			item->pli_status = PLI_DIRECTORY;
+			return;
+		}
+	}
+
+	if (strncmp(item->pli_mapped_path, pv->pv_required_destination_prefix,
+	    pv->pv_destination_prefix_len))
+		item->pli_status = PLI_NOT_OK;
+	else
+		item->pli_status = PLI_OK;
+}
+
+static void *pathlist_verifier_thread(void *arg)
+{
+	pathlist_verifier_t *pv = (pathlist_verifier_t *)arg;
+	int	i;
+
+	while ((i = __sync_fetch_and_add(&pv->pv_next_item, 1)) <
+	       pv->pv_num_items) {
+		verify_pathlist_item(pv, pv->pv_items + i);
+	}
+	return(NULL);
+}
+
+static void print_tsv_field(const char *str)
+{
+	for ( ; str && *str; str++) {
+		switch (*str) {
+		case '\t': fputs("\\t", stdout); break;
+		case '\\': fputs("\\\\", stdout); break;
+		default: putchar(*str); break;
+		}
+	}
+}
+
+static void print_json_string(const char *str)
+{
+	if (!str) {
+		fputs("null", stdout);
+		return;
+	}
+	putchar('"');
+	for ( ; *str; str++) {
+		switch (*str) {
+		case '"': fputs("\\\"", stdout); break;
+		case '\\': fputs("\\\\", stdout); break;
+		case '\t': fputs("\\t", stdout); break;
+		default:
+			if ((unsigned char)*str < 0x20)
+				printf("\\u%04x", (unsigned char)*str);
+			else
+				putchar(*str);
+			break;
+		}
+	}
+	putchar('"');
+}
+
+/* print the result of one path. Returns the bits which should be added
+ * to the exit status (1 = not OK, 2 = required both) */
+static int print_pathlist_item(pathlist_item_t *item,
+	pathlist_output_format_t output_format, int verbose)
+{
+	int	result = 0;
+
+	if (item->pli_status == PLI_NOT_OK)
+		result = (item->pli_require_both ? 2 : 1);
+
+	switch (output_format) {
+	case PATHLIST_OUTPUT_TSV:
+		print_tsv_field(item->pli_source);
+		putchar('\t');
+		print_tsv_field(item->pli_path);
+		printf("\t%s%s\t", pathlist_item_status_names[item->pli_status],
+			(item->pli_require_both ? "+require-both" : ""));
+		print_tsv_field(item->pli_mapped_path);
+		printf("\t%d\n", (item->pli_mapped_path ?
+			item->pli_readonly : 0));
+		return(result);
+	case PATHLIST_OUTPUT_JSON:
+		fputs("{\"source\":", stdout);
+		print_json_string(item->pli_source);
+		fputs(",\"path\":", stdout);
+		print_json_string(item->pli_path);
+		printf(",\"status\":\"%s\",\"require_both\":%s,\"mapped\":",
+			pathlist_item_status_names[item->pli_status],
+			(item->pli_require_both ? "true" : "false"));
+		print_json_string(item->pli_mapped_path);
+		printf(",\"readonly\":%s}\n", (item->pli_mapped_path &&
+			item->pli_readonly ? "true" : "false"));
+		return(result);
+	case PATHLIST_OUTPUT_TEXT:
+		break;
+	}
+
+	if (!verbose) return(result);
+
+	if (item->pli_status == PLI_IGNORED) {
+		printf("IGNORED by prefix: %s\n", item->pli_path);
+		return(result);
+	}
+	if (item->pli_require_both)
+		printf("REQUIRE_BOTH by prefix: %s\n", item->pli_path);
+	switch (item->pli_status) {
+	case PLI_MAPPING_FAILED:
+		printf("%s: Mapping failed\n", item->pli_path);
+		break;
+	case PLI_DIRECTORY:
+		printf("%s => %s: dir, ignored\n",
+			item->pli_path, item->pli_mapped_path);
+		break;
+	case PLI_NOT_OK:
+		printf("%s => %s%s: NOT OK%s\n",
+			item->pli_path, item->pli_mapped_path,
+			(item->pli_readonly ? " (readonly)" : ""),
+			(item->pli_require_both ? " (Require both)" : ""));
+		break;
+	default:
+		/* mapped OK. */
+		printf("%s => %s%s: Ok\n",
+			item->pli_path, item->pli_mapped_path,
+			(item->pli_readonly ? " (readonly)" : ""));
+		break;
+	}
+	return(result);
+}
+
+/* Verify a block of items, using "num_threads" threads */
+static void verify_pathlist_items(pathlist_verifier_t *pv, int num_threads)
+{
+	pthread_t	*threads;
+	int		i;
+
+	pv->pv_next_item = 0;
+	if ((num_threads <= 1) || (pv->pv_num_items <= 1)) {
+		pathlist_verifier_thread(pv);
+		return;
+	}
+	if (num_threads > pv->pv_num_items) num_threads = pv->pv_num_items;
+
+	threads = calloc(num_threads, sizeof(pthread_t));
+	for (i = 0; i < num_threads; i++) {
+		if (pthread_create(threads + i, NULL,
+		    pathlist_verifier_thread, pv)) {
+			/* the threads that were started (and this one)
+			 * will handle the rest */
+			break;
+		}
+	}
+	pathlist_verifier_thread(pv);
+	while (i > 0) pthread_join(threads[--i], NULL);
+	free(threads);
+}
+
+/* read paths from stdin or from the lists, report paths that are not
+ * mapped to specified directory.
+ * returns 0 if all OK, 1 if one or more paths were not mapped, 2 if
+ * paths must be available from both places (see "@require-both:"),
+ * 3 if both of these conditions were found.
 */
 static int command_verify_pathlist_mappings(
 	const char *binary_name,
@@ -609,121 +936,100 @@ static int command_verify_pathlist_mappings(
 	int ignore_directories,
 	int verbose,
 	const char *progname,
+	char **pathlists,
+	int num_threads,
+	pathlist_output_format_t output_format,
 	char **argv)
 {
-	int	destination_prefix_len;
+	static char	*stdin_pathlist[] = { "-", NULL };
+	pathlist_verifier_t pv;
 	char	path_buf[PATH_MAX + 1];
-	const char *required_destination_prefix = argv[0];
+	char	**pathlist;
+	int	max_items;
 	int	result = 0;
+	int	failed = 0;
 
-	if (!required_destination_prefix) {
+	if (!argv[0]) {
 		usage_exit(progname, "'destination_prefix' is missing", 1);
 	}
-	destination_prefix_len = strlen(required_destination_prefix);
-
-	while (fgets(path_buf, sizeof(path_buf), stdin)) {
-		int len = strlen(path_buf);
-		char	*mapped_path = NULL;
-		int	readonly_flag;
-		int	destination_prefix_cmp_result;
-		char	**ignore_path;
-		int	ignore_this = 0;
-		int	require_both = 0;
-		/* 1 == ignore, 2 == require_both */
-		int	compare_mode = 1;
-
-		if ((len > 0) && (path_buf[len-1] == '\n')) {
-			path_buf[--len] = '\0';
-		}
-		if (len == 0) continue;
+	memset(&pv, 0, sizeof(pv));
+	pv.pv_binary_name = binary_name;
+	pv.pv_fn_name = fn_name;
+	pv.pv_ignore_directories = ignore_directories;
+	pv.pv_required_destination_prefix = argv[0];
+	pv.pv_destination_prefix_len = strlen(argv[0]);
+	pv.pv_ignorelist = argv + 1;
+
+	if (num_threads < 1) num_threads = 1;
+	max_items = num_threads * PATHLIST_ITEMS_PER_THREAD;
+	pv.pv_items = calloc(max_items, sizeof(pathlist_item_t));
+
+	if (num_threads > 1) {
+		/* Initialize libsb2 and the Lua state of this thread
+		 * before the workers are started. */
+		free(call_sb2show__map_path2__(binary_name, "", fn_name,
+			"/", NULL));
+	}
 
-		for (ignore_path = argv+1; *ignore_path; ignore_path++) {
-			int	ign_len;
+	for (pathlist = (pathlists ? pathlists : stdin_pathlist);
+	     *pathlist; pathlist++) {
+		FILE	*f = stdin;
+		int	eof = 0;
 
-			if (**ignore_path == '@') {
-				if (!strcmp(*ignore_path, "@ignore:")) {
-					compare_mode = 1;
-					continue;
-				}
-				if (!strcmp(*ignore_path, "@require-both:")) {
-					compare_mode = 2;
-					continue;
-				}
-			}
+		if (strcmp(*pathlist, "-") && !(f = fopen(*pathlist, "r"))) {
+			fprintf(stderr, "%s: Failed to open '%s'\n",
+				progname, *pathlist);
+			result |= 1;
+			failed = 1;
+			continue;
+		}
+		while (!eof) {
+			int	i;
 
-			if (compare_mode == 1) {
-				ign_len = strlen(*ignore_path);
+			pv.pv_num_items = 0;
+			while (pv.pv_num_items < max_items) {
+				int len;
 
-				if (!strncmp(path_buf, *ignore_path, ign_len)) {
-					ignore_this = 1;
-					if (verbose)
-						printf("IGNORED by prefix: %s\n",
-							path_buf);
+				if (!fgets(path_buf, sizeof(path_buf), f)) {
+					eof = 1;
 					break;
 				}
-			} else {
-				/* FIXME: check it is 2 */
-				ign_len = strlen(*ignore_path);
-
-				if (!strncmp(path_buf, *ignore_path, ign_len)) {
-					require_both = 1;
-					if (verbose)
-						printf("REQUIRE_BOTH by prefix: %s\n",
-							path_buf);
-					break;
+				len = strlen(path_buf);
+				if ((len > 0) && (path_buf[len-1] == '\n')) {
+					path_buf[--len] = '\0';
 				}
+				if (len == 0) continue;
+
+				memset(pv.pv_items + pv.pv_num_items, 0,
+					sizeof(pathlist_item_t));
+				pv.pv_items[pv.pv_num_items].pli_source =
+					*pathlist;
+				pv.pv_items[pv.pv_num_items].pli_path =
+					strdup(path_buf);
+				pv.pv_num_items++;
 			}
-		}
-
-		if (ignore_this) continue;
-
-		mapped_path = call_sb2show__map_path2__(binary_name, "",
-				fn_name, path_buf, &readonly_flag);
-		if (!mapped_path) {
-			if (verbose)
-				printf("%s: Mapping failed\n", path_buf);
-			continue;
-		}
 
-		if (ignore_directories) {
-			struct stat statbuf;
+			verify_pathlist_items(&pv, num_threads);
 
-			if ((stat(mapped_path, &statbuf) == 0) &&
-			   S_ISDIR(statbuf.st_mode)) {
-				if (verbose)
-					printf("%s => %s: dir, ignored\n",
-						path_buf, mapped_path);
-				continue;
-			}
-		}
+			for (i = 0; i < pv.pv_num_items; i++) {
+				pathlist_item_t *item = pv.pv_items + i;
 
-		destination_prefix_cmp_result = strncmp(mapped_path,
-			required_destination_prefix, destination_prefix_len);
-		if (destination_prefix_cmp_result) {
-			if (require_both) {
-				result |= 2;
-				if (verbose)
-					printf("%s => %s%s: NOT OK (Require both)\n",
-						path_buf, mapped_path,
-						(readonly_flag ? " (readonly)" : ""));
-			} else {
-				result |= 1;
-				if (verbose)
-					printf("%s => %s%s: NOT OK\n",
-						path_buf, mapped_path,
-						(readonly_flag ? " (readonly)" : ""));
+				result |= print_pathlist_item(item,
+					output_format, verbose);
+				free(item->pli_path);
+				if (item->pli_mapped_path)
+					free(item->pli_mapped_path);
 			}
-		} else {
-			/* mapped OK. */
-			if (verbose)
-				printf("%s => %s%s: Ok\n",
-					path_buf, mapped_path,
-					(readonly_flag ? " (readonly)" : ""));
 		}
+		if (f != stdin) fclose(f);
 	}
+	free(pv.pv_items);
+	/* with -o tsv and -o json the results are in the output; the
+	 * exit status tells only if something could not be checked */
+	if (output_format != PATHLIST_OUTPUT_TEXT)
+		return(failed ? 4 : 0);
 	return (result);
 }
-
 static void command_log(char **argv, int loglevel)
 {
 	SB_LOG(loglevel, "%s", argv[0]);
@@ -750,8 +1056,11 @@ int main(int argc, char *argv[])
 	char	**additional_env = NULL;
 	char	*debug_port = "1234";
 	char	*active_exec_policy_name = NULL;
+	char	**pathlists = NULL;
+	int	num_threads = 1;
+	pathlist_output_format_t pathlist_output_format = PATHLIST_OUTPUT_TEXT;
 	
-	while ((opt = getopt(argc, argv, "hm:f:b:Dvtg:x:X:E:p:")) != -1) {
+	while ((opt = getopt(argc, argv, "hm:f:b:Dvtg:x:X:E:p:i:j:o:")) != -1) {
 		switch (opt) {
 		case 'h': usage_exit(progname, NULL, 0); break;
 		case 'm':
@@ -763,6 +1072,33 @@ int main(int argc, char *argv[])
 		case 'b': binary_name = optarg; break;
 		case 'p': active_exec_policy_name = optarg; break;
 		case 'D': ignore_directories = 1; break;
+		case 'i':
+			if (!pathlists) {
+				pathlists = calloc(2, sizeof(char*));
+				pathlists[0] = optarg;
+			} else {
+				int n_elem = elem_count(pathlists);
+				pathlists = realloc(pathlists,
+					(n_elem+2)*sizeof(char*));
+				pathlists[n_elem] = optarg;
+				pathlists[n_elem+1] = NULL;
+			}
+			break;
+		case 'j':
+			num_threads = atoi(optarg);
+			if (num_threads < 1)
+				usage_exit(progname, "Illegal value for -j", 1);
+			break;
+		case 'o':
+			if (!strcmp(optarg, "text"))
+				pathlist_output_format = PATHLIST_OUTPUT_TEXT;
+			else if (!strcmp(optarg, "tsv"))
+				pathlist_output_format = PATHLIST_OUTPUT_TSV;
+			else if (!strcmp(optarg, "json"))
+				pathlist_output_format = PATHLIST_OUTPUT_JSON;
+			else
+				usage_exit(progname, "Unknown output format", 1);
+			break;
 		case 'v': verbose = 1; break;
 		case 't': report_time = 1; break;
 		case 'g': debug_port = optarg; break;
@@ -875,11 +1211,14 @@ int main(int argc, char *argv[])
 	} else if (!strcmp(argv[optind], "verify-pathlist-mappings")) {
 		ret = command_verify_pathlist_mappings(binary_name,
 			function_name, ignore_directories,
-			verbose, progname, argv + optind + 1);
+			verbose, progname, pathlists, num_threads,
+			pathlist_output_format, argv + optind + 1);
 	} else if (!strcmp(argv[optind], "var")) {
 		ret = command_show_variable(verbose, progname, argv[optind+1]);
 	} else if (!strcmp(argv[optind], "execluafile")) {
 		call_sb2__load_and_execute_lua_file__(argv[optind+1]);
+	} else if (!strcmp(argv[optind], "startup-bench")) {
+		ret = command_startup_bench(progname, argv + optind + 1);
 	} else {
 		usage_exit(progname, "Unknown command", 1);
 	}
@@ -0,0 +1,362 @@
+/* sb2-watchd:
+ * Watch the writable trees of a session with inotify and maintain the
+ * directory generation counters (see include/watchgen.h), which libsb2
+ * uses to validate its cached path information.
+ *
+ * Started by "sb2 -w", outside of the session (without libsb2).
+ * The segment is created as GENFILE.tmp and renamed to GENFILE when
+ * all directories are being watched. Exits when the parent process
+ * (the session) exits; then the segment is marked as stopped, which
+ * invalidates everything.
+ *
+ * Licensed under LGPL version 2.1, see top level LICENSE file for details.
+*/
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <config.h>
+
+#include "watchgen.h"
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+	IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+static const char *progname;
+
+static struct sb2_watchgen_header	*hdr = NULL;
+static uint32_t				*buckets = NULL;
+
+static int	inotify_fd = -1;
+static char	**watch_paths = NULL;	/* indexed by watch descriptor */
+static int	max_watches = 0;
+static int	num_roots = 0;
+static char	**roots = NULL;
+
+static volatile sig_atomic_t	stop_requested = 0;
+
+static void usage_exit(const char *errmsg, int exitstatus)
+{
+	if (errmsg)
+		fprintf(stderr, "%s: Error: %s\n", progname, errmsg);
+
+	fprintf(stderr, "\nUsage:\n"
+		"\t%s GENFILE DIR...\n"
+		"\nWatches DIRs and their subdirectories and counts changes\n"
+		"per directory to GENFILE. Started by \"sb2 -w\".\n",
+		progname);
+	exit(exitstatus);
+}
+
+static void *xmalloc(size_t size)
+{
+	void	*p = malloc(size);
+
+	if (!p) {
+		fprintf(stderr, "%s: Out of memory\n", progname);
+		exit(1);
+	}
+	return(p);
+}
+
+/* "path" is absolute and has no trailing slash, except "/" */
+static void bump_directory(const char *path)
+{
+	size_t	len = strlen(path);
+
+	if (len == 1) len = 0;	/* "/" */
+	__sync_fetch_and_add(&buckets[sb2_watchgen_bucket(path, len)], 1);
+	__sync_fetch_and_add(&hdr->wgh_events, 1);
+}
+
+/* Everything may have changed */
+static void bump_generation(void)
+{
+	__sync_fetch_and_add(&hdr->wgh_generation, 1);
+	__sync_fetch_and_add(&hdr->wgh_events, 1);
+}
+
+/* Give up; libsb2 won't trust anything after this */
+static void stop_watching(void)
+{
+	hdr->wgh_state = SB2_WATCHGEN_STATE_STOPPED;
+	bump_generation();
+}
+
+static void set_watch_path(int wd, const char *path)
+{
+	if (wd >= max_watches) {
+		int	new_max = max_watches ? max_watches * 2 : 1024;
+		char	**new_paths;
+
+		while (new_max <= wd) new_max *= 2;
+		new_paths = realloc(watch_paths, new_max * sizeof(char *));
+		if (!new_paths) {
+			fprintf(stderr, "%s: Out of memory\n", progname);
+			exit(1);
+		}
+		memset(new_paths + max_watches, 0,
+			(new_max - max_watches) * sizeof(char *));
+		watch_paths = new_paths;
+		max_watches = new_max;
+	}
+	free(watch_paths[wd]);
+	watch_paths[wd] = strdup(path);
+}
+
+/* Watch "path" and all directories below it, and count a change in
+ * each of them (entries may have been created before the watch was
+ * added). Returns -1 if a watch could not be added. */
+static int add_tree(const char *path, dev_t dev)
+{
+	DIR		*dir;
+	struct dirent	*de;
+	struct stat	st;
+	int		wd;
+	int		r = 0;
+
+	wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+	if (wd < 0) {
+		if ((errno == ENOENT) || (errno == ENOTDIR) ||
+		    (errno == EACCES))
+			return(0);	/* gone, or not a directory */
+		fprintf(stderr, "%s: Can't watch %s: %s\n", progname,
+			path, strerror(errno));
+		return(-1);
+	}
+	set_watch_path(wd, path);
+	bump_directory(path);
+
+	dir = opendir(path);
+	if (!dir) return(0);
+	while ((r == 0) && ((de = readdir(dir)) != NULL)) {
+		char	child[PATH_MAX + 1];
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if ((de->d_type != DT_DIR) && (de->d_type != DT_UNKNOWN))
+			continue;
+		if (fstatat(dirfd(dir), de->d_name, &st,
+		    AT_SYMLINK_NOFOLLOW) < 0 ||
+		    !S_ISDIR(st.st_mode) || (st.st_dev != dev))
+			continue;	/* not a dir, or a mount point */
+		if (snprintf(child, sizeof(child), "%s%s%s", path,
+		    (strcmp(path, "/") ? "/" : ""), de->d_name) >=
+		    (int)sizeof(child))
+			continue;
+		r = add_tree(child, dev);
+	}
+	closedir(dir);
+	return(r);
+}
+
+static int add_roots(void)
+{
+	int	i;
+
+	for (i = 0; i < num_roots; i++) {
+		struct stat	st;
+
+		if (stat(roots[i], &st) < 0) continue;
+		if (add_tree(roots[i], st.st_dev) < 0) return(-1);
+	}
+	return(0);
+}
+
+/* A directory was moved away: its watches would keep the old paths */
+static void remove_tree(const char *path)
+{
+	size_t	len = strlen(path);
+	int	wd;
+
+	for (wd = 0; wd < max_watches; wd++) {
+		if (watch_paths[wd] && !strncmp(watch_paths[wd], path, len) &&
+		    ((watch_paths[wd][len] == '\0') ||
+		     (watch_paths[wd][len] == '/'))) {
+			inotify_rm_watch(inotify_fd, wd);
+			free(watch_paths[wd]);
+			watch_paths[wd] = NULL;
+		}
+	}
+}
+
+static int is_root(const char *path)
+{
+	int	i;
+
+	for (i = 0; i < num_roots; i++)
+		if (!strcmp(roots[i], path)) return(1);
+	return(0);
+}
+
+/* Returns -1 if watching can't continue */
+static int handle_event(const struct inotify_event *ev)
+{
+	const char	*dir_path;
+	char		child[PATH_MAX + 1];
+	struct stat	st;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/* events were lost, and possibly new directories, too */
+		bump_generation();
+		return(add_roots());
+	}
+	if ((ev->wd < 0) || (ev->wd >= max_watches) || !watch_paths[ev->wd])
+		return(0);
+	dir_path = watch_paths[ev->wd];
+
+	if (ev->mask & IN_IGNORED) {
+		free(watch_paths[ev->wd]);
+		watch_paths[ev->wd] = NULL;
+		return(0);
+	}
+	if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+		/* the parent got an event too, unless this is a root */
+		if (is_root(dir_path)) bump_generation();
+		else bump_directory(dir_path);
+		return(0);
+	}
+	if (!ev->len) {
+		bump_directory(dir_path);
+		return(0);
+	}
+
+	bump_directory(dir_path);
+	if (!(ev->mask & IN_ISDIR)) return(0);
+	if (snprintf(child, sizeof(child), "%s%s%s", dir_path,
+	    (strcmp(dir_path, "/") ? "/" : ""), ev->name) >= (int)sizeof(child))
+		return(0);
+	if (ev->mask & IN_MOVED_FROM) {
+		remove_tree(child);
+	} else if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+		   (lstat(dir_path, &st) == 0)) {
+		return(add_tree(child, st.st_dev));
+	}
+	return(0);
+}
+
+static void signal_handler(int sig)
+{
+	(void)sig;
+	stop_requested = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	char	*tmp_name;
+	size_t	seg_size;
+	void	*seg;
+	pid_t	parent = getppid();
+	int	fd;
+	int	i;
+	size_t	roots_size = 0;
+	char	*rp;
+	struct sigaction	sa;
+
+	progname = argv[0];
+	if (argc < 3) usage_exit("Wrong number of parameters", 1);
+
+	num_roots = argc - 2;
+	roots = xmalloc(num_roots * sizeof(char *));
+	for (i = 0; i < num_roots; i++) {
+		roots[i] = realpath(argv[i + 2], NULL);
+		if (!roots[i]) {
+			fprintf(stderr, "%s: %s: %s\n", progname,
+				argv[i + 2], strerror(errno));
+			return(1);
+		}
+		roots_size += strlen(roots[i]) + 1;
+	}
+
+	seg_size = sizeof(struct sb2_watchgen_header) +
+		SB2_WATCHGEN_NUM_BUCKETS * sizeof(uint32_t) + roots_size;
+	tmp_name = xmalloc(strlen(argv[1]) + 5);
+	sprintf(tmp_name, "%s.tmp", argv[1]);
+	fd = open(tmp_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if ((fd < 0) || (ftruncate(fd, seg_size) < 0)) {
+		fprintf(stderr, "%s: Can't create %s: %s\n", progname,
+			tmp_name, strerror(errno));
+		return(1);
+	}
+	seg = mmap(NULL, seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap failed: %s\n", progname,
+			strerror(errno));
+		unlink(tmp_name);
+		return(1);
+	}
+	hdr = seg;
+	buckets = (uint32_t *)(hdr + 1);
+	memcpy(hdr->wgh_magic, SB2_WATCHGEN_MAGIC, SB2_WATCHGEN_MAGIC_LEN);
+	hdr->wgh_header_size = sizeof(*hdr);
+	hdr->wgh_num_buckets = SB2_WATCHGEN_NUM_BUCKETS;
+	hdr->wgh_roots_size = roots_size;
+	rp = (char *)(buckets + SB2_WATCHGEN_NUM_BUCKETS);
+	for (i = 0; i < num_roots; i++) {
+		strcpy(rp, roots[i]);
+		rp += strlen(roots[i]) + 1;
+	}
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if ((inotify_fd < 0) || (add_roots() < 0)) {
+		fprintf(stderr, "%s: Can't watch the directories%s%s\n",
+			progname, (inotify_fd < 0 ? ": " : ""),
+			(inotify_fd < 0 ? strerror(errno) : ""));
+		unlink(tmp_name);
+		return(1);
+	}
+	hdr->wgh_state = SB2_WATCHGEN_STATE_RUNNING;
+	if (rename(tmp_name, argv[1]) < 0) {
+		fprintf(stderr, "%s: Can't rename %s: %s\n", progname,
+			tmp_name, strerror(errno));
+		unlink(tmp_name);
+		return(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = signal_handler;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	while (!stop_requested && (getppid() == parent)) {
+		char		buf[64 * 1024]
+			__attribute__((aligned(__alignof__(struct inotify_event))));
+		struct pollfd	pfd;
+		ssize_t		len;
+		char		*p;
+
+		pfd.fd = inotify_fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 1000) <= 0) continue;
+
+		len = read(inotify_fd, buf, sizeof(buf));
+		if (len <= 0) continue;
+		for (p = buf; p < buf + len; ) {
+			const struct inotify_event *ev =
+				(const struct inotify_event *)p;
+
+			if (handle_event(ev) < 0) {
+				fprintf(stderr, "%s: Stopped; cached paths "
+					"won't be trusted\n", progname);
+				stop_watching();
+				return(1);
+			}
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+	stop_watching();
+	return(0);
+}